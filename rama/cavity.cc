@@ -35,6 +35,7 @@ Cavity::Cavity(wxWindow* parent, wxWindowID id, const wxPoint &pos,
   antenna_pattern_plot_ = 0;
   valid_ = false;
   solver_ = 0;
+  previous_solver_ = 0;
   solver_draw_mode_static_ = Solver::DRAW_REAL;
   solver_draw_mode_animating_ = Solver::DRAW_REAL;
   show_boundary_lines_and_ports_ = true;
@@ -48,6 +49,7 @@ Cavity::Cavity(wxWindow* parent, wxWindowID id, const wxPoint &pos,
 }
 
 Cavity::~Cavity() {
+  delete previous_solver_;
 }
 
 bool Cavity::IsModelEmpty() {
@@ -64,6 +66,7 @@ void Cavity::SetModelValid(bool v) {
 
 void Cavity::ResetModel() {
   debug_shapes_.clear();
+  Shape::NewOperationCacheGeneration();
   lua_State *L = GetLua()->L();
   Shape::SetLuaGlobals(L);
   LuaUserClassRegister<Shape>(*GetLua(), "Shape");
@@ -80,6 +83,8 @@ void Cavity::ResetModel() {
   lua_pushcfunction(L,
                     (LuaGlobalStub2<Cavity, &Cavity::LuaGetFieldPoynting, 1>));
   lua_setglobal(L, "_GetFieldPoynting");
+  lua_pushcfunction(L, (LuaGlobalStub2<Cavity, &Cavity::LuaPortPower, 1>));
+  lua_setglobal(L, "_PortPower");
 }
 
 void Cavity::ScriptJustRan(bool only_compute_derivatives) {
@@ -106,6 +111,15 @@ void Cavity::ScriptJustRan(bool only_compute_derivatives) {
     return;
   }
 
+  // The time domain solver does not compute derivatives, which the optimizer
+  // and tolerance analysis need.
+  if (config_.time_domain && (IsOptimizing() || IsTolerancing())) {
+    GetLua()->Error("The optimizer and tolerance analysis can not be used "
+                    "with config.time_domain, as it does not compute "
+                    "derivatives");
+    return;
+  }
+
   // Clean up the shape by removing edges that are too small to matter. The
   // assumption is that if the shape was meshed with triangles about the size
   // of the smallest edge and if that resulted in more than
@@ -136,10 +150,24 @@ void Cavity::ScriptJustRan(bool only_compute_derivatives) {
   } else {
     // Delete the current solution if it no longer applies to the current
     // configuration, i.e. if the cd or config has changed then any mesh and
-    // field solution derived from it are no longer valid.
+    // field solution derived from it are no longer valid. A preview solution
+    // is also replaced once the preview is over.
     if (GetLua()->ThereWereErrors() ||
-        (solver_ && !solver_->SameAs(cd_, config_, GetLua()))) {
-      delete solver_;
+        (solver_ && !solver_->SameAs(cd_, config_, GetLua())) ||
+        (solver_ && solver_->IsPreview() && !IsPreviewing())) {
+      // Keep the solver so that the next model, which is likely to be similar
+      // (e.g. in a sweep), can be seeded with its waveguide modes or reuse its
+      // factored system matrix. A solver with nothing to reuse is deleted now
+      // rather than holding its memory until the next solve.
+      delete previous_solver_;
+      previous_solver_ = 0;
+      if (!GetLua()->ThereWereErrors() && solver_ &&
+          solver_->HasReusableState()) {
+        previous_solver_ = solver_;
+        previous_solver_values_ = solver_values_;
+      } else {
+        delete solver_;
+      }
       solver_ = 0;
     }
   }
@@ -170,7 +198,21 @@ void Cavity::CreateArgumentsToOptimize(bool optimize_output_requested) {
   // requested, as ComputePortOutgoingPower() triggers a complete solve
   // which is too expensive if all we are going to do later is draw the cd
   // or the mesh.
-  if (optimize_output_requested) {
+  if (optimize_output_requested && config_.TypeIsWaveguideMode()) {
+    // For waveguide modes the first argument is the mode cutoff frequencies
+    // and the second argument is unused.
+    vector<JetComplex> cutoff;
+    if (CreateSolver() && solver_->ComputeModeCutoffFrequencies(&cutoff)) {
+      lua_newtable(GetLua()->L());
+      for (int i = 0; i < cutoff.size(); i++) {
+        lua_pushnumber(GetLua()->L(), cutoff[i].real());
+        lua_rawseti(GetLua()->L(), -2, i + 1);
+      }
+      LuaRawGetGlobal(GetLua()->L(), "__ZeroTable__");
+    } else {
+      GetLua()->Error("Can not compute mode cutoff frequencies");
+    }
+  } else if (optimize_output_requested) {
     if (CreateSolver() && solver_->ComputePortOutgoingPower(&port_powers)) {
       // Create port_power and port_phase argument tables.
       lua_newtable(GetLua()->L());
@@ -574,9 +616,10 @@ int Cavity::LuaGetField(lua_State *L) {
   if (lua_gettop(L) != 2) {
     LuaError(L, "Usage: _GetField(x,y)");
   }
-  if (!solver_) {
+  if (!solver_ || !solver_->config_.TypeIsElectrodynamic()) {
     // Likely config.optimize is being called with dummy arguments without the
-    // field having been solved for. Just return zeros.
+    // field having been solved for, or for waveguide modes which have no
+    // field derivatives. Just return zeros.
     lua_pushnumber(L, 0);
     lua_pushnumber(L, 0);
     return 2;
@@ -626,9 +669,10 @@ int Cavity::LuaGetFieldPoynting(lua_State *L) {
   if (lua_gettop(L) != 2) {
     LuaError(L, "Usage: _GetFieldPoynting(x,y)");
   }
-  if (!solver_) {
+  if (!solver_ || !solver_->config_.TypeIsElectrodynamic()) {
     // Likely config.optimize is being called with dummy arguments without the
-    // field having been solved for. Just return zeros.
+    // field having been solved for, or for waveguide modes which have no
+    // field derivatives. Just return zeros.
     lua_pushnumber(L, 0);
     lua_pushnumber(L, 0);
     return 2;
@@ -641,6 +685,52 @@ int Cavity::LuaGetFieldPoynting(lua_State *L) {
   return 2;
 }
 
+int Cavity::LuaPortPower(lua_State *L) {
+  if (lua_gettop(L) != 1) {
+    LuaError(L, "Usage: _PortPower(frequency)");
+  }
+  if (!config_.time_domain) {
+    LuaError(L, "field.PortPower() needs config.time_domain");
+  }
+  double frequency = ToDouble(luaL_checknumber(L, 1));
+  const vector<double> &frequencies = config_.time_domain_frequencies;
+  int index = std::find(frequencies.begin(), frequencies.end(), frequency) -
+              frequencies.begin();
+  if (frequency != config_.frequency && index == frequencies.size()) {
+    LuaError(L, "field.PortPower() frequency is not in config.time_domain");
+  }
+  if (!solver_) {
+    // If there is no solver_ it's likely config.optimize is being called with
+    // dummy arguments without the field having been solved for.
+    LuaRawGetGlobal(L, "__ZeroTable__");
+    LuaRawGetGlobal(L, "__ZeroTable__");
+    return 2;
+  }
+  vector<JetComplex> port_powers;
+  vector<vector<JetComplex> > broadband;
+  if (frequency == config_.frequency) {
+    if (!solver_->ComputePortOutgoingPower(&port_powers)) {
+      LuaError(L, "Can not compute a solution");
+    }
+  } else {
+    if (!solver_->ComputeTimeDomainPortPower(&broadband)) {
+      LuaError(L, "Can not compute a solution");
+    }
+    port_powers = broadband[index];
+  }
+  lua_newtable(L);
+  for (int i = 0; i < port_powers.size(); i++) {
+    lua_pushnumber(L, abs(port_powers[i]));
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_newtable(L);
+  for (int i = 0; i < port_powers.size(); i++) {
+    lua_pushnumber(L, arg(port_powers[i]));
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 2;
+}
+
 Solver *Cavity::CreateSolver() {
   if (!solver_) {
     // Don't do anything for an empty cd as meshing will fail.
@@ -653,7 +743,31 @@ Solver *Cavity::CreateSolver() {
     if (!solver_->IsValid()) {
       delete solver_;
       solver_ = 0;
+    } else {
+      if (previous_solver_) {
+        // Mode numbering only needs to follow the previous modes where
+        // continuity matters, otherwise modes are sorted by cutoff frequency.
+        solver_->WarmStartModes(previous_solver_,
+                                IsSweeping() || IsOptimizing());
+        solver_->ReuseFactorization(previous_solver_);
+      }
+      // Sweep steps are solved from a reduced order model where possible. It
+      // is not used interactively as it gives approximate solutions.
+      if (IsSweeping()) {
+        solver_->UseReducedModel(previous_solver_);
+      }
+      // If only the parameter with the derivative has changed then the
+      // solution can be predicted from the previous one. This is the whole
+      // solution when previewing, otherwise it is only used if accurate.
+      GetParameterValues(&solver_values_);
+      double step;
+      if (previous_solver_ && !IsSweeping() && !IsOptimizing() &&
+          PredictionStep(previous_solver_values_, solver_values_, &step)) {
+        solver_->PredictSolution(previous_solver_, step, IsPreviewing());
+      }
     }
+    delete previous_solver_;
+    previous_solver_ = 0;
   }
   return solver_;
 }
@@ -742,13 +856,19 @@ void Cavity::SetConfigFromTable() {
   GET_FIELD(unit, true, DistanceScale, lua_tostring, LUA_TSTRING, 0, -1)
   GET_FIELD(mesh_edge_length, true, ToDouble, lua_tonumber, LUA_TNUMBER, 0, -1)
   GET_FIELD(mesh_refines, true, ToDouble, lua_tonumber, LUA_TNUMBER, 0, -1)
+  GET_FIELD(mesher, false, ScriptConfig::StringToMesher, lua_tostring,
+            LUA_TSTRING, 0, Mesh::TRIANGLE_MESHER)
+  GET_FIELD(mesh_grading, false, ToDouble, lua_tonumber, LUA_TNUMBER, 0, -1)
   GET_FIELD(frequency, config_.TypeIsElectrodynamic(), ToDouble, lua_tonumber,
             LUA_TNUMBER, 0, -1)
   GET_FIELD(depth, config_.type == ScriptConfig::EXY, ToDouble, lua_tonumber,
             LUA_TNUMBER, 0, -1)
   GET_FIELD(boresight, false, ToDouble, lua_tonumber, LUA_TNUMBER, -1e99, 0)
+  GET_FIELD(pattern_points, false, ToDouble, lua_tonumber, LUA_TNUMBER, 3, 500)
   GET_FIELD(max_modes, config_.TypeIsWaveguideMode(), ToDouble, lua_tonumber,
             LUA_TNUMBER, 1, 1)
+  GET_FIELD(mixed_precision, false, bool, lua_toboolean, LUA_TBOOLEAN, false,
+            false)
   #undef GET_FIELD
   if (config_.type == ScriptConfig::SCHRODINGER) {
     config_.type = ScriptConfig::EZ;
@@ -783,6 +903,175 @@ void Cavity::SetConfigFromTable() {
     GetLua()->Error("config.excited_port is not valid");
   }
   lua_pop(L, 1);
+
+  // Handle mesh_size_hints specially because it is a table.
+  config_.mesh_size_hints.clear();
+  lua_getfield(L, -1, "mesh_size_hints");
+  if (lua_type(L, -1) == LUA_TTABLE) {
+    lua_len(L, -1);                     // Stack: T len
+    int length = lua_tointeger(L, -1);
+    lua_pop(L, 1);                      // Stack T
+    for (int i = 1; i <= length; i++) {
+      lua_geti(L, -1, i);               // Stack T T[i]
+      if (lua_type(L, -1) != LUA_TNUMBER) {
+        GetLua()->Error("config.mesh_size_hints is not valid");
+      } else if (lua_tonumber(L, -1).Derivative() != 0) {
+        GetLua()->Error("config.mesh_size_hints can not depend on "
+                        "parameters as this will confuse the optimizer");
+      }
+      config_.mesh_size_hints.push_back(ToDouble(lua_tonumber(L, -1)));
+      lua_pop(L, 1);                    // Stack T
+    }
+    bool valid = length % 5 == 0;
+    for (int i = 4; i < length; i += 5) {
+      valid = valid && config_.mesh_size_hints[i] > 0;
+    }
+    if (!valid) {
+      config_.mesh_size_hints.clear();
+      GetLua()->Error("config.mesh_size_hints is not valid");
+    } else if (length > 0 && config_.mesh_edge_length <= 0) {
+      // The mesher only applies size features when the edge length is
+      // limited, so the hints would otherwise be silently ignored.
+      config_.mesh_size_hints.clear();
+      GetLua()->Error("config.mesh_size_hints needs mesh_edge_length > 0");
+    }
+  } else if (lua_type(L, -1) != LUA_TNIL) {
+    GetLua()->Error("config.mesh_size_hints is not valid");
+  }
+  lua_pop(L, 1);
+
+  // Handle substructure specially because it is a table.
+  config_.substructure.clear();
+  lua_getfield(L, -1, "substructure");
+  if (lua_type(L, -1) == LUA_TTABLE) {
+    lua_len(L, -1);                     // Stack: T len
+    int length = lua_tointeger(L, -1);
+    lua_pop(L, 1);                      // Stack T
+    for (int i = 1; i <= length; i++) {
+      lua_geti(L, -1, i);               // Stack T T[i]
+      if (lua_type(L, -1) != LUA_TNUMBER) {
+        GetLua()->Error("config.substructure is not valid");
+      } else if (lua_tonumber(L, -1).Derivative() != 0) {
+        GetLua()->Error("config.substructure can not depend on parameters "
+                        "as this will confuse the optimizer");
+      }
+      config_.substructure.push_back(ToDouble(lua_tonumber(L, -1)));
+      lua_pop(L, 1);                    // Stack T
+    }
+    if (length % 4 != 0) {
+      config_.substructure.clear();
+      GetLua()->Error("config.substructure is not valid");
+    }
+  } else if (lua_type(L, -1) != LUA_TNIL) {
+    GetLua()->Error("config.substructure is not valid");
+  }
+  lua_pop(L, 1);
+
+  // Handle pml specially because it is a table.
+  config_.pml.clear();
+  lua_getfield(L, -1, "pml");
+  if (lua_type(L, -1) == LUA_TTABLE) {
+    lua_len(L, -1);                     // Stack: T len
+    int length = lua_tointeger(L, -1);
+    lua_pop(L, 1);                      // Stack T
+    for (int i = 1; i <= length; i++) {
+      lua_geti(L, -1, i);               // Stack T T[i]
+      if (lua_type(L, -1) != LUA_TNUMBER) {
+        GetLua()->Error("config.pml is not valid");
+      } else if (lua_tonumber(L, -1).Derivative() != 0) {
+        GetLua()->Error("config.pml can not depend on parameters as this "
+                        "will confuse the optimizer");
+      }
+      config_.pml.push_back(ToDouble(lua_tonumber(L, -1)));
+      lua_pop(L, 1);                    // Stack T
+    }
+    if (length != 5 || config_.pml[0] >= config_.pml[2] ||
+        config_.pml[1] >= config_.pml[3] || config_.pml[4] <= 0) {
+      config_.pml.clear();
+      GetLua()->Error("config.pml is not valid");
+    }
+  } else if (lua_type(L, -1) != LUA_TNIL) {
+    GetLua()->Error("config.pml is not valid");
+  }
+  lua_pop(L, 1);
+
+  // Handle symmetry specially because it is a table with optional x and y
+  // fields.
+  config_.symmetry = Mesh::Symmetry();
+  lua_getfield(L, -1, "symmetry");
+  if (lua_type(L, -1) == LUA_TTABLE) {
+    lua_getfield(L, -1, "x");           // Stack: T T.x
+    lua_getfield(L, -2, "y");           // Stack: T T.x T.y
+    int tx = lua_type(L, -2), ty = lua_type(L, -1);
+    if ((tx != LUA_TNUMBER && tx != LUA_TNIL) ||
+        (ty != LUA_TNUMBER && ty != LUA_TNIL) ||
+        (tx == LUA_TNIL && ty == LUA_TNIL)) {
+      GetLua()->Error("config.symmetry is not valid");
+    } else if ((tx == LUA_TNUMBER && lua_tonumber(L, -2).Derivative() != 0) ||
+               (ty == LUA_TNUMBER && lua_tonumber(L, -1).Derivative() != 0)) {
+      GetLua()->Error("config.symmetry can not depend on parameters as this "
+                      "will confuse the optimizer");
+    } else {
+      config_.symmetry.mirror_x = tx == LUA_TNUMBER;
+      config_.symmetry.mirror_y = ty == LUA_TNUMBER;
+      if (tx == LUA_TNUMBER) {
+        config_.symmetry.x0 = ToDouble(lua_tonumber(L, -2));
+      }
+      if (ty == LUA_TNUMBER) {
+        config_.symmetry.y0 = ToDouble(lua_tonumber(L, -1));
+      }
+    }
+    lua_pop(L, 2);                      // Stack: T
+  } else if (lua_type(L, -1) != LUA_TNIL) {
+    GetLua()->Error("config.symmetry is not valid");
+  }
+  lua_pop(L, 1);
+
+  // Handle time_domain specially because it can be a boolean or a table of
+  // frequencies.
+  config_.time_domain = false;
+  config_.time_domain_frequencies.clear();
+  lua_getfield(L, -1, "time_domain");
+  if (lua_type(L, -1) == LUA_TBOOLEAN) {
+    config_.time_domain = lua_toboolean(L, -1);
+  } else if (lua_type(L, -1) == LUA_TTABLE) {
+    config_.time_domain = true;
+    lua_len(L, -1);                     // Stack: T len
+    int length = lua_tointeger(L, -1);
+    lua_pop(L, 1);                      // Stack T
+    for (int i = 1; i <= length; i++) {
+      lua_geti(L, -1, i);               // Stack T T[i]
+      if (lua_type(L, -1) != LUA_TNUMBER ||
+          !(ToDouble(lua_tonumber(L, -1)) > 0)) {
+        GetLua()->Error("config.time_domain is not valid");
+      } else if (lua_tonumber(L, -1).Derivative() != 0) {
+        GetLua()->Error("config.time_domain can not depend on parameters as "
+                        "this will confuse the optimizer");
+      }
+      config_.time_domain_frequencies.push_back(ToDouble(lua_tonumber(L, -1)));
+      lua_pop(L, 1);                    // Stack T
+    }
+  } else if (lua_type(L, -1) != LUA_TNIL) {
+    GetLua()->Error("config.time_domain is not valid");
+  }
+  lua_pop(L, 1);
+  if (config_.time_domain && (config_.type != ScriptConfig::EZ ||
+                              config_.schrodinger || !config_.pml.empty())) {
+    GetLua()->Error("config.time_domain is only supported for Ez cavities "
+                    "without config.pml");
+  }
+
+  // Handle solver specially because it is checked against the solver
+  // registry.
+  config_.solver = "auto";
+  lua_getfield(L, -1, "solver");
+  if (lua_type(L, -1) == LUA_TSTRING &&
+      ScriptConfig::SolverIsValid(lua_tostring(L, -1))) {
+    config_.solver = lua_tostring(L, -1);
+  } else if (lua_type(L, -1) != LUA_TNIL) {
+    GetLua()->Error("config.solver is not valid");
+  }
+  lua_pop(L, 1);
 }
 
 void Cavity::OnAnimationTimeout(wxTimerEvent& event) {
@@ -63,6 +63,7 @@ class Cavity : public LuaModelViewer {
   int LuaPattern(lua_State *L);           // _Pattern()
   int LuaDirectivity(lua_State *L);       // _Directivity()
   int LuaGetFieldPoynting(lua_State *L);  // _GetFieldPoynting()
+  int LuaPortPower(lua_State *L);         // _PortPower()
 
  private:
   // More connections to external controls.
@@ -77,6 +78,9 @@ class Cavity : public LuaModelViewer {
   bool valid_;          // true if config_ and cd_ are valid, else script error
   vector<Shape> debug_shapes_;    // Shapes emitted from script as s:Draw()
   Solver *solver_;      // Solution that is computed from cd_, or 0 if none
+  Solver *previous_solver_;     // Previous solver, or 0
+  ParameterValues solver_values_;           // Parameters of solver_
+  ParameterValues previous_solver_values_;  // Parameters of previous_solver_
   Solver::DrawMode solver_draw_mode_static_;      // DrawMode when not animated
   Solver::DrawMode solver_draw_mode_animating_;   // DrawMode when animating
   bool show_boundary_lines_and_ports_;
@@ -13,6 +13,7 @@
 #include "../stdwx.h"
 #include <wx/stdpaths.h>
 #include <wx/uri.h>
+#include <wx/numdlg.h>
 
 ////@begin includes
 #include "wx/imaglist.h"
@@ -71,6 +72,7 @@ BEGIN_EVENT_TABLE( MainWin, wxFrame )
     EVT_MENU( ID_MENU_OPTIMIZER_LEVENBERG_MARQUARDT, MainWin::OnMenuOptimizerLevenbergMarquardt )
     EVT_MENU( ID_MENU_OPTIMIZER_DOGLEG, MainWin::OnMenuOptimizerDogleg )
     EVT_MENU( ID_MENU_OPTIMIZE, MainWin::OnMenuOptimize )
+    EVT_MENU( ID_MENU_TOLERANCE_ANALYSIS, MainWin::OnMenuToleranceAnalysis )
     EVT_MENU( ID_MENU_STOP_SOLVE, MainWin::OnMenuStopSolve )
     EVT_MENU( ID_MENU_HELP_MANUAL, MainWin::OnMenuHelpManual )
     EVT_MENU( ID_MENU_HELP_WEBSITE, MainWin::OnMenuHelpWebsite )
@@ -231,6 +233,7 @@ void MainWin::CreateControls()
     itemMenu33->Enable(ID_MENU_OPTIMIZER_SIMULATED_ANNEALING, false);
     itemMenu31->Append(wxID_ANY, _("Select optimizer"), itemMenu33);
     itemMenu31->Append(ID_MENU_OPTIMIZE, _("Start o&ptimi&zation\tCtrl+P"), wxEmptyString, wxITEM_NORMAL);
+    itemMenu31->Append(ID_MENU_TOLERANCE_ANALYSIS, _("Tolerance &analysis"), wxEmptyString, wxITEM_NORMAL);
     itemMenu31->AppendSeparator();
     itemMenu31->Append(ID_MENU_STOP_SOLVE, _("S&top sweep or optimization"), wxEmptyString, wxITEM_NORMAL);
     menuBar->Append(itemMenu31, _("&Solve"));
@@ -690,7 +693,8 @@ void MainWin::OnMenuSolveSweep( wxCommandEvent& event ) {
         viewer_->Sweep(dlg.GetParameterName(),
                        dlg.GetStartValue(),
                        dlg.GetEndValue(),
-                       dlg.GetNumSteps());
+                       dlg.GetNumSteps(),
+                       dlg.GetAdaptive());
     }
 }
 
@@ -712,6 +716,15 @@ void MainWin::OnMenuOptimize( wxCommandEvent& event ) {
     viewer_->Optimize();
 }
 
+void MainWin::OnMenuToleranceAnalysis( wxCommandEvent& event ) {
+    long num_samples = wxGetNumberFromUser("Each sample solves the model with "
+        "random parameter variations.", "Number of samples:",
+        "Tolerance analysis", 100, 2, 10000, this);
+    if (num_samples > 0) {
+        viewer_->ToleranceAnalysis(num_samples);
+    }
+}
+
 void MainWin::OnMenuStopSolve( wxCommandEvent& event ) {
     viewer_->StopSweepOrOptimize();
 }
@@ -65,6 +65,7 @@ class wxListCtrl;
 #define ID_MENU_OPTIMIZER_NELDER_MEAD 10029
 #define ID_MENU_OPTIMIZER_SIMULATED_ANNEALING 10030
 #define ID_MENU_OPTIMIZE 10012
+#define ID_MENU_TOLERANCE_ANALYSIS 10038
 #define ID_MENU_STOP_SOLVE 10013
 #define ID_MENU_HELP_MANUAL 10022
 #define ID_MENU_HELP_WEBSITE 10024
@@ -186,6 +187,9 @@ public:
     /// wxEVT_COMMAND_MENU_SELECTED event handler for ID_MENU_OPTIMIZE
     void OnMenuOptimize( wxCommandEvent& event );
 
+    /// wxEVT_COMMAND_MENU_SELECTED event handler for ID_MENU_TOLERANCE_ANALYSIS
+    void OnMenuToleranceAnalysis( wxCommandEvent& event );
+
     /// wxEVT_COMMAND_MENU_SELECTED event handler for ID_MENU_STOP_SOLVE
     void OnMenuStopSolve( wxCommandEvent& event );
 
@@ -105,11 +105,13 @@ void SweepDialog::Init()
     end_value_ctrl_ = NULL;
     num_steps_text_ = NULL;
     num_steps_ctrl_ = NULL;
+    adaptive_ctrl_ = NULL;
 ////@end SweepDialog member initialisation
     viewer_ = NULL;
     integer_ = false;
     start_value_ = end_value_ = min_value_ = max_value_ = 0;
     num_steps_ = 0;
+    adaptive_ = false;
 }
 
 
@@ -153,18 +155,27 @@ void SweepDialog::CreateControls()
     num_steps_ctrl_ = new wxTextCtrl( itemDialog1, wxID_ANY, _("50"), wxDefaultPosition, wxDefaultSize, 0 );
     itemFlexGridSizer3->Add(num_steps_ctrl_, 0, wxGROW|wxALIGN_CENTER_VERTICAL|wxALL, 5);
 
-    wxStaticLine* itemStaticLine12 = new wxStaticLine( itemDialog1, wxID_STATIC, wxDefaultPosition, wxDefaultSize, wxLI_HORIZONTAL );
-    itemBoxSizer2->Add(itemStaticLine12, 0, wxGROW|wxALL, 5);
+    wxStaticText* itemStaticText12 = new wxStaticText( itemDialog1, wxID_STATIC, _("Adaptive"), wxDefaultPosition, wxDefaultSize, 0 );
+    itemFlexGridSizer3->Add(itemStaticText12, 0, wxALIGN_RIGHT|wxALIGN_CENTER_VERTICAL|wxALL, 5);
 
-    wxBoxSizer* itemBoxSizer13 = new wxBoxSizer(wxHORIZONTAL);
-    itemBoxSizer2->Add(itemBoxSizer13, 0, wxALIGN_CENTER_HORIZONTAL|wxALL, 5);
+    adaptive_ctrl_ = new wxCheckBox( itemDialog1, wxID_ANY, wxEmptyString, wxDefaultPosition, wxDefaultSize, 0 );
+    adaptive_ctrl_->SetValue(false);
+    if (SweepDialog::ShowToolTips())
+        adaptive_ctrl_->SetToolTip(_("Choose the values to solve at from the results so far, and report a rational fit at every step"));
+    itemFlexGridSizer3->Add(adaptive_ctrl_, 0, wxALIGN_LEFT|wxALIGN_CENTER_VERTICAL|wxALL, 5);
 
-    wxButton* itemButton14 = new wxButton( itemDialog1, wxID_OK, _("OK"), wxDefaultPosition, wxDefaultSize, 0 );
-    itemButton14->SetDefault();
-    itemBoxSizer13->Add(itemButton14, 0, wxALIGN_CENTER_VERTICAL|wxALL, 5);
+    wxStaticLine* itemStaticLine14 = new wxStaticLine( itemDialog1, wxID_STATIC, wxDefaultPosition, wxDefaultSize, wxLI_HORIZONTAL );
+    itemBoxSizer2->Add(itemStaticLine14, 0, wxGROW|wxALL, 5);
 
-    wxButton* itemButton15 = new wxButton( itemDialog1, wxID_CANCEL, _("Cancel"), wxDefaultPosition, wxDefaultSize, 0 );
-    itemBoxSizer13->Add(itemButton15, 0, wxALIGN_CENTER_VERTICAL|wxALL, 5);
+    wxBoxSizer* itemBoxSizer15 = new wxBoxSizer(wxHORIZONTAL);
+    itemBoxSizer2->Add(itemBoxSizer15, 0, wxALIGN_CENTER_HORIZONTAL|wxALL, 5);
+
+    wxButton* itemButton16 = new wxButton( itemDialog1, wxID_OK, _("OK"), wxDefaultPosition, wxDefaultSize, 0 );
+    itemButton16->SetDefault();
+    itemBoxSizer15->Add(itemButton16, 0, wxALIGN_CENTER_VERTICAL|wxALL, 5);
+
+    wxButton* itemButton17 = new wxButton( itemDialog1, wxID_CANCEL, _("Cancel"), wxDefaultPosition, wxDefaultSize, 0 );
+    itemBoxSizer15->Add(itemButton17, 0, wxALIGN_CENTER_VERTICAL|wxALL, 5);
 
 ////@end SweepDialog content construction
 
@@ -231,6 +242,7 @@ void SweepDialog::SetParameter(const std::string &name) {
     end_value_ctrl_->SetValue(wxString::Format("%.10g", param.the_max));
     num_steps_ctrl_->Enable(!param.integer);
     num_steps_text_->Enable(!param.integer);
+    adaptive_ctrl_->Enable(!param.integer);
     integer_ = param.integer;
     min_value_ = param.the_min;
     max_value_ = param.the_max;
@@ -264,5 +276,6 @@ void SweepDialog::OnOk( wxCommandEvent& event ) {
             return;
         }
     }
+    adaptive_ = adaptive_ctrl_->GetValue() && !integer_;
     event.Skip();
 }
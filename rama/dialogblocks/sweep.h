@@ -97,18 +97,21 @@ public:
     wxTextCtrl* end_value_ctrl_;
     wxStaticText* num_steps_text_;
     wxTextCtrl* num_steps_ctrl_;
+    wxCheckBox* adaptive_ctrl_;
 ////@end SweepDialog member variables
     Cavity *viewer_;
     std::string parameter_;
     bool integer_;
     double start_value_, end_value_, min_value_, max_value_;
     int num_steps_;
+    bool adaptive_;
 
     void SetParameter(const std::string &name);
     std::string GetParameterName() const { return parameter_; }
     double GetStartValue() const { return start_value_; }
     double GetEndValue() const { return end_value_; }
     int GetNumSteps() const { return num_steps_; }
+    bool GetAdaptive() const { return adaptive_; }
 };
 
 #endif
@@ -21,12 +21,59 @@ using Eigen::Matrix4d;
 static const bool kDebugMesh = false;           // Render debug stuff on mesh
 static const double kSharpestAllowableAngle = 1e-4;
 
+// For graded meshes, the edge length permitted at ports as a fraction of the
+// longest edge permitted.
+static const double kPortEdgeLengthFraction = 0.5;
+
 //***************************************************************************
 // Triangle library support. We use nasty globals here because the triangle
 // library does not support passing user data to the triunsuitable() callback.
 
 static double square_of_longest_edge_permitted;
 
+// Features that limit the edge length near them, for graded meshes. If this is
+// empty then square_of_longest_edge_permitted applies everywhere.
+struct SizeFeature {
+  double x1, y1, x2, y2;        // Segment endpoints, or box corners
+  bool box;                     // Is this a box (true) or a segment (false)?
+  double length;                // Longest edge permitted at the feature
+};
+static vector<SizeFeature> size_features;
+static double grading_rate;     // Edge length growth per unit distance
+
+// Return the distance from x,y to a size feature.
+static double FeatureDistance(const SizeFeature &f, double x, double y) {
+  if (f.box) {
+    double dx = std::max(0.0, std::max(f.x1 - x, x - f.x2));
+    double dy = std::max(0.0, std::max(f.y1 - y, y - f.y2));
+    return sqrt(dx * dx + dy * dy);
+  }
+  double sx = f.x2 - f.x1, sy = f.y2 - f.y1;
+  double len2 = sx * sx + sy * sy;
+  double t = 0;
+  if (len2 > 0) {
+    t = ((x - f.x1) * sx + (y - f.y1) * sy) / len2;
+    t = std::max(0.0, std::min(1.0, t));
+  }
+  double dx = f.x1 + t * sx - x, dy = f.y1 + t * sy - y;
+  return sqrt(dx * dx + dy * dy);
+}
+
+// Return the square of the longest edge permitted for a triangle that is
+// contained within radius r of x,y.
+static double SquareOfLocalEdgeLength(double x, double y, double r) {
+  double h2 = square_of_longest_edge_permitted;
+  for (int i = 0; i < size_features.size(); i++) {
+    const SizeFeature &f = size_features[i];
+    double d = std::max(0.0, FeatureDistance(f, x, y) - r);
+    if (grading_rate > 0 || d == 0) {
+      double h = f.length + std::max(0.0, grading_rate) * d;
+      h2 = std::min(h2, h * h);
+    }
+  }
+  return h2;
+}
+
 // Function called by the triangle library to see if a triangle is too big and
 // needs refinement.
 extern "C" int triunsuitable(double *v1, double *v2, double *v3, double area) {
@@ -46,6 +93,17 @@ extern "C" int triunsuitable(double *v1, double *v2, double *v3, double area) {
   // Find the square of the length of the longest edge.
   double maxlen = std::max(len1, std::max(len2, len3));
 
+  if (!size_features.empty()) {
+    // For graded meshes consider the features near the triangle.
+    double cx = (v1[0] + v2[0] + v3[0]) / 3;
+    double cy = (v1[1] + v2[1] + v3[1]) / 3;
+    double *v[3] = {v1, v2, v3};
+    double r2 = 0;
+    for (int i = 0; i < 3; i++) {
+      r2 = std::max(r2, sqr(v[i][0] - cx) + sqr(v[i][1] - cy));
+    }
+    return maxlen > SquareOfLocalEdgeLength(cx, cy, sqrt(r2));
+  }
   return maxlen > square_of_longest_edge_permitted;
 }
 
@@ -106,10 +164,31 @@ static void DeleteTriangulateIO(triangulateio *t) {
   delete[] t->normlist;
 }
 
+// Set the EdgeInfo and original piece and edge of a point that has been
+// created on the boundary segment that starts at s.Piece(piece)[edge]. The
+// EdgeInfo has its first slot set to the edge kind of the boundary segment.
+
+static void SetSegmentPoint(const Shape &s, int piece, int edge, RPoint *p) {
+  const RPoint &p1 = s.Piece(piece)[edge];
+  const RPoint &p2 = s.Piece(piece)[(edge + 1) % s.Piece(piece).size()];
+  float d1, d2;
+  p->e = EdgeInfo();
+  p->e.kind[0] = p1.e.SharedKind(p2.e, &d1, &d2);
+  // Linearly interpolate distance values.
+  JetNum len1 = (p->p - p1.p).squaredNorm();
+  JetNum len2 = (p2.p - p1.p).squaredNorm();
+  double alpha = ToDouble(sqrt(len1 / len2));
+  p->e.dist[0] = alpha * (d2 - d1) + d1;
+  p->original_piece = piece;
+  p->original_edge = edge;
+}
+
 //***************************************************************************
 // Mesh.
 
-Mesh::Mesh(const Shape &s, double longest_edge_permitted, Lua *lua) {
+Mesh::Mesh(const Shape &s, double longest_edge_permitted, Lua *lua,
+           MesherType mesher, const Grading &grading,
+           const Symmetry &symmetry) {
   Trace trace(__func__);
   valid_mesh_ = false;          // Default assumption
   {
@@ -136,6 +215,127 @@ Mesh::Mesh(const Shape &s, double longest_edge_permitted, Lua *lua) {
     return;
   }
 
+  // For symmetric shapes only the fundamental domain is meshed.
+  Shape fundamental;
+  const Shape *to_mesh = &s;
+  if (symmetry.Active()) {
+    JetNum min_x, min_y, max_x, max_y;
+    s.GetBounds(&min_x, &min_y, &max_x, &max_y);
+    JetNum margin = std::max(max_x - min_x, max_y - min_y);
+    fundamental.SetCrop(s, symmetry.mirror_x ? symmetry.x0 : min_x - margin,
+                           symmetry.mirror_y ? symmetry.y0 : min_y - margin,
+                        max_x + margin, max_y + margin);
+    if (fundamental.IsEmpty()) {
+      ERROR_ONCE("Can not create mesh: nothing is on the positive side of "
+                 "the symmetry lines");
+      return;
+    }
+    to_mesh = &fundamental;
+  }
+
+  // Rectilinear shapes can optionally be meshed with a structured grid,
+  // otherwise (or if the shape is not suitable for that, or the mesh is
+  // graded) use the triangle library.
+  bool meshed = mesher == STRUCTURED_MESHER && !grading.Active() &&
+                StructuredMesh(*to_mesh, longest_edge_permitted);
+  if (!meshed && !TriangleMesh(*to_mesh, longest_edge_permitted, grading)) {
+    return;
+  }
+
+  // Mirror the mesh of the fundamental domain. Triangle materials are pieces
+  // of the fundamental domain, convert them to the pieces of 's' with the
+  // same materials.
+  if (symmetry.Active()) {
+    vector<int> piece(fundamental.NumPieces(), -1);
+    for (int i = 0; i < fundamental.NumPieces(); i++) {
+      for (int j = 0; j < s.NumPieces() && piece[i] < 0; j++) {
+        if (s.GetMaterial(j) == fundamental.GetMaterial(i)) {
+          piece[i] = j;
+        }
+      }
+      CHECK(piece[i] >= 0);
+    }
+    for (int i = 0; i < triangles_.size(); i++) {
+      triangles_[i].material = piece[triangles_[i].material];
+    }
+    if (symmetry.mirror_x) {
+      MirrorMesh(0, symmetry.x0);
+    }
+    if (symmetry.mirror_y) {
+      MirrorMesh(1, symmetry.y0);
+    }
+    if (!LinkBoundaryPoints(s)) {
+      ERROR_ONCE("Can not create mesh: the shape is not symmetric about the "
+                 "symmetry lines");
+      return;
+    }
+  }
+
+  // Copy shape materials
+  materials_.resize(s.NumPieces());
+  for (int i = 0; i < s.NumPieces(); i++) {
+    materials_[i] = s.GetMaterial(i);
+  }
+
+  valid_mesh_ = true;
+  UpdateDerivatives(s);
+
+  if (lua) {
+    DeterminePointDielectric(lua, &dielectric_);
+  }
+}
+
+// Set the size features for a graded mesh, or clear them if the mesh is not
+// graded.
+
+static void SetSizeFeatures(const Shape &s, double longest_edge_permitted,
+                            const Mesh::Grading &grading) {
+  size_features.clear();
+  grading_rate = grading.rate;
+  if (longest_edge_permitted <= 0 || !grading.Active()) {
+    return;
+  }
+  SizeFeature f;
+  if (grading.rate > 0) {
+    // Edges that are shorter than the longest edge permitted, and ports.
+    f.box = false;
+    for (int i = 0; i < s.NumPieces(); i++) {
+      const vector<RPoint> &piece = s.Piece(i);
+      for (int j = 0; j < piece.size(); j++) {
+        const RPoint &p1 = piece[j];
+        const RPoint &p2 = piece[(j + 1) % piece.size()];
+        double length = ToDouble((p2.p - p1.p).norm());
+        f.length = __DBL_MAX__;
+        if (p1.e.SharedKind(p2.e).PortNumber()) {
+          f.length = longest_edge_permitted * kPortEdgeLengthFraction;
+        }
+        if (length < longest_edge_permitted) {
+          f.length = std::min(f.length, length);
+        }
+        if (f.length < longest_edge_permitted) {
+          f.x1 = ToDouble(p1.p[0]);
+          f.y1 = ToDouble(p1.p[1]);
+          f.x2 = ToDouble(p2.p[0]);
+          f.y2 = ToDouble(p2.p[1]);
+          size_features.push_back(f);
+        }
+      }
+    }
+  }
+  // Size hint boxes.
+  f.box = true;
+  for (int i = 0; i + 4 < grading.hints.size(); i += 5) {
+    f.x1 = std::min(grading.hints[i], grading.hints[i + 2]);
+    f.y1 = std::min(grading.hints[i + 1], grading.hints[i + 3]);
+    f.x2 = std::max(grading.hints[i], grading.hints[i + 2]);
+    f.y2 = std::max(grading.hints[i + 1], grading.hints[i + 3]);
+    f.length = grading.hints[i + 4];
+    size_features.push_back(f);
+  }
+}
+
+bool Mesh::TriangleMesh(const Shape &s, double longest_edge_permitted,
+                        const Grading &grading) {
   // Identify negative area pieces that will become holes. For each hole pick
   // an x,y point that is guaranteed to be in the hole so that we can identify
   // it to the triangle library. This cumbersome way to identify holes (and
@@ -270,7 +470,20 @@ Mesh::Mesh(const Shape &s, double longest_edge_permitted, Lua *lua) {
         tin.regionlist[offset*4 + 0] = ToDouble(point_in_poly[0]);
         tin.regionlist[offset*4 + 1] = ToDouble(point_in_poly[1]);
         tin.regionlist[offset*4 + 2] = i;    // Region attribute (polygon index)
-        tin.regionlist[offset*4 + 3] = -1;   // Region max area (ignored)
+        tin.regionlist[offset*4 + 3] = -1;   // Region max area (-1 for none)
+        // For graded meshes, shorten edges in dielectrics in proportion to
+        // the wavelength. Materials with callback functions are not
+        // considered as their epsilon is not known until after meshing.
+        const Material &mat = s.GetMaterial(i);
+        if (grading.rate > 0 && longest_edge_permitted > 0 &&
+            mat.callback.empty()) {
+          double eps = std::abs(ToComplex(mat.epsilon));
+          if (eps > 1) {
+            // Area of an equilateral triangle with the shortened edge length.
+            tin.regionlist[offset*4 + 3] =
+                sqrt(3.0) / 4 * sqr(longest_edge_permitted) / eps;
+          }
+        }
         offset++;
       }
     }
@@ -288,9 +501,10 @@ Mesh::Mesh(const Shape &s, double longest_edge_permitted, Lua *lua) {
   // well.
   if (setjmp(triangle_jmp_buf) != 0) {
     // triangulate() called triexit.
-    return;
+    return false;
   }
   square_of_longest_edge_permitted = sqr(longest_edge_permitted);
+  SetSizeFeatures(s, longest_edge_permitted, grading);
   // Useful options to 'triangulate' are:
   //   * z: Index from zero
   //   * p: Triangulate a PSLG
@@ -299,8 +513,11 @@ Mesh::Mesh(const Shape &s, double longest_edge_permitted, Lua *lua) {
   //   * V: Verbose (for debugging)
   //   * q: Quality mesh generation by Delaunay refinement
   //   * u: Use triunsuitable function
+  //   * a: Apply region max area constraints
   //   * n: Create a triangle neighbor list
-  if (longest_edge_permitted > 0) {
+  if (longest_edge_permitted > 0 && grading.rate > 0) {
+    triangulate("zpAQquan", &tin, &tout, NULL);
+  } else if (longest_edge_permitted > 0) {
     triangulate("zpAQqun", &tin, &tout, NULL);
   } else {
     triangulate("zpAQn", &tin, &tout, NULL);
@@ -330,25 +547,12 @@ Mesh::Mesh(const Shape &s, double longest_edge_permitted, Lua *lua) {
       points_[i].original_piece = piece;
       points_[i].original_edge = piece_index;
     } else if (marker < 0) {
-      // Output point was created on boundary segment. Set both slots of
-      // EdgeInfo to the edge kind of the boundary segment.
+      // Output point was created on boundary segment.
       int upi = -marker - 1;
       CHECK(upi < index_map.size());
-      int piece = index_map[upi].first;
-      int piece_index1 = index_map[upi].second;
-      int piece_index2 = (piece_index1 + 1) % s.Piece(piece).size();
-      float d1, d2;
-      const RPoint &p1 = s.Piece(piece)[piece_index1];
-      const RPoint &p2 = s.Piece(piece)[piece_index2];
-      EdgeKind s = p1.e.SharedKind(p2.e, &d1, &d2);
-      e.kind[0] = s;
-      // Linearly interpolate distance values.
-      JetNum len1 = (points_[i].p - p1.p).squaredNorm();
-      JetNum len2 = (p2.p - p1.p).squaredNorm();
-      double alpha = ToDouble(sqrt(len1 / len2));
-      e.dist[0] = alpha * (d2 - d1) + d1;
-      points_[i].original_piece = piece;
-      points_[i].original_edge = piece_index1;
+      SetSegmentPoint(s, index_map[upi].first, index_map[upi].second,
+                      &points_[i]);
+      e = points_[i].e;
     } else if (marker == 1) {
       // A marker value of 1 has a reserved meaning in the triangle library.
       // A marker value of 0 will be assigned to interior points.
@@ -379,25 +583,397 @@ Mesh::Mesh(const Shape &s, double longest_edge_permitted, Lua *lua) {
     }
   }
 
-  // Copy shape materials
-  materials_.resize(s.NumPieces());
-  for (int i = 0; i < s.NumPieces(); i++) {
-    materials_[i] = s.GetMaterial(i);
-  }
-
   // Free heap allocated data. Note that holelist and regionlist are copied
   // from tin to tout so make sure not to free them twice.
   DeleteTriangulateIO(&tin);
   tout.holelist = 0;
   tout.regionlist = 0;
   FreeTriangulateIO(&tout);
+  return true;
+}
 
-  valid_mesh_ = true;
-  UpdateDerivatives(s);
+//***************************************************************************
+// Mirror symmetric meshes.
 
-  if (lua) {
-    DeterminePointDielectric(lua, &dielectric_);
+// Points are on a mirror line, or on the boundary of the shape, if they are
+// within this fraction of the size of the mesh. This allows for the rounding
+// of coordinates in Shape::SetCrop().
+static const double kMirrorTolerance = 1e-8;
+
+// The size of the bounding box of some points.
+static double PointsExtent(const vector<RPoint> &points) {
+  double min_x = __DBL_MAX__, min_y = __DBL_MAX__;
+  double max_x = -__DBL_MAX__, max_y = -__DBL_MAX__;
+  for (int i = 0; i < points.size(); i++) {
+    min_x = std::min(min_x, ToDouble(points[i].p[0]));
+    min_y = std::min(min_y, ToDouble(points[i].p[1]));
+    max_x = std::max(max_x, ToDouble(points[i].p[0]));
+    max_y = std::max(max_y, ToDouble(points[i].p[1]));
   }
+  return std::max(max_x - min_x, max_y - min_y);
+}
+
+void Mesh::MirrorMesh(int axis, double c) {
+  const double tol = kMirrorTolerance * PointsExtent(points_);
+
+  // Points on the line are snapped to it and are their own images.
+  const int np = points_.size();
+  vector<int> image(np);
+  for (int i = 0; i < np; i++) {
+    if (fabs(ToDouble(points_[i].p[axis]) - c) <= tol) {
+      points_[i].p[axis] = c;
+      image[i] = i;
+    } else {
+      image[i] = points_.size();
+      RPoint q = points_[i];
+      q.p[axis] = 2.0 * c - q.p[axis];
+      points_.push_back(q);
+    }
+  }
+
+  // Mirror image triangles have their vertices in the opposite order to stay
+  // counterclockwise. The image of edge j (from index[j] to index[j+1]) is
+  // edge 2-j. Boundary edges on the line border the image triangle.
+  const int nt = triangles_.size();
+  triangles_.resize(2 * nt);
+  for (int i = 0; i < nt; i++) {
+    Triangle &t = triangles_[i];
+    Triangle &m = triangles_[nt + i];
+    m.material = t.material;
+    for (int j = 0; j < 3; j++) {
+      m.index[j] = image[t.index[(3 - j) % 3]];
+    }
+    for (int j = 0; j < 3; j++) {
+      int p1 = t.index[j], p2 = t.index[(j + 1) % 3];
+      if (t.neighbor[j] < 0 && image[p1] == p1 && image[p2] == p2) {
+        t.neighbor[j] = nt + i;
+        m.neighbor[2 - j] = i;
+      } else {
+        m.neighbor[2 - j] = t.neighbor[j] < 0 ? -1 : nt + t.neighbor[j];
+      }
+    }
+  }
+  spatial_index_.clear();
+}
+
+bool Mesh::LinkBoundaryPoints(const Shape &s) {
+  const double tol = kMirrorTolerance * PointsExtent(points_);
+  vector<bool> on_boundary(points_.size());
+  for (BoundaryIterator it(this); !it.done(); ++it) {
+    on_boundary[it.pindex1()] = on_boundary[it.pindex2()] = true;
+  }
+  Shape shape = s;                      // Queries need a non-const shape
+  for (int i = 0; i < points_.size(); i++) {
+    RPoint &p = points_[i];
+    p.original_piece = p.original_edge = -1;
+    if (!on_boundary[i]) {
+      p.e = EdgeInfo();
+      continue;
+    }
+    // Points at vertices of 's' are moved to the exact vertex position, and
+    // take the vertex EdgeInfo as in TriangleMesh(). Other points are
+    // assigned to the closest edge.
+    int piece, index;
+    shape.FindClosestVertex(p.p[0], p.p[1], &piece, &index);
+    const RPoint &v = s.Piece(piece)[index];
+    if (ToVector2d(v.p - p.p).norm() <= tol) {
+      p.p = v.p;
+      p.e = v.e;
+      p.original_piece = piece;
+      p.original_edge = index;
+      continue;
+    }
+    shape.FindClosestEdge(p.p[0], p.p[1], &piece, &index);
+    Eigen::Vector2d p1 = ToVector2d(s.Piece(piece)[index].p);
+    Eigen::Vector2d p2 =
+        ToVector2d(s.Piece(piece)[(index + 1) % s.Piece(piece).size()].p);
+    Eigen::Vector2d d = p2 - p1, q = ToVector2d(p.p) - p1;
+    double distance = fabs(d[0] * q[1] - d[1] * q[0]) / d.norm();
+    if (distance > tol) {
+      return false;
+    }
+    SetSegmentPoint(s, piece, index, &p);
+  }
+  return true;
+}
+
+//***************************************************************************
+// Structured mesher for rectilinear shapes. The shape's vertex coordinates
+// define a tensor product grid that is subdivided until no triangle edge is
+// longer than longest_edge_permitted. Each grid cell that is inside the shape
+// is split into two right triangles. The diagonals alternate in a checkerboard
+// pattern so that the mesh does not have a preferred direction.
+
+// Grid cells inside the shape can have at most this aspect ratio, otherwise we
+// fall back to the triangle library which will handle thin features better.
+static const double kMaxStructuredAspectRatio = 4;
+
+// Beyond this many grid cells we fall back to the triangle library.
+static const double kMaxStructuredCells = 1e7;
+
+// The triangle (0 or 1) within a grid cell and the triangle side that are on
+// the bottom, right, top and left cell edges, for each diagonal orientation.
+static const int kCellSide[2][4][2] = {
+  {{0, 0}, {0, 1}, {1, 1}, {1, 2}},     // Triangles a,b,c and a,c,d
+  {{0, 0}, {1, 0}, {1, 1}, {0, 2}},     // Triangles a,b,d and b,c,d
+};
+
+// Given sorted unique coordinates 'c', add intermediate coordinates so that no
+// interval is longer than 'longest' (if longest > 0). Return false if more
+// than 'max_count' coordinates would be generated.
+static bool SubdivideGridLines(const vector<double> &c, double longest,
+                               double max_count, vector<double> *g) {
+  double count = c.size();
+  if (longest > 0) {
+    for (int i = 0; i + 1 < c.size(); i++) {
+      count += ceil((c[i + 1] - c[i]) / longest) - 1;
+    }
+  }
+  if (count > max_count) {
+    return false;
+  }
+  g->clear();
+  for (int i = 0; i < c.size(); i++) {
+    g->push_back(c[i]);
+    if (i + 1 < c.size() && longest > 0) {
+      int n = ceil((c[i + 1] - c[i]) / longest);
+      for (int j = 1; j < n; j++) {
+        g->push_back(c[i] + (c[i + 1] - c[i]) * j / n);
+      }
+    }
+  }
+  return true;
+}
+
+// Return the index of grid coordinate 'x', which must be present in 'g'.
+static int GridLineIndex(const vector<double> &g, double x) {
+  int i = std::lower_bound(g.begin(), g.end(), x) - g.begin();
+  CHECK(i < g.size() && g[i] == x);
+  return i;
+}
+
+bool Mesh::StructuredMesh(const Shape &s, double longest_edge_permitted) {
+  // Check that all edges are axis aligned and collect vertex coordinates.
+  vector<double> xs, ys;
+  for (int i = 0; i < s.NumPieces(); i++) {
+    const vector<RPoint> &piece = s.Piece(i);
+    for (int j = 0; j < piece.size(); j++) {
+      const JetPoint &p1 = piece[j].p;
+      const JetPoint &p2 = piece[(j + 1) % piece.size()].p;
+      if (ToDouble(p1[0]) != ToDouble(p2[0]) &&
+          ToDouble(p1[1]) != ToDouble(p2[1])) {
+        return false;
+      }
+      xs.push_back(ToDouble(p1[0]));
+      ys.push_back(ToDouble(p1[1]));
+    }
+  }
+  std::sort(xs.begin(), xs.end());
+  xs.erase(std::unique(xs.begin(), xs.end()), xs.end());
+  std::sort(ys.begin(), ys.end());
+  ys.erase(std::unique(ys.begin(), ys.end()), ys.end());
+  if (xs.size() < 2 || ys.size() < 2) {
+    return false;
+  }
+
+  // Create the grid lines. Cell sides are limited to longest/sqrt(2) so that
+  // the diagonals are no longer than longest_edge_permitted.
+  double cell_side = longest_edge_permitted / sqrt(2.0);
+  vector<double> gx, gy;
+  if (!SubdivideGridLines(xs, cell_side, kMaxStructuredCells, &gx) ||
+      !SubdivideGridLines(ys, cell_side, kMaxStructuredCells, &gy) ||
+      double(gx.size() - 1) * double(gy.size() - 1) > kMaxStructuredCells) {
+    return false;
+  }
+  const int nx = gx.size() - 1;         // Number of cells in x
+  const int ny = gy.size() - 1;         // Number of cells in y
+
+  // Scan convert each piece into the grid, accumulating the winding number of
+  // each cell. Each cell that is inside the shape takes the material of the
+  // smallest positive area piece that contains it (pieces painted on top of
+  // other pieces lie inside the holes of those pieces). Cell centers are never
+  // on piece edges, so each row is classified exactly by the x coordinates of
+  // the vertical edges that cross it.
+  vector<int> winding(nx * ny), cell_piece(nx * ny, -1);
+  vector<double> piece_area(s.NumPieces());
+  vector<double> crossings;
+  for (int i = 0; i < s.NumPieces(); i++) {
+    const vector<RPoint> &piece = s.Piece(i);
+    piece_area[i] = ToDouble(s.Area(i));
+    int sign = (piece_area[i] > 0) ? 1 : -1;
+    double ymin = __DBL_MAX__, ymax = -__DBL_MAX__;
+    for (int j = 0; j < piece.size(); j++) {
+      ymin = std::min(ymin, ToDouble(piece[j].p[1]));
+      ymax = std::max(ymax, ToDouble(piece[j].p[1]));
+    }
+    for (int row = GridLineIndex(gy, ymin); row < GridLineIndex(gy, ymax);
+         row++) {
+      double yc = (gy[row] + gy[row + 1]) / 2;
+      crossings.clear();
+      for (int j = 0; j < piece.size(); j++) {
+        double y1 = ToDouble(piece[j].p[1]);
+        double y2 = ToDouble(piece[(j + 1) % piece.size()].p[1]);
+        if ((y1 < yc) != (y2 < yc)) {
+          crossings.push_back(ToDouble(piece[j].p[0]));
+        }
+      }
+      CHECK((crossings.size() & 1) == 0);
+      std::sort(crossings.begin(), crossings.end());
+      for (int j = 0; j < crossings.size(); j += 2) {
+        int c1 = GridLineIndex(gx, crossings[j]);
+        int c2 = GridLineIndex(gx, crossings[j + 1]);
+        for (int c = c1; c < c2; c++) {
+          int cell = row * nx + c;
+          winding[cell] += sign;
+          if (sign > 0 && (cell_piece[cell] < 0 ||
+                           piece_area[i] < piece_area[cell_piece[cell]])) {
+            cell_piece[cell] = i;
+          }
+        }
+      }
+    }
+  }
+
+  // Find the cells that are inside the shape and check their aspect ratios.
+  // Mark the grid points that will be mesh points.
+  vector<int> point_index((nx + 1) * (ny + 1), -1);
+  int num_cells = 0;
+  for (int row = 0; row < ny; row++) {
+    for (int c = 0; c < nx; c++) {
+      int cell = row * nx + c;
+      if (winding[cell] <= 0 || cell_piece[cell] < 0) {
+        cell_piece[cell] = -1;
+        continue;
+      }
+      double dx = gx[c + 1] - gx[c];
+      double dy = gy[row + 1] - gy[row];
+      if (std::max(dx, dy) > kMaxStructuredAspectRatio * std::min(dx, dy)) {
+        return false;
+      }
+      num_cells++;
+      point_index[row * (nx + 1) + c] = 0;
+      point_index[row * (nx + 1) + c + 1] = 0;
+      point_index[(row + 1) * (nx + 1) + c] = 0;
+      point_index[(row + 1) * (nx + 1) + c + 1] = 0;
+    }
+  }
+  if (num_cells == 0) {
+    return false;
+  }
+
+  // Create the mesh points in grid order, which keeps the bandwidth of the
+  // system matrix small.
+  points_.clear();
+  for (int row = 0; row <= ny; row++) {
+    for (int c = 0; c <= nx; c++) {
+      int &index = point_index[row * (nx + 1) + c];
+      if (index == 0) {
+        index = points_.size();
+        points_.push_back(RPoint(gx[c], gy[row]));
+      }
+    }
+  }
+
+  // Set the EdgeInfo of boundary points in the same way as the triangle
+  // library path does: points at shape vertices copy the vertex EdgeInfo (the
+  // first vertex at that location wins) then other points on piece edges take
+  // the edge kind of the first edge they are on.
+  vector<bool> assigned(points_.size());
+  for (int i = 0; i < s.NumPieces(); i++) {
+    for (int j = 0; j < s.Piece(i).size(); j++) {
+      const RPoint &v = s.Piece(i)[j];
+      int k = point_index[GridLineIndex(gy, ToDouble(v.p[1])) * (nx + 1) +
+                          GridLineIndex(gx, ToDouble(v.p[0]))];
+      if (k >= 0 && !assigned[k]) {
+        points_[k].e = v.e;
+        points_[k].original_piece = i;
+        points_[k].original_edge = j;
+        assigned[k] = true;
+      }
+    }
+  }
+  for (int i = 0; i < s.NumPieces(); i++) {
+    const vector<RPoint> &piece = s.Piece(i);
+    for (int j = 0; j < piece.size(); j++) {
+      const JetPoint &p1 = piece[j].p;
+      const JetPoint &p2 = piece[(j + 1) % piece.size()].p;
+      int x1 = GridLineIndex(gx, ToDouble(p1[0]));
+      int y1 = GridLineIndex(gy, ToDouble(p1[1]));
+      int x2 = GridLineIndex(gx, ToDouble(p2[0]));
+      int y2 = GridLineIndex(gy, ToDouble(p2[1]));
+      int n = std::max(abs(x2 - x1), abs(y2 - y1));
+      for (int k = 1; k < n; k++) {
+        int x = x1 + (x2 - x1) * k / n;
+        int y = y1 + (y2 - y1) * k / n;
+        int index = point_index[y * (nx + 1) + x];
+        if (index >= 0 && !assigned[index]) {
+          SetSegmentPoint(s, i, j, &points_[index]);
+          assigned[index] = true;
+        }
+      }
+    }
+  }
+
+  // Create two counterclockwise triangles per cell. Corners a,b,c,d are the
+  // bottom left, bottom right, top right and top left of the cell.
+  triangles_.clear();
+  triangles_.reserve(num_cells * 2);
+  vector<int> first_triangle(nx * ny, -1);
+  for (int row = 0; row < ny; row++) {
+    for (int c = 0; c < nx; c++) {
+      int cell = row * nx + c;
+      if (cell_piece[cell] < 0) {
+        continue;
+      }
+      int a = point_index[row * (nx + 1) + c];
+      int b = point_index[row * (nx + 1) + c + 1];
+      int cc = point_index[(row + 1) * (nx + 1) + c + 1];
+      int d = point_index[(row + 1) * (nx + 1) + c];
+      int corners[2][2][3] = {{{a, b, cc}, {a, cc, d}},
+                              {{a, b, d}, {b, cc, d}}};
+      int pattern = (row + c) & 1;
+      first_triangle[cell] = triangles_.size();
+      for (int t = 0; t < 2; t++) {
+        Triangle tri;
+        for (int j = 0; j < 3; j++) {
+          tri.index[j] = corners[pattern][t][j];
+          tri.neighbor[j] = -1;
+        }
+        tri.material = cell_piece[cell];
+        triangles_.push_back(tri);
+      }
+    }
+  }
+
+  // Connect neighbors. Each cell's two triangles share the diagonal. Cell
+  // edges shared with other inside cells are interior, even when the cells
+  // have different materials. The remaining edges are boundary edges.
+  static const int kDX[4] = {0, 1, 0, -1};
+  static const int kDY[4] = {-1, 0, 1, 0};
+  for (int row = 0; row < ny; row++) {
+    for (int c = 0; c < nx; c++) {
+      int t = first_triangle[row * nx + c];
+      if (t < 0) {
+        continue;
+      }
+      int pattern = (row + c) & 1;
+      triangles_[t].neighbor[pattern ? 1 : 2] = t + 1;
+      triangles_[t + 1].neighbor[pattern ? 2 : 0] = t;
+      for (int side = 0; side < 4; side++) {
+        int c2 = c + kDX[side];
+        int row2 = row + kDY[side];
+        if (c2 < 0 || c2 >= nx || row2 < 0 || row2 >= ny ||
+            first_triangle[row2 * nx + c2] < 0) {
+          continue;
+        }
+        const int *mine = kCellSide[pattern][side];
+        const int *theirs = kCellSide[(row2 + c2) & 1][(side + 2) % 4];
+        triangles_[t + mine[0]].neighbor[mine[1]] =
+            first_triangle[row2 * nx + c2] + theirs[0];
+      }
+    }
+  }
+  return true;
 }
 
 void Mesh::DrawMesh(MeshDrawType draw_type, Colormap::Function colormap,
@@ -757,3 +1333,304 @@ TEST_FUNCTION(SpatialIndex) {
     CHECK(t == -1);
   }
 }
+
+// Return the per-material areas of the triangles in a mesh.
+static vector<double> MaterialAreas(const vector<RPoint> &points,
+                                    const vector<Triangle> &triangles,
+                                    int num_materials) {
+  vector<double> area(num_materials);
+  for (int i = 0; i < triangles.size(); i++) {
+    const JetPoint &p1 = points[triangles[i].index[0]].p;
+    const JetPoint &p2 = points[triangles[i].index[1]].p;
+    const JetPoint &p3 = points[triangles[i].index[2]].p;
+    double a = ToDouble((p2[0] - p1[0]) * (p3[1] - p1[1]) -
+                        (p2[1] - p1[1]) * (p3[0] - p1[0])) / 2;
+    CHECK(a > 0);                       // Counterclockwise
+    area[triangles[i].material] += a;
+  }
+  return area;
+}
+
+// Return the total length of boundary edges in a mesh and the length of
+// boundary edges on port 1.
+static void BoundaryLengths(Mesh *m, double *total, double *port) {
+  *total = *port = 0;
+  for (BoundaryIterator it(m); !it.done(); ++it) {
+    const JetPoint &p1 = m->points()[it.pindex1()].p;
+    const JetPoint &p2 = m->points()[it.pindex2()].p;
+    CHECK(m->points()[it.pindex1()].original_piece >= 0);
+    CHECK(m->points()[it.pindex2()].original_piece >= 0);
+    double length = ToDouble((p2 - p1).norm());
+    *total += length;
+    if (it.kind().PortNumber() == 1) {
+      *port += length;
+    }
+  }
+}
+
+// Check that the neighbor information of a mesh is consistent.
+static void CheckNeighbors(const vector<Triangle> &triangles) {
+  for (int i = 0; i < triangles.size(); i++) {
+    for (int j = 0; j < 3; j++) {
+      int n = triangles[i].neighbor[j];
+      if (n >= 0) {
+        bool found = false;
+        for (int k = 0; k < 3; k++) {
+          if (triangles[n].index[k] == triangles[i].index[(j + 1) % 3] &&
+              triangles[n].index[(k + 1) % 3] == triangles[i].index[j]) {
+            CHECK(triangles[n].neighbor[k] == i);
+            found = true;
+          }
+        }
+        CHECK(found);
+      }
+    }
+  }
+}
+
+TEST_FUNCTION(StructuredMesh) {
+  // An L shaped region with a rectangular hole, a painted region of another
+  // material and a port on the right hand edge.
+  Shape s, r, u, hole, patch;
+  s.SetRectangle(0, 0, 3, 1);
+  r.SetRectangle(0, 0, 1, 2);
+  u.SetUnion(s, r);
+  hole.SetRectangle(1.5, 0.25, 2, 0.75);
+  s.SetDifference(u, hole);
+  patch.SetRectangle(0.25, 1.25, 0.75, 1.75);
+  Material mat;
+  mat.color = 0xff0000;
+  mat.epsilon = 2;
+  s.Paint(patch, mat);
+  bool port_assigned = false;
+  for (int i = 0; i < s.NumPieces(); i++) {
+    for (int j = 0; j < s.Piece(i).size(); j++) {
+      const JetPoint &p1 = s.Piece(i)[j].p;
+      const JetPoint &p2 = s.Piece(i)[(j + 1) % s.Piece(i).size()].p;
+      if (p1[0] == 3 && p2[0] == 3) {
+        CHECK(s.AssignPort(i, j, EdgeKind(1)));
+        port_assigned = true;
+      }
+    }
+  }
+  CHECK(port_assigned);
+
+  const double kLongest = 0.1;
+  Mesh m1(s, kLongest, NULL, Mesh::TRIANGLE_MESHER);
+  Mesh m2(s, kLongest, NULL, Mesh::STRUCTURED_MESHER);
+  CHECK(m1.IsValidMesh() && m2.IsValidMesh());
+  printf("Triangle mesher: %d points, %d triangles\n",
+         (int)m1.points_.size(), (int)m1.triangles_.size());
+  printf("Structured mesher: %d points, %d triangles\n",
+         (int)m2.points_.size(), (int)m2.triangles_.size());
+
+  // Check that the structured mesh is made of right triangles with axis
+  // aligned legs that satisfy the edge length constraint.
+  for (int i = 0; i < m2.triangles_.size(); i++) {
+    int axis_aligned = 0;
+    for (int j = 0; j < 3; j++) {
+      const JetPoint &p1 = m2.points_[m2.triangles_[i].index[j]].p;
+      const JetPoint &p2 = m2.points_[m2.triangles_[i].index[(j + 1) % 3]].p;
+      CHECK(ToDouble((p2 - p1).norm()) <= kLongest * (1 + 1e-9));
+      axis_aligned += (p1[0] == p2[0] || p1[1] == p2[1]);
+    }
+    CHECK(axis_aligned == 2);
+  }
+
+  CheckNeighbors(m2.triangles_);
+
+  // Both meshes should cover the same area with the same materials and have
+  // the same boundary and port lengths.
+  vector<double> a1 = MaterialAreas(m1.points_, m1.triangles_, s.NumPieces());
+  vector<double> a2 = MaterialAreas(m2.points_, m2.triangles_, s.NumPieces());
+  for (int i = 0; i < s.NumPieces(); i++) {
+    printf("Material %d area: %f, %f\n", i, a1[i], a2[i]);
+    CHECK(fabs(a1[i] - a2[i]) < 1e-9);
+  }
+  double total1, port1, total2, port2;
+  BoundaryLengths(&m1, &total1, &port1);
+  BoundaryLengths(&m2, &total2, &port2);
+  printf("Boundary lengths: %f, %f, port lengths: %f, %f\n",
+         total1, total2, port1, port2);
+  CHECK(fabs(total1 - total2) < 1e-9);
+  CHECK(fabs(port1 - 1) < 1e-9 && fabs(port2 - 1) < 1e-9);
+
+  // Shapes that are not rectilinear fall back to the triangle library.
+  Shape circle;
+  circle.SetCircle(0, 0, 1, 20);
+  Mesh m3(circle, kLongest, NULL, Mesh::TRIANGLE_MESHER);
+  Mesh m4(circle, kLongest, NULL, Mesh::STRUCTURED_MESHER);
+  CHECK(m3.IsValidMesh() && m4.IsValidMesh());
+  CHECK(m3.points_.size() == m4.points_.size());
+  CHECK(m3.triangles_.size() == m4.triangles_.size());
+}
+
+TEST_FUNCTION(GradedMesh) {
+  // A square with a port on the left edge, a size hint box in the bottom left
+  // corner and a dielectric patch in the top right.
+  const double kLongest = 0.2;
+  const double kRate = 0.3;
+  const double kHint = 0.02;
+  Shape s, patch;
+  s.SetRectangle(0, 0, 2, 2);
+  patch.SetRectangle(1.2, 1.2, 1.8, 1.8);
+  Material mat;
+  mat.epsilon = 4;
+  s.Paint(patch, mat);
+  bool port_assigned = false;
+  for (int i = 0; i < s.NumPieces(); i++) {
+    for (int j = 0; j < s.Piece(i).size(); j++) {
+      const JetPoint &p1 = s.Piece(i)[j].p;
+      const JetPoint &p2 = s.Piece(i)[(j + 1) % s.Piece(i).size()].p;
+      if (p1[0] == 0 && p2[0] == 0) {
+        CHECK(s.AssignPort(i, j, EdgeKind(1)));
+        port_assigned = true;
+      }
+    }
+  }
+  CHECK(port_assigned);
+  Mesh::Grading grading;
+  grading.rate = kRate;
+  const double kHintBox[5] = {0, 0, 0.2, 0.2, kHint};
+  grading.hints.assign(kHintBox, kHintBox + 5);
+  Mesh uniform(s, kLongest, NULL);
+  Mesh graded(s, kLongest, NULL, Mesh::TRIANGLE_MESHER, grading);
+  Mesh fine(s, kHint, NULL);
+  CHECK(uniform.IsValidMesh() && graded.IsValidMesh() && fine.IsValidMesh());
+  printf("Triangles: uniform %d, graded %d, fine %d\n",
+         (int)uniform.triangles_.size(), (int)graded.triangles_.size(),
+         (int)fine.triangles_.size());
+  CHECK(graded.triangles_.size() > uniform.triangles_.size());
+  CHECK(graded.triangles_.size() * 4 < fine.triangles_.size());
+
+  // Check the edge lengths near the hint box and the triangle areas in the
+  // dielectric.
+  const double kSlack = 1 + 1e-9;
+  for (int i = 0; i < graded.triangles_.size(); i++) {
+    const Triangle &t = graded.triangles_[i];
+    const JetPoint *p[3];
+    double cx = 0, cy = 0, longest = 0;
+    for (int j = 0; j < 3; j++) {
+      p[j] = &graded.points_[t.index[j]].p;
+      cx += ToDouble((*p[j])[0]) / 3;
+      cy += ToDouble((*p[j])[1]) / 3;
+    }
+    for (int j = 0; j < 3; j++) {
+      longest = std::max(longest, ToDouble((*p[(j + 1) % 3] - *p[j]).norm()));
+    }
+    CHECK(longest <= kLongest * kSlack);
+    double dx = std::max(0.0, cx - 0.2), dy = std::max(0.0, cy - 0.2);
+    CHECK(longest <= (kHint + kRate * sqrt(dx * dx + dy * dy)) * kSlack);
+    if (t.material == 1) {
+      double area = ToDouble(((*p[1])[0] - (*p[0])[0]) *
+                             ((*p[2])[1] - (*p[0])[1]) -
+                             ((*p[1])[1] - (*p[0])[1]) *
+                             ((*p[2])[0] - (*p[0])[0])) / 2;
+      CHECK(area <= sqrt(3.0) / 4 * sqr(kLongest) / 4 * kSlack);
+    }
+  }
+
+  // Check the port edge lengths.
+  int port_edges = 0;
+  for (BoundaryIterator it(&graded); !it.done(); ++it) {
+    if (it.kind().PortNumber() == 1) {
+      const JetPoint &p1 = graded.points_[it.pindex1()].p;
+      const JetPoint &p2 = graded.points_[it.pindex2()].p;
+      CHECK(ToDouble((p2 - p1).norm()) <= kLongest / 2 * kSlack);
+      port_edges++;
+    }
+  }
+  CHECK(port_edges >= 20);
+}
+
+TEST_FUNCTION(SymmetricMesh) {
+  // A rectangle with a circular hole and a dielectric patch, symmetric about
+  // x=1.5 and y=1, with port 1 on the left edge and port 2 on the right edge.
+  Shape s, hole, patch;
+  s.SetRectangle(0, 0, 3, 2);
+  CHECK(s.AssignPort(0, 3, EdgeKind(1)));
+  CHECK(s.AssignPort(0, 1, EdgeKind(2)));
+  hole.SetCircle(1.5, 1, 0.3, 20);
+  s.SetDifference(s, hole);
+  patch.SetRectangle(0.5, 0.75, 2.5, 1.25);
+  Material mat;
+  mat.epsilon = 2;
+  s.Paint(patch, mat);
+
+  const double kLongest = 0.1;
+  Mesh whole(s, kLongest, NULL);
+  CHECK(whole.IsValidMesh());
+  vector<double> whole_area =
+      MaterialAreas(whole.points_, whole.triangles_, s.NumPieces());
+  for (int quarter = 0; quarter < 2; quarter++) {
+    Mesh::Symmetry symmetry;
+    symmetry.mirror_x = true;
+    symmetry.x0 = 1.5;
+    symmetry.mirror_y = quarter;
+    symmetry.y0 = 1;
+    Mesh m(s, kLongest, NULL, Mesh::TRIANGLE_MESHER, Mesh::Grading(),
+           symmetry);
+    CHECK(m.IsValidMesh());
+    printf("Symmetric mesh: %d points, %d triangles\n",
+           (int)m.points_.size(), (int)m.triangles_.size());
+    CheckNeighbors(m.triangles_);
+
+    // Every point has a mirror image, to within rounding error.
+    auto has_point = [&m](double x, double y) {
+      for (int i = 0; i < m.points_.size(); i++) {
+        if (fabs(ToDouble(m.points_[i].p[0]) - x) < 1e-12 &&
+            fabs(ToDouble(m.points_[i].p[1]) - y) < 1e-12) {
+          return true;
+        }
+      }
+      return false;
+    };
+    for (int i = 0; i < m.points_.size(); i++) {
+      double x = ToDouble(m.points_[i].p[0]), y = ToDouble(m.points_[i].p[1]);
+      CHECK(has_point(3 - x, y));
+      if (quarter) {
+        CHECK(has_point(x, 2 - y));
+      }
+    }
+
+    // The materials and boundary are the same as in the whole mesh, and the
+    // mirror image of port 1 is still port 2. Pieces with the same material
+    // are not distinguished in the symmetric mesh.
+    vector<double> area = MaterialAreas(m.points_, m.triangles_,
+                                        s.NumPieces());
+    for (int i = 0; i < s.NumPieces(); i++) {
+      double a1 = 0, a2 = 0;
+      for (int j = 0; j < s.NumPieces(); j++) {
+        if (s.GetMaterial(j) == s.GetMaterial(i)) {
+          a1 += whole_area[j];
+          a2 += area[j];
+        }
+      }
+      printf("Material %d area: %f, %f\n", i, a1, a2);
+      CHECK(fabs(a1 - a2) < 1e-6);
+    }
+    double total1, port1, total2, port2;
+    BoundaryLengths(&whole, &total1, &port1);
+    BoundaryLengths(&m, &total2, &port2);
+    CHECK(fabs(total1 - total2) < 1e-6);
+    CHECK(fabs(port1 - 2) < 1e-9 && fabs(port2 - 2) < 1e-9);
+    double port2_length = 0;
+    for (BoundaryIterator it(&m); !it.done(); ++it) {
+      if (it.kind().PortNumber() == 2) {
+        CHECK(fabs(ToDouble(m.points_[it.pindex1()].p[0]) - 3) < 1e-9);
+        port2_length += ToDouble((m.points_[it.pindex2()].p -
+                                  m.points_[it.pindex1()].p).norm());
+      }
+    }
+    CHECK(fabs(port2_length - 2) < 1e-9);
+  }
+
+  // A shape that is not symmetric can not be meshed this way.
+  Shape t;
+  t.SetRectangle(0, 0, 3.1, 2);
+  Mesh::Symmetry symmetry;
+  symmetry.mirror_x = true;
+  symmetry.x0 = 1.5;
+  Mesh m(t, kLongest, NULL, Mesh::TRIANGLE_MESHER, Mesh::Grading(), symmetry);
+  CHECK(!m.IsValidMesh());
+}
@@ -14,8 +14,53 @@ class Mesh {
   // > 0 then triangles will be subdivided to satisfy this constraint,
   // otherwise a triangulation with a small number of triangles will be
   // produced. If 'lua' is provided the dielectric callback functions can be
-  // called.
-  explicit Mesh(const Shape &s, double longest_edge_permitted, Lua *lua);
+  // called. STRUCTURED_MESHER meshes rectilinear shapes with a regular grid of
+  // right triangles, which is faster and gives more regular connectivity.
+  // Shapes that are not suitable for this use the triangle library instead.
+  enum MesherType {
+    UNKNOWN_MESHER = -1,
+    TRIANGLE_MESHER = 0,
+    STRUCTURED_MESHER,
+  };
+
+  // Optional graded meshing, which is only done by the triangle library (the
+  // structured mesher falls back to it when grading is active). If 'rate' > 0
+  // then edges near short shape edges and ports are made shorter, and the
+  // permitted edge length grows by 'rate' per unit distance from them up to
+  // longest_edge_permitted. Edges in dielectric materials are also shortened
+  // by 1/sqrt(|epsilon|) to track the local wavelength. Each size hint box is
+  // x1,y1,x2,y2,edge_length and limits edges inside the box (and near it, if
+  // rate > 0) to that length.
+  struct Grading {
+    double rate;
+    vector<double> hints;       // Size hint boxes, 5 numbers each
+
+    Grading() : rate(-1) {}
+    bool Active() const { return rate > 0 || !hints.empty(); }
+  };
+
+  // Optional mirror symmetry. If the shape is symmetric about the line x==x0
+  // (if mirror_x) and/or y==y0 (if mirror_y) then only the fundamental domain,
+  // the part with x >= x0 and y >= y0, is meshed, and the rest of the mesh is
+  // its mirror image. The mesh is then exactly symmetric, which allows
+  // FEM::MirrorFactorizer to split the system matrix.
+  struct Symmetry {
+    bool mirror_x, mirror_y;
+    double x0, y0;
+
+    Symmetry() : mirror_x(false), mirror_y(false), x0(0), y0(0) {}
+    bool Active() const { return mirror_x || mirror_y; }
+    bool operator==(const Symmetry &s) const {
+      return mirror_x == s.mirror_x && mirror_y == s.mirror_y &&
+             x0 == s.x0 && y0 == s.y0;
+    }
+    bool operator!=(const Symmetry &s) const { return !operator==(s); }
+  };
+
+  explicit Mesh(const Shape &s, double longest_edge_permitted, Lua *lua,
+                MesherType mesher = TRIANGLE_MESHER,
+                const Grading &grading = Grading(),
+                const Symmetry &symmetry = Symmetry());
 
   // Did mesh creation succeed?
   bool IsValidMesh() const { return valid_mesh_; }
@@ -69,6 +114,30 @@ class Mesh {
 
   // For testing:
   friend void __RunTest_SpatialIndex();
+  friend void __RunTest_StructuredMesh();
+  friend void __RunTest_GradedMesh();
+  friend void __RunTest_SymmetricMesh();
+
+ private:
+  // Create points_ and triangles_ using the triangle library. Return false on
+  // failure.
+  bool TriangleMesh(const Shape &s, double longest_edge_permitted,
+                    const Grading &grading);
+
+  // Create points_ and triangles_ from a structured grid. Return false if the
+  // shape is not rectilinear or the grid would have poorly shaped cells, in
+  // which case nothing is changed.
+  bool StructuredMesh(const Shape &s, double longest_edge_permitted);
+
+  // Add the mirror image of all points and triangles about the line x==c
+  // (axis 0) or y==c (axis 1). Points on the line are shared and the
+  // triangles on either side of it become neighbors.
+  void MirrorMesh(int axis, double c);
+
+  // Link the boundary points of the mirrored mesh of 's' to the pieces and
+  // edges of 's', setting their EdgeInfo. Return false if some boundary point
+  // is not on the boundary of 's' (i.e. 's' is not symmetric).
+  bool LinkBoundaryPoints(const Shape &s);
 };
 
 // Iterate over all boundary edges of all triangles in a mesh.
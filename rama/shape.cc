@@ -1,6 +1,9 @@
 
 #include <math.h>
 #include <algorithm>
+#include <list>
+#include <map>
+#include <string>
 #include "common.h"
 #include "shape.h"
 #include "mesh.h"
@@ -8,6 +11,7 @@
 #include "shaders.h"
 #include "wxgl_font.h"
 #include "testing.h"
+#include "md5.h"
 
 using ClipperLib::IntPoint;
 using ClipperLib::Clipper;
@@ -37,6 +41,9 @@ const double kTolColinear = 1.74e-8;    // 1 micro-degree (in radians)
 const double kTolClean = 1e-9;          // Multiplies largest side length
 const JetNum kMaxStepsAllowed = 1e4;    // For grow() round style, etc
 
+// Operation cache limits.
+const int kMaxOperationCacheEntries = 20000;
+
 //***************************************************************************
 // Utility.
 
@@ -136,6 +143,42 @@ static bool GetPieceEdgeArray(lua_State *L, int index,
   return true;
 }
 
+// If there is an array at the given (absolute) index containing {x,y} or
+// {x=#,y=#} point tables then return true and return the points. Otherwise
+// return false. In either case the stack will be left unchanged.
+static bool GetPointArray(lua_State *L, int index, vector<JetPoint> *points) {
+  int top = lua_gettop(L);
+  CHECK(index >= 1);            // Absolute indexes simplify code below
+  if (lua_type(L, index) != LUA_TTABLE) {
+    return false;
+  }
+  points->clear();
+  lua_len(L, index);
+  int n = ToInt64(lua_tonumber(L, -1));
+  lua_pop(L, 1);
+  for (int i = 1; i <= n; i++) {
+    lua_rawgeti(L, index, i);
+    if (lua_type(L, -1) != LUA_TTABLE) {
+      lua_settop(L, top);
+      return false;
+    }
+    lua_rawgeti(L, -1, 1);
+    lua_rawgeti(L, -2, 2);
+    if (lua_type(L, -2) != LUA_TNUMBER) {
+      lua_pop(L, 2);
+      lua_getfield(L, -1, "x");
+      lua_getfield(L, -2, "y");
+    }
+    if (lua_type(L, -2) != LUA_TNUMBER || lua_type(L, -1) != LUA_TNUMBER) {
+      lua_settop(L, top);
+      return false;
+    }
+    points->push_back(JetPoint(lua_tonumber(L, -2), lua_tonumber(L, -1)));
+    lua_settop(L, top);
+  }
+  return true;
+}
+
 // Return the shortest distance between x,y and the line segment p1..p2. Return
 // in 'excursion' the distance that x,y is beyond the endcap of the line (this
 // is used to break ties when finding the shortest distance to multiple line
@@ -263,6 +306,44 @@ int PointInTriangle(const JetPoint &p, const JetPoint &a,
   return -1;
 }
 
+// Returns 1 if a ray from pt_x,pt_y in the +x direction crosses the polygon
+// edge ip..ipNext, 0 if it does not, or -1 if pt is on the edge. The number of
+// crossings for all edges determines whether pt is inside the polygon.
+static int EdgeCrossing(const JetPoint &ip, const JetPoint &ipNext,
+                        JetNum pt_x, JetNum pt_y) {
+  // What follows is a direct port of the clipper function, so that we don't
+  // have to convert to/from integer coordinates.
+  if (ipNext[1] == pt_y) {
+    if ((ipNext[0] == pt_x) || (ip[1] == pt_y &&
+        ((ipNext[0] > pt_x) == (ip[0] < pt_x))))
+      return -1;
+  }
+  if ((ip[1] < pt_y) != (ipNext[1] < pt_y)) {
+    if (ip[0] >= pt_x) {
+      if (ipNext[0] > pt_x)
+        return 1;
+      else {
+        JetNum d = (ip[0] - pt_x) * (ipNext[1] - pt_y) -
+                   (ipNext[0] - pt_x) * (ip[1] - pt_y);
+        if (d == 0)
+          return -1;
+        if ((d > 0) == (ipNext[1] > ip[1]))
+          return 1;
+      }
+    } else {
+      if (ipNext[0] > pt_x) {
+        JetNum d = (ip[0] - pt_x) * (ipNext[1] - pt_y) -
+                   (ipNext[0] - pt_x) * (ip[1] - pt_y);
+        if (d == 0)
+          return -1;
+        if ((d > 0) == (ipNext[1] > ip[1]))
+          return 1;
+      }
+    }
+  }
+  return 0;
+}
+
 // Returns 0 if 'pt' is not in the polygon, +1 if it is, or -1 if pt is on the
 // polygon boundary.
 static int PointInPolygon(const vector<RPoint> &path, const RPoint &pt) {
@@ -276,43 +357,13 @@ static int PointInPolygon(const vector<RPoint> &path, const RPoint &pt) {
     return PointInTriangle(pt.p, path[0].p, path[1].p, path[2].p);
   }
 
-  // What follows is a direct port of the clipper function, so that we don't
-  // have to convert to/from integer coordinates.
-  JetNum pt_x = pt.p[0];
-  JetNum pt_y = pt.p[1];
   int result = 0;
-  JetPoint ip = path[0].p;
-  for(size_t i = 1; i <= cnt; ++i) {
-    JetPoint ipNext = (i == cnt ? path[0].p : path[i].p);
-    if (ipNext[1] == pt_y) {
-      if ((ipNext[0] == pt_x) || (ip[1] == pt_y &&
-          ((ipNext[0] > pt_x) == (ip[0] < pt_x))))
-        return -1;
-    }
-    if ((ip[1] < pt_y) != (ipNext[1] < pt_y)) {
-      if (ip[0] >= pt_x) {
-        if (ipNext[0] > pt_x)
-          result = 1 - result;
-        else {
-          JetNum d = (ip[0] - pt_x) * (ipNext[1] - pt_y) -
-                     (ipNext[0] - pt_x) * (ip[1] - pt_y);
-          if (d == 0)
-            return -1;
-          if ((d > 0) == (ipNext[1] > ip[1]))
-            result = 1 - result;
-        }
-      } else {
-        if (ipNext[0] > pt_x) {
-          JetNum d = (ip[0] - pt_x) * (ipNext[1] - pt_y) -
-                     (ipNext[0] - pt_x) * (ip[1] - pt_y);
-          if (d == 0)
-            return -1;
-          if ((d > 0) == (ipNext[1] > ip[1]))
-            result = 1 - result;
-        }
-      }
+  for (size_t i = 0; i < cnt; ++i) {
+    int c = EdgeCrossing(path[i].p, path[(i + 1) % cnt].p, pt.p[0], pt.p[1]);
+    if (c < 0) {
+      return -1;
     }
-    ip = ipNext;
+    result ^= c;
   }
   return result;
 }
@@ -456,6 +507,284 @@ void MyZFillCallback(IntPoint &e1bot, IntPoint &e1top,
   pt.Z = new_et;
 }
 
+//***************************************************************************
+// Clipper operation cache.
+//
+// Scripts build their geometry as a DAG of primitives combined with boolean
+// operations. When a script is rerun because a parameter changed, only the
+// operations that transitively depend on that parameter see different
+// operands. Rather than asking scripts to declare which parameters each shape
+// depends on, we identify each clipper operation by an MD5 hash of its exact
+// integer operands (including edge kinds and coordinate derivatives) and
+// reuse the result from a previous run when the hash matches. Unchanged
+// subtrees of the DAG are therefore not recomputed, and only the invalidated
+// path up to config.cd is run through the clipper again.
+
+namespace {
+
+// Cache keys in order of use, most recently used first. When the cache is
+// full the least recently used entry is evicted, so the entries that an
+// optimizer keeps hitting survive.
+typedef std::list<std::string> OperationCacheLRU;
+
+struct OperationCacheEntry {
+  Paths result;                 // Clipper output for this operation
+  int generation;               // Last script run that used this entry
+  OperationCacheLRU::iterator lru;      // Position of key in operation_lru
+};
+
+typedef std::map<std::string, OperationCacheEntry> OperationCache;
+
+OperationCache operation_cache;
+OperationCacheLRU operation_lru;
+bool operation_cache_enabled = true;
+int operation_cache_generation = 0;
+int operation_cache_hits = 0;
+
+void HashPaths(md5_state_t *ms, const Paths &paths) {
+  int n = paths.size();
+  md5_append(ms, (const md5_byte_t*) &n, sizeof(n));
+  for (int i = 0; i < paths.size(); i++) {
+    n = paths[i].size();
+    md5_append(ms, (const md5_byte_t*) &n, sizeof(n));
+    for (int j = 0; j < paths[i].size(); j++) {
+      const IntPoint &pt = paths[i][j];
+      // Hash individual fields to avoid hashing uninitialized padding bytes.
+      // EdgeInfo itself is packed (two 16 bit kinds and two floats).
+      const EdgeInfo &e = pt.Z;
+      md5_append(ms, (const md5_byte_t*) &pt.X, sizeof(pt.X));
+      md5_append(ms, (const md5_byte_t*) &pt.Y, sizeof(pt.Y));
+      md5_append(ms, (const md5_byte_t*) &e, sizeof(e));
+      md5_append(ms, (const md5_byte_t*) &pt.Z.derivative_x,
+                 sizeof(pt.Z.derivative_x));
+      md5_append(ms, (const md5_byte_t*) &pt.Z.derivative_y,
+                 sizeof(pt.Z.derivative_y));
+    }
+  }
+}
+
+// Return the cache key for running the clipper on the given operands.
+std::string OperationKey(ClipType clip_type, const Paths *p1,
+                         const Paths *p2) {
+  md5_state_t ms;
+  md5_init(&ms);
+  int header[3] = { clip_type, p1 != 0, p2 != 0 };
+  md5_append(&ms, (const md5_byte_t*) header, sizeof(header));
+  if (p1) {
+    HashPaths(&ms, *p1);
+  }
+  if (p2) {
+    HashPaths(&ms, *p2);
+  }
+  md5_byte_t digest[16];
+  md5_finish(&ms, digest);
+  return std::string((const char*) digest, sizeof(digest));
+}
+
+}  // anonymous namespace
+
+void Shape::EnableOperationCache(bool enable) {
+  operation_cache_enabled = enable;
+  if (!enable) {
+    operation_cache.clear();
+    operation_lru.clear();
+  }
+}
+
+void Shape::NewOperationCacheGeneration() {
+  // Discard everything that was not used by the last script run. Those
+  // entries belong to parameter values that are no longer current.
+  for (OperationCache::iterator it = operation_cache.begin();
+       it != operation_cache.end();) {
+    if (it->second.generation != operation_cache_generation) {
+      operation_lru.erase(it->second.lru);
+      operation_cache.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  operation_cache_generation++;
+}
+
+int Shape::OperationCacheHits() {
+  return operation_cache_hits;
+}
+
+//***************************************************************************
+// Spatial index of shape edges.
+//
+// A uniform grid over the shape bounding box. Each cell lists the edges that
+// touch it (cells are slightly enlarged so that this is conservative) and the
+// edges whose first vertex lies inside it. Queries gather candidate edges from
+// the grid and then run exactly the same tests as the brute force code, in
+// the same order, so the results are identical.
+
+const int kMinEdgesForIndex = 64;       // Brute force is faster below this
+const int kMaxGridCells = 1 << 20;      // Limits index memory use
+
+static bool spatial_index_enabled = true;
+
+struct Shape::EdgeIndex {
+  struct Edge {
+    int piece, edge;            // Edge from vertex 'edge' to 'edge'+1
+  };
+  vector<Edge> edges;           // All edges, in piece and vertex order
+  vector<int> piece_sign;       // +1 for positive area pieces, else -1
+  vector<int> small_pieces;     // Pieces with fewer than 4 vertices
+  double x0, y0, x1, y1;        // Bounding box of all vertices
+  double dx, dy;                // Cell size
+  double margin;                // Cell enlargement for edges
+  int nx, ny;                   // Number of cells in each direction
+  vector<vector<int> > cells;   // Edges (indexes into edges) touching cells
+  vector<vector<int> > vertex_cells;    // Edges with first vertex in cells
+
+  explicit EdgeIndex(const vector<Polygon> &polys);
+
+  // Return the cell containing x or y, clamped to the grid.
+  int CellX(double x) const {
+    return int(std::max(0.0, std::min(nx - 1.0, floor((x - x0) / dx))));
+  }
+  int CellY(double y) const {
+    return int(std::max(0.0, std::min(ny - 1.0, floor((y - y0) / dy))));
+  }
+
+  // Append the contents of the cells that are exactly r cells away from
+  // ix,iy (in the Chebyshev sense) to 'result'.
+  void AddRing(const vector<vector<int> > &c, int ix, int iy, int r,
+               vector<int> *result) const;
+
+  // Return a distance from x,y such that everything closer is inside the
+  // square of cells within r of ix,iy. This is infinite if that square covers
+  // the whole grid.
+  double Coverage(double x, double y, int ix, int iy, int r) const;
+
+  // Return true if the square of cells within r of ix,iy covers the grid.
+  bool CoversGrid(int ix, int iy, int r) const {
+    return ix - r <= 0 && ix + r >= nx - 1 && iy - r <= 0 && iy + r >= ny - 1;
+  }
+};
+
+Shape::EdgeIndex::EdgeIndex(const vector<Polygon> &polys) {
+  x0 = y0 = __DBL_MAX__;
+  x1 = y1 = -__DBL_MAX__;
+  for (int i = 0; i < polys.size(); i++) {
+    const vector<RPoint> &p = polys[i].p;
+    piece_sign.push_back(PolyArea(p) > 0 ? 1 : -1);
+    if (p.size() < 4) {
+      small_pieces.push_back(i);
+    }
+    for (int j = 0; j < p.size(); j++) {
+      Edge e = {i, j};
+      edges.push_back(e);
+      x0 = std::min(x0, ToDouble(p[j].p[0]));
+      x1 = std::max(x1, ToDouble(p[j].p[0]));
+      y0 = std::min(y0, ToDouble(p[j].p[1]));
+      y1 = std::max(y1, ToDouble(p[j].p[1]));
+    }
+  }
+
+  // Choose the cell size to have about one edge per cell, but deal with the
+  // case where the bounding box is very thin or has zero size.
+  double w = x1 - x0, h = y1 - y0;
+  double cell = sqrt(w * h / edges.size());
+  cell = std::max(cell, std::max(w, h) / edges.size());
+  if (cell <= 0) {
+    cell = 1;
+  }
+  nx = std::min(int(w / cell) + 1, kMaxGridCells);
+  ny = std::min(int(h / cell) + 1, kMaxGridCells);
+  while (double(nx) * double(ny) > kMaxGridCells) {
+    nx = (nx + 1) / 2;
+    ny = (ny + 1) / 2;
+  }
+  dx = (w > 0) ? w / nx : cell;
+  dy = (h > 0) ? h / ny : cell;
+  margin = 1e-9 * (dx + dy);
+  cells.resize(nx * ny);
+  vertex_cells.resize(nx * ny);
+
+  for (int k = 0; k < edges.size(); k++) {
+    const vector<RPoint> &p = polys[edges[k].piece].p;
+    const JetPoint &a = p[edges[k].edge].p;
+    const JetPoint &b = p[(edges[k].edge + 1) % p.size()].p;
+    double ax = ToDouble(a[0]), ay = ToDouble(a[1]);
+    double bx = ToDouble(b[0]), by = ToDouble(b[1]);
+    vertex_cells[CellY(ay) * nx + CellX(ax)].push_back(k);
+    int i1 = CellX(std::min(ax, bx) - margin);
+    int i2 = CellX(std::max(ax, bx) + margin);
+    int j1 = CellY(std::min(ay, by) - margin);
+    int j2 = CellY(std::max(ay, by) + margin);
+    for (int j = j1; j <= j2; j++) {
+      for (int i = i1; i <= i2; i++) {
+        if (i1 == i2 || j1 == j2 ||
+            DoesLineIntersectBox(a, b, x0 + i * dx - margin,
+                                 x0 + (i + 1) * dx + margin,
+                                 y0 + j * dy - margin,
+                                 y0 + (j + 1) * dy + margin)) {
+          cells[j * nx + i].push_back(k);
+        }
+      }
+    }
+  }
+}
+
+void Shape::EdgeIndex::AddRing(const vector<vector<int> > &c, int ix, int iy,
+                               int r, vector<int> *result) const {
+  for (int j = iy - r; j <= iy + r; j++) {
+    if (j < 0 || j >= ny) {
+      continue;
+    }
+    // Whole rows at the top and bottom of the ring, only the end cells of the
+    // rows in between.
+    int step = (j == iy - r || j == iy + r) ? 1 : 2 * r;
+    for (int i = ix - r; i <= ix + r; i += step) {
+      if (i >= 0 && i < nx) {
+        const vector<int> &cell = c[j * nx + i];
+        result->insert(result->end(), cell.begin(), cell.end());
+      }
+    }
+  }
+}
+
+double Shape::EdgeIndex::Coverage(double x, double y, int ix, int iy,
+                                  int r) const {
+  double d = __DBL_MAX__;
+  if (ix - r > 0) {
+    d = std::min(d, x - (x0 + (ix - r) * dx));
+  }
+  if (ix + r < nx - 1) {
+    d = std::min(d, x0 + (ix + r + 1) * dx - x);
+  }
+  if (iy - r > 0) {
+    d = std::min(d, y - (y0 + (iy - r) * dy));
+  }
+  if (iy + r < ny - 1) {
+    d = std::min(d, y0 + (iy + r + 1) * dy - y);
+  }
+  return d - margin;
+}
+
+void Shape::EnableSpatialIndex(bool enable) {
+  spatial_index_enabled = enable;
+}
+
+const Shape::EdgeIndex *Shape::GetIndex() const {
+  if (!spatial_index_enabled) {
+    return 0;
+  }
+  if (!index_) {
+    int count = 0;
+    for (int i = 0; i < polys_.size(); i++) {
+      count += polys_[i].p.size();
+    }
+    if (count < kMinEdgesForIndex) {
+      return 0;
+    }
+    index_.reset(new EdgeIndex(polys_));
+  }
+  return index_.get();
+}
+
 //***************************************************************************
 // Lua global functions.
 
@@ -618,6 +947,7 @@ void Shape::SetLuaGlobals(lua_State *L) {
 
 void Shape::Clear() {
   polys_.clear();
+  InvalidateIndex();
 }
 
 void Shape::Dump() const {
@@ -779,6 +1109,7 @@ void Shape::AddPoint(JetNum x, JetNum y) {
     polys_.resize(1);
   }
   polys_.back().p.push_back(RPoint(x, y));
+  InvalidateIndex();
 }
 
 void Shape::MakePolyline() {
@@ -788,6 +1119,7 @@ void Shape::MakePolyline() {
       polys_.back().p.push_back(polys_.back().p[i]);
     }
   }
+  InvalidateIndex();
 }
 
 void Shape::SetToPiece(int n, const Shape &p) {
@@ -800,6 +1132,7 @@ void Shape::SetToPiece(int n, const Shape &p) {
     new_polys_[0] = p.polys_[n];
   }
   new_polys_.swap(polys_);
+  InvalidateIndex();
 }
 
 bool Shape::AssignPort(int piece, int edge, EdgeKind kind) {
@@ -872,6 +1205,7 @@ void Shape::SetRectangle(JetNum x1, JetNum y1, JetNum x2, JetNum y2) {
   polys_[0].p.push_back(RPoint(std::max(x1,x2), std::min(y1,y2)));
   polys_[0].p.push_back(RPoint(std::max(x1,x2), std::max(y1,y2)));
   polys_[0].p.push_back(RPoint(std::min(x1,x2), std::max(y1,y2)));
+  InvalidateIndex();
 }
 
 void Shape::SetCircle(JetNum x, JetNum y, JetNum radius, int npoints) {
@@ -881,6 +1215,7 @@ void Shape::SetCircle(JetNum x, JetNum y, JetNum radius, int npoints) {
     double angle = double(i) / double(npoints) * 2.0 * M_PI;
     polys_[0].p.push_back(RPoint(x + radius*cos(angle), y + radius*sin(angle)));
   }
+  InvalidateIndex();
 }
 
 void Shape::SetIntersect(const Shape &c1, const Shape &c2) {
@@ -900,60 +1235,129 @@ void Shape::SetXOR(const Shape &c1, const Shape &c2) {
 }
 
 void Shape::Paint(const Shape &s, const Material &mat) {
-  // Compute the coordinate conversion that we're going to use for all
-  // clipping. It's important to be consistent so that this shape and the area
-  // to paint will end up sharing coincident vertices that will be
-  // un-duplicated in Triangulate().
-  JetNum offset_x, offset_y, scale;
-  if (!ClipperBounds(this, &s, &offset_x, &offset_y, &scale)) {
+  Paint(vector<const Shape*>(1, &s), vector<Material>(1, mat));
+}
+
+void Shape::Paint(const vector<const Shape*> &s, const vector<Material> &mat) {
+  // Sequential painting gives each point the material of the last area that
+  // covers it. Compute that directly: working backwards, each area is trimmed
+  // by the union of all areas painted after it. This needs a fixed number of
+  // clipper operations per area, rather than one per area per existing piece.
+  CHECK(s.size() == mat.size());
+  if (IsEmpty()) {
     return;
   }
 
-  // Subtract 's' separately from each non-hole polygon piece, taking care to
-  // preserve the polygon material (color etc) of each piece. We can't simply
-  // run the clipper to subtract 's' from all pieces of 'this', since that
-  // would unrecoverably merge pieces with different materials.
-  Shape holes, not_holes, result;
-  for (int i = 0; i < polys_.size(); i++) {
-    if (PolyArea(polys_[i].p) > 0) {
-      not_holes.polys_.push_back(polys_[i]);
+  // Compute the coordinate conversion that we're going to use for all
+  // clipping. It's important to be consistent so that this shape and the
+  // areas to paint will end up sharing coincident vertices that will be
+  // un-duplicated in Triangulate(). The bounds of this shape and all areas
+  // are used, which for a single area is the conversion that Paint(s,mat)
+  // has always used.
+  vector<const Shape*> bounds_shapes(s);
+  bounds_shapes.push_back(this);
+  JetNum offset_x, offset_y, scale;
+  CHECK(ClipperBounds(bounds_shapes, &offset_x, &offset_y, &scale));
+
+  // Compute the visible part of each area to paint.
+  Shape covered;                        // Union of areas painted later
+  vector<Shape> areas(s.size());
+  for (int i = s.size() - 1; i >= 0; i--) {
+    Shape visible;
+    visible.RunClipper(this, s[i], ctIntersection, offset_x, offset_y, scale);
+    if (visible.IsEmpty()) {
+      continue;
+    }
+    if (covered.IsEmpty()) {
+      areas[i] = visible;
+      covered = visible;
     } else {
-      holes.polys_.push_back(polys_[i]);
+      areas[i].RunClipper(&visible, &covered, ctDifference,
+                          offset_x, offset_y, scale);
+      covered.RunClipper(&covered, &visible, ctUnion,
+                         offset_x, offset_y, scale);
+    }
+    for (int j = 0; j < areas[i].polys_.size(); j++) {
+      areas[i].polys_[j].material = mat[i];
     }
   }
-  for (int i = 0; i < not_holes.polys_.size(); i++) {
-    // Each piece we subtract from is one of the not-holes combined with all of
-    // the holes. This works because the pftPositive fill type allows the
-    // polygon to have external holes that are invisible.
+
+  // Subtract the total painted area separately from the pieces of each
+  // material, taking care to preserve the material. We can't simply run the
+  // clipper to subtract from all pieces of 'this', since that would
+  // unrecoverably merge pieces with different materials. Each material's
+  // pieces are processed together with the holes of that material, since a
+  // hole in one piece can contain a piece with a different material (e.g. an
+  // earlier painted area), which must not be erased by that hole.
+  Shape result;
+  vector<bool> done(polys_.size());
+  for (int i = 0; i < polys_.size(); i++) {
+    if (done[i]) {
+      continue;
+    }
     Shape a, b;
-    a.polys_.push_back(not_holes.polys_[i]);
-    a.polys_.insert(a.polys_.end(), holes.polys_.begin(), holes.polys_.end());
-    b.RunClipper(&a, &s, ctDifference, offset_x, offset_y, scale);
+    for (int j = i; j < polys_.size(); j++) {
+      if (!done[j] && polys_[j].material == polys_[i].material) {
+        a.polys_.push_back(polys_[j]);
+        done[j] = true;
+      }
+    }
+    b.RunClipper(&a, &covered, ctDifference, offset_x, offset_y, scale);
     for (int j = 0; j < b.polys_.size(); j++) {
-      b.polys_[j].material = not_holes.polys_[i].material;
+      b.polys_[j].material = polys_[i].material;
     }
     result.polys_.insert(result.polys_.end(), b.polys_.begin(), b.polys_.end());
   }
 
-  // Compute the area to paint and add it to the result as a separate
-  // (non-merged) polygon piece.
-  Shape area_to_paint;
-  area_to_paint.RunClipper(this, &s, ctIntersection, offset_x, offset_y, scale);
-  if (IsEmpty()) {
-    return;
-  }
-  for (int i = 0; i < area_to_paint.polys_.size(); i++) {
-    area_to_paint.polys_[i].material = mat;
+  // Add the painted areas as separate (non-merged) polygon pieces.
+  for (int i = 0; i < areas.size(); i++) {
+    result.polys_.insert(result.polys_.end(), areas[i].polys_.begin(),
+                                              areas[i].polys_.end());
   }
-  result.polys_.insert(result.polys_.end(), area_to_paint.polys_.begin(),
-                                            area_to_paint.polys_.end());
   polys_.swap(result.polys_);
+  InvalidateIndex();
 }
 
 void Shape::SetMerge(const Shape &s) {
   RunClipper(&s, NULL, ctUnion);
 }
 
+void Shape::SetCrop(const Shape &s, JetNum x1, JetNum y1,
+                    JetNum x2, JetNum y2) {
+  Shape box;
+  box.SetRectangle(x1, y1, x2, y2);
+  JetNum offset_x, offset_y, scale;
+  if (!ClipperBounds(&s, &box, &offset_x, &offset_y, &scale)) {
+    Clear();
+    return;
+  }
+
+  // As in Paint(), the pieces of each material are processed together with
+  // the holes of that material, using the same coordinate conversion so that
+  // adjacent pieces still share vertices.
+  Shape result;
+  vector<bool> done(s.polys_.size());
+  for (int i = 0; i < s.polys_.size(); i++) {
+    if (done[i]) {
+      continue;
+    }
+    Shape a, b;
+    for (int j = i; j < s.polys_.size(); j++) {
+      if (!done[j] && s.polys_[j].material == s.polys_[i].material) {
+        a.polys_.push_back(s.polys_[j]);
+        done[j] = true;
+      }
+    }
+    b.RunClipper(&a, &box, ctIntersection, offset_x, offset_y, scale);
+    for (int j = 0; j < b.polys_.size(); j++) {
+      b.polys_[j].material = s.polys_[i].material;
+    }
+    result.polys_.insert(result.polys_.end(), b.polys_.begin(), b.polys_.end());
+  }
+  polys_.swap(result.polys_);
+  InvalidateIndex();
+}
+
 void Shape::GetBounds(JetNum *min_x, JetNum *min_y,
                       JetNum *max_x, JetNum *max_y) const {
   CHECK(!IsEmpty());
@@ -964,6 +1368,52 @@ void Shape::GetBounds(JetNum *min_x, JetNum *min_y,
 
 int Shape::Contains(JetNum x, JetNum y) {
   RPoint pt(x, y);
+  const EdgeIndex *index = GetIndex();
+  if (index) {
+    // Only edges crossed by a ray from x,y in the +x direction matter, and
+    // they are all in the grid row containing y to the right of x.
+    double px = ToDouble(x), py = ToDouble(y);
+    if (px < index->x0 || px > index->x1 ||
+        py < index->y0 || py > index->y1) {
+      return 0;
+    }
+    vector<int> candidates;
+    int iy = index->CellY(py);
+    for (int ix = index->CellX(px); ix < index->nx; ix++) {
+      const vector<int> &cell = index->cells[iy * index->nx + ix];
+      candidates.insert(candidates.end(), cell.begin(), cell.end());
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                     candidates.end());
+    vector<int> inside(polys_.size());
+    for (int i = 0; i < candidates.size(); i++) {
+      const EdgeIndex::Edge &e = index->edges[candidates[i]];
+      const vector<RPoint> &p = polys_[e.piece].p;
+      if (p.size() < 4) {
+        continue;               // Handled below
+      }
+      int c = EdgeCrossing(p[e.edge].p, p[(e.edge + 1) % p.size()].p, x, y);
+      if (c < 0) {
+        return -1;
+      }
+      inside[e.piece] ^= c;
+    }
+    for (int i = 0; i < index->small_pieces.size(); i++) {
+      int piece = index->small_pieces[i];
+      int q = ::PointInPolygon(polys_[piece].p, pt);
+      if (q == -1) {
+        return q;
+      }
+      inside[piece] = q;
+    }
+    int count = 0;
+    for (int i = 0; i < inside.size(); i++) {
+      count += inside[i] * index->piece_sign[i];
+    }
+    return count > 0;
+  }
+
   int count = 0;
   for (int i = 0; i < polys_.size(); i++) {
     int q = ::PointInPolygon(polys_[i].p, pt);
@@ -981,6 +1431,13 @@ int Shape::Contains(JetNum x, JetNum y) {
   return count > 0;
 }
 
+void Shape::Contains(const vector<JetPoint> &points, vector<int> *result) {
+  result->resize(points.size());
+  for (int i = 0; i < points.size(); i++) {
+    (*result)[i] = Contains(points[i][0], points[i][1]);
+  }
+}
+
 void Shape::Offset(JetNum dx, JetNum dy) {
   for (int i = 0; i < polys_.size(); i++) {
     for (int j = 0; j < polys_[i].p.size(); j++) {
@@ -988,6 +1445,7 @@ void Shape::Offset(JetNum dx, JetNum dy) {
       polys_[i].p[j].p[1] += dy;
     }
   }
+  InvalidateIndex();
 }
 
 void Shape::Scale(JetNum scalex, JetNum scaley) {
@@ -997,6 +1455,7 @@ void Shape::Scale(JetNum scalex, JetNum scaley) {
       polys_[i].p[j].p[1] *= scaley;
     }
   }
+  InvalidateIndex();
 }
 
 void Shape::Rotate(JetNum theta) {
@@ -1009,6 +1468,7 @@ void Shape::Rotate(JetNum theta) {
       polys_[i].p[j].p = R * polys_[i].p[j].p;
     }
   }
+  InvalidateIndex();
 }
 
 void Shape::MirrorX(JetNum x_coord) {
@@ -1033,6 +1493,7 @@ void Shape::Reverse() {
   for (int i = 0; i < polys_.size(); i++) {
     std::reverse(polys_[i].p.begin(), polys_[i].p.end());
   }
+  InvalidateIndex();
 }
 
 void Shape::Grow(JetNum delta, CornerStyle style, JetNum limit,
@@ -1222,6 +1683,7 @@ void Shape::Clean(JetNum threshold) {
       polys_[i].p.resize(dest);
     }
   }
+  InvalidateIndex();
 }
 
 void Shape::FindClosestEdge(JetNum x, JetNum y, int *piece, int *edge) {
@@ -1230,6 +1692,55 @@ void Shape::FindClosestEdge(JetNum x, JetNum y, int *piece, int *edge) {
   *piece = -1;
   *edge = -1;
   JetNum best_dist = __DBL_MAX__, best_excursion = __DBL_MAX__;
+  const EdgeIndex *index = GetIndex();
+  if (index) {
+    // Search rings of cells outwards from x,y until no unsearched cell can
+    // contain an edge that is closer than the closest one found so far.
+    double px = ToDouble(x), py = ToDouble(y);
+    int ix = index->CellX(px), iy = index->CellY(py);
+    vector<int> candidates;
+    double closest = __DBL_MAX__;
+    for (int r = 0; ; r++) {
+      int start = candidates.size();
+      index->AddRing(index->cells, ix, iy, r, &candidates);
+      for (int i = start; i < candidates.size(); i++) {
+        const EdgeIndex::Edge &e = index->edges[candidates[i]];
+        const vector<RPoint> &p = polys_[e.piece].p;
+        JetNum excursion;
+        closest = std::min(closest, ToDouble(ShortestDistanceToLineSeg(
+            JetPoint(x, y), p[e.edge].p, p[(e.edge + 1) % p.size()].p,
+            &excursion)));
+      }
+      if (index->CoversGrid(ix, iy, r) ||
+          closest + kTol < index->Coverage(px, py, ix, iy, r)) {
+        break;
+      }
+    }
+
+    // Process the candidates in the same order as the brute force search so
+    // that ties are broken the same way.
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                     candidates.end());
+    for (int i = 0; i < candidates.size(); i++) {
+      const EdgeIndex::Edge &e = index->edges[candidates[i]];
+      const vector<RPoint> &p = polys_[e.piece].p;
+      JetNum excursion;
+      JetNum d = ShortestDistanceToLineSeg(JetPoint(x, y), p[e.edge].p,
+                                           p[(e.edge + 1) % p.size()].p,
+                                           &excursion);
+      if (d < best_dist - kTol ||
+          (d < best_dist + kTol && excursion < best_excursion)) {
+        best_dist = d;
+        best_excursion = excursion;
+        *piece = e.piece;
+        *edge = e.edge;
+      }
+    }
+    CHECK(*piece >= 0 && *edge >= 0);   // Make sure shape not empty
+    return;
+  }
+
   for (int i = 0; i < polys_.size(); i++) {
     for (int j1 = 0; j1 < polys_[i].p.size(); j1++) {
       int j2 = (j1 + 1) % polys_[i].p.size();
@@ -1249,10 +1760,53 @@ void Shape::FindClosestEdge(JetNum x, JetNum y, int *piece, int *edge) {
   CHECK(*piece >= 0 && *edge >= 0);     // Make sure shape not empty
 }
 
+void Shape::FindClosestEdges(const vector<JetPoint> &points,
+                             vector<int> *pieces, vector<int> *edges) {
+  pieces->resize(points.size());
+  edges->resize(points.size());
+  for (int i = 0; i < points.size(); i++) {
+    FindClosestEdge(points[i][0], points[i][1], &(*pieces)[i], &(*edges)[i]);
+  }
+}
+
 void Shape::FindClosestVertex(JetNum x, JetNum y, int *piece, int *index) {
   *piece = -1;
   *index = -1;
   JetNum best_dist = __DBL_MAX__;
+  const EdgeIndex *edge_index = GetIndex();
+  if (edge_index) {
+    // Search rings of cells outwards from x,y, as in FindClosestEdge().
+    double px = ToDouble(x), py = ToDouble(y);
+    int ix = edge_index->CellX(px), iy = edge_index->CellY(py);
+    vector<int> candidates;
+    double closest = __DBL_MAX__;
+    for (int r = 0; ; r++) {
+      int start = candidates.size();
+      edge_index->AddRing(edge_index->vertex_cells, ix, iy, r, &candidates);
+      for (int i = start; i < candidates.size(); i++) {
+        const EdgeIndex::Edge &e = edge_index->edges[candidates[i]];
+        closest = std::min(closest, ToDouble(
+            (JetPoint(x, y) - polys_[e.piece].p[e.edge].p).norm()));
+      }
+      if (edge_index->CoversGrid(ix, iy, r) ||
+          closest < edge_index->Coverage(px, py, ix, iy, r)) {
+        break;
+      }
+    }
+    std::sort(candidates.begin(), candidates.end());
+    for (int i = 0; i < candidates.size(); i++) {
+      const EdgeIndex::Edge &e = edge_index->edges[candidates[i]];
+      JetNum d = (JetPoint(x, y) - polys_[e.piece].p[e.edge].p).squaredNorm();
+      if (d < best_dist) {
+        best_dist = d;
+        *piece = e.piece;
+        *index = e.edge;
+      }
+    }
+    CHECK(*piece >= 0 && *index >= 0);  // Make sure shape not empty
+    return;
+  }
+
   for (int i = 0; i < polys_.size(); i++) {
     for (int j = 0; j < polys_[i].p.size(); j++) {
       JetNum d = (JetPoint(x, y) - polys_[i].p[j].p).squaredNorm();
@@ -1499,6 +2053,7 @@ void Shape::FromPaths(JetNum scale, JetNum offset_x, JetNum offset_y,
       p.e = paths[i][j].Z;
     }
   }
+  InvalidateIndex();
 }
 
 void Shape::RunClipper(const Shape *c1, const Shape *c2, ClipType clip_type) {
@@ -1514,12 +2069,28 @@ bool Shape::ClipperBounds(const Shape *c1, const Shape *c2, JetNum *offset_x,
                           JetNum *offset_y, JetNum *scale) const {
   // Compute bounds of c1, c2 or both.
   CHECK(c1 || c2);
+  vector<const Shape*> c;
+  if (c1) {
+    c.push_back(c1);
+  }
+  if (c2) {
+    c.push_back(c2);
+  }
+  return ClipperBounds(c, offset_x, offset_y, scale);
+}
+
+bool Shape::ClipperBounds(const vector<const Shape*> &c, JetNum *offset_x,
+                          JetNum *offset_y, JetNum *scale) const {
+  // Compute bounds of all shapes in c.
   JetNum min_x = __DBL_MAX__, min_y = __DBL_MAX__;
   JetNum max_x = -__DBL_MAX__, max_y = -__DBL_MAX__;
-  if ((c1 ? c1->UpdateBounds(&min_x, &min_y, &max_x, &max_y) : 0) +
-      (c2 ? c2->UpdateBounds(&min_x, &min_y, &max_x, &max_y) : 0) == 0) {
-    // No coordinates in either c1 or c2. The min/max wont be valid and the
-    // result will have to be empty anyway.
+  int count = 0;
+  for (int i = 0; i < c.size(); i++) {
+    count += c[i]->UpdateBounds(&min_x, &min_y, &max_x, &max_y);
+  }
+  if (count == 0) {
+    // No coordinates in any shape. The min/max wont be valid and the result
+    // will have to be empty anyway.
     return false;
   }
 
@@ -1542,18 +2113,45 @@ void Shape::RunClipper(const Shape *c1, const Shape *c2, ClipType clip_type,
     c2->ToPaths(scale, offset_x, offset_y, &p2);
   }
 
-  // Run the clipper. Use the pftPositive fill type so that a polygon can have
-  // external invisible holes (the Paint() function can generate these).
-  Clipper clipper;
-  clipper.ZFillFunction(MyZFillCallback);
-  if (c1) {
-    clipper.AddPaths(p1, ptSubject, true);
-  }
-  if (c2) {
-    clipper.AddPaths(p2, ptClip, true);
-  }
+  // If the operands are identical to an operation we have already done (e.g.
+  // in a previous run of the script) then reuse that result.
+  std::string key;
   Paths result;
-  clipper.Execute(clip_type, result, pftPositive, pftPositive);
+  OperationCache::iterator it = operation_cache.end();
+  if (operation_cache_enabled) {
+    key = OperationKey(clip_type, c1 ? &p1 : 0, c2 ? &p2 : 0);
+    it = operation_cache.find(key);
+  }
+  if (it != operation_cache.end()) {
+    it->second.generation = operation_cache_generation;
+    operation_lru.splice(operation_lru.begin(), operation_lru,
+                         it->second.lru);
+    result = it->second.result;
+    operation_cache_hits++;
+  } else {
+    // Run the clipper. Use the pftPositive fill type so that a polygon can
+    // have external invisible holes (the Paint() function can generate these).
+    Clipper clipper;
+    clipper.ZFillFunction(MyZFillCallback);
+    if (c1) {
+      clipper.AddPaths(p1, ptSubject, true);
+    }
+    if (c2) {
+      clipper.AddPaths(p2, ptClip, true);
+    }
+    clipper.Execute(clip_type, result, pftPositive, pftPositive);
+    if (operation_cache_enabled) {
+      if (operation_cache.size() >= kMaxOperationCacheEntries) {
+        operation_cache.erase(operation_lru.back());
+        operation_lru.pop_back();
+      }
+      operation_lru.push_front(key);
+      OperationCacheEntry &entry = operation_cache[key];
+      entry.result = result;
+      entry.generation = operation_cache_generation;
+      entry.lru = operation_lru.begin();
+    }
+  }
 
   // Sometimes the clipper leaves vertices that are very close together or
   // duplicated. Clean these out because these shapes can not be meshed.
@@ -1760,6 +2358,21 @@ int Shape::LuaClean(lua_State *L) {
 }
 
 int Shape::LuaContains(lua_State *L) {
+  if (lua_gettop(L) == 2) {
+    // Batched version: an array of points gives an array of booleans.
+    vector<JetPoint> points;
+    if (!GetPointArray(L, 2, &points)) {
+      LuaError(L, "Argument to Contains() must be an array of {x,y} tables");
+    }
+    vector<int> result;
+    Contains(points, &result);
+    lua_createtable(L, result.size(), 0);
+    for (int i = 0; i < result.size(); i++) {
+      lua_pushboolean(L, result[i] != 0);
+      lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+  }
   Expecting(L, 3, "Contains");
   lua_pushboolean(L,
       Contains(luaL_checknumber(L, 2), luaL_checknumber(L, 3)) != 0);
@@ -1831,12 +2444,31 @@ int Shape::LuaGrow(lua_State *L) {
 }
 
 int Shape::LuaSelect(lua_State *L) {
-  if (lua_gettop(L) != 3 && lua_gettop(L) != 5) {
-    LuaError(L, "Shape:Select() expecting 2 or 4 arguments");
+  if (lua_gettop(L) != 2 && lua_gettop(L) != 3 && lua_gettop(L) != 5) {
+    LuaError(L, "Shape:Select() expecting 1, 2 or 4 arguments");
   }
   if (IsEmpty()) {
     LuaError(L, "Shape:Select() called on an empty shape");
   }
+  if (lua_gettop(L) == 2) {
+    // Batched version: select the closest edge to each point in an array.
+    vector<JetPoint> points;
+    if (!GetPointArray(L, 2, &points)) {
+      LuaError(L, "Argument to Select() must be an array of {x,y} tables");
+    }
+    vector<int> pieces, edges;
+    FindClosestEdges(points, &pieces, &edges);
+    lua_createtable(L, pieces.size(), 0);
+    for (int i = 0; i < pieces.size(); i++) {
+      lua_createtable(L, 0, 2);
+      lua_pushnumber(L, pieces[i] + 1); // 1-based indexing
+      LuaRawSetField(L, -2, "p");
+      lua_pushnumber(L, edges[i] + 1);  // 1-based indexing
+      LuaRawSetField(L, -2, "e");
+      lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+  }
   JetNum x1 = luaL_checknumber(L, 2);
   JetNum y1 = luaL_checknumber(L, 3);
   if (lua_gettop(L) == 3) {
@@ -1857,6 +2489,38 @@ int Shape::LuaSelect(lua_State *L) {
     JetNum ymax = std::max(y1, y2);
     lua_createtable(L, 0, 0);           // Result table
     int count = 1;
+    const EdgeIndex *index = GetIndex();
+    if (index) {
+      // Only test the edges in cells that overlap the box.
+      vector<int> candidates;
+      int i1 = index->CellX(ToDouble(xmin) - index->margin);
+      int i2 = index->CellX(ToDouble(xmax) + index->margin);
+      int j1 = index->CellY(ToDouble(ymin) - index->margin);
+      int j2 = index->CellY(ToDouble(ymax) + index->margin);
+      for (int j = j1; j <= j2; j++) {
+        for (int i = i1; i <= i2; i++) {
+          const vector<int> &cell = index->cells[j * index->nx + i];
+          candidates.insert(candidates.end(), cell.begin(), cell.end());
+        }
+      }
+      std::sort(candidates.begin(), candidates.end());
+      candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                       candidates.end());
+      for (int i = 0; i < candidates.size(); i++) {
+        const EdgeIndex::Edge &e = index->edges[candidates[i]];
+        const vector<RPoint> &p = polys_[e.piece].p;
+        if (DoesLineIntersectBox(p[e.edge].p, p[(e.edge + 1) % p.size()].p,
+                                 xmin, xmax, ymin, ymax)) {
+          lua_createtable(L, 0, 2);
+          lua_pushnumber(L, e.piece + 1);       // Edge (1-based indexing)
+          LuaRawSetField(L, -2, "p");
+          lua_pushnumber(L, e.edge + 1);        // Edge (1-based indexing)
+          LuaRawSetField(L, -2, "e");
+          lua_rawseti(L, -2, count++);
+        }
+      }
+      return 1;
+    }
     for (int i = 0; i < polys_.size(); i++) {
       for (int j1 = 0; j1 < polys_[i].p.size(); j1++) {
         int j2 = (j1 + 1) % polys_[i].p.size();
@@ -1975,28 +2639,27 @@ int Shape::LuaChamferVertex(lua_State *L) {
   return 1;
 }
 
-int Shape::LuaPaint(lua_State *L) {
-  if (lua_gettop(L) < 4) {
-    LuaError(L, "Expecting shape1:Paint(shape2, color, param, ...)");
+// Read a paint color and material parameters (or callback function) from
+// stack positions first..last into 'mat'. The usage string is given in error
+// messages.
+static void GetPaintMaterial(lua_State *L, int first, int last,
+                             const char *usage, Material *mat) {
+  if (last < first + 1) {
+    LuaError(L, "Expecting %s", usage);
   }
-  CHECK(this == LuaCastTo<Shape>(L, 1));
-  Shape *s2 = LuaCastTo<Shape>(L, 2);
-  if (!s2) {
-    LuaError(L, "Expecting shape1:Paint(shape2, color, param, ...)");
-  }
-  Material mat;
-  mat.color = ToInt64(luaL_checknumber(L, 3));
-  if (lua_type(L, 4) == LUA_TFUNCTION) {
-    if (lua_gettop(L) != 4) {
-      LuaError(L, "Expecting shape1:Paint(shape2, color, function)");
+  mat->color = ToInt64(luaL_checknumber(L, first));
+  if (lua_type(L, first + 1) == LUA_TFUNCTION) {
+    if (last != first + 1) {
+      LuaError(L, "Expecting %s with a single function", usage);
     }
     // Store the function to the registry and add the registry key to the
     // material.
-    lua_pushvalue(L, -1);
-    mat.SetCallbackToRegistry(L);
+    lua_pushvalue(L, first + 1);
+    mat->SetCallbackToRegistry(L);
 
     // Run the callback function once to verify it can work. This gives an
     // early indication for some (though not all) runtime errors.
+    lua_pushvalue(L, first + 1);
     LuaVector *x = LuaUserClassCreateObj<LuaVector>(L);
     LuaVector *y = LuaUserClassCreateObj<LuaVector>(L);
     x->resize(10);
@@ -2006,16 +2669,63 @@ int Shape::LuaPaint(lua_State *L) {
       LuaError(L, "Callback function can not be run");
     }
   } else {
-    int num_params = lua_gettop(L) - 3;
+    int num_params = last - first;
     if (num_params > Material::MaxParameters()) {
       LuaError(L, "Too many material parameters");
     }
     vector<JetNum> list;
     for (int i = 0; i < num_params; i++) {
-      list.push_back(luaL_checknumber(L, i + 4));
+      list.push_back(luaL_checknumber(L, first + 1 + i));
     }
-    mat.SetParameters(list);
+    mat->SetParameters(list);
   }
+}
+
+int Shape::LuaPaint(lua_State *L) {
+  CHECK(this == LuaCastTo<Shape>(L, 1));
+  if (lua_gettop(L) == 2 && lua_type(L, 2) == LUA_TTABLE) {
+    // Batched version: an array of {shape, color, param, ...} tables, painted
+    // in order.
+    const char *usage = "shape1:Paint({{shape2, color, param, ...}, ...})";
+    lua_len(L, 2);
+    int n = ToInt64(lua_tonumber(L, -1));
+    lua_pop(L, 1);
+    vector<const Shape*> shapes(n);
+    vector<Material> materials(n);
+    for (int i = 0; i < n; i++) {
+      lua_rawgeti(L, 2, i + 1);
+      if (lua_type(L, -1) != LUA_TTABLE) {
+        LuaError(L, "Expecting %s", usage);
+      }
+      int entry = lua_gettop(L);
+      lua_len(L, entry);
+      int m = ToInt64(lua_tonumber(L, -1));
+      lua_pop(L, 1);
+      for (int j = 1; j <= m; j++) {
+        lua_rawgeti(L, entry, j);
+      }
+      shapes[i] = LuaCastTo<Shape>(L, entry + 1);
+      if (!shapes[i]) {
+        LuaError(L, "Expecting %s", usage);
+      }
+      GetPaintMaterial(L, entry + 2, entry + m, usage, &materials[i]);
+      lua_settop(L, 2);
+    }
+    Paint(shapes, materials);
+    lua_settop(L, 1);
+    return 1;
+  }
+
+  const char *usage = "shape1:Paint(shape2, color, param, ...)";
+  if (lua_gettop(L) < 4) {
+    LuaError(L, "Expecting %s", usage);
+  }
+  Shape *s2 = LuaCastTo<Shape>(L, 2);
+  if (!s2) {
+    LuaError(L, "Expecting %s", usage);
+  }
+  Material mat;
+  GetPaintMaterial(L, 3, lua_gettop(L), usage, &mat);
   Paint(*s2, mat);
   lua_settop(L, 1);
   return 1;
@@ -2314,3 +3024,294 @@ TEST_FUNCTION(TriangleIntersectsBox) {
     CHECK(intersects == !trirect.IsEmpty());
   }
 }
+
+TEST_FUNCTION(OperationCache) {
+  // Build the same geometry twice, once with the operation cache disabled and
+  // once with it enabled. The results must be identical and the second run
+  // with the cache must not need to run the clipper at all.
+  for (int i = 0; i < 10; i++) {
+    Shape uncached;
+    Shape::EnableOperationCache(false);
+    RandomShape2(&uncached, 1000);
+
+    Shape::EnableOperationCache(true);
+    Shape::NewOperationCacheGeneration();
+    int hits0 = Shape::OperationCacheHits();
+    Shape s1, s2, s3;
+    s1.SetUnion(uncached, uncached);
+    s3.SetRectangle(0.1, 0.1, 0.4, 0.3);
+    s2.SetDifference(s1, s3);
+    CHECK(Shape::OperationCacheHits() == hits0);
+
+    // Same operands in the next generation must hit the cache.
+    Shape::NewOperationCacheGeneration();
+    Shape t1, t2;
+    t1.SetUnion(uncached, uncached);
+    t2.SetDifference(t1, s3);
+    CHECK(Shape::OperationCacheHits() == hits0 + 2);
+    CHECK(t1 == s1);
+    CHECK(t2 == s2);
+
+    // Changing one leaf misses only the operations that depend on it.
+    Shape u2;
+    s3.Offset(0.01, 0);
+    u2.SetDifference(t1, s3);
+    CHECK(Shape::OperationCacheHits() == hits0 + 2);
+    Shape::EnableOperationCache(false);
+    Shape v2;
+    v2.SetDifference(s1, s3);
+    CHECK(u2 == v2);
+    Shape::EnableOperationCache(true);
+  }
+}
+
+TEST_FUNCTION(EdgeIndex) {
+  // Compare the indexed and brute force queries on shapes with enough edges
+  // to have an index. Test random points and also points exactly on vertices
+  // and edges.
+  for (int i = 0; i < 20; i++) {
+    Shape s;
+    if (i & 1) {
+      RandomShape1(&s, 200, false);
+    } else {
+      Shape c, r;
+      c.SetCircle(0.5, 0.5, 0.4, 100);
+      r.SetRectangle(0.3, 0.3, 0.6, 0.6);
+      s.SetDifference(c, r);
+      s.Rotate(RandDouble() * 360);
+    }
+    vector<JetPoint> points;
+    for (int j = 0; j < 500; j++) {
+      points.push_back(JetPoint(RandDouble() * 1.4 - 0.2,
+                                RandDouble() * 1.4 - 0.2));
+    }
+    for (int j = 0; j < s.NumPieces(); j++) {
+      const vector<RPoint> &p = s.Piece(j);
+      for (int k = 0; k < p.size(); k++) {
+        points.push_back(p[k].p);
+        points.push_back((p[k].p + p[(k + 1) % p.size()].p) / 2);
+      }
+    }
+    vector<int> contains1, contains2, pieces1, pieces2, edges1, edges2;
+    Shape::EnableSpatialIndex(false);
+    s.Contains(points, &contains1);
+    s.FindClosestEdges(points, &pieces1, &edges1);
+    Shape::EnableSpatialIndex(true);
+    s.Contains(points, &contains2);
+    s.FindClosestEdges(points, &pieces2, &edges2);
+    CHECK(contains1 == contains2);
+    CHECK(pieces1 == pieces2);
+    CHECK(edges1 == edges2);
+    for (int j = 0; j < points.size(); j++) {
+      int p1, v1, p2, v2;
+      Shape::EnableSpatialIndex(false);
+      s.FindClosestVertex(points[j][0], points[j][1], &p1, &v1);
+      Shape::EnableSpatialIndex(true);
+      s.FindClosestVertex(points[j][0], points[j][1], &p2, &v2);
+      CHECK(p1 == p2 && v1 == v2);
+    }
+
+    // Make sure the index is rebuilt when the shape changes.
+    s.Offset(0.1, 0.2);
+    Shape::EnableSpatialIndex(false);
+    s.Contains(points, &contains1);
+    Shape::EnableSpatialIndex(true);
+    s.Contains(points, &contains2);
+    CHECK(contains1 == contains2);
+  }
+}
+
+// Return the color of the material at x,y in 's', or -1 if x,y is outside s
+// or on a boundary.
+static int MaterialColorAt(const Shape &s, double x, double y) {
+  std::map<uint32, int> count;
+  for (int i = 0; i < s.NumPieces(); i++) {
+    int q = PointInPolygon(s.Piece(i), RPoint(x, y));
+    if (q == -1) {
+      return -1;
+    }
+    if (q) {
+      count[s.GetMaterial(i).color] += (s.Area(i) > 0) ? 1 : -1;
+    }
+  }
+  int color = -1;
+  for (std::map<uint32, int>::iterator it = count.begin();
+       it != count.end(); ++it) {
+    if (it->second > 0) {
+      CHECK(color == -1);       // Pieces must not overlap
+      color = it->first;
+    }
+  }
+  return color;
+}
+
+// Return the largest distance from a vertex of 't' to the boundary of 's'.
+static double MaxVertexDistance(Shape &s, const Shape &t) {
+  double max_distance = 0;
+  for (int i = 0; i < t.NumPieces(); i++) {
+    for (int j = 0; j < t.Piece(i).size(); j++) {
+      const JetPoint &p = t.Piece(i)[j].p;
+      int piece, edge;
+      s.FindClosestEdge(p[0], p[1], &piece, &edge);
+      const vector<RPoint> &q = s.Piece(piece);
+      JetNum excursion;
+      max_distance = std::max(max_distance, ToDouble(ShortestDistanceToLineSeg(
+          p, q[edge].p, q[(edge + 1) % q.size()].p, &excursion)));
+    }
+  }
+  return max_distance;
+}
+
+// Return the smallest nonzero distance between vertices of different pieces
+// of 's'. Pieces that share a boundary must share its vertices exactly, so
+// that Triangulate() merges them. Nearly coincident vertices instead show
+// that the pieces were clipped with different coordinate conversions.
+static double MinVertexSeparation(const Shape &s) {
+  double min_distance = __DBL_MAX__;
+  for (int i = 0; i < s.NumPieces(); i++) {
+    for (int j = i + 1; j < s.NumPieces(); j++) {
+      for (int k = 0; k < s.Piece(i).size(); k++) {
+        for (int l = 0; l < s.Piece(j).size(); l++) {
+          double d = ToDouble((s.Piece(i)[k].p - s.Piece(j)[l].p).norm());
+          if (d > 0) {
+            min_distance = std::min(min_distance, d);
+          }
+        }
+      }
+    }
+  }
+  return min_distance;
+}
+
+TEST_FUNCTION(PaintOutsideShape) {
+  // Areas that extend outside the shape must share boundary vertices with the
+  // unpainted pieces next to them, whether painted singly or in a batch.
+  Shape base, a, b;
+  base.SetRectangle(0, 0, 10, 10);
+  a.SetRectangle(-3, 2, 5.3, 7.1);
+  a.Rotate(7);
+  b.SetRectangle(4, -2, 13, 4.7);
+  b.Rotate(-5);
+  Material m1, m2;
+  m1.color = 1;
+  m2.color = 2;
+  Shape s1 = base, s2 = base;
+  s1.Paint(a, m1);
+  CHECK(s1.NumPieces() >= 2);
+  CHECK(MinVertexSeparation(s1) > 1e-6);
+  s1.Paint(b, m2);
+  CHECK(MinVertexSeparation(s1) > 1e-6);
+  vector<const Shape*> areas;
+  areas.push_back(&a);
+  areas.push_back(&b);
+  vector<Material> materials;
+  materials.push_back(m1);
+  materials.push_back(m2);
+  s2.Paint(areas, materials);
+  CHECK(MinVertexSeparation(s2) > 1e-6);
+
+  // The batched result matches painting the areas one at a time, to within
+  // the clipper quantization.
+  CHECK(fabs(ToDouble(s2.TotalArea()) - 100) < 1e-6);
+  std::map<uint32, double> area1, area2;
+  for (int j = 0; j < s1.NumPieces(); j++) {
+    area1[s1.GetMaterial(j).color] += ToDouble(s1.Area(j));
+  }
+  for (int j = 0; j < s2.NumPieces(); j++) {
+    area2[s2.GetMaterial(j).color] += ToDouble(s2.Area(j));
+  }
+  CHECK(area1.size() == 3 && area2.size() == 3);
+  for (std::map<uint32, double>::iterator it = area1.begin();
+       it != area1.end(); ++it) {
+    CHECK(fabs(it->second - area2[it->first]) < 1e-6);
+  }
+  CHECK(MaxVertexDistance(s1, s2) < 1e-6);
+}
+
+TEST_FUNCTION(BatchedPaint) {
+  // An area painted inside a piece becomes a hole in that piece. Painting
+  // again must not let that hole erase the first painted area. The same goes
+  // for an area of the original material painted inside that first area.
+  {
+    Shape s, a, b, c;
+    s.SetRectangle(0, 0, 10, 10);
+    a.SetRectangle(2, 2, 5, 5);
+    b.SetRectangle(6, 6, 7, 7);
+    c.SetRectangle(3, 3, 4, 4);
+    Material m0 = s.GetMaterial(0), m1, m2;
+    m1.color = 1;
+    m2.color = 2;
+    s.Paint(a, m1);
+    s.Paint(b, m2);
+    s.Paint(c, m0);
+    s.Paint(b, m2);
+    CHECK(fabs(ToDouble(s.TotalArea()) - 100) < 1e-9);
+    CHECK(MaterialColorAt(s, 2.5, 2.5) == 1);
+    CHECK(MaterialColorAt(s, 3.5, 3.5) == m0.color);
+    CHECK(MaterialColorAt(s, 6.5, 6.5) == 2);
+    CHECK(MaterialColorAt(s, 8.5, 8.5) == m0.color);
+  }
+
+  for (int i = 0; i < 20; i++) {
+    Shape base;
+    RandomShape2(&base, 1000);
+    vector<Shape> areas(10);
+    vector<const Shape*> area_pointers;
+    vector<Material> materials(areas.size());
+
+    // In even iterations keep the areas within the bounds of the base shape,
+    // where batched and sequential painting quantize coordinates the same
+    // way. In odd iterations the areas can extend outside it.
+    bool inside = (i % 2) == 0;
+    JetNum min_x, min_y, max_x, max_y;
+    base.GetBounds(&min_x, &min_y, &max_x, &max_y);
+    for (int j = 0; j < areas.size(); j++) {
+      JetNum x1, y1, x2, y2;
+      do {
+        double x = RandDouble(), y = RandDouble();
+        areas[j].SetRectangle(x, y, x + RandDouble() * 0.5,
+                              y + RandDouble() * 0.5);
+        areas[j].Rotate(RandDouble() * 10);
+        areas[j].GetBounds(&x1, &y1, &x2, &y2);
+      } while (inside && (x1 < min_x || y1 < min_y ||
+                          x2 > max_x || y2 > max_y));
+      area_pointers.push_back(&areas[j]);
+      materials[j].color = j + 1;
+    }
+    Shape s1 = base, s2 = base;
+    for (int j = 0; j < areas.size(); j++) {
+      s1.Paint(areas[j], materials[j]);
+    }
+    s2.Paint(area_pointers, materials);
+    CHECK(fabs(s1.TotalArea() - base.TotalArea()) < 1e-6);
+    CHECK(fabs(s2.TotalArea() - base.TotalArea()) < 1e-6);
+
+    // Compare the total area of each material and the material at random
+    // points.
+    std::map<uint32, double> area1, area2;
+    for (int j = 0; j < s1.NumPieces(); j++) {
+      area1[s1.GetMaterial(j).color] += ToDouble(s1.Area(j));
+    }
+    for (int j = 0; j < s2.NumPieces(); j++) {
+      area2[s2.GetMaterial(j).color] += ToDouble(s2.Area(j));
+    }
+    for (std::map<uint32, double>::iterator it = area1.begin();
+         it != area1.end(); ++it) {
+      CHECK(fabs(it->second - area2[it->first]) < 1e-9);
+    }
+    for (std::map<uint32, double>::iterator it = area2.begin();
+         it != area2.end(); ++it) {
+      CHECK(fabs(it->second - area1[it->first]) < 1e-9);
+    }
+    for (int j = 0; j < 1000; j++) {
+      double x = RandDouble() * 1.4 - 0.2, y = RandDouble() * 1.4 - 0.2;
+      CHECK(MaterialColorAt(s1, x, y) == MaterialColorAt(s2, x, y));
+    }
+
+    // Every vertex of the batched result must be on a boundary of the
+    // sequential result, to within a couple of quantization steps (the
+    // sequential result can have extra collinear vertices, so the reverse
+    // is not checked). Areas outside the base shape change the quantization.
+    CHECK(MaxVertexDistance(s1, s2) < (inside ? 1e-9 : 1e-6));
+  }
+}
@@ -2,6 +2,7 @@
 #ifndef __SHAPE_H__
 #define __SHAPE_H__
 
+#include <memory>
 #include <myvector>
 #include "lua_util.h"
 #include "common.h"
@@ -116,7 +117,7 @@ class Shape : public LuaUserClass {
   static void SetLuaGlobals(lua_State *L);
 
   // Swap two shapes (a fast way to exchange data).
-  void Swap(Shape *s) { polys_.swap(s->polys_); }
+  void Swap(Shape *s) { polys_.swap(s->polys_); index_.swap(s->index_); }
 
   // Set the empty shape.
   void Clear();
@@ -194,11 +195,43 @@ class Shape : public LuaUserClass {
   // the polygons into unmerged pieces with different material properties.
   void Paint(const Shape &s, const Material &mat);
 
+  // Paint a list of areas s[i] with materials mat[i]. The result is the same
+  // as calling Paint(*s[i],mat[i]) for each i in order (later areas take
+  // precedence where they overlap) but it is much faster for many areas. The
+  // materials cover the same regions, but the division of each material into
+  // pieces can differ. All areas are clipped with one coordinate conversion,
+  // for the bounds of this shape and all areas, so if some areas extend
+  // outside this shape the result can differ from sequential painting by the
+  // clipper quantization.
+  void Paint(const vector<const Shape*> &s, const vector<Material> &mat);
+
   // Set this shape to 's', but merge together any adjacent pieces, erasing the
   // distinction between different materials. This undoes the effects of
   // Paint().
   void SetMerge(const Shape &s);
 
+  // Set this shape to the part of 's' inside the rectangle with corners
+  // (x1,y1) and (x2,y2). Unlike SetIntersect() this preserves the materials of
+  // the pieces.
+  void SetCrop(const Shape &s, JetNum x1, JetNum y1, JetNum x2, JetNum y2);
+
+  // The results of clipper operations (SetUnion(), Paint() etc) are memoized
+  // so that geometry that does not change between runs of a script is not
+  // recomputed. Call NewOperationCacheGeneration() at the start of each script
+  // run, this discards all cache entries that were not used during the
+  // previous run. The cache is enabled by default. OperationCacheHits() is a
+  // running count of operations satisfied from the cache, for testing.
+  static void EnableOperationCache(bool enable);
+  static void NewOperationCacheGeneration();
+  static int OperationCacheHits();
+
+  // Contains(), FindClosestEdge() and FindClosestVertex() use a uniform grid
+  // over the polygon edges for shapes with many edges. The grid is built
+  // lazily on the first query and discarded when the shape is changed. The
+  // results are identical to a brute force search. Disabling this is only
+  // useful for testing.
+  static void EnableSpatialIndex(bool enable);
+
   // Get the boundary rectangle of this shape. It is a runtime error if the
   // shape is empty so the caller must check for that.
   void GetBounds(JetNum *min_x, JetNum *min_y,
@@ -209,6 +242,9 @@ class Shape : public LuaUserClass {
   // will be considered to be outside.
   int Contains(JetNum x, JetNum y);
 
+  // Batched version of Contains(), for many points at once.
+  void Contains(const vector<JetPoint> &points, vector<int> *result);
+
   // Transform the shape. All transformations except Reverse() preserve the
   // orientation.
   void Offset(JetNum dx, JetNum dy);
@@ -237,6 +273,10 @@ class Shape : public LuaUserClass {
   // N+1. It is a runtime error if the shape is empty.
   void FindClosestEdge(JetNum x, JetNum y, int *piece, int *edge);
 
+  // Batched version of FindClosestEdge(), for many points at once.
+  void FindClosestEdges(const vector<JetPoint> &points,
+                        vector<int> *pieces, vector<int> *edges);
+
   // Return the piece and vertex index that is closest to x,y. It is a runtime
   // error if the shape is empty.
   void FindClosestVertex(JetNum x, JetNum y, int *piece, int *index);
@@ -315,6 +355,14 @@ class Shape : public LuaUserClass {
   };
   vector<Polygon> polys_;
 
+  // Spatial index for edge and vertex queries, or null if it has not been
+  // built yet. This must be reset by every function that changes polys_. It is
+  // immutable once built so copies of this shape can share it.
+  struct EdgeIndex;
+  mutable std::shared_ptr<const EdgeIndex> index_;
+  const EdgeIndex *GetIndex() const;
+  void InvalidateIndex() { index_.reset(); }
+
   int UpdateBounds(JetNum *min_x, JetNum *min_y, JetNum *max_x, JetNum *max_y)
       const;
   void ToPaths(JetNum scale, JetNum offset_x, JetNum offset_y,
@@ -325,6 +373,8 @@ class Shape : public LuaUserClass {
                   ClipperLib::ClipType clip_type);
   bool ClipperBounds(const Shape *c1, const Shape *c2, JetNum *offset_x,
                      JetNum *offset_y, JetNum *scale) const;
+  bool ClipperBounds(const vector<const Shape*> &c, JetNum *offset_x,
+                     JetNum *offset_y, JetNum *scale) const;
   void RunClipper(const Shape *c1, const Shape *c2,
                   ClipperLib::ClipType clip_type,
                   JetNum offset_x, JetNum offset_y, JetNum scale);
@@ -7,10 +7,14 @@
 #include "mat_file.h"
 #include "testing.h"
 #include "femsolver.h"
+#include "mirror_symmetry.h"
 #include "shaders.h"
+#include "thread.h"
+#include "fft.h"
 
 const double kSpeedOfLight = 299792458;         // m/s
-const int kFarFieldPoints = 500;                // Pattern points to compute
+const int kFarFieldBlock = 64;                  // Pattern points per thread
+const double kPMLReflection = 1e-6;             // PML normal reflection
 
 using Eigen::Vector3f;
 using Eigen::Vector4f;
@@ -36,7 +40,13 @@ namespace rama {
 //
 // The FEM system matrix depends on the shape, mesh and config. The
 // SimplicialLDLT factorizer can not be used because the system matrix is
-// symmetric but not hermitian.
+// symmetric but not hermitian. The factorizer backend is chosen at runtime by
+// config.solver. If config.substructure is given then the part of the model
+// outside its boxes is factored separately and cached, so that models that
+// only change inside the boxes (e.g. in an optimization) are solved quickly.
+// If config.symmetry is given then the mesh is exactly mirror symmetric (see
+// Mesh::Symmetry) and the system is split into independent even and odd
+// halves, which are cheaper to factor than the whole.
 //
 // Ports use a generalized Neumann ("Robin") boundary condition to specify an
 // impedance match with an incoming wave. For a boundary x=0 and a plane wave
@@ -50,6 +60,10 @@ namespace rama {
 //     dEz/dnormal + alpha*Ez = 0, where
 //     alpha = -1i*beta_guide * (S11+1)/(S11-1)
 // In an Exy cavity we use cos(theta)=1.
+//
+// A perfectly matched layer (PML) absorbs outgoing waves at all angles of
+// incidence, so much less air is needed around radiators than with the ABC.
+// It is a region with complex coordinate stretching, see Anisotropy() below.
 
 struct HelmholtzFEMProblem : FEM::FEMProblem {
   Solver *s;
@@ -68,8 +82,48 @@ struct HelmholtzFEMProblem : FEM::FEMProblem {
   typedef Eigen::Matrix<GNumber, 2, 1> Point;   // Point x,y
   typedef Eigen::Matrix<Number, Eigen::Dynamic, 1> NumberVector;
   typedef Eigen::Matrix<MNumber, Eigen::Dynamic, 1> MNumberVector;
-  typedef Eigen::SparseLU<Eigen::SparseMatrix<MNumber>,
-                          Eigen::COLAMDOrdering<int> > Factorizer;
+  typedef FEM::MirrorFactorizer<MNumber> Factorizer;
+  struct FactorizerConfig {
+    std::string solver;
+    bool mixed_precision;
+    vector<double> substructure;        // Boxes in meters
+    Mesh::Symmetry symmetry;            // Mirror positions in meters
+    bool operator==(const FactorizerConfig &c) const {
+      return solver == c.solver && mixed_precision == c.mixed_precision &&
+             substructure == c.substructure && symmetry == c.symmetry;
+    }
+  };
+  FactorizerConfig GetFactorizerConfig() const {
+    // The factorizer sees point coordinates in meters, see PointXY().
+    const double unit = s->config_.unit;
+    FactorizerConfig c;
+    c.solver = s->config_.solver;
+    c.mixed_precision = s->config_.mixed_precision;
+    c.substructure = s->config_.substructure;
+    for (int i = 0; i < c.substructure.size(); i++) {
+      c.substructure[i] *= unit;
+    }
+    c.symmetry = s->config_.symmetry;
+    c.symmetry.x0 *= unit;
+    c.symmetry.y0 *= unit;
+    return c;
+  }
+  void ConfigureFactorizer(Factorizer *f) {
+    FactorizerConfig c = GetFactorizerConfig();
+    f->SetSolver(c.solver);
+    f->SetMixedPrecision(c.mixed_precision);
+    f->SetChangingRegion(c.substructure);
+    if (c.symmetry.mirror_x) {
+      f->AddMirror(0, c.symmetry.x0);
+    }
+    if (c.symmetry.mirror_y) {
+      f->AddMirror(1, c.symmetry.y0);
+    }
+  }
+  MNumberVector SolveWithGuess(Factorizer *f, const MNumberVector &b,
+                               const MNumberVector &guess) {
+    return f->solveWithGuess(b, guess);
+  }
   bool ProblemIsLowerTriangular() const { return false; }
   bool GradientStepAtDielectricBoundary() const {
     return s->config_.type == ScriptConfig::EXY;
@@ -105,6 +159,50 @@ struct HelmholtzFEMProblem : FEM::FEMProblem {
     return Number(0.0);
   }
 
+  // Triangles outside the config.pml box are in the perfectly matched layer.
+  // There the x and y coordinates are stretched by complex factors sx and sy,
+  // so that outgoing waves (which go as exp(-i*k*x)) decay without reflection
+  // from the start of the layer. The stretch grows quadratically with depth
+  // into the layer, and its maximum is chosen so that the wave that is
+  // reflected from the end of the layer and comes back has magnitude
+  // kPMLReflection.
+  bool Anisotropy(int i, Number *lx, Number *ly, Number *scale) const {
+    const vector<double> &pml = s->config_.pml;
+    if (pml.empty()) {
+      return false;
+    }
+    JetPoint c = (s->points_[s->triangles_[i].index[0]].p +
+                  s->points_[s->triangles_[i].index[1]].p +
+                  s->points_[s->triangles_[i].index[2]].p) / 3.0;
+    JetNum depth[2] = {0, 0};
+    for (int j = 0; j < 2; j++) {
+      if (c[j] < pml[j]) {
+        depth[j] = pml[j] - c[j];
+      } else if (c[j] > pml[j + 2]) {
+        depth[j] = c[j] - pml[j + 2];
+      }
+      if (depth[j] > pml[4]) {
+        depth[j] = pml[4];
+      }
+    }
+    if (depth[0] == 0 && depth[1] == 0) {
+      return false;
+    }
+    // A stretch of sigma(x) = sigma_max*(x/thickness)^2 attenuates the wave
+    // by exp(-sigma_max*thickness/3) each way.
+    const double sigma_max = 3.0 * log(1.0 / kPMLReflection) /
+                             (2.0 * pml[4] * s->config_.unit);
+    const double k = sqrt(vacuum_k2);
+    JetComplex sxy[2];
+    for (int j = 0; j < 2; j++) {
+      sxy[j] = JetComplex(1.0, -sigma_max / k * sqr(depth[j] / pml[4]));
+    }
+    *lx = sxy[1] / sxy[0];
+    *ly = sxy[0] / sxy[1];
+    *scale = sxy[0] * sxy[1];
+    return true;
+  }
+
   EType EdgeType(int i, int j) const {
     if (s->triangles_[i].neighbor[j] != -1) return INTERIOR;
     // DIRICHLET if EZ and non-port boundary, otherwise ROBIN.
@@ -205,8 +303,8 @@ struct WaveguideModeFEMProblem : FEM::FEMProblem {
   typedef Eigen::Matrix<GNumber, 2, 1> Point;   // Point x,y
   typedef Eigen::Matrix<Number, Eigen::Dynamic, 1> NumberVector;
   typedef Eigen::Matrix<MNumber, Eigen::Dynamic, 1> MNumberVector;
-  typedef Eigen::SimplicialLLT<Eigen::SparseMatrix<MNumber>, Eigen::Lower,
-                               Eigen::AMDOrdering<int> > Factorizer;
+  typedef FEM::MultifrontalLDLT<Eigen::SparseMatrix<MNumber>,
+                                FEM::NestedDissectionOrdering<int> > Factorizer;
   bool ProblemIsLowerTriangular() const { return true; }
   bool GradientStepAtDielectricBoundary() const { return false; }
   MNumber MNumberFromNumber(Number n) const { return ToDouble(n); }
@@ -318,12 +416,28 @@ ScriptConfig::Type ScriptConfig::StringToType(const char *name) {
   return UNKNOWN;
 }
 
+Mesh::MesherType ScriptConfig::StringToMesher(const char *name) {
+  if (name == 0)
+    return Mesh::UNKNOWN_MESHER;
+  if (strcmp(name, "triangle") == 0)
+    return Mesh::TRIANGLE_MESHER;
+  if (strcmp(name, "structured") == 0)
+    return Mesh::STRUCTURED_MESHER;
+  return Mesh::UNKNOWN_MESHER;
+}
+
+bool ScriptConfig::SolverIsValid(const char *name) {
+  return name && FEM::SparseSolverRegistry<Complex>::Get().IsValid(name);
+}
+
 //***************************************************************************
 // Solver.
 
 Solver::Solver(const Shape &s, const ScriptConfig &config, Lua *lua)
-    : Mesh(s, config.mesh_edge_length, lua), shape_(s), config_(config),
-      solver_(0), ed_solver_(0), mode_solver_(0), solver_solution_(0)
+    : Mesh(s, config.mesh_edge_length, lua, config.mesher,
+           config.MeshGrading(), config.symmetry),
+      shape_(s), config_(config), solver_(0), ed_solver_(0), mode_solver_(0),
+      solver_solution_(0), mode_track_(false), preview_(false)
 {
   if (config_.TypeIsElectrodynamic()) {
     ed_solver_ = new EDSolverType;
@@ -414,9 +528,15 @@ bool Solver::UpdateDerivatives(const Shape &s) {
   Mesh::UpdateDerivatives(s);
 
   // Recreate the system (this will use the updated derivatives in the mesh
-  // points and materials).
+  // points and materials). The mode solver keeps the G matrix separate.
   solver_->UnCreateSystem();            // Resets triplets and rhs
-  solver_->CreateSystem();
+  solver_->CreateSystem(config_.TypeIsWaveguideMode());
+
+  // Mode cutoff frequency derivatives come from the recreated system
+  // matrices, see ComputeModeCutoffFrequencies().
+  if (config_.TypeIsWaveguideMode()) {
+    return true;
+  }
 
   // Recompute derivatives.
   solution_derivative_.resize(0);
@@ -683,6 +803,65 @@ bool Solver::ComputePortOutgoingPower(vector<JetComplex> *result) {
   if (!ComputePortOutgoingField2(&field)) {     // Select method 1 or 2
     return false;
   }
+  PortFieldToPower(field, config_.frequency, result);
+  port_outgoing_power_ = *result;
+  return true;
+}
+
+bool Solver::ComputeTimeDomainPortPower(vector<vector<JetComplex> > *result) {
+  if (!config_.TypeIsElectrodynamic() || !config_.time_domain || !Solve()) {
+    return false;
+  }
+  Trace trace(__func__);
+
+  // The port fields only depend on the solution at the port points, so each
+  // frequency's probes are temporarily swapped in as the solution.
+  const vector<double> &frequencies = config_.time_domain_frequencies;
+  result->resize(frequencies.size());
+  for (int k = 0; k < frequencies.size(); k++) {
+    Eigen::VectorXcd probes = Eigen::VectorXcd::Zero(points_.size());
+    for (int i = 0; i < time_domain_points_.size(); i++) {
+      probes[time_domain_points_[i]] = time_domain_probes_(i, k);
+    }
+    vector<JetComplex> field;
+    ed_solver_->solution.swap(probes);
+    bool ok = ComputePortOutgoingField2(&field);
+    ed_solver_->solution.swap(probes);
+    if (!ok) {
+      return false;
+    }
+    PortFieldToPower(field, frequencies[k], &(*result)[k]);
+  }
+  return true;
+}
+
+bool Solver::SolveTimeDomain() {
+  if (ed_solver_->solvesystem_retval >= 0) {
+    return ed_solver_->solvesystem_retval;
+  }
+  Trace trace(__func__);
+  time_domain_points_.clear();
+  for (BoundaryIterator it(this); !it.done(); ++it) {
+    if (it.kind().PortNumber()) {
+      time_domain_points_.push_back(it.pindex1());
+      time_domain_points_.push_back(it.pindex2());
+    }
+  }
+  std::sort(time_domain_points_.begin(), time_domain_points_.end());
+  time_domain_points_.erase(std::unique(time_domain_points_.begin(),
+                                        time_domain_points_.end()),
+                            time_domain_points_.end());
+  vector<double> omegas;
+  for (int i = 0; i < config_.time_domain_frequencies.size(); i++) {
+    omegas.push_back(2 * M_PI * config_.time_domain_frequencies[i]);
+  }
+  return ed_solver_->SolveTimeDomain(2 * M_PI * config_.frequency, omegas,
+                                     time_domain_points_,
+                                     &time_domain_probes_);
+}
+
+void Solver::PortFieldToPower(const vector<JetComplex> &field,
+                              double frequency, vector<JetComplex> *result) {
   result->resize(field.size());
   JetNum overall_scale = 0;
   for (int i = 0; i < field.size(); i++) {
@@ -691,7 +870,7 @@ bool Solver::ComputePortOutgoingPower(vector<JetComplex> *result) {
     JetNum power_scale = 1;
     if (config_.type == ScriptConfig::EZ) {
       JetNum a = port_lengths_[port_number];     // Waveguide A-dimension
-      double k = 2.0 * M_PI * config_.frequency / kSpeedOfLight;
+      double k = 2.0 * M_PI * frequency / kSpeedOfLight;
       JetComplex beta = sqrt(JetComplex(sqr(k) - sqr(M_PI / a)));
       power_scale = a * beta.real();
     } else if (config_.type == ScriptConfig::EXY) {
@@ -713,8 +892,6 @@ bool Solver::ComputePortOutgoingPower(vector<JetComplex> *result) {
       (*result)[i] /= overall_scale;
     }
   }
-  port_outgoing_power_ = *result;
-  return true;
 }
 
 void Solver::GetField(JetNum x, JetNum y, JetComplex *value) {
@@ -796,6 +973,273 @@ void Solver::GetFieldPoynting(JetNum x, JetNum y, JetPoint *poynting) {
   (*poynting)[1] = (conj(Dy) * value / k).imag();
 }
 
+// A far field radiator at the centroid of an ABC boundary triangle. 'center'
+// is in meters, 'z' is the field there, 'gradN' and 'gradP' are the
+// components of the field gradient normal and parallel to the boundary, and
+// 'nangle' is the angle of the outward normal.
+struct FarFieldRadiator {
+  JetPoint center;
+  JetNum nangle;
+  JetComplex z, gradN, gradP;
+};
+
+// Compute sin(x[i]) and cos(x[i]) for n values. This is the cephes algorithm
+// (accurate to about 1e-15 for |x| < 1e5) written without branches or
+// library calls so that the compiler can vectorize the loop.
+static void SinCos(int n, const double *x, double *s, double *c) {
+  // pi/2 split into three parts, so that j*kPiOver2[0] is exact.
+  const double kPiOver2[3] = {1.57079625129699707031e+00,
+                              7.54978941586159635336e-08,
+                              5.39030285815811905290e-15};
+  const double kRound = 6755399441055744.0;     // 1.5*2^52
+  for (int i = 0; i < n; i++) {
+    // Reduce x to r in -pi/4..pi/4 and the quadrant q.
+    double j = (x[i] * (2.0 / M_PI) + kRound) - kRound;
+    double r = ((x[i] - j * kPiOver2[0]) - j * kPiOver2[1]) - j * kPiOver2[2];
+    int q = int(j) & 3;
+    double z = r * r;
+    double sr = r + r * z * (((((1.58962301576546568060e-10 * z -
+        2.50507477628578072866e-8) * z + 2.75573136213857245213e-6) * z -
+        1.98412698295895385996e-4) * z + 8.33333333332211858878e-3) * z -
+        1.66666666666666307295e-1);
+    double cr = 1.0 - 0.5 * z + z * z * (((((-1.13585365213876817300e-11 * z +
+        2.08757008419747316778e-9) * z - 2.75573141792967388112e-7) * z +
+        2.48015872888517045348e-5) * z - 1.38888888888730564116e-3) * z +
+        4.16666666666665929218e-2);
+    double sv = (q & 1) ? cr : sr;
+    double cv = (q & 1) ? sr : cr;
+    s[i] = (q & 2) ? -sv : sv;
+    c[i] = ((q + 1) & 2) ? -cv : cv;
+  }
+}
+
+// Add the far field of all radiators to ff[begin..end-1], for the given
+// azimuths and boresight angle (in degrees), using JetComplex arithmetic so
+// that derivatives are propagated.
+static void JetFarField(const vector<FarFieldRadiator> &radiators, double k,
+                        double boresight, const vector<double> &azimuth,
+                        int begin, int end, vector<JetComplex> *ff) {
+  JetComplex scale(0, 1 / k);
+  for (int e = 0; e < radiators.size(); e++) {
+    const FarFieldRadiator &r = radiators[e];
+    for (int i = begin; i < end; i++) {
+      double phi = azimuth[i] + boresight * M_PI / 180.0;
+      (*ff)[i] += (r.z + scale * (r.gradN * cos(phi - r.nangle) -
+                                  r.gradP * sin(phi - r.nangle))) *
+        exp(JetComplex(0, k * (r.center[0] * cos(phi) +
+                               r.center[1] * sin(phi))));
+    }
+  }
+}
+
+// Like JetFarField() but using plain doubles, for when all derivatives are
+// zero. The dipole terms are expanded with
+//   gradN*cos(phi-nangle) - gradP*sin(phi-nangle) = U*cos(phi) + V*sin(phi)
+// so that the only per-radiator-per-angle transcendental is the phase term,
+// which is computed by SinCos() for a block of angles at once.
+static void DoubleFarField(const vector<FarFieldRadiator> &radiators,
+                           double k, double boresight,
+                           const vector<double> &azimuth,
+                           int begin, int end, vector<JetComplex> *ff) {
+  const int n = end - begin;
+  CHECK(n <= kFarFieldBlock);
+  double cos_phi[kFarFieldBlock], sin_phi[kFarFieldBlock];
+  double theta[kFarFieldBlock], s[kFarFieldBlock], c[kFarFieldBlock];
+  double ff_re[kFarFieldBlock], ff_im[kFarFieldBlock];
+  for (int i = 0; i < n; i++) {
+    double phi = azimuth[begin + i] + boresight * M_PI / 180.0;
+    cos_phi[i] = cos(phi);
+    sin_phi[i] = sin(phi);
+    ff_re[i] = ff_im[i] = 0;
+  }
+  for (int e = 0; e < radiators.size(); e++) {
+    const FarFieldRadiator &r = radiators[e];
+    const double cx = ToDouble(r.center[0]) * k;
+    const double cy = ToDouble(r.center[1]) * k;
+    const double cn = cos(ToDouble(r.nangle)), sn = sin(ToDouble(r.nangle));
+    const Complex z = ToComplex(r.z);
+    const Complex gn = ToComplex(r.gradN), gp = ToComplex(r.gradP);
+    // The amplitude is z + (i/k)*(U*cos(phi) + V*sin(phi)).
+    const Complex U = (gn * cn + gp * sn) / k, V = (gn * sn - gp * cn) / k;
+    for (int i = 0; i < n; i++) {
+      theta[i] = cx * cos_phi[i] + cy * sin_phi[i];
+    }
+    SinCos(n, theta, s, c);
+    for (int i = 0; i < n; i++) {
+      double a_re = z.real() - U.imag() * cos_phi[i] - V.imag() * sin_phi[i];
+      double a_im = z.imag() + U.real() * cos_phi[i] + V.real() * sin_phi[i];
+      ff_re[i] += a_re * c[i] - a_im * s[i];
+      ff_im[i] += a_re * s[i] + a_im * c[i];
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    (*ff)[begin + i] += JetComplex(ff_re[i], ff_im[i]);
+  }
+}
+
+// Compute the Bessel functions J[n] = J_n(x) for n = 0..nmax and x >= 0. This
+// uses Miller's algorithm: the recurrence J_{n-1} = (2n/x)*J_n - J_{n+1} is
+// stable when run downwards from some n well above nmax and x, and the result
+// is normalized with J_0 + 2*(J_2 + J_4 + ...) = 1.
+static void BesselJ(int nmax, double x, double *J) {
+  for (int n = 0; n <= nmax; n++) {
+    J[n] = 0;
+  }
+  if (x == 0) {
+    J[0] = 1;
+    return;
+  }
+  int start = std::max(nmax, int(x));
+  start += 16 + int(sqrt(40.0 * start));
+  start += start & 1;                           // Must be even
+  double j_next = 0, j = 1e-30, sum = 0;        // J_{n+1}, J_n, even sum
+  for (int n = start; n > 0; n--) {
+    double j_prev = 2.0 * n / x * j - j_next;   // J_{n-1}
+    j_next = j;
+    j = j_prev;
+    if (fabs(j) > 1e250) {                      // Rescale to avoid overflow
+      j *= 1e-250;
+      j_next *= 1e-250;
+      sum *= 1e-250;
+      for (int i = n; i <= nmax; i++) {
+        J[i] *= 1e-250;
+      }
+    }
+    if (n - 1 <= nmax) {
+      J[n - 1] = j;
+    }
+    if (((n - 1) & 1) == 0 && n > 1) {
+      sum += j;
+    }
+  }
+  double scale = 1.0 / (j + 2.0 * sum);
+  for (int n = 0; n <= nmax; n++) {
+    J[n] *= scale;
+  }
+}
+
+// The expansion center (ox,oy) and the number of cylindrical harmonics
+// needed by HarmonicFarField(). The far field of radiators within a circle of
+// radius r needs harmonics up to order about k*r, plus a few more for full
+// double precision.
+static int FarFieldHarmonics(const vector<FarFieldRadiator> &radiators,
+                             double k, double *ox, double *oy) {
+  double xmin = __DBL_MAX__, xmax = -__DBL_MAX__;
+  double ymin = __DBL_MAX__, ymax = -__DBL_MAX__;
+  for (int e = 0; e < radiators.size(); e++) {
+    double x = ToDouble(radiators[e].center[0]);
+    double y = ToDouble(radiators[e].center[1]);
+    xmin = std::min(xmin, x);
+    xmax = std::max(xmax, x);
+    ymin = std::min(ymin, y);
+    ymax = std::max(ymax, y);
+  }
+  *ox = radiators.empty() ? 0 : (xmin + xmax) / 2;
+  *oy = radiators.empty() ? 0 : (ymin + ymax) / 2;
+  double radius = 0;
+  for (int e = 0; e < radiators.size(); e++) {
+    radius = std::max(radius, hypot(ToDouble(radiators[e].center[0]) - *ox,
+                                    ToDouble(radiators[e].center[1]) - *oy));
+  }
+  // The excess bandwidth formula for 15 digits of accuracy.
+  const double kr = k * radius;
+  return int(ceil(kr + 1.8 * pow(15.0, 2.0 / 3.0) * cbrt(kr))) + 10;
+}
+
+// Compute the far field of all radiators at num_points evenly spaced azimuths
+// (the same azimuths as ComputeAntennaPattern() uses) in O(E*L + N*log(N))
+// time for E radiators and N points, instead of the O(E*N) of the direct sum.
+// Using plane waves relative to the expansion center o and the Jacobi-Anger
+// expansion, each radiator's contribution is
+//
+//   (z + c1*exp(i*phi) + c2*exp(-i*phi)) * sum_n i^n*J_n(k*r)*exp(in(phi-a))
+//
+// where (r,a) is the radiator's position relative to o in polar coordinates,
+// and c1,c2 come from the dipole terms. The far field is thus a sum of
+// cylindrical harmonics exp(i*m*phi), |m| <= L+1. Their coefficients are
+// accumulated over all radiators, and then one FFT evaluates the sum at all
+// azimuths. If N < 2L+3 the harmonics alias, but since the azimuths are evenly
+// spaced that is exact: harmonics m and m+N have the same values there.
+static void HarmonicFarField(const vector<FarFieldRadiator> &radiators,
+                             double k, double boresight, int num_points,
+                             vector<JetComplex> *ff) {
+  double ox, oy;
+  const int L = FarFieldHarmonics(radiators, k, &ox, &oy);
+  const int num_coeffs = 2 * L + 3;             // For m = -(L+1)..L+1
+
+  // Accumulate the harmonic coefficients C[m+L+1] in parallel over chunks of
+  // radiators.
+  const int num_chunks = std::min<int>(NumberOfCores(), radiators.size());
+  vector<vector<Complex> > chunk_coeffs(num_chunks);
+  ParallelFor(num_chunks, [&](int chunk) {
+    vector<Complex> &C = chunk_coeffs[chunk];
+    C.resize(num_coeffs);
+    vector<double> J(L + 1);
+    vector<Complex> P(2 * L + 1);               // P[n+L] for n = -L..L
+    const Complex i_pow[4] = {Complex(1, 0), Complex(0, 1),
+                              Complex(-1, 0), Complex(0, -1)};
+    for (int e = chunk; e < radiators.size(); e += num_chunks) {
+      const FarFieldRadiator &r = radiators[e];
+      const double dx = ToDouble(r.center[0]) - ox;
+      const double dy = ToDouble(r.center[1]) - oy;
+      const double dist = hypot(dx, dy);
+      BesselJ(L, k * dist, J.data());
+
+      // P[n] = i^n*J_n(k*r)*exp(-i*n*a), and since J_{-n} = (-1)^n*J_n,
+      // P[-n] = i^n*J_n(k*r)*exp(i*n*a).
+      const Complex rot = dist > 0 ? Complex(dx, -dy) / dist : Complex(1, 0);
+      Complex e_n = 1;                          // exp(-i*n*a)
+      for (int n = 0; n <= L; n++) {
+        Complex t = i_pow[n & 3] * J[n];
+        P[L + n] = t * e_n;
+        P[L - n] = t * conj(e_n);
+        e_n *= rot;
+      }
+
+      // The amplitude is z + (i/k)*(U*cos(phi) + V*sin(phi)) as in
+      // DoubleFarField(), i.e. z + c1*exp(i*phi) + c2*exp(-i*phi).
+      const double cn = cos(ToDouble(r.nangle)), sn = sin(ToDouble(r.nangle));
+      const Complex z = ToComplex(r.z);
+      const Complex gn = ToComplex(r.gradN), gp = ToComplex(r.gradP);
+      const Complex U = (gn * cn + gp * sn) / k, V = (gn * sn - gp * cn) / k;
+      const Complex c1 = (V + Complex(0, 1) * U) / 2.0;
+      const Complex c2 = (Complex(0, 1) * U - V) / 2.0;
+      for (int n = -L; n <= L; n++) {
+        const Complex p = P[L + n];
+        C[n + L] += c2 * p;                     // Harmonic n-1
+        C[n + L + 1] += z * p;                  // Harmonic n
+        C[n + L + 2] += c1 * p;                 // Harmonic n+1
+      }
+    }
+  });
+
+  // Fold the harmonics into num_points bins. The azimuths are
+  // phi_j = 2*pi*j/N - pi + boresight, so harmonic m contributes
+  // C[m]*exp(i*m*(boresight-pi)) * exp(2*pi*i*m*j/N).
+  vector<Complex> bins(num_points);
+  const double phi0 = boresight * M_PI / 180.0 - M_PI;
+  for (int m = -(L + 1); m <= L + 1; m++) {
+    Complex c = 0;
+    for (int chunk = 0; chunk < num_chunks; chunk++) {
+      c += chunk_coeffs[chunk][m + L + 1];
+    }
+    int bin = m % num_points;
+    if (bin < 0) {
+      bin += num_points;
+    }
+    bins[bin] += c * Complex(cos(m * phi0), sin(m * phi0));
+  }
+  fft::FFT(1, &bins);
+
+  // Restore the phase of the plane waves relative to the true origin.
+  for (int j = 0; j < num_points; j++) {
+    double phi = 2.0 * M_PI * double(j) / num_points + phi0;
+    double theta = k * (ox * cos(phi) + oy * sin(phi));
+    Complex value = bins[j] * Complex(cos(theta), sin(theta));
+    (*ff)[j] += JetComplex(value.real(), value.imag());
+  }
+}
+
 bool Solver::ComputeAntennaPattern(vector<double> *azimuth,
                                    vector<JetNum> *magnitude) {
   Trace trace(__func__);
@@ -826,26 +1270,28 @@ bool Solver::ComputeAntennaPattern(vector<double> *azimuth,
   }
 
   // Precompute azimuths for far field result.
-  azimuth->resize(kFarFieldPoints);
-  for (int i = 0; i < kFarFieldPoints ; i++) {
-    (*azimuth)[i] = (2.0 * M_PI * double(i)) / kFarFieldPoints - M_PI;
-  }
-
-  // For all ABC boundary triangles find field values and field gradients, then
-  // update the far field. There is approximation error because the field and
-  // gradient are sampled at discrete points on a piecewise linear boundary.
-  // The error shows up as imperfect back-lobe cancellation for plane waves.
-  // The positions of the isotropic and dipole radiators have a big influence
-  // on this. The best results seem to be obtained when both kinds of radiators
-  // are positioned at the centroid of boundary triangles, with field values
-  // and gradients computed from the solution values at the triangle vertices.
-  vector<JetComplex> ff(kFarFieldPoints);       // Far field values over angle
-  int abc_count = 0;
+  const int num_points = config_.pattern_points;
+  azimuth->resize(num_points);
+  for (int i = 0; i < num_points; i++) {
+    (*azimuth)[i] = (2.0 * M_PI * double(i)) / num_points - M_PI;
+  }
+
+  // For all ABC boundary triangles find field values and field gradients, from
+  // which the far field is computed below. There is approximation error
+  // because the field and gradient are sampled at discrete points on a
+  // piecewise linear boundary. The error shows up as imperfect back-lobe
+  // cancellation for plane waves. The positions of the isotropic and dipole
+  // radiators have a big influence on this. The best results seem to be
+  // obtained when both kinds of radiators are positioned at the centroid of
+  // boundary triangles, with field values and gradients computed from the
+  // solution values at the triangle vertices.
+  vector<FarFieldRadiator> radiators;
+  bool has_derivatives = false;
   for (BoundaryIterator it(this); !it.done(); ++it) {
     if (!it.kind().IsABC()) {
       continue;
     }
-    abc_count++;
+    FarFieldRadiator r;
 
     // Triangle vertices scaled to meters.
     JetPoint p1 = points_[it.pindex1()].p * config_.unit;
@@ -853,16 +1299,16 @@ bool Solver::ComputeAntennaPattern(vector<double> *azimuth,
     JetPoint p3 = points_[it.pindex3()].p * config_.unit;
 
     // Triangle centroid.
-    JetPoint center = (p1 + p2 + p3) / 3.0;
+    r.center = (p1 + p2 + p3) / 3.0;
 
     // Interpolate the solution to the center of the triangle, and compute the
     // triangle gradient.
-    JetComplex z, gradX, gradY;
+    JetComplex gradX, gradY;
     {
       JetComplex z1 = SolutionJet(it.pindex1());
       JetComplex z2 = SolutionJet(it.pindex2());
       JetComplex z3 = SolutionJet(it.pindex3());
-      z = (z1 + z2 + z3) / JetComplex(3.0);
+      r.z = (z1 + z2 + z3) / JetComplex(3.0);
       TriangleGradient(p1, p2, p3, z1, z2, z3, &gradX, &gradY);
     }
 
@@ -874,28 +1320,54 @@ bool Solver::ComputeAntennaPattern(vector<double> *azimuth,
     if (normal.dot(p3 - p1) > 0) {
       normal *= -1;
     }
-    JetNum nangle = atan2(normal[1], normal[0]);
+    r.nangle = atan2(normal[1], normal[0]);
 
     // Find the boundary-normal and boundary-perpendicular components of the
     // gradient.
-    JetComplex gradN = gradX * normal[0] + gradY * normal[1];
-    JetComplex gradP = gradX * normal[1] - gradY * normal[0];
-
-    // Update far field values with an isotropic radiator from z and
-    // orthogonally oriented dipoles from gradN and gradP.
-    JetComplex scale(0, 1 / k);
-    for (int i = 0; i < kFarFieldPoints; i++) {
-      double phi = (*azimuth)[i] + config_.boresight * M_PI / 180.0;
-      ff[i] += (z + scale * (gradN * cos(phi - nangle) -
-                             gradP * sin(phi - nangle))) *
-        exp(JetComplex(0, k * (center[0] * cos(phi) + center[1] * sin(phi))));
-    }
+    r.gradN = gradX * normal[0] + gradY * normal[1];
+    r.gradP = gradX * normal[1] - gradY * normal[0];
+
+    has_derivatives = has_derivatives ||
+        r.center[0].Derivative() != 0 || r.center[1].Derivative() != 0 ||
+        r.nangle.Derivative() != 0 ||
+        r.z.real().Derivative() != 0 || r.z.imag().Derivative() != 0 ||
+        r.gradN.real().Derivative() != 0 || r.gradN.imag().Derivative() != 0 ||
+        r.gradP.real().Derivative() != 0 || r.gradP.imag().Derivative() != 0;
+    radiators.push_back(r);
+  }
+
+  // Update far field values with an isotropic radiator from z and orthogonally
+  // oriented dipoles from gradN and gradP. Only use JetComplex arithmetic if
+  // there are derivatives to propagate. Otherwise if the far field needs many
+  // fewer cylindrical harmonics than there are pattern points (i.e. the
+  // pattern is finely sampled compared to the electrical size of the ABC)
+  // then expand in harmonics and evaluate with an FFT. Otherwise compute the
+  // direct sum, with blocks of angles computed in parallel.
+  vector<JetComplex> ff(num_points);            // Far field values over angle
+  double ox, oy;
+  if (!has_derivatives &&
+      4 * FarFieldHarmonics(radiators, k, &ox, &oy) < num_points) {
+    HarmonicFarField(radiators, k, config_.boresight, num_points, &ff);
+  } else {
+    const int num_blocks = (num_points + kFarFieldBlock - 1) / kFarFieldBlock;
+    ParallelFor(num_blocks, [&](int block) {
+      int begin = block * kFarFieldBlock;
+      int end = std::min(begin + kFarFieldBlock, num_points);
+      if (has_derivatives) {
+        JetFarField(radiators, k, config_.boresight, *azimuth, begin, end,
+                    &ff);
+      } else {
+        DoubleFarField(radiators, k, config_.boresight, *azimuth, begin, end,
+                       &ff);
+      }
+    });
   }
+  const int abc_count = radiators.size();
 
   // Return far field magnitudes. Scale by the number of radiators, i.e. the
   // number of times we added to each element of ff[] in the inner loop.
-  magnitude->resize(kFarFieldPoints);
-  for (int i = 0; i < kFarFieldPoints; i++) {
+  magnitude->resize(num_points);
+  for (int i = 0; i < num_points; i++) {
     (*magnitude)[i] = abs(ff[i]) / double(abc_count);
   }
 
@@ -910,8 +1382,8 @@ bool Solver::LookupAntennaPattern(JetNum theta, JetNum *magnitude) {
   if (!ComputeAntennaPattern(&antenna_azimuth_, &antenna_magnitude_)) {
     return false;
   }
-  CHECK(antenna_azimuth_.size() == kFarFieldPoints);
-  CHECK(antenna_magnitude_.size() == kFarFieldPoints);
+  CHECK(antenna_azimuth_.size() == config_.pattern_points);
+  CHECK(antenna_magnitude_.size() == config_.pattern_points);
   // Search the azimuth array for theta. Account for the wrap-around gap
   // between the last and first azimuth.
   theta = NormalizeAngle(theta);
@@ -991,8 +1463,13 @@ void Solver::SaveMeshAndSolutionToMatlab(const char *filename) {
 
 bool Solver::Solve() {
   if (config_.TypeIsElectrodynamic()) {
-    bool status = ed_solver_->SolveSystem();
+    bool status = config_.time_domain ? SolveTimeDomain() :
+                                        ed_solver_->SolveSystem();
     solver_solution_ = &ed_solver_->solution;
+    if (status && preview_ && ed_solver_->predicted_solution &&
+        solution_derivative_.size() == 0) {
+      solution_derivative_ = prediction_derivative_;
+    }
     return status;
   } else if (config_.TypeIsWaveguideMode()) {
     // For TE modes the A matrix in the eigenproblem will be singular so we
@@ -1013,7 +1490,8 @@ bool Solver::Solve() {
       sigma = -lambda1_estimate * 0.01;
     }
 
-    if (mode_solver_->EigenSystem(std::max(1, config_.max_modes), sigma)) {
+    if (mode_solver_->EigenSystem(std::max(1, config_.max_modes), sigma,
+                                  mode_warm_start_, mode_track_)) {
       // Eigenvectors are stored in locally allocated space for display.
       if (!solver_solution_) {
         solver_solution_ = new VectorXcd;
@@ -1051,6 +1529,123 @@ void Solver::SelectWaveguideMode(int n) {
   Mgradient_.resize(0);
 }
 
+void Solver::ReuseFactorization(Solver *previous) {
+  if (!config_.TypeIsElectrodynamic() || !previous ||
+      previous->config_.type != config_.type || !previous->ed_solver_) {
+    return;
+  }
+  ed_solver_->ReuseFactorization(previous->ed_solver_);
+}
+
+void Solver::UseReducedModel(Solver *previous) {
+  if (!config_.TypeIsElectrodynamic() || !ed_solver_) {
+    return;
+  }
+  if (previous && (previous->config_.type != config_.type ||
+                   !previous->ed_solver_)) {
+    previous = 0;
+  }
+  ed_solver_->UseReducedModel(previous ? previous->ed_solver_ : 0);
+}
+
+bool Solver::PredictSolution(Solver *previous, double step, bool preview) {
+  preview_ = false;
+  if (!config_.TypeIsElectrodynamic() || config_.time_domain ||
+      !ed_solver_ || !previous ||
+      previous->config_.type != config_.type || !previous->ed_solver_ ||
+      previous->ed_solver_->solvesystem_retval != 1) {
+    return false;
+  }
+
+  // The solution vectors are only comparable if the meshes are the same.
+  // Points are allowed to move, as their derivatives are accounted for.
+  if (points_.size() != previous->points_.size() ||
+      triangles_.size() != previous->triangles_.size() ||
+      ed_solver_->reverse_index_map !=
+          previous->ed_solver_->reverse_index_map) {
+    return false;
+  }
+  for (int i = 0; i < triangles_.size(); i++) {
+    const Triangle &t1 = triangles_[i], &t2 = previous->triangles_[i];
+    if (t1.index[0] != t2.index[0] || t1.index[1] != t2.index[1] ||
+        t1.index[2] != t2.index[2] || t1.material != t2.material) {
+      return false;
+    }
+  }
+
+  // The derivative of the previous solution is usually cheap, as its system
+  // has been factored or it is itself a prediction.
+  if (!previous->ComputeDerivatives()) {
+    return false;
+  }
+  prediction_derivative_ = previous->solution_derivative_;
+  ed_solver_->SetPredictedSolution(
+      previous->ed_solver_->solution + step * prediction_derivative_,
+      preview ? HUGE_VAL : FEM::kReducedModelTolerance);
+  preview_ = preview;
+  return true;
+}
+
+bool Solver::HasReusableState() const {
+  if (config_.TypeIsWaveguideMode()) {
+    return mode_solver_ && mode_solver_->eigensolver;
+  }
+  return config_.TypeIsElectrodynamic() && !config_.time_domain &&
+         ed_solver_ && ed_solver_->solvesystem_retval == 1;
+}
+
+void Solver::WarmStartModes(Solver *previous, bool track) {
+  mode_warm_start_.resize(0, 0);
+  mode_track_ = track;
+  if (!config_.TypeIsWaveguideMode() || !previous ||
+      previous->config_.type != config_.type || !previous->mode_solver_ ||
+      !previous->mode_solver_->eigensolver) {
+    return;
+  }
+  CHECK(!mode_solver_->eigensolver);
+  mode_solver_->CreateIndexMaps();
+  const Eigen::MatrixXd &modes =
+      previous->mode_solver_->eigensolver->GetEigenVectors();
+  const vector<int> &previous_index = previous->mode_solver_->index_map;
+
+  // Linearly interpolate the previous modes at each of our points. Points
+  // outside the previous mesh are left at zero.
+  mode_warm_start_.setZero(mode_solver_->SystemSize(), modes.cols());
+  for (int i = 0; i < points_.size(); i++) {
+    int row = mode_solver_->index_map[i];
+    if (row < 0) {
+      continue;
+    }
+    double x = ToDouble(points_[i].p[0]);
+    double y = ToDouble(points_[i].p[1]);
+    int t = previous->FindTriangle(x, y);
+    if (t < 0) {
+      continue;
+    }
+    // Barycentric coordinates of x,y in triangle t.
+    const Triangle &tri = previous->triangles_[t];
+    double px[3], py[3];
+    for (int j = 0; j < 3; j++) {
+      px[j] = ToDouble(previous->points_[tri.index[j]].p[0]);
+      py[j] = ToDouble(previous->points_[tri.index[j]].p[1]);
+    }
+    double det = (py[1] - py[2]) * (px[0] - px[2]) +
+                 (px[2] - px[1]) * (py[0] - py[2]);
+    double w[3];
+    w[0] = ((py[1] - py[2]) * (x - px[2]) + (px[2] - px[1]) * (y - py[2])) /
+           det;
+    w[1] = ((py[2] - py[0]) * (x - px[2]) + (px[0] - px[2]) * (y - py[2])) /
+           det;
+    w[2] = 1 - w[0] - w[1];
+    for (int j = 0; j < 3; j++) {
+      int previous_row = previous_index[tri.index[j]];
+      if (previous_row >= 0) {
+        mode_warm_start_.row(row) += w[j] * modes.row(previous_row);
+      }
+    }
+  }
+}
+
 bool Solver::ComputeModeCutoffFrequencies(vector<JetComplex> *cutoff) {
   if (!config_.TypeIsWaveguideMode() || !Solve()) {
     return false;
@@ -1059,8 +1654,14 @@ bool Solver::ComputeModeCutoffFrequencies(vector<JetComplex> *cutoff) {
   for (int i = 0; i < config_.max_modes; i++) {
     // For TE modes the lowest eigenvalue is zero, but numerical error might
     // give it some other small value. Force it to zero.
-    double lambda = (i == 0 && config_.type == ScriptConfig::TE) ? 0 :
-                    mode_solver_->GetEigenvalue(i);
+    if (i == 0 && config_.type == ScriptConfig::TE) {
+      cutoff->at(i) = JetNum(0);
+      continue;
+    }
+    // The eigenvalue derivative is cheap to compute from the eigenvector and
+    // the derivatives of the system matrices, so no extra solve is needed.
+    JetNum lambda = mode_solver_->GetEigenvalue(i);
+    lambda.Derivative() = mode_solver_->GetEigenvalueDerivative(i);
     cutoff->at(i) = kSpeedOfLight * sqrt(lambda) / (2.0 * M_PI);
   }
   return true;
@@ -1173,6 +1774,17 @@ bool Solver::ComputeDerivatives() {
     // Derivatives already computed.
     return true;
   }
+  if (config_.time_domain) {
+    // The time domain solver does not compute derivatives, as that would
+    // need the system matrix to be factored, which it avoids. They are
+    // reported as zero for display, and Cavity stops the optimizer and
+    // tolerance analysis, which need them, in the time domain.
+    if (!Solve()) {
+      return false;
+    }
+    solution_derivative_.setZero(points_.size());
+    return true;
+  }
   if (!ed_solver_->ComputeSolutionDerivative(&solution_derivative_)) {
     return false;
   }
@@ -1280,3 +1892,384 @@ TEST_FUNCTION(GetField_and_Friends) {
   CHECK(max_perror_x < 120);    //@@@ Can tighten up these limits if
   CHECK(max_perror_y < 120);    //    GetFieldPoynting() uses smoother gradient
 }
+
+TEST_FUNCTION(PerfectlyMatchedLayer) {
+  // A section of WR-12 waveguide at 70 GHz terminated by a matched port is
+  // compared with the same waveguide extended into a PML that ends at a metal
+  // wall. If the PML does not reflect then the fields are the same.
+  ScriptConfig config;
+  config.type = ScriptConfig::EZ;
+  config.unit = 2.54e-5;
+  config.mesh_edge_length = 10;
+  config.port_excitation.resize(2);
+  config.port_excitation[0] = 1;
+  config.frequency = 70e9;
+  Shape s1;
+  s1.AddPoint(0, 0);
+  s1.AddPoint(500, 0);
+  s1.AddPoint(500, 120);
+  s1.AddPoint(0, 120);
+  CHECK(s1.AssignPort(0, 3, EdgeKind(1)));
+  CHECK(s1.AssignPort(0, 1, EdgeKind(2)));
+  Solver solver1(s1, config, NULL);
+
+  const double thickness = 120;
+  Shape s2;
+  s2.AddPoint(0, 0);
+  s2.AddPoint(500 + thickness, 0);
+  s2.AddPoint(500 + thickness, 120);
+  s2.AddPoint(0, 120);
+  CHECK(s2.AssignPort(0, 3, EdgeKind(1)));
+  config.pml.resize(5);
+  config.pml[0] = 0;
+  config.pml[1] = 0;
+  config.pml[2] = 500;
+  config.pml[3] = 120;
+  config.pml[4] = thickness;
+  Solver solver2(s2, config, NULL);
+
+  double max_error = 0, max_value = 0;
+  for (int i = 10; i < 120; i += 10) {
+    for (int j = 5; j < 500; j += 10) {
+      JetComplex value1, value2;
+      solver1.GetField(j, i, &value1);
+      solver2.GetField(j, i, &value2);
+      max_error = std::max(max_error, abs(ToComplex(value1 - value2)));
+      max_value = std::max(max_value, abs(ToComplex(value1)));
+    }
+  }
+  printf("PML max error = %g, max value = %g\n", max_error, max_value);
+  CHECK(max_error < 0.03 * max_value);
+}
+
+TEST_FUNCTION(MirrorSymmetry) {
+  // A section of WR-12 waveguide at 70 GHz with a metal post in the middle,
+  // excited from port 1. The model is solved as a whole and with half and
+  // quarter symmetry, which should give the same fields and port powers.
+  ScriptConfig config;
+  config.type = ScriptConfig::EZ;
+  config.unit = 2.54e-5;
+  config.mesh_edge_length = 10;
+  config.port_excitation.resize(2);
+  config.port_excitation[0] = 1;
+  config.frequency = 70e9;
+  Shape box, post, s;
+  box.SetRectangle(0, 0, 500, 120);
+  CHECK(box.AssignPort(0, 3, EdgeKind(1)));
+  CHECK(box.AssignPort(0, 1, EdgeKind(2)));
+  post.SetCircle(250, 60, 20, 16);
+  s.SetDifference(box, post);
+  Solver solver1(s, config, NULL);
+  config.symmetry.mirror_x = true;
+  config.symmetry.x0 = 250;
+  Solver solver2(s, config, NULL);
+  config.symmetry.mirror_y = true;
+  config.symmetry.y0 = 60;
+  Solver solver4(s, config, NULL);
+  CHECK(solver1.IsValid() && solver2.IsValid() && solver4.IsValid());
+
+  vector<JetComplex> power1, power2, power4;
+  CHECK(solver1.ComputePortOutgoingPower(&power1));
+  CHECK(solver2.ComputePortOutgoingPower(&power2));
+  CHECK(solver4.ComputePortOutgoingPower(&power4));
+  CHECK(power1.size() == 2 && power2.size() == 2 && power4.size() == 2);
+  for (int i = 0; i < 2; i++) {
+    printf("Port %d power: %g, %g, %g\n", i + 1, ToDouble(power1[i].real()),
+           ToDouble(power2[i].real()), ToDouble(power4[i].real()));
+  }
+
+  // The meshes are different so the fields are only approximately the same.
+  double max_error2 = 0, max_error4 = 0, max_value = 0;
+  for (int i = 10; i < 120; i += 10) {
+    for (int j = 5; j < 500; j += 10) {
+      JetComplex value1, value2, value4;
+      solver1.GetField(j, i, &value1);
+      solver2.GetField(j, i, &value2);
+      solver4.GetField(j, i, &value4);
+      max_error2 = std::max(max_error2, abs(ToComplex(value1 - value2)));
+      max_error4 = std::max(max_error4, abs(ToComplex(value1 - value4)));
+      max_value = std::max(max_value, abs(ToComplex(value1)));
+    }
+  }
+  printf("Symmetry max error = %g, %g, max value = %g\n",
+         max_error2, max_error4, max_value);
+  CHECK(max_error2 < 0.03 * max_value);
+  CHECK(max_error4 < 0.03 * max_value);
+  const double max_power = abs(ToComplex(power1[0]));
+  for (int i = 0; i < 2; i++) {
+    CHECK(abs(ToComplex(power2[i] - power1[i])) < 0.01 * max_power);
+    CHECK(abs(ToComplex(power4[i] - power1[i])) < 0.01 * max_power);
+  }
+}
+
+TEST_FUNCTION(ReducedModelSweep) {
+  // Sweep the frequency of a section of WR-12 waveguide with a metal post,
+  // with each step using the reduced order model of the previous step. The
+  // port powers should match those of solving each step in full.
+  ScriptConfig config;
+  config.type = ScriptConfig::EZ;
+  config.unit = 2.54e-5;
+  config.mesh_edge_length = 10;
+  config.port_excitation.resize(2);
+  config.port_excitation[0] = 1;
+  Shape box, post, s;
+  box.SetRectangle(0, 0, 500, 120);
+  CHECK(box.AssignPort(0, 3, EdgeKind(1)));
+  CHECK(box.AssignPort(0, 1, EdgeKind(2)));
+  post.SetCircle(250, 60, 20, 16);
+  s.SetDifference(box, post);
+
+  const int num_steps = 31;
+  Solver *previous = 0;
+  int reduced_solves = 0;
+  double max_error = 0;
+  for (int step = 0; step < num_steps; step++) {
+    config.frequency = 60e9 + 30e9 * step / (num_steps - 1);
+    Solver *solver = new Solver(s, config, NULL);
+    Solver direct(s, config, NULL);
+    CHECK(solver->IsValid() && direct.IsValid());
+    solver->UseReducedModel(previous);
+    vector<JetComplex> power, direct_power;
+    CHECK(solver->ComputePortOutgoingPower(&power));
+    CHECK(direct.ComputePortOutgoingPower(&direct_power));
+    CHECK(power.size() == 2 && direct_power.size() == 2);
+    reduced_solves += solver->ed_solver_->reduced_solution;
+    for (int i = 0; i < 2; i++) {
+      max_error = std::max(max_error,
+                           abs(ToComplex(power[i] - direct_power[i])));
+    }
+    delete previous;
+    previous = solver;
+  }
+  delete previous;
+  printf("Reduced solves = %d of %d, max power error = %g\n",
+         reduced_solves, num_steps, max_error);
+  CHECK(reduced_solves > num_steps / 2);
+  CHECK(max_error < 1e-4);
+}
+
+TEST_FUNCTION(PredictSolution) {
+  // A section of WR-12 waveguide with a dielectric insert whose permittivity
+  // has the derivative.
+  ScriptConfig config;
+  config.type = ScriptConfig::EZ;
+  config.unit = 2.54e-5;
+  config.mesh_edge_length = 10;
+  config.port_excitation.resize(2);
+  config.port_excitation[0] = 1;
+  config.frequency = 75e9;
+  Shape box, insert;
+  box.SetRectangle(0, 0, 500, 120);
+  CHECK(box.AssignPort(0, 3, EdgeKind(1)));
+  CHECK(box.AssignPort(0, 1, EdgeKind(2)));
+  insert.SetRectangle(200, 0, 300, 60);
+  Shape s[4];
+  const double epsilon[4] = {2, 2.05, 2 + 1e-5, 2};
+  for (int i = 0; i < 4; i++) {
+    Material mat;
+    JetNum e = epsilon[i];
+    e.Derivative() = 1;
+    mat.epsilon = e;
+    s[i] = box;
+    s[i].Paint(insert, mat);
+  }
+
+  // Predictions of the other permittivities from the first.
+  Solver first(s[0], config, NULL);
+  vector<JetComplex> first_power;
+  CHECK(first.ComputePortOutgoingPower(&first_power));
+  for (int i = 1; i < 3; i++) {
+    Solver solver(s[i], config, NULL), direct(s[i], config, NULL);
+    vector<JetComplex> power, direct_power;
+    CHECK(solver.PredictSolution(&first, epsilon[i] - epsilon[0], i == 1));
+    CHECK(solver.Solve());
+    CHECK(solver.ed_solver_->predicted_solution);
+    CHECK(solver.ComputePortOutgoingPower(&power));
+    CHECK(direct.ComputePortOutgoingPower(&direct_power));
+    double error = 0;
+    for (int j = 0; j < 2; j++) {
+      error = std::max(error, abs(ToComplex(power[j] - direct_power[j])));
+    }
+    printf("Prediction step = %g, residual = %g, power error = %g\n",
+           epsilon[i] - epsilon[0], solver.ed_solver_->prediction_residual,
+           error);
+    CHECK(solver.IsPreview() == (i == 1));
+    CHECK(error < (i == 1 ? 1e-2 : 1e-6));
+    // Only the preview takes its derivative from the previous solution.
+    CHECK(fabs(power[0].real().Derivative() -
+               direct_power[0].real().Derivative()) < (i == 1 ? 1e-1 : 1e-6));
+  }
+
+  // A prediction for a large step is not accurate enough to use.
+  {
+    Solver solver(s[1], config, NULL);
+    CHECK(solver.PredictSolution(&first, epsilon[1] - epsilon[0], false));
+    vector<JetComplex> power;
+    CHECK(solver.ComputePortOutgoingPower(&power));
+    CHECK(!solver.ed_solver_->predicted_solution);
+
+    // The iterative solver starts from the rejected prediction.
+    ScriptConfig iterative_config = config;
+    iterative_config.solver = "iterative";
+    Solver iterative(s[1], iterative_config, NULL);
+    CHECK(iterative.PredictSolution(&first, epsilon[1] - epsilon[0], false));
+    CHECK(iterative.Solve());
+    CHECK(!iterative.ed_solver_->predicted_solution);
+    double error = (iterative.ed_solver_->solution -
+                    solver.ed_solver_->solution).norm();
+    printf("Iterative solution from prediction, error = %g\n", error);
+    CHECK(error < 1e-6 * solver.ed_solver_->solution.norm());
+  }
+
+  // No prediction can be made for a different mesh.
+  {
+    config.mesh_edge_length = 12;
+    Solver solver(s[3], config, NULL);
+    CHECK(!solver.PredictSolution(&first, 0, true));
+  }
+}
+
+TEST_FUNCTION(TimeDomain) {
+  // A section of WR-12 waveguide with a dielectric insert, solved in the
+  // frequency domain at three frequencies and in the time domain once.
+  ScriptConfig config;
+  config.type = ScriptConfig::EZ;
+  config.unit = 2.54e-5;
+  config.mesh_edge_length = 10;
+  config.port_excitation.resize(2);
+  config.port_excitation[0] = 1;
+  config.frequency = 75e9;
+  Shape s, insert;
+  s.SetRectangle(0, 0, 500, 120);
+  CHECK(s.AssignPort(0, 3, EdgeKind(1)));
+  CHECK(s.AssignPort(0, 1, EdgeKind(2)));
+  insert.SetRectangle(200, 0, 300, 60);
+  Material mat;
+  mat.epsilon = 2;
+  s.Paint(insert, mat);
+  const double frequencies[3] = {75e9, 70e9, 80e9};
+  vector<JetComplex> direct_power[3];
+  for (int i = 0; i < 3; i++) {
+    config.frequency = frequencies[i];
+    Solver direct(s, config, NULL);
+    CHECK(direct.ComputePortOutgoingPower(&direct_power[i]));
+  }
+  config.frequency = frequencies[0];
+  config.time_domain = true;
+  config.time_domain_frequencies.push_back(frequencies[1]);
+  config.time_domain_frequencies.push_back(frequencies[2]);
+  Solver solver(s, config, NULL);
+  vector<JetComplex> power;
+  vector<vector<JetComplex> > broadband;
+  CHECK(solver.ComputePortOutgoingPower(&power));
+  CHECK(solver.ComputeTimeDomainPortPower(&broadband));
+  CHECK(broadband.size() == 2);
+
+  // The ports are exactly absorbing only at config.frequency, so the other
+  // frequencies are less accurate. The lumped mass matrix gives larger phase
+  // errors than the frequency domain solver's, so the phases are compared
+  // less precisely than the magnitudes.
+  for (int i = 0; i < 3; i++) {
+    const vector<JetComplex> &p = i == 0 ? power : broadband[i - 1];
+    CHECK(p.size() == 2);
+    double error = 0, magnitude_error = 0;
+    for (int j = 0; j < 2; j++) {
+      error = std::max(error, abs(ToComplex(p[j] - direct_power[i][j])));
+      magnitude_error = std::max(magnitude_error,
+          fabs(abs(ToComplex(p[j])) - abs(ToComplex(direct_power[i][j]))));
+    }
+    printf("Time domain frequency %g, |S21|^2 = %g, power error = %g, "
+           "magnitude error = %g\n", frequencies[i], abs(ToComplex(p[1])),
+           error, magnitude_error);
+    CHECK(error < 0.2);
+    CHECK(magnitude_error < (i == 0 ? 1e-2 : 5e-2));
+  }
+}
+
+TEST_FUNCTION(SinCos) {
+  const int n = 10000;
+  vector<double> x(n), s(n), c(n);
+  for (int i = 0; i < n; i++) {
+    x[i] = (RandDouble() * 2 - 1) * ((i < n / 2) ? 10 : 1e4);
+  }
+  SinCos(n, x.data(), s.data(), c.data());
+  double max_error = 0;
+  for (int i = 0; i < n; i++) {
+    max_error = std::max(max_error, fabs(s[i] - sin(x[i])));
+    max_error = std::max(max_error, fabs(c[i] - cos(x[i])));
+  }
+  printf("SinCos max error = %g\n", max_error);
+  CHECK(max_error < 1e-14);
+}
+
+TEST_FUNCTION(DoubleFarField) {
+  // Random radiators with no derivatives. The double and Jet far fields
+  // should agree.
+  vector<FarFieldRadiator> radiators(100);
+  for (int i = 0; i < radiators.size(); i++) {
+    FarFieldRadiator &r = radiators[i];
+    r.center = JetPoint(RandDouble() * 2 - 1, RandDouble() * 2 - 1);
+    r.nangle = RandDouble() * 2 * M_PI;
+    r.z = JetComplex(RandDouble(), RandDouble());
+    r.gradN = JetComplex(RandDouble(), RandDouble());
+    r.gradP = JetComplex(RandDouble(), RandDouble());
+  }
+  const int num_points = 500;
+  vector<double> azimuth(num_points);
+  for (int i = 0; i < num_points; i++) {
+    azimuth[i] = (2.0 * M_PI * double(i)) / num_points - M_PI;
+  }
+  const double k = 30;
+  vector<JetComplex> ff1(num_points), ff2(num_points);
+  for (int begin = 0; begin < num_points; begin += kFarFieldBlock) {
+    int end = std::min(begin + kFarFieldBlock, num_points);
+    JetFarField(radiators, k, 10, azimuth, begin, end, &ff1);
+    DoubleFarField(radiators, k, 10, azimuth, begin, end, &ff2);
+  }
+  for (int i = 0; i < num_points; i++) {
+    CHECK(abs(ToComplex(ff1[i]) - ToComplex(ff2[i])) < 1e-12);
+  }
+}
+
+TEST_FUNCTION(HarmonicFarField) {
+  // Random radiators with no derivatives in a circle that is not centered on
+  // the origin. The harmonic expansion should agree with the direct sum for
+  // any number of points, including when the harmonics alias.
+  vector<FarFieldRadiator> radiators(200);
+  for (int i = 0; i < radiators.size(); i++) {
+    FarFieldRadiator &r = radiators[i];
+    double radius = sqrt(RandDouble()), angle = RandDouble() * 2 * M_PI;
+    r.center = JetPoint(3 + radius * cos(angle), 2 + radius * sin(angle));
+    r.nangle = RandDouble() * 2 * M_PI;
+    r.z = JetComplex(RandDouble(), RandDouble());
+    r.gradN = JetComplex(RandDouble(), RandDouble());
+    r.gradP = JetComplex(RandDouble(), RandDouble());
+  }
+  const double k = 30;
+  double ox, oy;
+  const int L = FarFieldHarmonics(radiators, k, &ox, &oy);
+  printf("%d harmonics\n", L);
+  const int sizes[] = {4096, 777, 500, 101};
+  for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    const int num_points = sizes[s];
+    vector<double> azimuth(num_points);
+    for (int i = 0; i < num_points; i++) {
+      azimuth[i] = (2.0 * M_PI * double(i)) / num_points - M_PI;
+    }
+    vector<JetComplex> ff1(num_points), ff2(num_points);
+    for (int begin = 0; begin < num_points; begin += kFarFieldBlock) {
+      int end = std::min(begin + kFarFieldBlock, num_points);
+      DoubleFarField(radiators, k, 25, azimuth, begin, end, &ff1);
+    }
+    HarmonicFarField(radiators, k, 25, num_points, &ff2);
+    double max_value = 0, max_error = 0;
+    for (int i = 0; i < num_points; i++) {
+      max_value = std::max(max_value, abs(ToComplex(ff1[i])));
+      max_error = std::max(max_error, abs(ToComplex(ff1[i]) -
+                                          ToComplex(ff2[i])));
+    }
+    printf("%d points: max error = %g, max value = %g\n", num_points,
+           max_error, max_value);
+    CHECK(max_error < 1e-10 * max_value);
+  }
+}
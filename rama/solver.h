@@ -5,6 +5,7 @@
 #define __SOLVER_H__
 
 #include <string.h>
+#include <string>
 #include <myvector>
 #include "Eigen/Dense"
 #include "Eigen/Sparse"
@@ -42,11 +43,22 @@ struct ScriptConfig {
   double unit;                  // One script-distance-unit is this many meters
   double mesh_edge_length;      // In units of 'unit'
   int mesh_refines;
+  Mesh::MesherType mesher;      // Mesher to use
+  double mesh_grading;          // Mesh::Grading rate, or -1 for none
+  vector<double> mesh_size_hints;  // x1,y1,x2,y2,length for each hint box
   vector<JetNum> port_excitation;  // Magnitudes and phases of port excitations
   double frequency;             // In Hz
   double depth;                 // In units of 'unit'
   double boresight;             // Boresight angle for plotting antenna patterns
+  int pattern_points;           // Number of antenna pattern azimuths
   int max_modes;                // TE or TM: Number of modes to compute
+  bool mixed_precision;         // Factor in single precision and refine
+  std::string solver;           // Sparse solver backend name, or "auto"
+  vector<double> substructure;  // x1,y1,x2,y2 of boxes around changing parts
+  vector<double> pml;           // x1,y1,x2,y2,thickness for the PML, or empty
+  Mesh::Symmetry symmetry;      // Mirror symmetry lines
+  bool time_domain;             // Solve with TimeDomainSolver
+  vector<double> time_domain_frequencies;  // Extra frequencies, in Hz
 
   ScriptConfig() {
     type = UNKNOWN;
@@ -54,10 +66,16 @@ struct ScriptConfig {
     unit = -1;
     mesh_edge_length = -1;
     mesh_refines = -1;
+    mesher = Mesh::TRIANGLE_MESHER;
+    mesh_grading = -1;
     frequency = -1;
     depth = -1;
     boresight = 0;
+    pattern_points = 500;
     max_modes = 1;
+    mixed_precision = false;
+    solver = "auto";
+    time_domain = false;
   }
 
   bool operator==(const ScriptConfig &c) const {
@@ -66,21 +84,46 @@ struct ScriptConfig {
         && unit             == c.unit
         && mesh_edge_length == c.mesh_edge_length
         && mesh_refines     == c.mesh_refines
+        && mesher           == c.mesher
+        && mesh_grading     == c.mesh_grading
+        && mesh_size_hints  == c.mesh_size_hints
         && port_excitation  == c.port_excitation
         && frequency        == c.frequency
         && depth            == c.depth
         && boresight        == c.boresight
-        && max_modes        == c.max_modes;
+        && pattern_points   == c.pattern_points
+        && max_modes        == c.max_modes
+        && mixed_precision  == c.mixed_precision
+        && solver           == c.solver
+        && substructure     == c.substructure
+        && pml              == c.pml
+        && symmetry         == c.symmetry
+        && time_domain      == c.time_domain
+        && time_domain_frequencies == c.time_domain_frequencies;
   }
   bool operator!=(const ScriptConfig &c) const { return !operator==(c); }
 
   // Convert a cavity type name into a type constant, or UNKNOWN if none.
   static Type StringToType(const char *name);
 
+  // Convert a mesher name into a mesher type, or UNKNOWN_MESHER if none.
+  static Mesh::MesherType StringToMesher(const char *name);
+
+  // Return true if 'name' is a sparse solver backend or "auto".
+  static bool SolverIsValid(const char *name);
+
   // Convenience functions to test the type.
   bool TypeIsElectrodynamic() const { return type == EZ || type == EXY; }
   bool TypeIsWaveguideMode() const { return type == TE || type == TM; }
 
+  // Return the mesh grading parameters.
+  Mesh::Grading MeshGrading() const {
+    Mesh::Grading grading;
+    grading.rate = mesh_grading;
+    grading.hints = mesh_size_hints;
+    return grading;
+  }
+
   // Return the excitation magnitude and phase for a particular port number.
   JetComplex PortExcitation(int port_number) const {
     if (port_number >= 1 && port_number <= port_excitation.size() / 2) {
@@ -153,6 +196,13 @@ class Solver : public Mesh {
   // ComputePortOutgoingField() but the magnitude equals the power.
   bool ComputePortOutgoingPower(vector<JetComplex> *result) MUST_USE_RESULT;
 
+  // If config.time_domain is set, compute the outgoing power at each port
+  // (as for ComputePortOutgoingPower()) at each of the config
+  // time_domain_frequencies, from the one time domain solve. Return true on
+  // success. The results have no derivatives.
+  bool ComputeTimeDomainPortPower(vector<vector<JetComplex> > *result)
+                                  MUST_USE_RESULT;
+
   // Retrieve the field values and other quantities from the solution at the
   // point (x,y) which is in config.unit. This interpolates across mesh
   // elements. It is assumed that the solution and derivative is valid (e.g.
@@ -164,8 +214,11 @@ class Solver : public Mesh {
   void GetFieldPoynting(JetNum x, JetNum y, JetPoint *poynting);
 
   // Compute the radiation pattern at the ABC. Return arrays of azimuth (in
-  // radians) and associated field magnitude. The azimuth angles will be
-  // monotonically increasing and in the range -pi..pi.
+  // radians) and associated field magnitude. There are config.pattern_points
+  // evenly spaced azimuth angles, monotonically increasing and in the range
+  // -pi..pi. If there are many more points than needed to resolve the pattern
+  // of the ABC this uses a cylindrical harmonic expansion and an FFT, so high
+  // resolution patterns are cheap.
   bool ComputeAntennaPattern(vector<double> *azimuth,
                              vector<JetNum> *magnitude) MUST_USE_RESULT;
 
@@ -184,10 +237,62 @@ class Solver : public Mesh {
   // display. This will trigger a solve if one has not been done yet.
   void SelectWaveguideMode(int n);
 
+  // If we are solving for waveguide modes, seed the eigensolver with the modes
+  // computed by 'previous', which is a solver for a similar model (e.g. the
+  // previous step of a sweep). The modes are interpolated onto this mesh. If
+  // 'track' is true then the mode numbering of this solver will follow the
+  // modes of 'previous' even if their cutoff frequencies cross, for
+  // continuity in sweeps and optimization. Modes that no longer resemble any
+  // previous mode, and all modes if 'track' is false, are numbered in order
+  // of increasing cutoff frequency. This does nothing if 'previous' has not
+  // computed modes of the same type. It must be called before any solve.
+  void WarmStartModes(Solver *previous, bool track);
+
+  // If we are solving an electrodynamic problem, reuse the factored system
+  // matrix of 'previous', which is a solver for a similar model. If the
+  // models differ only in a small region (e.g. the material of a small
+  // dielectric insert is changed in a sweep) then the solve is done by a low
+  // rank update of the previous factorization, which is much faster than
+  // factoring the system matrix again. This does nothing if 'previous' has not
+  // solved the same type of problem. It must be called before any solve.
+  void ReuseFactorization(Solver *previous);
+
+  // If we are solving an electrodynamic problem, solve it from the reduced
+  // order model of 'previous' (see FEMSolver::UseReducedModel()), which is the
+  // solver for the previous step of a sweep. Sweeps that change the whole
+  // system matrix only smoothly, e.g. frequency sweeps, then need a full
+  // factorization only at the few steps where the reduced model is not
+  // accurate enough. If 'previous' is 0 or has no reduced model then a new
+  // one is started. It must be called before any solve.
+  void UseReducedModel(Solver *previous);
+
+  // If we are solving an electrodynamic problem, predict the solution to
+  // first order from the solution and solution derivative of 'previous', a
+  // solver for the same model with only the parameter that has the
+  // derivative changed by 'step'. This needs the two meshes to have the same
+  // points and triangles, e.g. when a material property is changed. If
+  // 'preview' is true then the prediction is used as the solution, for quick
+  // approximate results (e.g. while a parameter slider is being dragged).
+  // Otherwise it is only used if its residual is small enough, which saves
+  // factoring the system matrix for small steps. In a preview the solution
+  // derivative is also taken from 'previous', otherwise it is computed for
+  // this model when it is needed (which factors the system). Return false if
+  // no prediction can be made. It must be called before any solve.
+  bool PredictSolution(Solver *previous, double step, bool preview);
+
+  // True if this solver has computed something that the solver for a
+  // similar model can use: waveguide modes for WarmStartModes(), or a solved
+  // system for ReuseFactorization(), UseReducedModel() and PredictSolution().
+  bool HasReusableState() const;
+
+  // True if PredictSolution() was called with 'preview' true.
+  bool IsPreview() const { return preview_; }
+
   // If we are solving for waveguide modes, return the cutoff frequencies of
   // all modes. Return true on success or false on failure. Note that
-  // JetComplex is returned even though the result is really 'double' for
-  // compatibility with ComputePortOutgoingField().
+  // JetComplex is returned even though the result is really 'JetNum' for
+  // compatibility with ComputePortOutgoingField(). The derivatives are with
+  // respect to the same parameter as the mesh point derivatives.
   bool ComputeModeCutoffFrequencies(vector<JetComplex> *cutoff) MUST_USE_RESULT;
 
  public:
@@ -204,6 +309,10 @@ class Solver : public Mesh {
   EDSolverType *ed_solver_;             // Electrodynamics solver
   ModeSolverType *mode_solver_;         // Eigenmode solver
   Eigen::VectorXcd *solver_solution_;   // Solution vector to display
+  Eigen::MatrixXd mode_warm_start_;     // Initial eigenvectors, or no columns
+  bool mode_track_;                     // Follow mode_warm_start_ numbering
+  Eigen::VectorXcd prediction_derivative_;  // From PredictSolution()
+  bool preview_;                        // From PredictSolution()
   vector<double> antenna_azimuth_;      // Cached antenna pattern
   vector<JetNum> antenna_magnitude_;    // Cached antenna pattern
 
@@ -236,8 +345,22 @@ class Solver : public Mesh {
   // The last ComputePortOutgoingPower() result.
   vector<JetComplex> port_outgoing_power_;
 
+  // For the time domain solver, the port points and the solution at each of
+  // them (rows) for each of the time_domain_frequencies (columns).
+  vector<int> time_domain_points_;
+  Eigen::MatrixXcd time_domain_probes_;
+
   // **********
 
+  // Solve the electrodynamic problem with the time domain solver, if that
+  // has not already been done. Return true on success.
+  bool SolveTimeDomain() MUST_USE_RESULT;
+
+  // Scale the port fields from ComputePortOutgoingField2() to the powers
+  // returned by ComputePortOutgoingPower(), at the given frequency.
+  void PortFieldToPower(const vector<JetComplex> &field, double frequency,
+                        vector<JetComplex> *result);
+
   // Compute k^2 for the system given the config_.
   double ComputeKSquared();
 
@@ -3,7 +3,7 @@
 function Parameter(T)
   -- Check that all keys in T have valid type.
   local keys = {label='string', min='number', max='number', default='number',
-                integer='boolean'}
+                integer='boolean', tolerance='number', distribution='string'}
   for k,v in pairs(T) do
     if keys[k] then
       if type(v) ~= keys[k] then
@@ -19,6 +19,8 @@ function Parameter(T)
   -- Check that all necessary keys are present).
   keys.integer = nil            -- Optional field
   keys.default = nil            -- Optional field
+  keys.tolerance = nil          -- Optional field
+  keys.distribution = nil       -- Optional field
   if next(keys) ~= nil then
     error("In argument table, missing '"..next(keys).."' key")
   end
@@ -42,6 +44,17 @@ function Parameter(T)
   if default < min or default > max then
     error("In argument table, you must have default between min and max")
   end
+  local tolerance = tonumber(T.tolerance) or 0
+  local distribution = T.distribution or 'normal'
+  if tolerance < 0 then
+    error("In argument table, the tolerance can not be negative")
+  end
+  if tolerance > 0 and integer then
+    error("In argument table, integer parameters can not have a tolerance")
+  end
+  if distribution ~= 'normal' and distribution ~= 'uniform' then
+    error("In argument table, distribution should be 'normal' or 'uniform'")
+  end
 
   -- Create the parameter and return its current value.
   local label = tostring(T.label)
@@ -52,7 +65,8 @@ function Parameter(T)
     error("The label can not using the single quote character: '")
     -- ...since we don't escape it when copying parameters to the clipboard
   end
-  return _CreateParameter(label, min, max, default, integer)
+  return _CreateParameter(label, min, max, default, integer, tolerance,
+                          distribution == 'uniform')
 end
 
 function ParameterMarker(T)
@@ -98,6 +112,7 @@ __Optimize3rdArg__ = {
   end,
   Pattern = _Pattern,
   Directivity = _Directivity,
+  PortPower = _PortPower,
 }
 
 -- Utility functions.
@@ -0,0 +1,91 @@
+
+// Testing for DomainDecompositionFactorizer.
+
+#include "domain_decomposition.h"
+#include <stdio.h>
+#include "testing.h"
+
+namespace FEM {
+
+typedef Eigen::SparseMatrix<double> SMatrix;
+
+// A 5 point Laplacian (plus a shift) on an nx*ny grid, made nonsymmetric by
+// 'asymmetry'. If 'split' is true the grid is cut into two disconnected
+// halves.
+static void DDTestMatrix(int nx, int ny, double asymmetry, bool split,
+                         SMatrix *A, Eigen::Matrix2Xd *xy) {
+  std::vector<Eigen::Triplet<double> > t;
+  xy->resize(2, nx * ny);
+  for (int i = 0; i < ny; i++) {
+    for (int j = 0; j < nx; j++) {
+      int k = i * nx + j;
+      (*xy)(0, k) = j;
+      (*xy)(1, k) = i;
+      t.push_back(Eigen::Triplet<double>(k, k, 4.1));
+      if (i > 0 && !(split && i == ny / 2)) {
+        t.push_back(Eigen::Triplet<double>(k, k - nx, -1));
+        t.push_back(Eigen::Triplet<double>(k - nx, k, -1 + asymmetry));
+      }
+      if (j > 0) {
+        t.push_back(Eigen::Triplet<double>(k, k - 1, -1));
+        t.push_back(Eigen::Triplet<double>(k - 1, k, -1 + asymmetry));
+      }
+    }
+  }
+  A->resize(nx * ny, nx * ny);
+  A->setFromTriplets(t.begin(), t.end());
+}
+
+static void DDTest(int parts, const SMatrix &A, const Eigen::Matrix2Xd *xy) {
+  std::vector<int> adj_begin, adj, part;
+  SymmetricAdjacency(A, &adj_begin, &adj);
+  PartitionGraph(adj_begin, adj, parts, &part);
+  std::vector<int> size(parts);
+  for (int i = 0; i < part.size(); i++) {
+    CHECK(part[i] >= 0 && part[i] < parts);
+    size[part[i]]++;
+  }
+  for (int p = 0; p < parts; p++) {
+    CHECK(size[p] >= A.rows() / parts - 1 && size[p] <= A.rows() / parts + 1);
+  }
+
+  DomainDecompositionFactorizer<double> f(parts);
+  NestedDissectionCoordinates coordinates(xy);
+  f.analyzePattern(A);
+  f.factorize(A);
+  CHECK(f.info() == Eigen::Success);
+  Eigen::VectorXd b = Eigen::VectorXd::Random(A.rows());
+  Eigen::VectorXd x = f.solve(b);
+  double error = (A * x - b).norm() / b.norm();
+  printf("%d parts of %d rows, interface size %d, error = %g\n",
+         f.NumParts(), int(A.rows()), f.InterfaceSize(), error);
+  CHECK(f.NumParts() == parts);
+  CHECK(error < 1e-12);
+  if (parts == 1) {
+    CHECK(f.InterfaceSize() == 0);
+  }
+}
+
+TEST_FUNCTION(DomainDecompositionFactorizer) {
+  SMatrix A;
+  Eigen::Matrix2Xd xy;
+  DDTestMatrix(60, 40, 0, false, &A, &xy);
+  for (int parts = 1; parts <= 8; parts++) {
+    DDTest(parts, A, &xy);
+  }
+  DDTest(4, A, 0);
+  DDTestMatrix(60, 40, 0.2, false, &A, &xy);
+  DDTest(5, A, &xy);
+  DDTestMatrix(60, 40, 0, true, &A, &xy);
+  DDTest(2, A, &xy);
+  DDTest(3, A, &xy);
+
+  // The interface of a long strip is three cross sections, which are
+  // staircases as the breadth first search starts from a corner.
+  DDTestMatrix(400, 10, 0, false, &A, &xy);
+  DomainDecompositionFactorizer<double> f(4);
+  f.analyzePattern(A);
+  CHECK(f.InterfaceSize() <= 3 * 12);
+}
+
+}  // namespace FEM
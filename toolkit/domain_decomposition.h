@@ -0,0 +1,356 @@
+// Parallel Schur complement domain decomposition.
+//
+// The rows of the matrix (the mesh points) are partitioned into k subdomains
+// of nearly equal size by recursive bisection of the matrix graph. The rows
+// that couple different subdomains form the interface G, and the rest of each
+// subdomain p is its interior. With the interiors ordered first the matrix is
+//
+//   A = [ A_11            A_1G ]
+//       [       ...       ...  ]
+//       [            A_kk A_kG ]
+//       [ A_G1  ...  A_Gk A_GG ]
+//
+// The interior blocks A_pp are independent, so they are factored concurrently,
+// one per thread. Then the interface system, the Schur complement
+//
+//   S = A_GG - sum_p A_Gp * inv(A_pp) * A_pG
+//
+// is assembled and factored, and solving A*x=b takes two parallel rounds of
+// interior solves around one solve with S. Each A_pp is factored by SparseLU,
+// which with nested dissection orderings is itself efficient but serial, so
+// this scales across cores when the interface is small compared to the
+// subdomains, i.e. for large problems.
+
+#ifndef __TOOLKIT_DOMAIN_DECOMPOSITION_H__
+#define __TOOLKIT_DOMAIN_DECOMPOSITION_H__
+
+#include <algorithm>
+#include <memory>
+#include "myvector"
+#include "Eigen/Dense"
+#include "Eigen/Sparse"
+#include "error.h"
+#include "thread.h"
+#include "mixed_precision.h"
+#include "nested_dissection.h"
+
+namespace FEM {
+
+// Partition a graph (given by adjacency lists as from SymmetricAdjacency())
+// into 'parts' parts of nearly equal size, which need not be a power of two.
+// Each bisection orders the vertices by breadth first search from a pseudo-
+// peripheral vertex and splits the order in proportion to the number of parts
+// on each side, so parts are usually connected and their boundaries short.
+// On return part[i] is the part of vertex i.
+inline void PartitionGraph(const std::vector<int> &adj_begin,
+                           const std::vector<int> &adj, int parts,
+                           std::vector<int> *part) {
+  CHECK(parts >= 1);
+  const int n = adj_begin.size() - 1;
+  part->assign(n, 0);
+  std::vector<int> mark(n, -1);
+  int stamp = 0;
+
+  // Order the vertices of 'v' by breadth first search within 'v', starting
+  // from v[0] and then from each vertex that is still unvisited. Return the
+  // last vertex visited.
+  auto search = [&](std::vector<int> &v) {
+    stamp++;
+    std::vector<int> order;
+    order.reserve(v.size());
+    for (int i = 0; i < v.size(); i++) {
+      mark[v[i]] = stamp;
+    }
+    for (int i = 0; i < v.size(); i++) {
+      if (mark[v[i]] != stamp) {
+        continue;
+      }
+      int head = order.size();
+      order.push_back(v[i]);
+      mark[v[i]] = -stamp;
+      while (head < order.size()) {
+        int u = order[head++];
+        for (int p = adj_begin[u]; p < adj_begin[u + 1]; p++) {
+          if (mark[adj[p]] == stamp) {
+            mark[adj[p]] = -stamp;
+            order.push_back(adj[p]);
+          }
+        }
+      }
+    }
+    v.swap(order);
+    return v.back();
+  };
+
+  struct Item {
+    std::vector<int> vertices;
+    int first_part, num_parts;
+  };
+  std::vector<Item> stack(1);
+  stack[0].vertices.resize(n);
+  for (int i = 0; i < n; i++) {
+    stack[0].vertices[i] = i;
+  }
+  stack[0].first_part = 0;
+  stack[0].num_parts = parts;
+  while (!stack.empty()) {
+    Item item;
+    item.vertices.swap(stack.back().vertices);
+    item.first_part = stack.back().first_part;
+    item.num_parts = stack.back().num_parts;
+    stack.pop_back();
+    std::vector<int> &v = item.vertices;
+    if (item.num_parts == 1 || v.size() <= 1) {
+      for (int i = 0; i < v.size(); i++) {
+        (*part)[v[i]] = item.first_part;
+      }
+      continue;
+    }
+    // Two searches find a pseudo-peripheral vertex, which starts the third.
+    int u = search(v);
+    std::swap(v[0], v[std::find(v.begin(), v.end(), u) - v.begin()]);
+    u = search(v);
+    std::swap(v[0], v[std::find(v.begin(), v.end(), u) - v.begin()]);
+    search(v);
+    int left_parts = item.num_parts / 2;
+    int split = int(double(v.size()) * left_parts / item.num_parts);
+    stack.resize(stack.size() + 2);
+    Item *items = &stack[stack.size() - 2];
+    items[0].vertices.assign(v.begin(), v.begin() + split);
+    items[0].first_part = item.first_part;
+    items[0].num_parts = left_parts;
+    items[1].vertices.assign(v.begin() + split, v.end());
+    items[1].first_part = item.first_part + left_parts;
+    items[1].num_parts = item.num_parts - left_parts;
+  }
+}
+
+// A drop-in replacement for an Eigen sparse factorizer. Both triangles of the
+// matrix must be set. If NestedDissectionCoordinates are given around
+// analyzePattern() and factorize() they are used for the orderings of the
+// subdomains and of S.
+template<class _Scalar>
+class DomainDecompositionFactorizer {
+ public:
+  typedef _Scalar Scalar;
+  typedef Eigen::SparseMatrix<Scalar> MatrixType;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+  typedef typename LowPrecision<Scalar>::Type LowScalar;
+  typedef MixedPrecisionFactorizer<
+      Eigen::SparseLU<MatrixType, NestedDissectionColumnOrdering<int> >,
+      Eigen::SparseLU<Eigen::SparseMatrix<LowScalar>,
+                      NestedDissectionColumnOrdering<int> > > Factorizer;
+
+  // Use 'parts' subdomains, or by default one per core (but at least two).
+  explicit DomainDecompositionFactorizer(int parts = 0)
+      : num_parts_(parts > 0 ? parts : std::max(2, NumberOfCores())),
+        mixed_(false), info_(Eigen::Success) {}
+
+  void SetMixedPrecision(bool mixed) { mixed_ = mixed; }
+
+  // The number of subdomains and interface rows, after analyzePattern().
+  int NumParts() const { return parts_.size(); }
+  int InterfaceSize() const { return interface_.size(); }
+
+  void analyzePattern(const MatrixType &A) {
+    CHECK(A.rows() == A.cols());
+    const int n = A.rows();
+    std::vector<int> adj_begin, adj, part;
+    SymmetricAdjacency(A, &adj_begin, &adj);
+    PartitionGraph(adj_begin, adj, std::min(num_parts_, std::max(n, 1)),
+                   &part);
+
+    // Move one end of every edge between subdomains to the interface. Where
+    // there is a choice the end in the higher numbered subdomain is moved.
+    for (int i = 0; i < n; i++) {
+      for (int p = adj_begin[i]; p < adj_begin[i + 1]; p++) {
+        int j = adj[p];
+        if (part[i] >= 0 && part[j] >= 0 && part[i] != part[j]) {
+          part[part[i] > part[j] ? i : j] = -1;
+        }
+      }
+    }
+    parts_.resize(std::min(num_parts_, std::max(n, 1)));
+    for (int p = 0; p < parts_.size(); p++) {
+      parts_[p].reset(new Part);
+    }
+    interface_.clear();
+    position_.resize(n);
+    for (int i = 0; i < n; i++) {
+      std::vector<int> &rows = (part[i] < 0) ? interface_ :
+                                               parts_[part[i]]->rows;
+      position_[i] = rows.size();
+      rows.push_back(i);
+    }
+    part_.swap(part);
+  }
+
+  void factorize(const MatrixType &A) {
+    CHECK(A.rows() == part_.size());
+    const int ng = interface_.size();
+    const Eigen::Matrix2Xd *xy = NestedDissectionCoordinates::Current();
+    if (xy && xy->cols() != A.rows()) {
+      xy = 0;
+    }
+
+    // Split A into blocks.
+    typedef Eigen::Triplet<Scalar> Triplet;
+    std::vector<std::vector<Triplet> > tpp(parts_.size()), tpg(parts_.size()),
+                                       tgp(parts_.size());
+    std::vector<Triplet> tgg;
+    for (int j = 0; j < A.outerSize(); j++) {
+      for (typename MatrixType::InnerIterator it(A, j); it; ++it) {
+        int r = it.row(), c = it.col();
+        int pr = part_[r], pc = part_[c];
+        Triplet t(position_[r], position_[c], it.value());
+        if (pr >= 0 && pc >= 0) {
+          CHECK(pr == pc);
+          tpp[pr].push_back(t);
+        } else if (pr >= 0) {
+          tpg[pr].push_back(t);
+        } else if (pc >= 0) {
+          tgp[pc].push_back(t);
+        } else {
+          tgg.push_back(t);
+        }
+      }
+    }
+
+    // Factor the subdomains and compute their contributions to S.
+    std::vector<std::vector<Triplet> > tschur(parts_.size());
+    std::vector<int> failed(parts_.size(), 0);
+    ParallelFor(parts_.size(), [&](int p) {
+      Part &part = *parts_[p];
+      const int np = part.rows.size();
+      part.App.resize(np, np);
+      part.Apg.resize(np, ng);
+      part.Agp.resize(ng, np);
+      part.App.setFromTriplets(tpp[p].begin(), tpp[p].end());
+      part.Apg.setFromTriplets(tpg[p].begin(), tpg[p].end());
+      part.Agp.setFromTriplets(tgp[p].begin(), tgp[p].end());
+      if (np == 0) {
+        return;                 // The interface took the whole subdomain
+      }
+      Eigen::Matrix2Xd part_xy(2, xy ? np : 0);
+      for (int i = 0; i < part_xy.cols(); i++) {
+        part_xy.col(i) = xy->col(part.rows[i]);
+      }
+      NestedDissectionCoordinates coordinates(xy ? &part_xy : 0);
+      part.factorizer.reset(new Factorizer);
+      part.factorizer->SetMixedPrecision(mixed_);
+      part.factorizer->analyzePattern(part.App);
+      part.factorizer->factorize(part.App);
+      if (part.factorizer->info() != Eigen::Success) {
+        failed[p] = 1;
+        return;
+      }
+      // The interface rows next to this subdomain.
+      std::vector<int> next;
+      for (int j = 0; j < ng; j++) {
+        if (part.Apg.col(j).nonZeros() > 0) {
+          next.push_back(j);
+        }
+      }
+      for (int j = 0; j < next.size(); j++) {
+        Vector w = part.factorizer->solve(
+            Vector(part.Apg.col(next[j]).toDense()));
+        Vector c = part.Agp * w;
+        for (int i = 0; i < next.size(); i++) {
+          tschur[p].push_back(Triplet(next[i], next[j], -c[next[i]]));
+        }
+      }
+    });
+    for (int p = 0; p < parts_.size(); p++) {
+      if (failed[p]) {
+        info_ = Eigen::NumericalIssue;
+        return;
+      }
+      tgg.insert(tgg.end(), tschur[p].begin(), tschur[p].end());
+    }
+
+    // Form and factor S.
+    schur_.reset(new Factorizer);
+    schur_->SetMixedPrecision(mixed_);
+    MatrixType S(ng, ng);
+    S.setFromTriplets(tgg.begin(), tgg.end());
+    Eigen::Matrix2Xd interface_xy(2, xy ? ng : 0);
+    for (int i = 0; i < interface_xy.cols(); i++) {
+      interface_xy.col(i) = xy->col(interface_[i]);
+    }
+    NestedDissectionCoordinates coordinates(xy ? &interface_xy : 0);
+    info_ = Eigen::Success;
+    if (ng > 0) {
+      schur_->analyzePattern(S);
+      schur_->factorize(S);
+      info_ = schur_->info();
+    }
+  }
+
+  Eigen::ComputationInfo info() const { return info_; }
+
+  // Solve A*x=b. Like MixedPrecisionFactorizer this is not const.
+  template<class Derived>
+  Vector solve(const Eigen::MatrixBase<Derived> &b) {
+    const int ng = interface_.size();
+    std::vector<Vector> y(parts_.size()), t(parts_.size());
+    ParallelFor(parts_.size(), [&](int p) {
+      Part &part = *parts_[p];
+      if (part.rows.empty()) {
+        t[p].setZero(ng);
+        return;
+      }
+      Vector bp(part.rows.size());
+      for (int i = 0; i < part.rows.size(); i++) {
+        bp[i] = b[part.rows[i]];
+      }
+      y[p] = part.factorizer->solve(bp);
+      t[p] = part.Agp * y[p];
+    });
+    Vector xg(ng);
+    for (int i = 0; i < ng; i++) {
+      xg[i] = b[interface_[i]];
+    }
+    for (int p = 0; p < parts_.size(); p++) {
+      xg -= t[p];
+    }
+    if (ng > 0) {
+      xg = schur_->solve(xg);
+    }
+    Vector x(b.size());
+    for (int i = 0; i < ng; i++) {
+      x[interface_[i]] = xg[i];
+    }
+    ParallelFor(parts_.size(), [&](int p) {
+      Part &part = *parts_[p];
+      if (part.rows.empty()) {
+        return;
+      }
+      Vector xp = y[p] - part.factorizer->solve(Vector(part.Apg * xg));
+      for (int i = 0; i < part.rows.size(); i++) {
+        x[part.rows[i]] = xp[i];
+      }
+    });
+    return x;
+  }
+
+ private:
+  struct Part {
+    std::vector<int> rows;              // The rows of the interior
+    MatrixType App, Apg, Agp;
+    std::unique_ptr<Factorizer> factorizer;     // Factors App
+  };
+  int num_parts_;
+  bool mixed_;
+  Eigen::ComputationInfo info_;
+  std::vector<std::shared_ptr<Part> > parts_;
+  std::vector<int> part_;               // Subdomain of each row, or -1
+  std::vector<int> position_;           // Offset of each row in its part
+  std::vector<int> interface_;          // Rows of G
+  std::unique_ptr<Factorizer> schur_;   // Factors S
+
+  DISALLOW_COPY_AND_ASSIGN(DomainDecompositionFactorizer);
+};
+
+}  // namespace FEM
+
+#endif
@@ -142,3 +142,240 @@ TEST_FUNCTION(LaplacianEigenSolver) {
   CHECK(fabs(val[3] - 0.049704) < 1e-6);
   CHECK(fabs(val[4] - 0.098489) < 1e-6);
 }
+
+TEST_FUNCTION(BlockEigenSolver) {
+  srandom(123);
+
+  // Create laplacian sparse matrices for an N*N 2D grid with dirichlet and
+  // neumann boundary conditions, and a random positive definite B, as above.
+  const int N = 40;
+  vector<Triplet<double> > Ad_trips, An_trips, Btrips;
+  for (int i = 0; i < N; i++) {
+    for (int j = 0; j < N; j++) {
+      int index = i*N + j;
+      int sz = An_trips.size();
+      if (i > 0) An_trips.push_back(Triplet<double>(index, index-N, -1));
+      if (i < N-1) An_trips.push_back(Triplet<double>(index, index+N, -1));
+      if (j > 0) An_trips.push_back(Triplet<double>(index, index-1, -1));
+      if (j < N-1) An_trips.push_back(Triplet<double>(index, index+1, -1));
+      Ad_trips.insert(Ad_trips.end(), An_trips.begin() + sz, An_trips.end());
+      Ad_trips.push_back(Triplet<double>(index, index, 4));
+      An_trips.push_back(Triplet<double>(index, index, An_trips.size() - sz));
+    }
+  }
+  SMatrix Ad(N*N, N*N), An(N*N, N*N);
+  Ad.setFromTriplets(Ad_trips.begin(), Ad_trips.end());
+  An.setFromTriplets(An_trips.begin(), An_trips.end());
+  for (int i = 0; i < N*N; i++) {
+    Btrips.push_back(Triplet<double>(i, i, 0.015));
+    if (i > 0) Btrips.push_back(Triplet<double>(i, i-1, 0.01 * RandDouble()));
+  }
+  SMatrix B(N*N, N*N);
+  B.setFromTriplets(Btrips.begin(), Btrips.end());
+  B = B + SMatrix(B.transpose());
+
+  // Check the eigenpairs of a solver for A*x=lambda*B*x.
+  const int M = 5;
+  auto check = [&](const eigensolvers::BlockEigenSolver &e, const SMatrix &A,
+                   const SMatrix *B) {
+    printf("iterations = %d\n", e.GetNumIterations());
+    CHECK(e.Status() == Success);
+    CHECK(e.GetNumConvergedEigenvalues() == M);
+    const VectorXd &val = e.GetEigenValues();
+    const MatrixXd &vec = e.GetEigenVectors();
+    CHECK(val.size() == M && vec.rows() == A.cols() && vec.cols() == M);
+    for (int i = 0; i < M; i++) {
+      printf("Eigenvalue %d = %f\n", i, val[i]);
+      VectorXd Bx = B ? VectorXd((*B) * vec.col(i)) : VectorXd(vec.col(i));
+      CHECK((A * vec.col(i) - val[i] * Bx).norm() < 1e-9);
+    }
+  };
+
+  // Ad*x=lambda*x from random vectors, against the analytic eigenvalues.
+  MatrixXd none;
+  eigensolvers::BlockEigenSolver e1(Ad, 0, M, 0, none, false);
+  check(e1, Ad, 0);
+  vector<double> exact;
+  for (int i = 1; i <= N; i++) {
+    for (int j = 1; j <= N; j++) {
+      exact.push_back(4 - 2*cos(M_PI*i/(N+1)) - 2*cos(M_PI*j/(N+1)));
+    }
+  }
+  std::sort(exact.begin(), exact.end());
+  for (int i = 0; i < M; i++) {
+    CHECK(fabs(e1.GetEigenValues()[i] - exact[i]) < 1e-9);
+  }
+
+  // An*x=lambda*B*x, which has a zero eigenvalue.
+  eigensolvers::BlockEigenSolver e2(An, &B, M, -0.01, none, false);
+  check(e2, An, &B);
+  CHECK(fabs(e2.GetEigenValues()[0]) < 1e-9);
+
+  // Perturb the problem and warm start from the previous eigenvectors. This
+  // should converge faster and give the same answer as a cold start.
+  SMatrix B2 = B;
+  for (int i = 0; i < N*N; i += 3) {
+    B2.coeffRef(i, i) *= 1.05;
+  }
+  eigensolvers::BlockEigenSolver cold(Ad, &B2, M, 0, none, false);
+  check(cold, Ad, &B2);
+  eigensolvers::BlockEigenSolver e3(Ad, &B, M, 0, none, false);
+  check(e3, Ad, &B);
+  eigensolvers::BlockEigenSolver warm(Ad, &B2, M, 0, e3.GetEigenVectors(),
+                                      false);
+  check(warm, Ad, &B2);
+  CHECK(warm.GetNumIterations() < cold.GetNumIterations());
+  for (int i = 0; i < M; i++) {
+    CHECK(fabs(warm.GetEigenValues()[i] - cold.GetEigenValues()[i]) < 1e-9);
+  }
+
+  // With tracking the eigenpairs follow the order of the initial vectors.
+  MatrixXd reversed = e3.GetEigenVectors().rowwise().reverse();
+  eigensolvers::BlockEigenSolver tracked(Ad, &B2, M, 0, reversed, true);
+  check(tracked, Ad, &B2);
+  for (int i = 0; i < M; i++) {
+    CHECK(fabs(tracked.GetEigenValues()[i] -
+               cold.GetEigenValues()[M - 1 - i]) < 1e-9);
+    CHECK(tracked.GetEigenVectors().col(i).dot(B * reversed.col(i)) > 0);
+  }
+}
+
+TEST_FUNCTION(BlockEigenSolverModeCrossing) {
+  srandom(123);
+
+  // Two uncoupled 1D laplacians, the second scaled by 'scale'. As the scale
+  // goes from 0.5 to 2 the lowest eigenvalue of the second block crosses the
+  // lowest eigenvalue of the first block, and these are the two smallest
+  // eigenvalues throughout.
+  const int N = 20, M = 2;
+  auto matrix = [&](double scale) {
+    vector<Triplet<double> > trips;
+    for (int b = 0; b < 2; b++) {
+      double s = b ? scale : 1.0;
+      for (int i = 0; i < N; i++) {
+        trips.push_back(Triplet<double>(b*N + i, b*N + i, 2 * s));
+        if (i > 0) trips.push_back(Triplet<double>(b*N + i, b*N + i-1, -s));
+        if (i < N-1) trips.push_back(Triplet<double>(b*N + i, b*N + i+1, -s));
+      }
+    }
+    SMatrix A(2*N, 2*N);
+    A.setFromTriplets(trips.begin(), trips.end());
+    return A;
+  };
+  // Return the block that eigenvector 'v' is in.
+  auto block = [&](const VectorXd &v) {
+    return v.tail(N).norm() > v.head(N).norm() ? 1 : 0;
+  };
+
+  // Sweep the scale with tracking, warm starting each step from the last.
+  // The mode numbering must follow the blocks through the crossing.
+  MatrixXd none, previous;
+  for (int step = 0; step <= 15; step++) {
+    SMatrix A = matrix(0.5 + 0.1 * step);
+    eigensolvers::BlockEigenSolver e(A, 0, M, 0, previous, true);
+    CHECK(e.Status() == Success);
+    CHECK(e.GetEigenValues().size() == M);
+    for (int i = 0; i < M; i++) {
+      CHECK(block(e.GetEigenVectors().col(i)) == 1 - i);
+      if (previous.cols() > 0) {
+        CHECK(e.GetEigenVectors().col(i).dot(previous.col(i)) > 0);
+      }
+    }
+    previous = e.GetEigenVectors();
+  }
+  SMatrix A = matrix(2.0);
+  eigensolvers::BlockEigenSolver tracked(A, 0, M, 0, previous, true);
+  CHECK(tracked.GetEigenValues()[0] > tracked.GetEigenValues()[1]);
+
+  // Without tracking, or with initial vectors that do not resemble any mode,
+  // the modes are in order of increasing eigenvalue.
+  eigensolvers::BlockEigenSolver untracked(A, 0, M, 0, previous, false);
+  CHECK(untracked.Status() == Success);
+  CHECK(untracked.GetEigenValues()[0] < untracked.GetEigenValues()[1]);
+  CHECK(block(untracked.GetEigenVectors().col(0)) == 0);
+  MatrixXd random = MatrixXd::Random(2*N, M);
+  eigensolvers::BlockEigenSolver unmatched(A, 0, M, 0, random, true);
+  CHECK(unmatched.Status() == Success);
+  CHECK(unmatched.GetEigenValues()[0] < unmatched.GetEigenValues()[1]);
+  CHECK(fabs(unmatched.GetEigenValues()[0] -
+             untracked.GetEigenValues()[0]) < 1e-9);
+}
+
+TEST_FUNCTION(SlicedEigenSolver) {
+  srandom(123);
+
+  // Create laplacian sparse matrices for an N*N 2D grid with dirichlet and
+  // neumann boundary conditions, and a random positive definite B, as above.
+  const int N = 30;
+  vector<Triplet<double> > Ad_trips, An_trips, Btrips;
+  for (int i = 0; i < N; i++) {
+    for (int j = 0; j < N; j++) {
+      int index = i*N + j;
+      int sz = An_trips.size();
+      if (i > 0) An_trips.push_back(Triplet<double>(index, index-N, -1));
+      if (i < N-1) An_trips.push_back(Triplet<double>(index, index+N, -1));
+      if (j > 0) An_trips.push_back(Triplet<double>(index, index-1, -1));
+      if (j < N-1) An_trips.push_back(Triplet<double>(index, index+1, -1));
+      Ad_trips.insert(Ad_trips.end(), An_trips.begin() + sz, An_trips.end());
+      Ad_trips.push_back(Triplet<double>(index, index, 4));
+      An_trips.push_back(Triplet<double>(index, index, An_trips.size() - sz));
+    }
+  }
+  SMatrix Ad(N*N, N*N), An(N*N, N*N);
+  Ad.setFromTriplets(Ad_trips.begin(), Ad_trips.end());
+  An.setFromTriplets(An_trips.begin(), An_trips.end());
+  for (int i = 0; i < N*N; i++) {
+    Btrips.push_back(Triplet<double>(i, i, 0.015));
+    if (i > 0) Btrips.push_back(Triplet<double>(i, i-1, 0.01 * RandDouble()));
+  }
+  SMatrix B(N*N, N*N);
+  B.setFromTriplets(Btrips.begin(), Btrips.end());
+  B = B + SMatrix(B.transpose());
+
+  // Check the eigenpairs of a solver for A*x=lambda*B*x. The eigenvectors
+  // from different slices must be B-orthonormal, i.e. no mode is repeated.
+  const int M = 60;
+  auto check = [&](const eigensolvers::EigenSolverBase &e, const SMatrix &A,
+                   const SMatrix *B) {
+    printf("iterations = %d\n", e.GetNumIterations());
+    CHECK(e.Status() == Success);
+    CHECK(e.GetNumConvergedEigenvalues() == M);
+    const VectorXd &val = e.GetEigenValues();
+    const MatrixXd &vec = e.GetEigenVectors();
+    CHECK(val.size() == M && vec.rows() == A.cols() && vec.cols() == M);
+    for (int i = 0; i < M; i++) {
+      VectorXd Bx = B ? VectorXd((*B) * vec.col(i)) : VectorXd(vec.col(i));
+      CHECK((A * vec.col(i) - val[i] * Bx).norm() < 1e-9);
+      if (i > 0) {
+        CHECK(val[i] >= val[i-1]);
+      }
+    }
+    MatrixXd Bvec = B ? MatrixXd((*B) * vec) : vec;
+    MatrixXd gram = vec.transpose() * Bvec;
+    CHECK((gram - MatrixXd::Identity(M, M)).norm() < 1e-6);
+  };
+
+  // Ad*x=lambda*x against the analytic eigenvalues.
+  eigensolvers::SlicedEigenSolver e1(Ad, 0, M, 0, 4);
+  check(e1, Ad, 0);
+  vector<double> exact;
+  for (int i = 1; i <= N; i++) {
+    for (int j = 1; j <= N; j++) {
+      exact.push_back(4 - 2*cos(M_PI*i/(N+1)) - 2*cos(M_PI*j/(N+1)));
+    }
+  }
+  std::sort(exact.begin(), exact.end());
+  for (int i = 0; i < M; i++) {
+    CHECK(fabs(e1.GetEigenValues()[i] - exact[i]) < 1e-9);
+  }
+
+  // An*x=lambda*B*x, which has a zero eigenvalue, against a dense solver.
+  eigensolvers::SlicedEigenSolver e2(An, &B, M, -0.01, 7);
+  check(e2, An, &B);
+  MatrixXd An_dense = An, B_dense = B;
+  GeneralizedSelfAdjointEigenSolver<MatrixXd> dense(An_dense, B_dense);
+  CHECK(fabs(e2.GetEigenValues()[0]) < 1e-9);
+  for (int i = 0; i < M; i++) {
+    CHECK(fabs(e2.GetEigenValues()[i] - dense.eigenvalues()[i]) < 1e-8);
+  }
+}
@@ -23,14 +23,35 @@
 // up to -1 times the expected lowest magnitude positive eigenvalue (call this
 // lambda1). In a laplacian system the lambda1 estimate can come from the
 // natural frequency of a rectangular cavity that bounds the model.
+//
+// ARPACK always starts from a random vector. When a sequence of slightly
+// different problems is solved (e.g. in a parameter sweep) the eigenvectors of
+// one problem are good approximations to those of the next, so we also have a
+// block eigensolver (LOBPCG) that can be seeded with them.
+//
+// When many eigenpairs are wanted the ARPACK workspace and reorthogonalization
+// costs grow quickly, and it runs on a single core. Spectrum slicing instead
+// splits the wanted part of the spectrum into intervals. The number of
+// eigenvalues below any shift s is the number of negative entries of D in the
+// LDLT factorization of A-s*B (Sylvester's law of inertia), so the interval
+// boundaries can be chosen to give each interval a similar number of
+// eigenvalues. Each interval is then solved independently with shift-and-
+// invert around its midpoint.
+//
+// All shift-and-invert factorizations use the multifrontal LDLT factorizer,
+// which factors independent parts of the elimination tree on separate cores.
 
 #ifndef __TOOLKIT_EIGENSOLVERS_H__
 #define __TOOLKIT_EIGENSOLVERS_H__
 
 #include <vector>
+#include <algorithm>
+#include <random>
 #include <Eigen/Dense>
 #include "error.h"
+#include "multifrontal.h"
 #include "myvector"
+#include "thread.h"
 
 namespace eigensolvers {
 
@@ -53,18 +74,12 @@ extern "C" void dseupd_(int *rvec, char *All, int *select, double *d, double *z,
                         double *workd, double *workl, int *lworkl, int *ierr,
                         int All_length, int bmat_length, int which_length);
 
-class LaplacianEigenSolver {
+// The results of an eigensolver.
+class EigenSolverBase {
 public:
   typedef SparseMatrix<double> SMatrix;
 
-  // Solve the laplacian eigenproblem. If the 'B' pointer is null then B is
-  // taken to be the identity matrix. If 'A' is positive semidefinite (i.e. has
-  // a zero eigenvalue) then 'sigma' must be some fraction 0<sigma<1 of the
-  // smallest eigenvalue. If 'A' is positive definite then sigma can be zero.
-  // The 'num_eigenpairs' is clamped to A.cols()-1, which is the largest number
-  // of eigenpairs that ARPACK can recover.
-  LaplacianEigenSolver(const SMatrix &A, const SMatrix *B,
-                       int num_eigenpairs, double sigma);
+  virtual ~EigenSolverBase() {}
 
   // Return the status of the eigensearch.
   ComputationInfo Status() const { return status_; }
@@ -79,11 +94,89 @@ public:
   // number of columns might be less than num_eigenpairs.
   const MatrixXd &GetEigenVectors() const { return eigenvectors_; }
 
- private:
+ protected:
   VectorXd eigenvalues_;
   MatrixXd eigenvectors_;
   ComputationInfo status_;
   int num_converged_, num_iterations_;
+
+  // Rayleigh-Ritz procedure for the subspace spanned by the columns of S,
+  // given AS=A*S and BS=B*S. Directions that are numerically dependent are
+  // dropped. Return the Ritz values in increasing order in 'values' and the
+  // corresponding coefficients (Ritz vectors are S*coeffs) in 'coeffs'.
+  static void RayleighRitz(const MatrixXd &S, const MatrixXd &AS,
+                           const MatrixXd &BS, VectorXd *values,
+                           MatrixXd *coeffs);
+
+  // Y = M*X, done in parallel over the columns with 'pool' (or with
+  // ParallelFor() if it is null). If M is null it is taken to be the
+  // identity.
+  static void Multiply(const SMatrix *M, const MatrixXd &X, MatrixXd *Y,
+                       ThreadPool *pool = 0);
+
+  // Return the 1-norm of M. Residual tolerances are relative to this.
+  static double Norm(const SMatrix &M);
+};
+
+class LaplacianEigenSolver : public EigenSolverBase {
+public:
+  // Solve the laplacian eigenproblem. If the 'B' pointer is null then B is
+  // taken to be the identity matrix. If 'A' is positive semidefinite (i.e. has
+  // a zero eigenvalue) then 'sigma' must be some fraction 0<sigma<1 of the
+  // smallest eigenvalue. If 'A' is positive definite then sigma can be zero.
+  // The 'num_eigenpairs' is clamped to A.cols()-1, which is the largest number
+  // of eigenpairs that ARPACK can recover.
+  LaplacianEigenSolver(const SMatrix &A, const SMatrix *B,
+                       int num_eigenpairs, double sigma);
+};
+
+class BlockEigenSolver : public EigenSolverBase {
+public:
+  // Solve the laplacian eigenproblem with LOBPCG (locally optimal block
+  // preconditioned conjugate gradient). A, B, num_eigenpairs and sigma are as
+  // for LaplacianEigenSolver, and the factorization of A-sigma*B is the
+  // preconditioner. The columns of 'initial_vectors' (which can have zero
+  // columns, or A.rows() rows) seed the search, and random vectors are used
+  // for the rest of the block. With good initial vectors only a few iterations
+  // are needed. If 'track' is true then eigenpairs are matched to the initial
+  // vectors they overlap with most, and each matched eigenpair takes the
+  // position (and sign) of its initial vector. Only pairs whose B-normalized
+  // overlap |x'*B*y| is above 0.5 are matched, so an initial vector that does
+  // not resemble any eigenvector (e.g. after a large change to the problem)
+  // does not reorder the modes. The unmatched eigenpairs fill the remaining
+  // positions in order of increasing eigenvalue. If 'track' is false then all
+  // are in order of increasing eigenvalue.
+  BlockEigenSolver(const SMatrix &A, const SMatrix *B, int num_eigenpairs,
+                   double sigma, const MatrixXd &initial_vectors, bool track);
+};
+
+class SlicedEigenSolver : public EigenSolverBase {
+public:
+  // Solve the laplacian eigenproblem by spectrum slicing. A, B, num_eigenpairs
+  // and sigma are as for LaplacianEigenSolver. The spectrum above sigma is
+  // split into about 'num_slices' intervals (or NumberOfCores() if this is
+  // zero) which are solved in parallel. The eigenpairs are returned in order
+  // of increasing eigenvalue. The number of iterations is that of the slowest
+  // interval.
+  SlicedEigenSolver(const SMatrix &A, const SMatrix *B, int num_eigenpairs,
+                    double sigma, int num_slices = 0);
+
+ private:
+  // Return the number of eigenvalues less than 'shift', or -1 if A-shift*B
+  // could not be factored or if the inertia of the factorization can not be
+  // trusted. The factorization is not pivoted, so a pivot that is tiny
+  // compared to the matrix norm may have the wrong sign (and the ones after it
+  // may be inaccurate). The caller should move the shift and try again.
+  static int CountEigenvalues(const SMatrix &A, const SMatrix *B,
+                              double shift);
+
+  // Find the 'count' eigenpairs with eigenvalues in [lo,hi). Return false if
+  // this fails. Slices are solved concurrently, so the random starting block
+  // comes from a generator seeded with 'seed' rather than std::rand().
+  static bool SolveSlice(const SMatrix &A, const SMatrix *B, double lo,
+                         double hi, int count, double Anorm, double Bnorm,
+                         unsigned int seed, VectorXd *values,
+                         MatrixXd *vectors, int *iterations);
 };
 
 inline
@@ -127,7 +220,7 @@ LaplacianEigenSolver::LaplacianEigenSolver(const SMatrix &A, const SMatrix *B,
   }
 
   // Factor A-sigma*B.
-  Eigen::SimplicialLDLT<SMatrix> OP;
+  FEM::MultifrontalLDLT<SMatrix> OP;
   if (B && sigma != 0) {
     OP.compute(A - (sigma / Bscale) * (*B));
   } else {
@@ -250,6 +343,570 @@ LaplacianEigenSolver::LaplacianEigenSolver(const SMatrix &A, const SMatrix *B,
   status_ = Success;
 }
 
+inline void EigenSolverBase::RayleighRitz(const MatrixXd &S,
+                                          const MatrixXd &AS,
+                                          const MatrixXd &BS,
+                                          VectorXd *values,
+                                          MatrixXd *coeffs) {
+  // Orthonormalize the basis with respect to B using the eigendecomposition of
+  // its (diagonally scaled) Gram matrix, which is robust to rank deficiency.
+  MatrixXd GA = S.transpose() * AS;
+  MatrixXd GB = S.transpose() * BS;
+  GA = (GA + GA.transpose()) * 0.5;
+  GB = (GB + GB.transpose()) * 0.5;
+  VectorXd D = GB.diagonal();
+  for (int i = 0; i < D.size(); i++) {
+    D[i] = (D[i] > 0) ? 1.0 / sqrt(D[i]) : 0;
+  }
+  SelfAdjointEigenSolver<MatrixXd> gram(D.asDiagonal() * GB * D.asDiagonal());
+  const VectorXd &theta = gram.eigenvalues();
+  const double kDropTolerance = 1e-12;
+  int first = 0;
+  while (first < theta.size() &&
+         theta[first] <= kDropTolerance * theta[theta.size() - 1]) {
+    first++;
+  }
+  int rank = theta.size() - first;
+  MatrixXd C = D.asDiagonal() * gram.eigenvectors().rightCols(rank) *
+               theta.tail(rank).cwiseSqrt().cwiseInverse().asDiagonal();
+
+  // Solve the projected standard eigenproblem.
+  MatrixXd H = C.transpose() * GA * C;
+  H = (H + H.transpose()) * 0.5;
+  SelfAdjointEigenSolver<MatrixXd> ritz(H);
+  *values = ritz.eigenvalues();
+  *coeffs = C * ritz.eigenvectors();
+}
+
+inline void EigenSolverBase::Multiply(const SMatrix *M, const MatrixXd &X,
+                                      MatrixXd *Y, ThreadPool *pool) {
+  if (!M) {
+    *Y = X;
+    return;
+  }
+  Y->resize(X.rows(), X.cols());
+  auto column = [&](int i) {
+    Y->col(i) = (*M) * X.col(i);
+  };
+  if (pool) {
+    pool->ParallelFor(X.cols(), column);
+  } else {
+    ParallelFor(X.cols(), column);
+  }
+}
+
+inline double EigenSolverBase::Norm(const SMatrix &M) {
+  VectorXd sums = VectorXd::Zero(M.cols());
+  for (int j = 0; j < M.outerSize(); j++) {
+    for (SMatrix::InnerIterator it(M, j); it; ++it) {
+      sums[j] += fabs(it.value());
+    }
+  }
+  return sums.maxCoeff();
+}
+
+inline
+BlockEigenSolver::BlockEigenSolver(const SMatrix &A, const SMatrix *B,
+                                   int num_eigenpairs, double sigma,
+                                   const MatrixXd &initial_vectors,
+                                   bool track) {
+  status_ = Success;
+  num_converged_ = 0;
+  num_iterations_ = 0;
+  const int kMaxIterations = 200;
+  const double kTolerance = 1e-12;
+
+  // Check arguments.
+  CHECK(A.cols() == A.rows());                  // A square
+  if (B) {
+    CHECK(B->cols() == B->rows() && B->rows() == A.rows());     // B square
+  }
+  CHECK(initial_vectors.cols() == 0 || initial_vectors.rows() == A.rows());
+  const int n = A.cols();
+  const int nev = std::min(num_eigenpairs, n - 1);
+  if (nev <= 0) {
+    status_ = InvalidInput;
+    return;
+  }
+  // The block has some extra vectors beyond the wanted ones, which speeds up
+  // convergence of the last wanted eigenpairs.
+  const int block_size = std::min(n, nev + std::max(2, nev / 2));
+
+  // Factor A-sigma*B for the preconditioner.
+  FEM::MultifrontalLDLT<SMatrix> OP;
+  if (sigma != 0) {
+    if (B) {
+      OP.compute(A - sigma * (*B));
+    } else {
+      SMatrix I(A.rows(), A.cols());
+      I.setIdentity();
+      OP.compute(A - sigma * I);
+    }
+  } else {
+    OP.compute(A);
+  }
+  if (OP.info() != Eigen::Success) {
+    status_ = Eigen::NumericalIssue;
+    return;
+  }
+
+  // The residual tolerance is relative to these matrix norm estimates.
+  const double Anorm = Norm(A);
+  const double Bnorm = B ? Norm(*B) : 1.0;
+
+  // The iterations do many short parallel loops, which use one set of
+  // threads.
+  ThreadPool pool;
+
+  // Initial block.
+  MatrixXd X = MatrixXd::Random(n, block_size);
+  int num_initial = std::min<int>(initial_vectors.cols(), block_size);
+  if (num_initial > 0) {
+    X.leftCols(num_initial) = initial_vectors.leftCols(num_initial);
+  }
+  MatrixXd AX, BX, P, AP, BP, coeffs;
+  VectorXd lambda, values;
+  Multiply(&A, X, &AX, &pool);
+  Multiply(B, X, &BX, &pool);
+  RayleighRitz(X, AX, BX, &values, &coeffs);
+  if (values.size() < block_size) {
+    // The initial vectors are dependent, start from random vectors instead.
+    X = MatrixXd::Random(n, block_size);
+    Multiply(&A, X, &AX, &pool);
+    Multiply(B, X, &BX, &pool);
+    RayleighRitz(X, AX, BX, &values, &coeffs);
+    if (values.size() < block_size) {
+      status_ = NumericalIssue;
+      return;
+    }
+  }
+  X = X * coeffs.leftCols(block_size);
+  AX = AX * coeffs.leftCols(block_size);
+  BX = BX * coeffs.leftCols(block_size);
+  lambda = values.head(block_size);
+
+  for (;;) {
+    // Compute residuals and check for convergence of the wanted eigenpairs.
+    MatrixXd R = AX - BX * lambda.asDiagonal();
+    vector<int> active;
+    num_converged_ = 0;
+    for (int i = 0; i < block_size; i++) {
+      double scale = (Anorm + fabs(lambda[i]) * Bnorm) * X.col(i).norm();
+      bool converged = R.col(i).norm() <= kTolerance * scale;
+      if (!converged) {
+        active.push_back(i);
+      } else if (i < nev) {
+        num_converged_++;
+      }
+    }
+    if (num_converged_ == nev) {
+      break;
+    }
+    if (num_iterations_ >= kMaxIterations) {
+      status_ = NoConvergence;
+      return;
+    }
+    num_iterations_++;
+
+    // Preconditioned residuals of the active vectors.
+    const int num_active = active.size();
+    MatrixXd W(n, num_active);
+    pool.ParallelFor(num_active, [&](int i) {
+      W.col(i) = OP.solve(R.col(active[i]));
+    });
+
+    // Rayleigh-Ritz on the span of X, W and the active search directions P.
+    // If the basis is too dependent drop P and try again.
+    const int num_p = (P.cols() > 0) ? num_active : 0;
+    MatrixXd S(n, block_size + num_active + num_p);
+    MatrixXd AS(n, S.cols()), BS(n, S.cols()), AW, BW;
+    Multiply(&A, W, &AW, &pool);
+    Multiply(B, W, &BW, &pool);
+    S << X, W, MatrixXd(n, num_p);
+    AS << AX, AW, MatrixXd(n, num_p);
+    BS << BX, BW, MatrixXd(n, num_p);
+    for (int i = 0; i < num_p; i++) {
+      S.col(block_size + num_active + i) = P.col(active[i]);
+      AS.col(block_size + num_active + i) = AP.col(active[i]);
+      BS.col(block_size + num_active + i) = BP.col(active[i]);
+    }
+    RayleighRitz(S, AS, BS, &values, &coeffs);
+    int num_s = S.cols();
+    if (values.size() < block_size && num_p > 0) {
+      num_s = block_size + num_active;
+      RayleighRitz(S.leftCols(num_s), AS.leftCols(num_s), BS.leftCols(num_s),
+                   &values, &coeffs);
+    }
+    if (values.size() < block_size) {
+      status_ = NumericalIssue;
+      return;
+    }
+
+    // The new search directions are the W,P components of the new Ritz
+    // vectors.
+    MatrixXd Y = coeffs.leftCols(block_size);
+    const int num_rest = num_s - block_size;
+    P = S.middleCols(block_size, num_rest) * Y.bottomRows(num_rest);
+    AP = AS.middleCols(block_size, num_rest) * Y.bottomRows(num_rest);
+    BP = BS.middleCols(block_size, num_rest) * Y.bottomRows(num_rest);
+    X = S.leftCols(num_s) * Y;
+    AX = AS.leftCols(num_s) * Y;
+    BX = BS.leftCols(num_s) * Y;
+    lambda = values.head(block_size);
+
+    // Periodically recompute AX and BX so that rounding errors do not
+    // accumulate in the residuals.
+    if (num_iterations_ % 10 == 0) {
+      Multiply(&A, X, &AX, &pool);
+      Multiply(B, X, &BX, &pool);
+    }
+  }
+
+  // Order the results.
+  const double kMinTrackingOverlap = 0.5;
+  vector<int> order(nev, -1);
+  vector<bool> used(nev);
+  if (track && num_initial > 0) {
+    // Pair initial vectors and eigenvectors in order of decreasing overlap,
+    // ignoring pairs that overlap too little to be the same mode.
+    const int num_tracked = std::min(num_initial, nev);
+    MatrixXd initial = initial_vectors.leftCols(num_tracked), Binitial;
+    Multiply(B, initial, &Binitial);
+    MatrixXd overlap = initial.transpose() * BX.leftCols(nev);
+    for (int i = 0; i < num_tracked; i++) {
+      double norm = sqrt(std::max(0.0, initial.col(i).dot(Binitial.col(i))));
+      overlap.row(i) /= (norm > 0) ? norm : 1.0;
+    }
+    for (int j = 0; j < nev; j++) {
+      double norm = sqrt(std::max(0.0, X.col(j).dot(BX.col(j))));
+      overlap.col(j) /= (norm > 0) ? norm : 1.0;
+    }
+    for (int k = 0; k < num_tracked; k++) {
+      int bi = -1, bj = -1;
+      double best = kMinTrackingOverlap;
+      for (int i = 0; i < num_tracked; i++) {
+        for (int j = 0; j < nev; j++) {
+          if (order[i] < 0 && !used[j] && fabs(overlap(i, j)) > best) {
+            best = fabs(overlap(i, j));
+            bi = i;
+            bj = j;
+          }
+        }
+      }
+      if (bi < 0) {
+        break;
+      }
+      order[bi] = bj;
+      used[bj] = true;
+      if (overlap(bi, bj) < 0) {
+        X.col(bj) = -X.col(bj);
+      }
+    }
+  }
+  // The unmatched eigenpairs fill the remaining positions in order of
+  // increasing eigenvalue.
+  for (int i = 0, j = 0; i < nev; i++) {
+    if (order[i] < 0) {
+      while (used[j]) {
+        j++;
+      }
+      order[i] = j;
+      used[j] = true;
+    }
+  }
+  eigenvalues_.resize(nev);
+  eigenvectors_.resize(n, nev);
+  for (int i = 0; i < nev; i++) {
+    eigenvalues_[i] = lambda[order[i]];
+    eigenvectors_.col(i) = X.col(order[i]);
+  }
+  status_ = Success;
+}
+
+inline int SlicedEigenSolver::CountEigenvalues(const SMatrix &A,
+                                               const SMatrix *B,
+                                               double shift) {
+  // Pivots smaller than this (relative to the norm of A-shift*B) are rejected.
+  const double kMinPivot = 1e-8;
+  SMatrix S;
+  if (B) {
+    S = A - shift * (*B);
+  } else {
+    SMatrix I(A.rows(), A.cols());
+    I.setIdentity();
+    S = A - shift * I;
+  }
+  FEM::MultifrontalLDLT<SMatrix> OP;
+  OP.compute(S);
+  if (OP.info() != Eigen::Success) {
+    return -1;
+  }
+  // By Sylvester's law of inertia A-shift*B has the same number of negative
+  // eigenvalues as D, and since B is positive definite that is the number of
+  // generalized eigenvalues less than shift.
+  const double min_pivot = kMinPivot * Norm(S);
+  const VectorXd &D = OP.vectorD();
+  int count = 0;
+  for (int i = 0; i < D.size(); i++) {
+    if (fabs(D[i]) <= min_pivot) {
+      return -1;
+    }
+    count += (D[i] < 0);
+  }
+  return count;
+}
+
+inline bool SlicedEigenSolver::SolveSlice(const SMatrix &A, const SMatrix *B,
+                                          double lo, double hi, int count,
+                                          double Anorm, double Bnorm,
+                                          unsigned int seed, VectorXd *values,
+                                          MatrixXd *vectors, int *iterations) {
+  const int kMaxIterations = 500;
+  const double kTolerance = 1e-12;
+  const int n = A.cols();
+  *iterations = 0;
+
+  // Factor A-shift*B with the shift in the middle of the interval. The
+  // wanted eigenvalues are the ones closest to the shift.
+  const double shift = 0.5 * (lo + hi);
+  FEM::MultifrontalLDLT<SMatrix> OP;
+  if (B) {
+    OP.compute(A - shift * (*B));
+  } else {
+    SMatrix I(A.rows(), A.cols());
+    I.setIdentity();
+    OP.compute(A - shift * I);
+  }
+  if (OP.info() != Eigen::Success) {
+    return false;
+  }
+
+  // Block shift-and-invert subspace iteration. Each step does Rayleigh-Ritz
+  // on the span of X and inv(A-shift*B)*B*X, then keeps the Ritz pairs
+  // closest to the shift. The block has some extra vectors to speed up
+  // convergence of the eigenpairs near the ends of the interval.
+  const int block_size = std::min(n, count + std::max(2, count / 2));
+  MatrixXd X(n, block_size), AX, BX, W(n, block_size);
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<double> uniform(-1, 1);
+  for (int j = 0; j < block_size; j++) {
+    for (int i = 0; i < n; i++) {
+      X(i, j) = uniform(rng);
+    }
+  }
+  ThreadPool pool;              // Serial if the slices are done in parallel
+  Multiply(B, X, &BX, &pool);
+  for (;;) {
+    if (*iterations >= kMaxIterations) {
+      return false;
+    }
+    (*iterations)++;
+    pool.ParallelFor(block_size, [&](int i) {
+      W.col(i) = OP.solve(BX.col(i));
+    });
+    MatrixXd S(n, 2 * block_size), AS, BS, coeffs;
+    S << X, W;
+    Multiply(&A, S, &AS, &pool);
+    Multiply(B, S, &BS, &pool);
+    VectorXd theta;
+    RayleighRitz(S, AS, BS, &theta, &coeffs);
+    if (theta.size() < block_size) {
+      return false;
+    }
+    vector<int> order(theta.size());
+    for (int i = 0; i < order.size(); i++) {
+      order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int i, int j) {
+      return fabs(theta[i] - shift) < fabs(theta[j] - shift);
+    });
+    order.resize(block_size);
+    std::sort(order.begin(), order.end());
+    MatrixXd C(coeffs.rows(), block_size);
+    VectorXd lambda(block_size);
+    for (int i = 0; i < block_size; i++) {
+      C.col(i) = coeffs.col(order[i]);
+      lambda[i] = theta[order[i]];
+    }
+    X = S * C;
+    AX = AS * C;
+    BX = BS * C;
+
+    // We are done when exactly 'count' Ritz values are in the interval and
+    // all of them have converged.
+    vector<int> found;
+    bool converged = true;
+    for (int i = 0; i < block_size; i++) {
+      if (lambda[i] >= lo && lambda[i] < hi) {
+        found.push_back(i);
+        double scale = (Anorm + fabs(lambda[i]) * Bnorm) * X.col(i).norm();
+        VectorXd r = AX.col(i) - lambda[i] * BX.col(i);
+        if (r.norm() > kTolerance * scale) {
+          converged = false;
+        }
+      }
+    }
+    if (converged && found.size() == count) {
+      values->resize(count);
+      vectors->resize(n, count);
+      for (int i = 0; i < count; i++) {
+        (*values)[i] = lambda[found[i]];
+        vectors->col(i) = X.col(found[i]);
+      }
+      return true;
+    }
+  }
+}
+
+inline
+SlicedEigenSolver::SlicedEigenSolver(const SMatrix &A, const SMatrix *B,
+                                     int num_eigenpairs, double sigma,
+                                     int num_slices) {
+  const int kMaxBoundIterations = 50;
+  const int kMaxRefinements = 5;
+  status_ = Success;
+  num_converged_ = 0;
+  num_iterations_ = 0;
+
+  // Check arguments.
+  CHECK(A.cols() == A.rows());                  // A square
+  if (B) {
+    CHECK(B->cols() == B->rows() && B->rows() == A.rows());     // B square
+  }
+  const int n = A.cols();
+  const int nev = std::min(num_eigenpairs, n - 1);
+  if (nev <= 0) {
+    status_ = InvalidInput;
+    return;
+  }
+  if (num_slices <= 0) {
+    num_slices = NumberOfCores();
+  }
+  const double Anorm = Norm(A);
+  const double Bnorm = B ? Norm(*B) : 1.0;
+
+  // Count eigenvalues below a shift, nudging the shift if it happens to make
+  // A-shift*B singular or nearly so. Each nudge is larger than the last, in
+  // case the shift is very close to an eigenvalue.
+  auto count_below = [&](double *shift, double nudge) {
+    for (int i = 0; i < 6; i++) {
+      int count = CountEigenvalues(A, B, *shift);
+      if (count >= 0) {
+        return count;
+      }
+      *shift += nudge;
+      nudge *= 10;
+    }
+    return -1;
+  };
+
+  // There should be no eigenvalues below sigma.
+  if (CountEigenvalues(A, B, sigma) != 0) {
+    status_ = NumericalIssue;
+    return;
+  }
+
+  // Find an upper bound 'hi' with between nev and 2*nev eigenvalues below it.
+  // The initial guess assumes the eigenvalues are evenly spread up to about
+  // Anorm/Bnorm, which is true for 2D laplacians.
+  double hi = sigma + Anorm / Bnorm * nev / n;
+  int hi_count = 0;
+  for (int i = 0; ; i++) {
+    if (i >= kMaxBoundIterations) {
+      status_ = NoConvergence;
+      return;
+    }
+    hi_count = count_below(&hi, (hi - sigma) * 1e-6);
+    double scale;
+    if (hi_count < 0) {
+      status_ = NumericalIssue;
+      return;
+    } else if (hi_count == 0) {
+      scale = 4;
+    } else if (hi_count < nev) {
+      scale = std::min(4.0, 1.2 * nev / hi_count);
+    } else if (hi_count > 2 * nev && i < kMaxBoundIterations / 2) {
+      scale = 1.5 * nev / hi_count;
+    } else {
+      break;
+    }
+    hi = sigma + (hi - sigma) * scale;
+  }
+
+  // Split [sigma,hi) into intervals that each contain about 'target'
+  // eigenvalues. Intervals with too many eigenvalues are split assuming the
+  // eigenvalues are evenly spread within them, and the new boundaries are
+  // counted in parallel.
+  const int target = std::max(1, (nev + num_slices - 1) / num_slices);
+  vector<double> bound;         // Interval boundaries
+  vector<int> count;            // Number of eigenvalues below each boundary
+  bound.push_back(sigma);
+  count.push_back(0);
+  bound.push_back(hi);
+  count.push_back(hi_count);
+  for (int refinement = 0; refinement < kMaxRefinements; refinement++) {
+    vector<double> new_bound;
+    for (int i = 0; i + 1 < bound.size() && count[i] < nev; i++) {
+      int pieces = (count[i + 1] - count[i] + target - 1) / target;
+      for (int j = 1; j < pieces; j++) {
+        new_bound.push_back(bound[i] + (bound[i + 1] - bound[i]) * j / pieces);
+      }
+    }
+    if (new_bound.empty()) {
+      break;
+    }
+    vector<int> new_count(new_bound.size());
+    ParallelFor(new_bound.size(), [&](int i) {
+      new_count[i] = count_below(&new_bound[i], (hi - sigma) * 1e-9);
+    });
+    for (int i = 0; i < new_bound.size(); i++) {
+      if (new_count[i] < 0) {
+        status_ = NumericalIssue;
+        return;
+      }
+      int j = std::upper_bound(bound.begin(), bound.end(), new_bound[i]) -
+              bound.begin();
+      bound.insert(bound.begin() + j, new_bound[i]);
+      count.insert(count.begin() + j, new_count[i]);
+    }
+  }
+
+  // Solve the intervals that contain the wanted eigenvalues in parallel. Each
+  // eigenvalue belongs to exactly one interval so there are no duplicates to
+  // remove when merging.
+  vector<int> slice;
+  for (int i = 0; i + 1 < bound.size() && count[i] < nev; i++) {
+    if (count[i + 1] > count[i]) {
+      slice.push_back(i);
+    }
+  }
+  vector<VectorXd> values(slice.size());
+  vector<MatrixXd> vectors(slice.size());
+  vector<int> iterations(slice.size());
+  vector<char> ok(slice.size());
+  ParallelFor(slice.size(), [&](int k) {
+    int i = slice[k];
+    ok[k] = SolveSlice(A, B, bound[i], bound[i + 1], count[i + 1] - count[i],
+                       Anorm, Bnorm, i + 1, &values[k], &vectors[k],
+                       &iterations[k]);
+  });
+  eigenvalues_.resize(nev);
+  eigenvectors_.resize(n, nev);
+  for (int k = 0; k < slice.size(); k++) {
+    num_iterations_ = std::max(num_iterations_, iterations[k]);
+    if (!ok[k]) {
+      status_ = NoConvergence;
+      return;
+    }
+    int m = std::min<int>(values[k].size(), nev - num_converged_);
+    eigenvalues_.segment(num_converged_, m) = values[k].head(m);
+    eigenvectors_.middleCols(num_converged_, m) = vectors[k].leftCols(m);
+    num_converged_ += m;
+  }
+  CHECK(num_converged_ == nev);
+  status_ = Success;
+}
+
 }  // namespace eigensolvers
 
 #endif
@@ -4,6 +4,7 @@
 #include "femsolver.h"
 #include <stdio.h>
 #include "testing.h"
+#include "sparse_solver.h"
 
 namespace FEM {
 
@@ -211,6 +212,56 @@ TEST_FUNCTION(RobinBoundary) {
   }
 }
 
+// ExampleFEMProblem with its x and y coordinates divided by 'ax' and 'ay'. If
+// 'anisotropic' is true then the coordinates are not scaled, instead there is
+// an anisotropy that makes the problem equivalent to the scaled one: with
+// x=ax*x' and y=ay*y' the terms of the weak form for -laplacian'(u) - g*u = f
+// are all multiplied by ax*ay when lx=ax^2, ly=ay^2 and s=1.
+struct StretchedFEMProblem : public ExampleFEMProblem {
+  double ax, ay, s;
+  bool anisotropic;
+  StretchedFEMProblem() : ax(3), ay(0.7), s(1), anisotropic(false) {}
+  Point PointXY(int i) const {
+    Point p = ExampleFEMProblem::PointXY(i);
+    if (!anisotropic) {
+      p[0] = p[0] / ax;
+      p[1] = p[1] / ay;
+    }
+    return p;
+  }
+  bool Anisotropy(int i, Number *lx, Number *ly, Number *scale) const {
+    if (!anisotropic) {
+      return false;
+    }
+    *lx = Number(ax * ax);
+    *ly = Number(ay * ay);
+    *scale = Number(s);
+    return true;
+  }
+};
+
+TEST_FUNCTION(Anisotropy) {
+  // There are no Robin terms as these do not scale like the other terms. The
+  // anisotropic problem's 's' multiplies g and f, so the isotropic problem's
+  // g and f are multiplied explicitly.
+  FEMSolver<StretchedFEMProblem> solver1, solver2;
+  solver2.anisotropic = true;
+  solver2.s = 1.5;
+  for (int i = 0; i < solver1.NumTriangles() * 3; i++) {
+    solver1.test_a[i] = solver2.test_a[i] = 0;
+    solver1.test_b[i] = solver2.test_b[i] = 0;
+    solver2.test_f[i] = solver1.test_f[i];
+    solver2.test_g[i] = solver1.test_g[i] * 0.1;
+    solver1.test_f[i] *= solver2.s;
+    solver1.test_g[i] = solver2.test_g[i] * solver2.s;
+  }
+  CHECK(solver1.SolveSystem());
+  CHECK(solver2.SolveSystem());
+  double error = (solver1.solution - solver2.solution).norm();
+  printf("Anisotropic solution error = %g\n", error);
+  CHECK(error < 1e-9 * solver1.solution.norm());
+}
+
 TEST_FUNCTION(ComputeSolutionDerivative) {
   FEMSolver<ExampleFEMProblem> solver;
   CHECK(solver.SolveSystem());
@@ -247,7 +298,8 @@ TEST_FUNCTION(ComputeSolutionDerivative) {
   for (int i = 0; i < soln.size(); i++) {
     soln[i] = solver.solution[solver.reverse_index_map[i]];
   }
-  Eigen::VectorXd target = solver.factorizer->solve(-dAdp * soln + dbdp);
+  Eigen::VectorXd target =
+      solver.factorization->factorizer.solve(-dAdp * soln + dbdp);
   solver.PadSolution(&target);
 
   // Compare.
@@ -259,6 +311,220 @@ TEST_FUNCTION(ComputeSolutionDerivative) {
   }
 }
 
+TEST_FUNCTION(ReuseFactorization) {
+  // Change g in one triangle and check that the solution computed by updating
+  // the previous factorization is the same as the one from refactoring.
+  FEMSolver<ExampleFEMProblem> solver1;
+  CHECK(solver1.SolveSystem());
+  CHECK(!solver1.factorization_updated);
+  FEMSolver<ExampleFEMProblem> solver2, solver3, solver4;
+  FEMSolver<ExampleFEMProblem> *solvers[3] = {&solver2, &solver3, &solver4};
+  for (int k = 0; k < 3; k++) {
+    solvers[k]->test_f = solver1.test_f;
+    solvers[k]->test_g = solver1.test_g;
+    solvers[k]->test_a = solver1.test_a;
+    solvers[k]->test_b = solver1.test_b;
+  }
+  for (int j = 0; j < 3; j++) {
+    solver2.test_g[12*3 + j] += 1;
+    solver3.test_g[12*3 + j] += 1;
+  }
+  solver2.ReuseFactorization(&solver1);
+  CHECK(solver2.SolveSystem());
+  CHECK(solver3.SolveSystem());
+  CHECK(solver2.factorization_updated);
+  CHECK(solver2.factorization == solver1.factorization);
+  CHECK(solver2.factorization_update.Rank() > 0);
+  CHECK(!solver3.factorization_updated);
+  double error = (solver2.solution - solver3.solution).norm();
+  printf("Update rank = %d, error = %g\n",
+         solver2.factorization_update.Rank(), error);
+  CHECK(error < 1e-9 * solver3.solution.norm());
+
+  // Changing g everywhere is too large an update, so the system is factored.
+  for (int i = 0; i < solver4.NumTriangles() * 3; i++) {
+    solver4.test_g[i] += 1;
+  }
+  solver4.ReuseFactorization(&solver1);
+  CHECK(solver4.SolveSystem());
+  CHECK(!solver4.factorization_updated);
+  CHECK(solver4.factorization != solver1.factorization);
+}
+
+// ExampleFEMProblem solved with a RuntimeFactorizer, whose backend is chosen
+// by 'solver'.
+struct RuntimeFEMProblem : public ExampleFEMProblem {
+  typedef RuntimeFactorizer<MNumber> Factorizer;
+  struct FactorizerConfig {
+    std::string solver;
+    bool operator==(const FactorizerConfig &c) const {
+      return solver == c.solver;
+    }
+  };
+  std::string solver;
+  RuntimeFEMProblem() : solver("lu") {}
+  FactorizerConfig GetFactorizerConfig() const {
+    FactorizerConfig c;
+    c.solver = solver;
+    return c;
+  }
+  void ConfigureFactorizer(Factorizer *f) { f->SetSolver(solver); }
+  bool ProblemIsLowerTriangular() const { return false; }
+};
+
+TEST_FUNCTION(ReuseFactorizationConfig) {
+  // Change g in one triangle and the solver backend. The previous
+  // factorization must not be updated, the system must be factored again
+  // with the new backend. With the same backend the update is still used.
+  FEMSolver<RuntimeFEMProblem> solver1, solver2, solver3;
+  solver1.solver = "ldlt";
+  CHECK(solver1.SolveSystem());
+  CHECK(solver1.factorization->factorizer.BackendName() == "ldlt");
+  FEMSolver<RuntimeFEMProblem> *solvers[2] = {&solver2, &solver3};
+  for (int k = 0; k < 2; k++) {
+    solvers[k]->test_f = solver1.test_f;
+    solvers[k]->test_g = solver1.test_g;
+    solvers[k]->test_a = solver1.test_a;
+    solvers[k]->test_b = solver1.test_b;
+    for (int j = 0; j < 3; j++) {
+      solvers[k]->test_g[12*3 + j] += 1;
+    }
+    solvers[k]->ReuseFactorization(&solver1);
+  }
+  solver2.solver = "lu";
+  solver3.solver = "ldlt";
+  CHECK(solver2.SolveSystem());
+  CHECK(solver3.SolveSystem());
+  CHECK(!solver2.factorization_updated);
+  CHECK(solver2.factorization != solver1.factorization);
+  CHECK(solver2.factorization->factorizer.BackendName() == "lu");
+  CHECK(solver3.factorization_updated);
+  CHECK(solver3.factorization == solver1.factorization);
+  double error = (solver2.solution - solver3.solution).norm();
+  printf("Backend change error = %g\n", error);
+  CHECK(error < 1e-9 * solver2.solution.norm());
+}
+
+TEST_FUNCTION(UseReducedModel) {
+  // Sweep a shift of g, each step using the reduced basis of the previous
+  // step, and check against solving each step directly.
+  FEMSolver<ExampleFEMProblem> first;
+  FEMSolver<ExampleFEMProblem> *previous = 0;
+  const int num_steps = 50;
+  int reduced_solves = 0;
+  for (int step = 0; step < num_steps; step++) {
+    FEMSolver<ExampleFEMProblem> *solver = new FEMSolver<ExampleFEMProblem>;
+    FEMSolver<ExampleFEMProblem> direct;
+    for (int i = 0; i < first.NumTriangles() * 3; i++) {
+      solver->test_f[i] = direct.test_f[i] = first.test_f[i];
+      solver->test_g[i] = direct.test_g[i] = first.test_g[i] + step * 0.02;
+      solver->test_a[i] = direct.test_a[i] = first.test_a[i];
+      solver->test_b[i] = direct.test_b[i] = first.test_b[i];
+    }
+    solver->UseReducedModel(previous);
+    CHECK(solver->SolveSystem());
+    CHECK(direct.SolveSystem());
+    CHECK(!direct.reduced_solution);
+    reduced_solves += solver->reduced_solution;
+    double error = (solver->solution - direct.solution).norm();
+    CHECK(error < 1e-4 * direct.solution.norm());
+    delete previous;
+    previous = solver;
+  }
+  printf("Reduced solves = %d of %d, basis size = %d\n", reduced_solves,
+         num_steps, previous->reduced_basis->Size());
+  CHECK(reduced_solves > num_steps / 2);
+  CHECK(reduced_solves + previous->reduced_basis->Size() == num_steps);
+
+  // The derivative of a reduced solution with respect to a parameter that
+  // nothing depends on is zero, and needs no factorization.
+  CHECK(previous->reduced_solution);
+  ExampleFEMProblem::MNumberVector derivative, direct_derivative;
+  CHECK(previous->ComputeSolutionDerivative(&derivative));
+  CHECK(derivative.size() == 25 && derivative.norm() == 0);
+  CHECK(previous->reduced_solution);
+
+  // Other derivatives are not in the span of the basis, so the system is
+  // factored to compute them.
+  FEMSolver<ExampleFEMProblem> direct;
+  direct.test_f = previous->test_f;
+  direct.test_g = previous->test_g;
+  direct.test_a = previous->test_a;
+  direct.test_b = previous->test_b;
+  direct.CreateSystem();
+  previous->rhs[0].derivative = direct.rhs[0].derivative = 1;
+  CHECK(previous->ComputeSolutionDerivative(&derivative));
+  CHECK(direct.ComputeSolutionDerivative(&direct_derivative));
+  CHECK(!previous->reduced_solution);
+  CHECK(previous->factorization);
+  double error = (derivative - direct_derivative).norm();
+  printf("Derivative error = %g\n", error);
+  CHECK(error < 1e-4 * direct_derivative.norm());
+  delete previous;
+}
+
+TEST_FUNCTION(SetPredictedSolution) {
+  // Solutions for a shift of g everywhere, and the derivative of the solution
+  // with respect to the shift by central differences.
+  const double h = 1e-4, step = 1e-3;
+  FEMSolver<ExampleFEMProblem> base, plus, minus, direct;
+  FEMSolver<ExampleFEMProblem> *solvers[3] = {&plus, &minus, &direct};
+  const double shift[3] = {h, -h, step};
+  for (int k = 0; k < 3; k++) {
+    solvers[k]->test_f = base.test_f;
+    solvers[k]->test_a = base.test_a;
+    solvers[k]->test_b = base.test_b;
+    solvers[k]->test_g = base.test_g;
+    for (int i = 0; i < base.NumTriangles() * 3; i++) {
+      solvers[k]->test_g[i] += shift[k];
+    }
+  }
+  for (int k = 0; k < 3; k++) {
+    CHECK(solvers[k]->SolveSystem());
+  }
+  CHECK(base.SolveSystem());
+  ExampleFEMProblem::MNumberVector derivative =
+      (plus.solution - minus.solution) / (2 * h);
+  ExampleFEMProblem::MNumberVector predicted =
+      base.solution + step * derivative;
+
+  // An accurate enough prediction is used without factoring the system.
+  FEMSolver<ExampleFEMProblem> solver1;
+  solver1.test_f = direct.test_f;
+  solver1.test_g = direct.test_g;
+  solver1.test_a = direct.test_a;
+  solver1.test_b = direct.test_b;
+  solver1.SetPredictedSolution(predicted, 1e-4);
+  CHECK(solver1.SolveSystem());
+  CHECK(solver1.predicted_solution && !solver1.factorization);
+  double error = (solver1.solution - direct.solution).norm();
+  printf("Prediction residual = %g, error = %g\n",
+         solver1.prediction_residual, error);
+  CHECK(solver1.prediction_residual > 0);
+  CHECK(error < 1e-4 * direct.solution.norm());
+  CHECK(error > 0);
+
+  // Its derivatives need a factorization.
+  ExampleFEMProblem::MNumberVector solution_derivative;
+  CHECK(solver1.ComputeSolutionDerivative(&solution_derivative));
+  CHECK(solution_derivative.norm() == 0 && solver1.predicted_solution);
+  solver1.rhs[0].derivative = 1;
+  CHECK(solver1.ComputeSolutionDerivative(&solution_derivative));
+  CHECK(!solver1.predicted_solution && solver1.factorization);
+
+  // A prediction that is not accurate enough is not used.
+  FEMSolver<ExampleFEMProblem> solver2;
+  solver2.test_f = direct.test_f;
+  solver2.test_g = direct.test_g;
+  solver2.test_a = direct.test_a;
+  solver2.test_b = direct.test_b;
+  solver2.SetPredictedSolution(predicted, solver1.prediction_residual / 2);
+  CHECK(solver2.SolveSystem());
+  CHECK(!solver2.predicted_solution && solver2.factorization);
+  CHECK((solver2.solution - direct.solution).norm() <
+        1e-9 * direct.solution.norm());
+}
+
 TEST_FUNCTION(EigenSystem) {
   FEMSolver<ExampleFEMProblem> solver;
   for (int i = 0; i < solver.NumTriangles() * 3; i++) {
@@ -287,4 +553,53 @@ TEST_FUNCTION(EigenSystem) {
   }
 }
 
+TEST_FUNCTION(EigenvalueDerivative) {
+  FEMSolver<ExampleFEMProblem> solver;
+  for (int i = 0; i < solver.NumTriangles() * 3; i++) {
+    solver.test_g[i] = -1;
+    solver.test_a[i] = 0;
+  }
+  CHECK(solver.EigenSystem(5, 0));
+
+  // Set random derivatives in triplets and Gtriplets, and build the full
+  // matrices and their derivatives.
+  const int m = solver.SystemSize();
+  Eigen::MatrixXd A(m, m), B(m, m), dA(m, m), dB(m, m);
+  A.setZero();
+  B.setZero();
+  dA.setZero();
+  dB.setZero();
+  for (int k = 0; k < 2; k++) {
+    vector<ExampleFEMProblem::Triplet> &trips =
+        k ? solver.Gtriplets : solver.triplets;
+    Eigen::MatrixXd &M = k ? B : A;
+    Eigen::MatrixXd &dM = k ? dB : dA;
+    for (int i = 0; i < trips.size(); i++) {
+      ExampleFEMProblem::Number value = trips[i].value();
+      value.derivative = RandDouble() * 2 - 1;
+      int row = trips[i].row(), col = trips[i].col();
+      M(row, col) += value.value;
+      dM(row, col) += value.derivative;
+      if (row != col) {
+        M(col, row) += value.value;
+        dM(col, row) += value.derivative;
+      }
+      trips[i] = ExampleFEMProblem::Triplet(row, col, value);
+    }
+  }
+
+  // Compare against central differences of the dense eigenvalues.
+  const double h = 1e-6;
+  Eigen::MatrixXd Ap = A + h * dA, Bp = B + h * dB;
+  Eigen::MatrixXd Am = A - h * dA, Bm = B - h * dB;
+  Eigen::GeneralizedSelfAdjointEigenSolver<Eigen::MatrixXd> ep(Ap, Bp);
+  Eigen::GeneralizedSelfAdjointEigenSolver<Eigen::MatrixXd> em(Am, Bm);
+  for (int i = 0; i < 5; i++) {
+    double numerical = (ep.eigenvalues()[i] - em.eigenvalues()[i]) / (2 * h);
+    double analytic = solver.GetEigenvalueDerivative(i);
+    printf("dlambda%d = %f (numerical %f)\n", i, analytic, numerical);
+    CHECK(fabs(analytic - numerical) < 1e-5 * std::max(1.0, fabs(numerical)));
+  }
+}
+
 }  // namespace FEM
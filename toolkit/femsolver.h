@@ -11,11 +11,18 @@
 #ifndef __TOOLKIT_FEMSOLVER_H__
 #define __TOOLKIT_FEMSOLVER_H__
 
+#include <chrono>
+#include <memory>
 #include "myvector"
 #include "Eigen/Dense"
 #include "Eigen/Sparse"
 #include "error.h"
 #include "eigensolvers.h"
+#include "low_rank_update.h"
+#include "multifrontal.h"
+#include "nested_dissection.h"
+#include "reduced_model.h"
+#include "time_domain.h"
 
 namespace FEM {
 
@@ -89,6 +96,40 @@ struct FEMProblem {
     DIRICHLET,          // Dirichlet boundary, u = 0
     ROBIN,              // Robin boundary, du/dnormal + alpha*u = beta,
   };                    //   the normal is outward-pointing
+
+  // Called with each new Factorizer before it is used, to allow problems to
+  // set factorizer options (e.g. MixedPrecisionFactorizer::SetMixedPrecision).
+  template<class Factorizer> void ConfigureFactorizer(Factorizer *f) {}
+
+  // The options that ConfigureFactorizer() sets, which are stored with each
+  // factorization. A factorization shared by ReuseFactorization() is only
+  // used if it was configured with equal options, so that e.g. changing the
+  // solver backend between two solves is not ignored. Problems whose
+  // ConfigureFactorizer() sets options should override both of these.
+  struct FactorizerConfig {
+    bool operator==(const FactorizerConfig &c) const { return true; }
+  };
+  FactorizerConfig GetFactorizerConfig() const { return FactorizerConfig(); }
+
+  // Solve with the factorizer 'f' given an approximate solution 'guess' (a
+  // prediction that was not accurate enough to use, see
+  // SetPredictedSolution()). Problems whose Factorizer has solveWithGuess()
+  // (e.g. RuntimeFactorizer) can override this to start from the guess.
+  template<class Factorizer, class Vector>
+  Vector SolveWithGuess(Factorizer *f, const Vector &b, const Vector &guess) {
+    return f->solve(b);
+  }
+
+  // By default the PDE is the isotropic -laplacian(u) - g*u = f. A problem can
+  // make triangle i anisotropic by returning true here and setting lx, ly and
+  // s so that the PDE in that triangle is
+  //   -d/dx(lx * du/dx) - d/dy(ly * du/dy) - s*g*u = s*f
+  // The coefficients are constant over the triangle and can be complex, e.g.
+  // for the complex coordinate stretching of a perfectly matched layer.
+  template<class Number>
+  bool Anisotropy(int i, Number *lx, Number *ly, Number *s) const {
+    return false;
+  }
 };
 
 struct ExampleFEMProblem : public FEMProblem {
@@ -106,17 +147,21 @@ struct ExampleFEMProblem : public FEMProblem {
   // The sparse matrix factorizer that will be used. When solving the Helmholtz
   // equation and MNumber is complex the SparseLU should be used as the system
   // matrix is symmetric but not hermitian. When MNumber is real then the
-  // problem is positive definite and SimplicialLLT or SimplicialLDLT can be
-  // used. COLAMDOrdering is the only ordering that makes sense for SparseLU,
-  // the AMD and METIS-based orderings are only effective for symmetric
-  // factorizations and will slow down SparseLU. For efficiency of the
+  // problem is positive definite and SimplicialLLT, SimplicialLDLT or
+  // MultifrontalLDLT can be used. MultifrontalLDLT is the fastest for large
+  // problems as it uses dense kernels and multiple cores. The orderings in
+  // nested_dissection.h use the mesh geometry and work for all of these. Note
+  // that Eigen's AMDOrdering gives the inverse of the permutation that SparseLU
+  // expects so it will slow down SparseLU, use COLAMDOrdering or
+  // NestedDissectionColumnOrdering instead. For efficiency of the
   // factorizer and Eigen-compatibility reasons, MNumber should be a regular
   // real or complex type.
-  typedef Eigen::SimplicialLLT<Eigen::SparseMatrix<MNumber>, Eigen::Lower,
-                               Eigen::AMDOrdering<int> > Factorizer;
+  typedef MultifrontalLDLT<Eigen::SparseMatrix<MNumber>,
+                           NestedDissectionOrdering<int> > Factorizer;
   // Or this:
   //     typedef Eigen::SparseLU<Eigen::SparseMatrix<MNumber>,
-  //                             Eigen::COLAMDOrdering<int> > Factorizer;
+  //                             NestedDissectionColumnOrdering<int> >
+  //             Factorizer;
 
   // Return true if the Factorizer only requires the lower triangle of the
   // sparse matrix to be set (e.g. if Factorizer is SimplicialLDLT), or false
@@ -263,30 +308,60 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
   typedef typename T::Point Point;
   typedef typename T::Triplet Triplet;
   typedef typename T::Factorizer Factorizer;
+  typedef typename T::FactorizerConfig FactorizerConfig;
   typedef typename T::DoTrace DoTrace;
 
-  typedef eigensolvers::LaplacianEigenSolver EigenSolver;
+  typedef eigensolvers::EigenSolverBase EigenSolver;
 
   // Various outputs of the functions below. The index_map_ is a representation
   // of the mesh with all Dirichlet points removed. The index_map_ maps point
   // indexes into offsets into a smaller system matrix that does not represent
   // those points. Dirichlet points have value -1. The size of the system
   // matrix and the right hand side is the size of reverse_index_map_. The
-  // factorizer is kept around so that some clients can update derivative
-  // information.
+  // factorization is kept around so that some clients can update derivative
+  // information. It may be shared with other solvers (see
+  // ReuseFactorization()), in which case it may be the factorization of a
+  // slightly different system matrix that SolveSystem() has updated. If the
+  // solution was computed from a reduced basis (see UseReducedModel()) or is
+  // a prediction (see SetPredictedSolution()) then there is no factorization
+  // of this system until one is needed.
+  struct Factorization {
+    Factorizer factorizer;
+    FactorizerConfig config;            // Options given to the factorizer
+    Eigen::SparseMatrix<MNumber> A;     // The matrix that was factored
+    double seconds;                     // Time taken to analyze and factor A
+  };
   vector<int> index_map, reverse_index_map;     // Created by CreateIndexMaps()
   vector<Triplet> triplets, Gtriplets;          // Created by CreateSystem()
   NumberVector rhs;                             // Created by CreateSystem()
-  Factorizer *factorizer;                       // Created by SolveSystem()
+  std::shared_ptr<Factorization> factorization; // Created by SolveSystem()
+  bool factorization_updated;                   // Set by SolveSystem()
+  LowRankUpdate<Factorizer> factorization_update;   // Set by SolveSystem()
   MNumberVector solution;                       // Created by SolveSystem()
   int solvesystem_retval;                       // Set by SolveSystem()
+  std::shared_ptr<ReducedBasis<MNumber> > reduced_basis;  // UseReducedModel()
+  bool reduced_solution;                        // Set by SolveSystem()
+  double reduced_model_tolerance;               // Max reduced model residual
+  MNumberVector prediction;                     // SetPredictedSolution()
+  double prediction_tolerance;                  // SetPredictedSolution()
+  double prediction_residual;                   // Set by SolveSystem()
+  bool predicted_solution;                      // Set by SolveSystem()
   EigenSolver *eigensolver;                     // Created by EigenSystem()
   int eigensystem_retval;                       // Set by EigenSystem()
 
-  FEMSolver() : factorizer(0), solvesystem_retval(-1),
-                eigensolver(0), eigensystem_retval(-1) {}
+  // The maximum number of changed rows and columns for which SolveSystem()
+  // will update a reused factorization rather than factor the system matrix.
+  // This bounds the memory needed for the update, which is a dense matrix
+  // with this many columns.
+  static const int kMaxUpdateRank = 100;
+
+  FEMSolver() : factorization_updated(false), solvesystem_retval(-1),
+                reduced_solution(false),
+                reduced_model_tolerance(kReducedModelTolerance),
+                prediction_tolerance(0), prediction_residual(0),
+                predicted_solution(false), eigensolver(0),
+                eigensystem_retval(-1) {}
   ~FEMSolver() {
-    delete factorizer;
     delete eigensolver;
   }
 
@@ -473,6 +548,10 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
         area2 = T::Absolute(d1[0]*d2[1] - d1[1]*d2[0]);
       }
 
+      // Coefficients for anisotropic triangles.
+      Number lx, ly, scale;
+      const bool anisotropic = T::Anisotropy(i, &lx, &ly, &scale);
+
       // Compute system matrix contributions for each vertex and edge of the
       // triangle.
       for (int j0 = 0; j0 < 3; j0++) {
@@ -503,18 +582,38 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
 
         // Add contributions to on-diagonal entry A(sj2, sj2).
         GNumber opplen2 = (pt[j0] - pt[j1]).squaredNorm();
+        Number Aii_value = T::GNumberToNumber(opplen2 / (area2 * 2.0));
+        Number Cii_value = -(g0 + g1 + g2 * 3.0) *
+                            T::GNumberToNumber(area2 / 60.0);
+        Number f_value = -(T::PointF(i, j0) * 2.0 + T::PointF(i, j1) +
+                           T::PointF(i, j2)) * T::GNumberToNumber(area2 / 24.0);
+
+        // For anisotropic triangles the gradient of the basis function for
+        // point j is perpendicular to the opposite edge, so the stiffness
+        // terms are the isotropic ones with the x and y components of those
+        // edges weighted separately.
+        if (anisotropic) {
+          Point e0 = pt[j1] - pt[j2];   // Opposite j0
+          Point e1 = pt[j2] - pt[j0];   // Opposite j1
+          Point e2 = pt[j0] - pt[j1];   // Opposite j2
+          Aij_value = (lx * T::GNumberToNumber(e0[1] * e1[1]) +
+                       ly * T::GNumberToNumber(e0[0] * e1[0])) /
+                      T::GNumberToNumber(area2 * 2.0);
+          Aii_value = (lx * T::GNumberToNumber(e2[1] * e2[1]) +
+                       ly * T::GNumberToNumber(e2[0] * e2[0])) /
+                      T::GNumberToNumber(area2 * 2.0);
+          Cij_value = Cij_value * scale;
+          Cii_value = Cii_value * scale;
+          f_value = f_value * scale;
+        }
         if (sj2 >= 0) {
-          // Aii
-          diagonal[sj2] -= T::GNumberToNumber(-opplen2 / (area2 * 2.0));
-          // Cii
-          (create_Gtriplets ? Gdiagonal : diagonal)[sj2] -=
-              (g0 + g1 + g2 * 3.0) * T::GNumberToNumber(area2 / 60.0);
+          diagonal[sj2] += Aii_value;
+          (create_Gtriplets ? Gdiagonal : diagonal)[sj2] += Cii_value;
         }
 
         // Contribution of 'f' to right hand side.
         if (sj0 >= 0) {
-          rhs[sj0] -= (T::PointF(i, j0) * 2.0 + T::PointF(i, j1) +
-                       T::PointF(i, j2)) * T::GNumberToNumber(area2 / 24.0);
+          rhs[sj0] += f_value;
         }
 
         // Add contributions for triangle edges with robin boundary conditions,
@@ -632,9 +731,10 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
             // this is not likely to be a bottleneck.
             triplets.push_back(Triplet(sj0, sj1, Aij_value));
             triplets.push_back(Triplet(sj1, sj0, Aij_value));
-            // We do not yet handle the case of creating a fully symmetric
-            // matrix for Gtriplets.
-            CHECK(!create_Gtriplets);
+            if (create_Gtriplets) {
+              Gtriplets.push_back(Triplet(sj0, sj1, Cij_value));
+              Gtriplets.push_back(Triplet(sj1, sj0, Cij_value));
+            }
           }
         }
       }
@@ -652,8 +752,156 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
     CHECK(triplets.size() <= triplets_size);
   }
 
-  // Factor and solve the system created by CreateSystem(). Return true on
-  // success or false if the factorization failed. This only does work the
+  // Let SolveSystem() reuse the factorization of 'previous', a solver for a
+  // similar system, e.g. the previous step of a sweep that changes the
+  // material of a small part of the model. If the system matrices differ in
+  // only a few rows and columns then the system is solved by a low rank
+  // update of that factorization, otherwise it is factored as usual. The
+  // factorization is also not used if its factorizer was configured
+  // differently (see FEMProblem::GetFactorizerConfig()), e.g. if the solver
+  // backend has changed. 'previous' can be deleted afterwards. This must be called before
+  // SolveSystem().
+  void ReuseFactorization(const FEMSolver<T> *previous) {
+    CHECK(solvesystem_retval < 0);
+    if (previous->solvesystem_retval == 1) {
+      factorization = previous->factorization;
+    }
+  }
+
+  // Let SolveSystem() try to solve this system in the span of a reduced basis
+  // of solutions to similar systems (see ReducedBasis), before factoring it.
+  // This is for sweeps where each step changes the system matrix everywhere
+  // but only smoothly, e.g. a frequency sweep. The basis of 'previous', the
+  // solver for the previous step, is shared and grows as steps are solved:
+  // the reduced solution is used if its relative residual is at most
+  // reduced_model_tolerance, otherwise the system is solved in full and the
+  // solution (and any solution derivative computed later) is added to the
+  // basis. If 'previous' is 0 or has no basis then a new one is started.
+  // This must be called before SolveSystem().
+  void UseReducedModel(const FEMSolver<T> *previous) {
+    CHECK(solvesystem_retval < 0);
+    if (previous && previous->reduced_basis) {
+      reduced_basis = previous->reduced_basis;
+    } else {
+      reduced_basis.reset(new ReducedBasis<MNumber>);
+    }
+  }
+
+  // Give SolveSystem() an approximate solution 'x', the same size as
+  // 'solution', e.g. a first order prediction from the solution and solution
+  // derivative of a similar system. If the relative residual |b-A*x|/|b| is
+  // at most 'tolerance' then 'x' is used as the solution and the system is
+  // not factored, otherwise the system is solved as usual (but starting from
+  // 'x', see FEMProblem::SolveWithGuess()). An infinite
+  // tolerance always uses 'x', e.g. for a quick preview. This must be called
+  // before SolveSystem().
+  void SetPredictedSolution(const MNumberVector &x, double tolerance) {
+    CHECK(solvesystem_retval < 0);
+    CHECK(x.size() == T::NumPoints());
+    prediction = x;
+    prediction_tolerance = tolerance;
+  }
+
+  // Solve the system in the time domain instead of factoring it (see
+  // TimeDomainSolver). This is for problems that are the frequency domain
+  // form of a wave equation at angular frequency 'omega', i.e. g is omega^2
+  // times a (possibly complex) material constant, the imaginary parts of the
+  // rest of the system matrix are omega times a damping (e.g. absorbing
+  // Robin boundaries), and the right hand side is i*omega times a constant.
+  // The g and damping matrices are lumped. The solution at 'omega' becomes
+  // 'solution', and column k of 'probes' is the solution at omegas[k] at the
+  // points 'probe_points' (point indexes, not system indexes). Return false
+  // if the time steps can not be done, e.g. because g is not positive, or if
+  // the field did not decay. This is done instead of SolveSystem().
+  bool SolveTimeDomain(double omega, const vector<double> &omegas,
+                       const vector<int> &probe_points,
+                       Eigen::MatrixXcd *probes) MUST_USE_RESULT {
+    DoTrace trace(__func__);
+    CHECK(solvesystem_retval < 0 && omega > 0);
+    if (CreateIndexMapsNeedsCalling()) {
+      CreateIndexMaps();
+    }
+    UnCreateSystem();
+    CreateSystem(true);
+    const int n = SystemSize();
+
+    // Split the system matrix into the stiffness K (real part) and damping C
+    // (imaginary part), and the g matrix into the mass M and a damping that
+    // accounts for material loss. M and C are lumped by summing their rows.
+    typedef std::complex<double> Complex;
+    vector<Eigen::Triplet<double> > Ktriplets;
+    Eigen::VectorXd M = Eigen::VectorXd::Zero(n), C = Eigen::VectorXd::Zero(n);
+    for (int pass = 0; pass < 2; pass++) {
+      const vector<Triplet> &trips = pass == 0 ? triplets : Gtriplets;
+      for (int i = 0; i < trips.size(); i++) {
+        int row = trips[i].row(), col = trips[i].col();
+        Complex value = T::MNumberFromNumber(trips[i].value());
+        bool lower = T::ProblemIsLowerTriangular() && row != col;
+        if (pass == 0) {
+          Ktriplets.push_back(Eigen::Triplet<double>(row, col, value.real()));
+          if (lower) {
+            Ktriplets.push_back(Eigen::Triplet<double>(col, row,
+                                                       value.real()));
+          }
+          C[row] += value.imag() / omega;
+          if (lower) {
+            C[col] += value.imag() / omega;
+          }
+        } else {
+          value /= -omega * omega;
+          M[row] += value.real();
+          C[row] -= omega * value.imag();
+          if (lower) {
+            M[col] += value.real();
+            C[col] -= omega * value.imag();
+          }
+        }
+      }
+    }
+    TimeDomainSolver::MatrixType K(n, n);
+    K.setFromTriplets(Ktriplets.begin(), Ktriplets.end());
+    Eigen::VectorXcd p(n);
+    for (int i = 0; i < n; i++) {
+      p[i] = Complex(T::MNumberFromNumber(rhs[i])) / Complex(0, omega);
+    }
+    UnCreateSystem();
+    Gtriplets.clear();
+
+    // Step the wave equation, recording the probe rows.
+    TimeDomainSolver td(K, M, C, p);
+    if (!td.IsValid()) {
+      return (solvesystem_retval = false);
+    }
+    vector<double> all_omegas(1, omega);
+    all_omegas.insert(all_omegas.end(), omegas.begin(), omegas.end());
+    vector<int> probe_rows;
+    for (int i = 0; i < probe_points.size(); i++) {
+      if (index_map[probe_points[i]] >= 0) {
+        probe_rows.push_back(index_map[probe_points[i]]);
+      }
+    }
+    Eigen::VectorXcd field;
+    Eigen::MatrixXcd responses;
+    if (!td.Run(all_omegas, probe_rows, &field, &responses)) {
+      return (solvesystem_retval = false);
+    }
+
+    // Dirichlet probe points are zero.
+    probes->setZero(probe_points.size(), omegas.size());
+    for (int i = 0, j = 0; i < probe_points.size(); i++) {
+      if (index_map[probe_points[i]] >= 0) {
+        probes->row(i) = responses.row(j++).tail(omegas.size());
+      }
+    }
+    solution = field;
+    PadSolution(&solution);
+    return (solvesystem_retval = true);
+  }
+
+  // Factor and solve the system created by CreateSystem(), or solve it from
+  // a prediction (see SetPredictedSolution()) or the reduced basis (see
+  // UseReducedModel()). Return true on success or
+  // false if the factorization failed. This only does work the
   // first time it is called, subsequent times it simply returns the same
   // return code as the first time.
   bool SolveSystem() MUST_USE_RESULT {
@@ -684,24 +932,51 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
       }
     }
 
-    // Factor 'A'. Return false if A can not be factored. Then solve.
-    CHECK(!factorizer)
-    factorizer = new Factorizer;
-    CHECK(A.isCompressed());      // Otherwise factorizer might make a copy
-    {
-      DoTrace trace("Analyze");
-      factorizer->analyzePattern(A);
-    }
-    {
-      DoTrace trace("Factorize");
-      factorizer->factorize(A);
+    // If we have a prediction then check its residual, which is much cheaper
+    // than factoring A. If it is not used it is a guess for the solve.
+    MNumberVector guess;
+    if (prediction.size() > 0) {
+      DoTrace trace("Prediction");
+      MNumberVector x(system_size);
+      for (int i = 0; i < system_size; i++) {
+        x[i] = prediction[reverse_index_map[i]];
+      }
+      MNumberVector Ax = A * x;
+      if (T::ProblemIsLowerTriangular()) {
+        Ax += A.transpose() * x;
+        Ax -= A.diagonal().cwiseProduct(x);
+      }
+      double bnorm = b->norm();
+      prediction_residual = bnorm > 0 ? (*b - Ax).norm() / bnorm :
+                                        (x.norm() > 0 ? HUGE_VAL : 0);
+      if (prediction_residual <= prediction_tolerance) {
+        predicted_solution = true;
+        solution = x;
+      } else {
+        guess.swap(x);
+      }
+      prediction.resize(0);
     }
-    if (factorizer->info() != Eigen::Success) {
-      return (solvesystem_retval = false);
+
+    // If we have a reduced basis then try to solve in its span, which is
+    // much cheaper than factoring A.
+    if (reduced_basis && !predicted_solution) {
+      DoTrace trace("Reduced");
+      reduced_solution = reduced_basis->Solve(A, *b,
+          T::ProblemIsLowerTriangular(), reduced_model_tolerance, &solution);
     }
-    {
+
+    // Otherwise factor A and solve, and add the solution to the reduced basis
+    // as a new expansion point.
+    if (!reduced_solution && !predicted_solution) {
+      if (!FactorSystem(&A)) {
+        return (solvesystem_retval = false);
+      }
       DoTrace trace("Solve");
-      solution = factorizer->solve(*b);
+      solution = Solve(*b, guess);
+      if (reduced_basis) {
+        reduced_basis->Add(solution);
+      }
     }
 
     // Pad the solution vector with zeros as necessary.
@@ -746,10 +1021,38 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
       tmp[i] += T::Derivative(rhs[i]);
     }
 
-    // Solve for the solution derivative.
+    // Solve for the solution derivative, which is zero if nothing depends on
+    // the parameter. If the solution came from the reduced basis then try
+    // that first, otherwise (and for predicted solutions) the system has to
+    // be factored now. When the derivative is with respect to a swept
+    // parameter, adding it to the basis makes this step a Hermite expansion
+    // point.
     {
       DoTrace trace("Solve");
-      *solution_derivative = factorizer->solve(tmp);
+      bool solved = false;
+      if (tmp.norm() == 0) {
+        solution_derivative->setZero(system_size);
+        solved = true;
+      } else if (reduced_solution || predicted_solution) {
+        Eigen::SparseMatrix<MNumber> A;
+        GetSystemMatrix(triplets, &A, false);
+        if (reduced_basis) {
+          solved = reduced_basis->Solve(A, tmp, T::ProblemIsLowerTriangular(),
+                     reduced_model_tolerance, solution_derivative);
+        }
+        if (!solved) {
+          if (!FactorSystem(&A)) {
+            return false;
+          }
+          reduced_solution = predicted_solution = false;
+        }
+      }
+      if (!solved) {
+        *solution_derivative = Solve(tmp);
+        if (reduced_basis) {
+          reduced_basis->Add(*solution_derivative);
+        }
+      }
       PadSolution(solution_derivative);
     }
     return true;
@@ -758,8 +1061,17 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
   // Compute eigenvalues and eigenvectors of the system matrix. See
   // LaplacianEigenSolver for the definition of sigma. This only does work the
   // first time it is called, subsequent times it simply returns the same
-  // return code as the first time.
-  bool EigenSystem(int eigenpair_count, double sigma) MUST_USE_RESULT {
+  // return code as the first time. If 'initial_vectors' has columns (each a
+  // vector of size SystemSize()) then they are approximate eigenvectors, e.g.
+  // from the solution of a similar problem. They seed BlockEigenSolver, and if
+  // 'track' is true the eigenpairs that match them are ordered to follow them
+  // (see BlockEigenSolver), otherwise the eigenpairs are in order of
+  // increasing eigenvalue. When there are no initial vectors and many
+  // eigenpairs are wanted they are computed in parallel by SlicedEigenSolver.
+  // If either of those fails we fall back to LaplacianEigenSolver.
+  bool EigenSystem(int eigenpair_count, double sigma,
+                   const Eigen::MatrixXd &initial_vectors = Eigen::MatrixXd(),
+                   bool track = false) MUST_USE_RESULT {
     // Prerequisites.
     DoTrace trace(__func__);
     if (eigensystem_retval >= 0) {
@@ -775,7 +1087,23 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
     GetSystemMatrix(Gtriplets, &B, true);
 
     // Compute the smallest eigenvalues, with eigenvectors.
-    eigensolver = new EigenSolver(A, &B, eigenpair_count, sigma);
+    const int kMinSlicedEigenpairs = 20;
+    if (initial_vectors.cols() > 0) {
+      CHECK(initial_vectors.rows() == SystemSize());
+      eigensolver = new eigensolvers::BlockEigenSolver(A, &B, eigenpair_count,
+                                        sigma, initial_vectors, track);
+    } else if (eigenpair_count >= kMinSlicedEigenpairs) {
+      eigensolver = new eigensolvers::SlicedEigenSolver(A, &B,
+                                        eigenpair_count, sigma);
+    }
+    if (eigensolver && eigensolver->Status() != Eigen::Success) {
+      delete eigensolver;
+      eigensolver = 0;
+    }
+    if (!eigensolver) {
+      eigensolver = new eigensolvers::LaplacianEigenSolver(A, &B,
+                                        eigenpair_count, sigma);
+    }
     if (eigensolver->Status() != Eigen::Success) {
       return (eigensystem_retval = false);
     }
@@ -789,11 +1117,17 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
 
     // Check that if sigma<0 its magnitude is less than the lowest nonzero
     // eigenvalue. If its not this might have impacted convergence and
-    // accuracy.
+    // accuracy. Tracked eigenvalues are not necessarily sorted, so find the
+    // second smallest.
     CHECK(sigma <= 0);
-    if (sigma < 0 && val.size() >= 2 && sigma < -0.5 * val[1]) {
-      Warning("EigenSystem |sigma| (%e) too close to lambda1 (%e), accuracy "
-              "might be affected", -sigma, val[1]);
+    if (sigma < 0 && val.size() >= 2) {
+      Eigen::VectorXd sorted = val;
+      std::nth_element(sorted.data(), sorted.data() + 1,
+                       sorted.data() + sorted.size());
+      if (sigma < -0.5 * sorted[1]) {
+        Warning("EigenSystem |sigma| (%e) too close to lambda1 (%e), accuracy "
+                "might be affected", -sigma, sorted[1]);
+      }
     }
 
     // For debugging, check the eigenvalues and eigenvectors.
@@ -829,6 +1163,21 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
     }
   }
 
+  // Get the derivative of eigenvalue 'n' with respect to some parameter, from
+  // the derivatives in 'triplets' and 'Gtriplets'. For A*v = lambda*B*v this
+  // is v'*(dA - lambda*dB)*v / (v'*B*v). Clamp 'n' to the range of available
+  // values.
+  MNumber GetEigenvalueDerivative(int n) {
+    CHECK(eigensolver);
+    const Eigen::MatrixXd &vecs = eigensolver->GetEigenVectors();
+    n = std::max(0, std::min(vecs.cols() - 1, n));
+    const Eigen::VectorXd v = vecs.col(n);
+    MNumber lambda = eigensolver->GetEigenValues()[n];
+    MNumber dA = QuadraticForm(triplets, v, true);
+    MNumber dB = QuadraticForm(Gtriplets, v, true);
+    return (dA - lambda * dB) / QuadraticForm(Gtriplets, v, false);
+  }
+
   // For debug/test:
   const Eigen::MatrixXd GetRawEigenvector(int n) const {
     CHECK(eigensolver);
@@ -859,6 +1208,104 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
       A->setFromTriplets(trips.begin(), trips.end());
     }
   }
+
+  // Utility: Compute v'*M*v where M is the matrix represented by 'triplets',
+  // or the derivative of that matrix if 'derivative' is true.
+  MNumber QuadraticForm(const std::vector<Triplet> &triplets,
+                        const Eigen::VectorXd &v, bool derivative) {
+    MNumber sum = 0;
+    for (int i = 0; i < triplets.size(); i++) {
+      MNumber value = derivative ? T::Derivative(triplets[i].value()) :
+                                   T::MNumberFromNumber(triplets[i].value());
+      MNumber term = value * v[triplets[i].row()] * v[triplets[i].col()];
+      // If the problem is lower triangular then each off-diagonal entry
+      // stands for two entries.
+      if (T::ProblemIsLowerTriangular() &&
+          triplets[i].row() != triplets[i].col()) {
+        term *= 2.0;
+      }
+      sum += term;
+    }
+    return sum;
+  }
+
+  // Utility: Prepare 'factorization' for solving with the system matrix 'A',
+  // either by updating a factorization given to ReuseFactorization() or by
+  // factoring 'A' (which is then swapped into the factorization). Return
+  // false if A can not be factored.
+  bool FactorSystem(Eigen::SparseMatrix<MNumber> *A) MUST_USE_RESULT {
+    const int system_size = reverse_index_map.size();
+
+    // If a factorization was given to ReuseFactorization() then try to solve
+    // by updating it, as long as its factorizer was configured the same way
+    // as ours. That is not worthwhile if it takes longer than about half the
+    // time of factoring A from scratch (but don't give up on tiny problems
+    // because of timer noise).
+    if (factorization) {
+      DoTrace trace("Update");
+      factorization_updated =
+          factorization->config == T::GetFactorizerConfig() &&
+          factorization->A.rows() == A->rows() &&
+          factorization_update.Compute(
+              &factorization->factorizer, factorization->A, *A,
+              T::ProblemIsLowerTriangular(),
+              std::min(int(kMaxUpdateRank), system_size / 4),
+              std::max(factorization->seconds / 2, 1e-3));
+      if (!factorization_updated) {
+        factorization.reset();
+      }
+    }
+
+    // Otherwise factor 'A'. The point coordinates are made available to
+    // NestedDissectionOrdering, in case the factorizer uses it.
+    if (!factorization_updated) {
+      factorization.reset(new Factorization);
+      Factorizer *factorizer = &factorization->factorizer;
+      T::ConfigureFactorizer(factorizer);
+      factorization->config = T::GetFactorizerConfig();
+      CHECK(A->isCompressed());   // Otherwise factorizer might make a copy
+      auto start_time = std::chrono::steady_clock::now();
+      Eigen::Matrix2Xd xy(2, system_size);
+      for (int i = 0; i < system_size; i++) {
+        Point p = T::PointXY(reverse_index_map[i]);
+        for (int j = 0; j < 2; j++) {
+          xy(j, i) = std::real(T::MNumberFromNumber(T::GNumberToNumber(p[j])));
+        }
+      }
+      NestedDissectionCoordinates coordinates(&xy);
+      {
+        DoTrace trace("Analyze");
+        factorizer->analyzePattern(*A);
+      }
+      {
+        DoTrace trace("Factorize");
+        factorizer->factorize(*A);
+      }
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start_time;
+      factorization->seconds = elapsed.count();
+      if (factorizer->info() != Eigen::Success) {
+        factorization.reset();
+        return false;
+      }
+      factorization->A.swap(*A);
+    }
+    return true;
+  }
+
+  // Utility: Solve the system matrix for 'b' using the factorization, which
+  // may have been updated by SolveSystem(). A nonempty 'guess' is an
+  // approximate solution to start from.
+  MNumberVector Solve(const MNumberVector &b,
+                      const MNumberVector &guess = MNumberVector()) {
+    if (factorization_updated) {
+      return factorization_update.solve(b);
+    }
+    if (guess.size() > 0) {
+      return T::SolveWithGuess(&factorization->factorizer, b, guess);
+    }
+    return factorization->factorizer.solve(b);
+  }
 };
 
 }  // namespace FEM
@@ -0,0 +1,52 @@
+
+// Testing for FFT.
+
+#include "fft.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "testing.h"
+
+namespace fft {
+
+TEST_FUNCTION(FFT) {
+  srandom(123);
+  // Compare against the direct transform for power of two and other sizes.
+  const int sizes[] = {1, 2, 8, 64, 3, 5, 12, 100, 257};
+  for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    const int n = sizes[s];
+    std::vector<Complex> x(n);
+    for (int i = 0; i < n; i++) {
+      x[i] = Complex(random() / double(RAND_MAX) - 0.5,
+                     random() / double(RAND_MAX) - 0.5);
+    }
+    for (int sign = -1; sign <= 1; sign += 2) {
+      std::vector<Complex> y = x;
+      FFT(sign, &y);
+      double max_error = 0;
+      for (int j = 0; j < n; j++) {
+        Complex sum = 0;
+        for (int k = 0; k < n; k++) {
+          double theta = sign * 2.0 * M_PI * double((long long) j * k % n) / n;
+          sum += x[k] * Complex(cos(theta), sin(theta));
+        }
+        max_error = std::max(max_error, abs(sum - y[j]));
+      }
+      printf("n=%d sign=%d max error = %g\n", n, sign, max_error);
+      CHECK(max_error < 1e-12);
+    }
+  }
+
+  // The inverse transform undoes the forward transform.
+  std::vector<Complex> x(1000), y;
+  for (int i = 0; i < x.size(); i++) {
+    x[i] = Complex(random() / double(RAND_MAX), random() / double(RAND_MAX));
+  }
+  y = x;
+  FFT(-1, &y);
+  FFT(1, &y);
+  for (int i = 0; i < x.size(); i++) {
+    CHECK(abs(y[i] / double(x.size()) - x[i]) < 1e-13);
+  }
+}
+
+}  // namespace fft
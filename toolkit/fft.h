@@ -0,0 +1,119 @@
+// Fast Fourier transform of complex sequences of any length.
+//
+// Power of two lengths use the iterative radix 2 Cooley-Tukey algorithm.
+// Other lengths use Bluestein's algorithm, which rewrites the transform as a
+// convolution that is computed with power of two transforms. Both are
+// O(n*log(n)).
+
+#ifndef __TOOLKIT_FFT_H__
+#define __TOOLKIT_FFT_H__
+
+#include <math.h>
+#include <complex>
+#include "myvector"
+#include "error.h"
+
+namespace fft {
+
+typedef std::complex<double> Complex;
+
+// The radix 2 transform, n must be a power of two.
+inline void FFTPowerOf2(int sign, std::vector<Complex> *x) {
+  const int n = x->size();
+  CHECK((n & (n - 1)) == 0);
+  Complex *a = x->data();
+
+  // Bit reversal permutation.
+  for (int i = 1, j = 0; i < n; i++) {
+    int bit = n >> 1;
+    for (; j & bit; bit >>= 1) {
+      j ^= bit;
+    }
+    j ^= bit;
+    if (i < j) {
+      std::swap(a[i], a[j]);
+    }
+  }
+
+  // Butterflies. The twiddle factors are computed directly rather than by
+  // recurrence, to avoid accumulating rounding error for large n.
+  std::vector<Complex> w(n / 2);
+  for (int i = 0; i < n / 2; i++) {
+    double theta = sign * 2.0 * M_PI * i / n;
+    w[i] = Complex(cos(theta), sin(theta));
+  }
+  for (int len = 2; len <= n; len *= 2) {
+    const int half = len / 2, step = n / len;
+    for (int i = 0; i < n; i += len) {
+      for (int j = 0; j < half; j++) {
+        Complex u = a[i + j];
+        Complex v = a[i + j + half] * w[j * step];
+        a[i + j] = u + v;
+        a[i + j + half] = u - v;
+      }
+    }
+  }
+}
+
+// Bluestein's algorithm. With jk = (j^2 + k^2 - (j-k)^2)/2 the transform is
+//
+//   X[j] = c[j] * sum_k (x[k]*c[k]) * conj(c[j-k]),  c[k] = exp(sign*pi*i*k^2/n)
+//
+// which is a convolution that we compute with power of two transforms of size
+// m >= 2n-1.
+inline void FFTBluestein(int sign, std::vector<Complex> *x) {
+  const int n = x->size();
+  int m = 1;
+  while (m < 2 * n - 1) {
+    m *= 2;
+  }
+  // The chirp c[k]. k^2 is reduced modulo 2n so that the argument to cos()
+  // and sin() stays small, otherwise accuracy is lost for large n.
+  std::vector<Complex> chirp(n);
+  for (int k = 0; k < n; k++) {
+    long long k2 = (long long) k * k % (2 * n);
+    double theta = sign * M_PI * double(k2) / n;
+    chirp[k] = Complex(cos(theta), sin(theta));
+  }
+  std::vector<Complex> a(m), b(m);
+  for (int k = 0; k < n; k++) {
+    a[k] = (*x)[k] * chirp[k];
+  }
+  b[0] = conj(chirp[0]);
+  for (int k = 1; k < n; k++) {
+    b[k] = b[m - k] = conj(chirp[k]);
+  }
+  FFTPowerOf2(-1, &a);
+  FFTPowerOf2(-1, &b);
+  for (int i = 0; i < m; i++) {
+    a[i] *= b[i];
+  }
+  FFTPowerOf2(1, &a);
+  for (int j = 0; j < n; j++) {
+    (*x)[j] = chirp[j] * a[j] / double(m);
+  }
+}
+
+// Compute the unnormalized transform
+//
+//   x[j] <- sum_k x[k] * exp(sign*2*pi*i*j*k/n)
+//
+// in place, where n is the size of x and sign is -1 (forward transform) or
+// +1 (inverse transform). The inverse of the forward transform is the inverse
+// transform divided by n.
+inline void FFT(int sign, std::vector<Complex> *x) {
+  CHECK(sign == -1 || sign == 1);
+  const int n = x->size();
+  if (n <= 1) {
+    return;
+  }
+  if ((n & (n - 1)) == 0) {
+    FFTPowerOf2(sign, x);
+  } else {
+    FFTBluestein(sign, x);
+  }
+}
+
+}  // namespace fft
+
+#endif
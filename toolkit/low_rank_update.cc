@@ -0,0 +1,85 @@
+
+// Testing for LowRankUpdate.
+
+#include "low_rank_update.h"
+#include <stdio.h>
+#include "testing.h"
+
+namespace FEM {
+
+typedef Eigen::SparseMatrix<double> SMatrix;
+typedef std::vector<Eigen::Triplet<double> > Triplets;
+
+// The 5 point Laplacian on an n*n grid, plus 'shift' on the diagonal. If
+// 'lower' is true then only the lower triangle is stored.
+static void GridMatrix(int n, double shift, bool lower, Triplets *t) {
+  t->clear();
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < n; j++) {
+      int k = i * n + j;
+      t->push_back(Eigen::Triplet<double>(k, k, 4 + shift));
+      if (i > 0) {
+        t->push_back(Eigen::Triplet<double>(k, k - n, -1));
+        if (!lower) t->push_back(Eigen::Triplet<double>(k - n, k, -1));
+      }
+      if (j > 0) {
+        t->push_back(Eigen::Triplet<double>(k, k - 1, -1));
+        if (!lower) t->push_back(Eigen::Triplet<double>(k - 1, k, -1));
+      }
+    }
+  }
+}
+
+template<class Factorizer>
+static void TestLowRankUpdate(bool lower) {
+  const int n = 40, size = n * n;
+  Triplets t;
+  GridMatrix(n, 0.1, lower, &t);
+  SMatrix A0(size, size), A(size, size);
+  A0.setFromTriplets(t.begin(), t.end());
+
+  // Change a small square of the grid, including the coupling between its
+  // points.
+  for (int i = 10; i < 13; i++) {
+    for (int j = 20; j < 23; j++) {
+      int k = i * n + j;
+      t.push_back(Eigen::Triplet<double>(k, k, 0.5));
+      if (j > 20) {
+        t.push_back(Eigen::Triplet<double>(k, k - 1, -0.25));
+        if (!lower) t.push_back(Eigen::Triplet<double>(k - 1, k, -0.25));
+      }
+    }
+  }
+  A.setFromTriplets(t.begin(), t.end());
+
+  Factorizer base;
+  base.compute(A0);
+  CHECK(base.info() == Eigen::Success);
+  LowRankUpdate<Factorizer> update;
+  CHECK(update.Compute(&base, A0, A, lower, 100, 1e9));
+  CHECK(update.Rank() == 9);
+
+  Eigen::VectorXd b = Eigen::VectorXd::Random(size);
+  Eigen::VectorXd x = update.solve(b);
+  Factorizer full;
+  full.compute(A);
+  Eigen::VectorXd x_full = full.solve(b);
+  double error = (x - x_full).norm() / x_full.norm();
+  printf("Rank %d update error = %g\n", update.Rank(), error);
+  CHECK(error < 1e-12);
+
+  // An unchanged matrix is a rank zero update.
+  CHECK(update.Compute(&base, A0, A0, lower, 100, 1e9));
+  CHECK(update.Rank() == 0);
+  CHECK((update.solve(b) - base.solve(b)).norm() == 0);
+
+  // Too large an update is rejected.
+  CHECK(!update.Compute(&base, A0, A, lower, 8, 1e9));
+}
+
+TEST_FUNCTION(LowRankUpdate) {
+  TestLowRankUpdate<Eigen::SparseLU<SMatrix> >(false);
+  TestLowRankUpdate<Eigen::SimplicialLDLT<SMatrix> >(true);
+}
+
+}  // namespace FEM
@@ -0,0 +1,145 @@
+// Solve a sparse system by updating the factorization of a similar system.
+//
+// When a model changes only locally (e.g. the permittivity of a small
+// dielectric insert is changed in a sweep) the new system matrix A differs
+// from the previous one A0 in only a few rows and columns. If R is the set of
+// those rows and columns, E the columns of the identity matrix selected by R
+// and M = (A-A0)(R,R) then A = A0 + E*M*E', and by the Woodbury identity
+//
+//   inv(A) = inv(A0) - W*M*inv(S)*E'*inv(A0)
+//
+// where W = inv(A0)*E and S = I + E'*W*M is a small dense 'capacitance'
+// matrix. Computing W takes |R| solves with the existing factorization of A0,
+// which is much cheaper than factoring A when |R| is small. Each solve with A
+// is then one solve with A0 plus a little dense algebra.
+
+#ifndef __TOOLKIT_LOW_RANK_UPDATE_H__
+#define __TOOLKIT_LOW_RANK_UPDATE_H__
+
+#include <chrono>
+#include "myvector"
+#include "Eigen/Dense"
+#include "Eigen/Sparse"
+#include "error.h"
+
+namespace FEM {
+
+template<class Factorizer> class LowRankUpdate {
+ public:
+  typedef typename Factorizer::MatrixType MatrixType;
+  typedef typename MatrixType::Scalar Scalar;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> DenseMatrix;
+
+  LowRankUpdate() : base_(0) {}
+
+  // Prepare to solve with A given 'base', a factorizer for A0. Both matrices
+  // must have the same size, and if 'lower_triangular' is true then only
+  // their lower triangles are stored (the upper triangles are implied by
+  // symmetry). Return false if the rank of A-A0 is more than max_rank, if
+  // computing the update takes more than max_seconds (after which
+  // refactoring is likely to be quicker), or if the update is numerically
+  // singular. The base factorizer must outlive this object.
+  bool Compute(Factorizer *base, const MatrixType &A0, const MatrixType &A,
+               bool lower_triangular, int max_rank, double max_seconds)
+               MUST_USE_RESULT {
+    base_ = 0;
+    CHECK(A0.rows() == A.rows() && A0.cols() == A.cols());
+    auto start_time = std::chrono::steady_clock::now();
+    const int n = A.rows();
+
+    // Find the rows and columns that have changed.
+    MatrixType D = A - A0;
+    std::vector<int> position(n, -1);         // Offset in rows_, or -1
+    rows_.clear();
+    for (int j = 0; j < D.outerSize(); j++) {
+      for (typename MatrixType::InnerIterator it(D, j); it; ++it) {
+        if (it.value() != Scalar(0)) {
+          int index[2] = {int(it.row()), int(it.col())};
+          for (int k = 0; k < 2; k++) {
+            if (position[index[k]] < 0) {
+              position[index[k]] = rows_.size();
+              rows_.push_back(index[k]);
+            }
+          }
+        }
+      }
+    }
+    const int rank = rows_.size();
+    if (rank > max_rank) {
+      return false;
+    }
+    M_.setZero(rank, rank);
+    for (int j = 0; j < D.outerSize(); j++) {
+      for (typename MatrixType::InnerIterator it(D, j); it; ++it) {
+        if (it.value() != Scalar(0)) {
+          M_(position[it.row()], position[it.col()]) = it.value();
+          if (lower_triangular) {
+            M_(position[it.col()], position[it.row()]) = it.value();
+          }
+        }
+      }
+    }
+
+    // W = inv(A0)*E, one column at a time so that we can give up early.
+    W_.resize(n, rank);
+    Vector e(n);
+    e.setZero();
+    for (int k = 0; k < rank; k++) {
+      e[rows_[k]] = 1;
+      W_.col(k) = base->solve(e);
+      e[rows_[k]] = 0;
+      if (base->info() != Eigen::Success) {
+        return false;
+      }
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start_time;
+      if (elapsed.count() > max_seconds) {
+        return false;
+      }
+    }
+
+    // The capacitance matrix S = I + W(R,:)*M.
+    DenseMatrix WR(rank, rank);
+    for (int k = 0; k < rank; k++) {
+      WR.row(k) = W_.row(rows_[k]);
+    }
+    DenseMatrix S = DenseMatrix::Identity(rank, rank) + WR * M_;
+    S_.compute(S);
+    if (rank > 0 && !(S_.rcond() > 1e-12)) {
+      return false;
+    }
+    base_ = base;
+    return true;
+  }
+
+  // The number of rows and columns that changed, after Compute().
+  int Rank() const { return rows_.size(); }
+
+  // Solve A*x = b.
+  Vector solve(const Vector &b) {
+    CHECK(base_);
+    Vector y = base_->solve(b);
+    if (rows_.empty()) {
+      return y;
+    }
+    Vector yR(rows_.size());
+    for (int k = 0; k < rows_.size(); k++) {
+      yR[k] = y[rows_[k]];
+    }
+    Vector z = M_ * S_.solve(yR);
+    y -= W_ * z;
+    return y;
+  }
+
+ private:
+  Factorizer *base_;            // Factorizer for A0, or 0 if not computed
+  std::vector<int> rows_;       // The changed rows and columns R
+  DenseMatrix M_;               // (A-A0)(R,R)
+  DenseMatrix W_;               // inv(A0)*E
+  Eigen::PartialPivLU<DenseMatrix> S_;    // The capacitance matrix
+};
+
+}  // namespace FEM
+
+#endif
@@ -20,6 +20,13 @@ using Eigen::Vector2f;
 const int kSliderResolution = 1000;
 const int kMarkerSize = 5;
 
+// The relative accuracy of the fitted response of an adaptive sweep.
+const double kAdaptiveSweepTolerance = 1e-3;
+
+// The random seed for tolerance analysis samples, fixed so that repeating an
+// analysis gives the same results.
+const unsigned int kToleranceSeed = 1;
+
 // Source code for the lua utility functions that are available to user
 // scripts.
 extern "C" char user_script_util_dot_lua;
@@ -73,7 +80,8 @@ class MyLua : public Lua {
     return 0;
   }
 
-  // Implement lua _CreateParameter(label, min, max, default, integer).
+  // Implement lua _CreateParameter(label, min, max, default, integer,
+  // tolerance, uniform).
   int LuaCreateParameter() {
     return model_->LuaCreateParameter(L());
   }
@@ -338,6 +346,11 @@ void MySlider::OnSliderUpdated(wxScrollEvent &event) {
     text_ctrl_->ReflectParameterValue();
   }
 
+  // While the thumb is being dragged a preview will do. Releasing it sends
+  // another event that reruns the script in full.
+  if (event.GetEventType() == wxEVT_SCROLL_THUMBTRACK) {
+    model_->RequestPreview();
+  }
   model_->RerunScript();
 }
 
@@ -370,6 +383,8 @@ LuaModelViewer::LuaModelViewer(wxWindow* parent, wxWindowID id,
   runscript_resets_param_map_ = true;
   num_ticked_count_ = 0;
   derivative_index_ = 0;
+  preview_requested_ = false;
+  previewing_ = false;
   rebuild_parameters_ = false;
   colormap_ = Colormap::Jet;
   brightness_ = 500;
@@ -404,6 +419,8 @@ void LuaModelViewer::OnIdle(wxIdleEvent &event) {
     want_more_idles = OnInvisibleHandSweep();
   } else if (ih_.state == InvisibleHand::OPTIMIZING) {
     want_more_idles = OnInvisibleHandOptimize();
+  } else if (ih_.state == InvisibleHand::TOLERANCING) {
+    want_more_idles = OnInvisibleHandTolerance();
   }
   if (want_more_idles) {
     event.RequestMore();
@@ -478,7 +495,7 @@ void LuaModelViewer::SetBrightness(int brightness) {
 
 void LuaModelViewer::Sweep(const string &parameter_name,
                            double start_value, double end_value,
-                           int num_steps) {
+                           int num_steps, bool adaptive) {
   if (!IsModelValid()) {
     Error("The model is not yet valid");
     return;
@@ -497,6 +514,18 @@ void LuaModelViewer::Sweep(const string &parameter_name,
   }
   CHECK(num_steps > 0);
   ih_.sweep_parameter_name = parameter_name;
+  if (adaptive && !p.integer) {
+    // The sample values are chosen one at a time by the sampler, and the
+    // num_steps values are only used to report the fitted response.
+    ih_.sampler = new rational_fit::AdaptiveSampler(start_value, end_value,
+                                  num_steps, kAdaptiveSweepTolerance);
+    double value;
+    CHECK(ih_.sampler->Next(&value));
+    ih_.sweep_values.assign(1, value);
+    ih_.sweep_output.resize(1);
+    ih_.state = InvisibleHand::SWEEPING;
+    return;
+  }
   ih_.sweep_values.resize(num_steps);
   ih_.sweep_output.resize(num_steps);
   if (num_steps == 1) {
@@ -561,6 +590,62 @@ void LuaModelViewer::Optimize() {
   // will kick off the actual optimization.
 }
 
+void LuaModelViewer::ToleranceAnalysis(int num_samples) {
+  // Tolerance analysis is the same as an invisible hand moving the sliders of
+  // the toleranced parameters at random and recording the results after each
+  // solve.
+  ih_.Start();
+
+  if (!IsModelValid()) {
+    Error("The model is not yet valid");
+    return;
+  }
+  if (num_optimize_outputs_ <= 0) {
+    Error("The config.optimize() function must return one or more values "
+          "to analyze.");
+    return;
+  }
+  if (num_samples < 2) {
+    Error("Tolerance analysis needs at least two samples.");
+    return;
+  }
+
+  // Find all the parameters that have tolerances, in the order that the
+  // script creates them (which is the order that derivative_index_ counts
+  // them).
+  vector<tolerance::Distribution> distributions;
+  for (int i = 0; i < current_param_controls_.size(); i++) {
+    const Parameter &p = GetParameter(current_param_controls_[i]);
+    if (p.tolerance.width > 0) {
+      ih_.tol_parameter_names.push_back(p.label);
+      ih_.tol_nominal_values.push_back(p.value);
+      distributions.push_back(p.tolerance);
+      // Samples outside the parameter bounds are clipped by SetParameter(),
+      // which distorts the distribution. Normal samples rarely go past three
+      // standard deviations.
+      double range = p.tolerance.type == tolerance::Distribution::NORMAL ?
+                     3 * p.tolerance.width : p.tolerance.width;
+      if (p.value - range < p.the_min || p.value + range > p.the_max) {
+        Warning("The tolerance of '%s' reaches past its min or max, so some "
+                "samples will be clipped", p.label.c_str());
+      }
+    }
+  }
+  if (distributions.empty()) {
+    Error("No parameters have a tolerance.");
+    return;
+  }
+
+  // Visit the samples in an order where consecutive models are similar, so
+  // that solvers can make the best use of the previous solution.
+  tolerance::LatinHypercube(distributions, num_samples, kToleranceSeed,
+                            &ih_.tol_samples);
+  tolerance::NearestNeighborOrder(distributions, &ih_.tol_samples);
+  ih_.state = InvisibleHand::TOLERANCING;
+  // OnIdle() will run automatically after this event handler returns, which
+  // will kick off the actual analysis.
+}
+
 void LuaModelViewer::StopSweepOrOptimize() {
   ih_.Stop();
 }
@@ -656,6 +741,8 @@ bool LuaModelViewer::RunScript(const char *script, bool rerun_even_if_same,
 bool LuaModelViewer::RerunScript(bool refresh_window,
                                  vector<JetNum> *optimize_output,
                                  bool only_compute_derivatives) {
+  bool preview = preview_requested_;
+  preview_requested_ = false;
   if (in_rerun_script_) {
     // The custom controls for parameter changing can sometimes cause this
     // function to indirectly call itself, e.g. through SelectPane(). Prevent
@@ -665,6 +752,8 @@ bool LuaModelViewer::RerunScript(bool refresh_window,
   Trace trace(__func__);
   in_rerun_script_ = true;
   num_ticked_count_ = 0;
+  derivative_parameter_.clear();
+  previewing_ = preview;
   SetModelValid(false);                 // Assumption, updated below
 
   // optimize_output will be returned empty on any error, e.g. on script error
@@ -809,11 +898,39 @@ void LuaModelViewer::GetParamControlNames(vector<string> *names) const {
   *names = current_param_controls_;
 }
 
+void LuaModelViewer::GetParameterValues(ParameterValues *pv) const {
+  pv->values.clear();
+  for (ParamMap::const_iterator it = param_map_.begin();
+       it != param_map_.end(); ++it) {
+    pv->values[it->first] = it->second.value;
+  }
+  pv->derivative_parameter = derivative_parameter_;
+}
+
+bool LuaModelViewer::PredictionStep(const ParameterValues &a,
+                                    const ParameterValues &b, double *step) {
+  const string &name = a.derivative_parameter;
+  if (name.empty() || name != b.derivative_parameter ||
+      a.values.size() != b.values.size() || a.values.count(name) == 0) {
+    return false;
+  }
+  std::map<string, double>::const_iterator ia = a.values.begin();
+  std::map<string, double>::const_iterator ib = b.values.begin();
+  for (; ia != a.values.end(); ++ia, ++ib) {
+    if (ia->first != ib->first ||
+        (ia->first != name && ia->second != ib->second)) {
+      return false;
+    }
+  }
+  *step = b.values.find(name)->second - a.values.find(name)->second;
+  return true;
+}
+
 int LuaModelViewer::LuaCreateParameter(lua_State *L) {
   // This is called during script execution as _CreateParameter(label, min,
-  // max, default, integer).
-  if (lua_gettop(L) != 5) {
-    LuaError(L, "Internal error: Expecting 5 arguments");
+  // max, default, integer, tolerance, uniform).
+  if (lua_gettop(L) != 7) {
+    LuaError(L, "Internal error: Expecting 7 arguments");
   }
 
   // Extract arguments and return the current parameter value. If the parameter
@@ -844,13 +961,19 @@ int LuaModelViewer::LuaCreateParameter(lua_State *L) {
   }
   p.label = label;              // Lua Parameter() fn checks label not empty
   p.integer = lua_toboolean(L, 5);
+  p.tolerance = tolerance::Distribution(lua_toboolean(L, 7) ?
+      tolerance::Distribution::UNIFORM : tolerance::Distribution::NORMAL,
+      ToDouble(lua_tonumber(L, 6)));
   JetNum value = p.value;
 
   // Keep count of the number of checkbox-ticked parameters seen so far. The
-  // n'th checked parameters gets to have a derivative:
-  if (p.checkbox && p.checkbox->GetValue()) {
+  // n'th checked parameters gets to have a derivative. During tolerance
+  // analysis the toleranced parameters are counted instead.
+  if (IsTolerancing() ? p.tolerance.width > 0 :
+                        (p.checkbox && p.checkbox->GetValue())) {
     if (!rebuild_parameters_ && derivative_index_ == num_ticked_count_) {
       value.Derivative() = 1;
+      derivative_parameter_ = label;
     }
     num_ticked_count_++;
   }
@@ -1215,6 +1338,38 @@ bool LuaModelViewer::OnInvisibleHandSweep() {
 
   // Advance to the next value in a sweep.
   ih_.sweep_index++;
+  if (ih_.sampler) {
+    // In an adaptive sweep the next value depends on the outputs so far.
+    vector<std::complex<double> > output(ih_.sweep_output.back().size());
+    for (int i = 0; i < output.size(); i++) {
+      output[i] = ToComplex(ih_.sweep_output.back()[i]);
+    }
+    if (!ih_.sampler->Add(ih_.sweep_values.back(), output)) {
+      Error("Error during sweep (e.g. nonconstant number of ports or modes)");
+      return false;
+    }
+    double value;
+    if (ih_.sampler->Next(&value)) {
+      ih_.sweep_values.push_back(value);
+      ih_.sweep_output.resize(ih_.sweep_values.size());
+      return true;
+    }
+    // Replace the samples with the fitted response on the full grid.
+    int num_samples = ih_.sampler->NumSamples();
+    vector<vector<std::complex<double> > > response;
+    ih_.sampler->GetResponse(&ih_.sweep_values, &response);
+    ih_.sweep_output.resize(response.size());
+    for (int i = 0; i < response.size(); i++) {
+      ih_.sweep_output[i].resize(response[i].size());
+      for (int j = 0; j < response[i].size(); j++) {
+        ih_.sweep_output[i][j] = JetComplex(response[i][j].real(),
+                                            response[i][j].imag());
+      }
+    }
+    ih_.sweep_index = ih_.sweep_values.size();
+    Message("Adaptive sweep used %d of %d steps", num_samples,
+            int(ih_.sweep_values.size()));
+  }
   if (ih_.sweep_index < ih_.sweep_values.size()) {
     return true;
   } else {
@@ -1250,6 +1405,25 @@ bool LuaModelViewer::OnInvisibleHandOptimize() {
     CHECK(ih_.optimizer->Parameters().size() == ih_.opt_parameter_names.size());
   }
 
+  // Trial steps (where no jacobian is requested) that the errors and
+  // jacobians at the current parameters predict will increase the error are
+  // rejected without being evaluated. The optimizer proposes such steps when
+  // the parameter bounds cut off the step that it wanted.
+  while (!ih_.optimizer_done_ && !ih_.optimizer->JacobianRequested() &&
+         !ih_.linear_errors.empty()) {
+    if (!RejectTrialStep(ih_.linear_parameters, ih_.linear_errors,
+                         ih_.linear_jacobians, ih_.optimizer->Parameters())) {
+      break;
+    }
+    ih_.skipped_steps++;
+    ih_.optimizer_done_ =
+        ih_.optimizer->DoOneIteration(vector<double>(), vector<double>());
+    if (ih_.optimizer->Parameters().empty()) {
+      Error("Optimizer interrupted (iteration failed)");
+      return false;
+    }
+  }
+
   // Copy optimizer parameters so RerunScript() can pick them up, also also
   // update all parameter controls so the user can see evidence of progress.
   for (int i = 0; i < ih_.opt_parameter_names.size(); i++) {
@@ -1275,6 +1449,10 @@ bool LuaModelViewer::OnInvisibleHandOptimize() {
 
   // See if we're all done.
   if (ih_.optimizer_done_) {
+    if (ih_.skipped_steps > 0) {
+      Message("The optimizer skipped %d steps that were predicted to be "
+              "worse", ih_.skipped_steps);
+    }
     Refresh();
     return false;
   }
@@ -1309,6 +1487,11 @@ bool LuaModelViewer::OnInvisibleHandOptimize() {
   for (int i = 0; i < optimize_errors.size(); i++) {
     optimize_errors_d[i] = ToDouble(optimize_errors[i]);
   }
+  if (!jacobians.empty()) {
+    ih_.linear_parameters = ih_.optimizer->Parameters();
+    ih_.linear_errors = optimize_errors_d;
+    ih_.linear_jacobians = jacobians;
+  }
 
   // Do one iteration of the optimizer.
   ih_.optimizer_done_ =
@@ -1333,3 +1516,157 @@ bool LuaModelViewer::OnInvisibleHandOptimize() {
   // Schedule the next iteration of the optimization.
   return true;
 }
+
+bool LuaModelViewer::OnInvisibleHandTolerance() {
+  Trace trace(__func__);
+  const int num_parameters = ih_.tol_parameter_names.size();
+  const int num_samples = ih_.tol_samples.size();
+  if (ih_.sweep_index < 0 || ih_.sweep_index > num_samples + 1) {
+    Error("Tolerance analysis interrupted (internal error)");
+    return false;
+  }
+
+  // Step 0 is the nominal parameters, steps 1..num_samples are the samples,
+  // and the last step restores the nominal parameters.
+  bool nominal = ih_.sweep_index == 0 || ih_.sweep_index == num_samples + 1;
+  bool clipped = false;
+  for (int i = 0; i < num_parameters; i++) {
+    double value = ih_.tol_nominal_values[i];
+    if (!nominal) {
+      value += ih_.tol_samples[ih_.sweep_index - 1][i];
+    }
+    if (!SetParameter(ih_.tol_parameter_names[i], value)) {
+      Error("Tolerance analysis interrupted (could not set parameter value)");
+      return false;
+    }
+    clipped |= GetParameter(ih_.tol_parameter_names[i]).value != value;
+  }
+  if (clipped && !nominal) {
+    ih_.tol_num_clipped++;
+  }
+
+  vector<JetNum> output;
+  if (ih_.sweep_index == 0) {
+    // At the nominal parameters the derivative of every output with respect
+    // to every toleranced parameter gives a linearized estimate of the output
+    // variation, to compare with the sampled one. This is exact for small
+    // tolerances, and the samples show how far that holds.
+    vector<double> variance;
+    PrepareForOptimize();
+    for (int i = 0; i < num_parameters; i++) {
+      derivative_index_ = i;
+      if (!RerunScript(false, &output, i > 0) || output.empty() ||
+          derivative_parameter_ != ih_.tol_parameter_names[i]) {
+        derivative_index_ = 0;
+        Error("Tolerance analysis interrupted (script failed)");
+        return false;
+      }
+      if (i == 0) {
+        variance.resize(output.size(), 0);
+      } else if (output.size() != variance.size()) {
+        derivative_index_ = 0;
+        Error("Tolerance analysis interrupted (config.optimize() returned "
+              "a different number of values)");
+        return false;
+      }
+      double std_dev =
+          GetParameter(ih_.tol_parameter_names[i]).tolerance.StdDev();
+      for (int j = 0; j < variance.size(); j++) {
+        double d = output[j].Derivative() * std_dev;
+        variance[j] += d * d;
+      }
+    }
+    derivative_index_ = 0;
+    ih_.tol_nominal_output.resize(variance.size());
+    ih_.tol_linear_std_dev.resize(variance.size());
+    for (int j = 0; j < variance.size(); j++) {
+      ih_.tol_nominal_output[j] = ToDouble(output[j]);
+      ih_.tol_linear_std_dev[j] = sqrt(variance[j]);
+    }
+  } else {
+    // No parameter needs a derivative for the samples.
+    derivative_index_ = -1;
+    bool ok = RerunScript(false, &output) && !output.empty();
+    derivative_index_ = 0;
+    if (!ok) {
+      Error("Tolerance analysis interrupted (script failed)");
+      return false;
+    }
+    if (output.size() != ih_.tol_nominal_output.size()) {
+      Error("Tolerance analysis interrupted (config.optimize() returned "
+            "a different number of values)");
+      return false;
+    }
+    if (!nominal) {
+      ih_.tol_output.push_back(vector<double>(output.size()));
+      for (int j = 0; j < output.size(); j++) {
+        ih_.tol_output.back()[j] = ToDouble(output[j]);
+      }
+    }
+  }
+
+  // Display the result.
+  {
+    wxClientDC dc(this);
+    Refresh();
+    Update();
+  }
+
+  ih_.sweep_index++;
+  if (ih_.sweep_index <= num_samples + 1) {
+    return true;
+  }
+  ReportToleranceAnalysis();
+  return false;
+}
+
+void LuaModelViewer::ReportToleranceAnalysis() {
+  const int num_samples = ih_.tol_output.size();
+  CHECK(num_samples == ih_.tol_samples.size());
+  Message("Tolerance analysis of %d parameters with %d samples:",
+          int(ih_.tol_parameter_names.size()), num_samples);
+  if (ih_.tol_num_clipped > 0) {
+    Message("%d samples were clipped to the parameter bounds",
+            ih_.tol_num_clipped);
+  }
+
+  // Report the statistics of each output, and plot its histogram.
+  GetMainPlot()->plot().Clear();
+  const int num_bins = std::max(5, int(sqrt(double(num_samples))));
+  const int num_outputs = ih_.tol_nominal_output.size();
+  for (int j = 0; j < num_outputs; j++) {
+    vector<double> values(num_samples);
+    for (int i = 0; i < num_samples; i++) {
+      values[i] = ih_.tol_output[i][j];
+    }
+    tolerance::Statistics s(values);
+    Message("Output %d: nominal %g, linear std dev %g, sampled mean %g, "
+            "std dev %g, range [%g, %g]", j + 1, ih_.tol_nominal_output[j],
+            ih_.tol_linear_std_dev[j], s.mean, s.std_dev, s.min, s.max);
+
+    // Each histogram is drawn as a staircase.
+    vector<double> edges, x, y;
+    vector<int> counts;
+    tolerance::Histogram(values, num_bins, &edges, &counts);
+    x.push_back(edges[0]);
+    y.push_back(0);
+    for (int i = 0; i < num_bins; i++) {
+      x.push_back(edges[i]);
+      y.push_back(counts[i]);
+      x.push_back(edges[i + 1]);
+      y.push_back(counts[i]);
+    }
+    x.push_back(edges.back());
+    y.push_back(0);
+    GetMainPlot()->plot().AddTrace(x, y, -1, 2);
+    char label[100];
+    snprintf(label, sizeof(label), "Output %d", j + 1);
+    GetMainPlot()->plot().AddTraceLabel(label);
+  }
+  GetMainPlot()->plot().Grid();
+  GetMainPlot()->plot().SetXAxisLabel("config.optimize() output");
+  GetMainPlot()->plot().SetYAxisLabel("Samples");
+  GetMainPlot()->plot().SetTitle("Tolerance analysis histogram");
+  SelectPane("Plots", true);
+  GetMainPlot()->Refresh();
+}
@@ -15,6 +15,8 @@
 #include "text_alignment.h"
 #include "my_jet.h"
 #include "lua_util.h"
+#include "rational_fit.h"
+#include "tolerance.h"
 
 class MyLua;
 class MyCheckBox;
@@ -28,6 +30,7 @@ struct Parameter {
   double the_default;           // Default value of parameter
   double value;                 // Current value of parameter
   bool integer;                 // Takes on integer values only?
+  tolerance::Distribution tolerance;  // Manufacturing variation, width 0=none
   MyCheckBox *checkbox;         // Associated checkbox control
   MySlider *slider;             // Associated slider control
   MyTextCtrl *text_ctrl;        // Associated text control
@@ -71,9 +74,18 @@ class LuaModelViewer : public GLViewer {
   void SetIfRunScriptResetsParameters(bool runscript_resets_param_map) {
     runscript_resets_param_map_ = runscript_resets_param_map;
   }
+  // Sweep a parameter over num_steps values from start_value to end_value.
+  // If 'adaptive' is true (and the parameter is not an integer) then the
+  // values to solve at are chosen adaptively from the results so far, and
+  // the result is a rational fit reported at all num_steps values.
   void Sweep(const std::string &parameter_name,
-             double start_value, double end_value, int num_steps);
+             double start_value, double end_value, int num_steps,
+             bool adaptive = false);
   void Optimize();
+  // Solve the model for num_samples random variations of the parameters that
+  // have tolerances, and report the statistics of the config.optimize()
+  // outputs that result.
+  void ToleranceAnalysis(int num_samples);
   void StopSweepOrOptimize();
   void ToggleEmitTraceReport();
   void SetOptimizer(OptimizerType type) { ih_.optimizer_type = type; }
@@ -126,6 +138,33 @@ class LuaModelViewer : public GLViewer {
   wxPlot *GetMainPlot() { return plot_; }
   Lua *GetLua();
   bool AntiAliasing() const { return antialiasing_; }
+  bool IsSweeping() const { return ih_.state == InvisibleHand::SWEEPING; }
+  bool IsOptimizing() const { return ih_.state == InvisibleHand::OPTIMIZING; }
+  bool IsTolerancing() const {
+    return ih_.state == InvisibleHand::TOLERANCING;
+  }
+
+  // True if the last script run was for a parameter slider being dragged, so
+  // that quick approximate results will do until the slider is released.
+  bool IsPreviewing() const { return previewing_; }
+
+  // Make the next RerunScript() a preview (see IsPreviewing()).
+  void RequestPreview() { preview_requested_ = true; }
+
+  // The values of all parameters, and the parameter that had the derivative
+  // in the last script run (empty if none). A subclass can keep these with
+  // the results of a script run to see how later runs differ from it, e.g.
+  // to predict their results from the derivatives (see PredictionStep()).
+  struct ParameterValues {
+    std::map<std::string, double> values;
+    std::string derivative_parameter;
+  };
+  void GetParameterValues(ParameterValues *pv) const;
+
+  // If 'b' differs from 'a' only in the value of the parameter that had the
+  // derivative in both, return true and the change in that value in *step.
+  static bool PredictionStep(const ParameterValues &a,
+                             const ParameterValues &b, double *step);
 
   // Add a line to the "script messages" pane. The arguments map directly to
   // wxListCtrl::InsertItem. This is callable from multiple threads so that
@@ -228,6 +267,10 @@ class LuaModelViewer : public GLViewer {
   std::vector<std::string> markers_; // Pairs of controls names shown as markers
   int num_ticked_count_;             // Ticked params seen by CreateParameter()
   int derivative_index_;             // n'th checked parameter gets derivative
+                                     // (n'th toleranced one when tolerancing)
+  std::string derivative_parameter_; // Parameter that got the derivative
+  bool preview_requested_;           // If the next RerunScript() previews
+  bool previewing_;                  // If the last RerunScript() previewed
   // If true then rebuild parameter controls in RerunScript(). If script
   // execution is triggered by parameter change then this must be false as the
   // user will be currently interacting with the parameter controls.
@@ -240,22 +283,39 @@ class LuaModelViewer : public GLViewer {
   bool antialiasing_;
   bool show_markers_;
 
-  // State used for sweeping and optimizing, i.e. when an "invisible hand" is
-  // moving the parameter sliders.
+  // State used for sweeping, optimizing and tolerance analysis, i.e. when an
+  // "invisible hand" is moving the parameter sliders.
   struct InvisibleHand {
-    enum State { OFF, SWEEPING, OPTIMIZING } state;
+    enum State { OFF, SWEEPING, OPTIMIZING, TOLERANCING } state;
     std::string sweep_parameter_name;         // Parameter name we're sweeping
     int sweep_index;                          // Current parameter value index
     std::vector<double> sweep_values;           // All values of parameter to use
     std::vector<std::vector<JetComplex> > sweep_output;
+    rational_fit::AdaptiveSampler *sampler;   // Nonzero for adaptive sweeps
     OptimizerType optimizer_type;             // Algorithm to use
     CeresInteractiveOptimizer *optimizer;     // Nonzero if currently optimizing
     std::vector<std::string> opt_parameter_names;  // Parameter names optimizing
     bool optimizer_done_;                     // true if found optimal solution
+    // The errors and jacobians at the last parameters that a jacobian was
+    // computed for, to predict the errors of the optimizer's trial steps.
+    std::vector<double> linear_parameters, linear_errors, linear_jacobians;
+    int skipped_steps;                        // Trial steps not evaluated
+    // For tolerance analysis, the toleranced parameters, their nominal values
+    // and their sampled variations (one vector per sample). The outputs are
+    // the config.optimize() values at the nominal parameters and for each
+    // sample. The linear_std_dev of each output is estimated from its
+    // derivatives at the nominal parameters.
+    std::vector<std::string> tol_parameter_names;
+    std::vector<double> tol_nominal_values;
+    std::vector<std::vector<double> > tol_samples;
+    std::vector<double> tol_nominal_output, tol_linear_std_dev;
+    std::vector<std::vector<double> > tol_output;
+    int tol_num_clipped;              // Samples clipped to parameter bounds
 
     InvisibleHand() {
       optimizer_type = LEVENBERG_MARQUARDT;
       optimizer = 0;
+      sampler = 0;
       Start();
     }
 
@@ -272,8 +332,21 @@ class LuaModelViewer : public GLViewer {
       sweep_index = 0;
       delete optimizer;
       optimizer = 0;
+      delete sampler;
+      sampler = 0;
       opt_parameter_names.clear();
       optimizer_done_ = false;
+      linear_parameters.clear();
+      linear_errors.clear();
+      linear_jacobians.clear();
+      skipped_steps = 0;
+      tol_parameter_names.clear();
+      tol_nominal_values.clear();
+      tol_samples.clear();
+      tol_nominal_output.clear();
+      tol_linear_std_dev.clear();
+      tol_output.clear();
+      tol_num_clipped = 0;
     }
   };
   InvisibleHand ih_;
@@ -297,6 +370,10 @@ class LuaModelViewer : public GLViewer {
   // false is returned then the invisible hand state will be reset in OnIdle().
   bool OnInvisibleHandSweep();
   bool OnInvisibleHandOptimize();
+  bool OnInvisibleHandTolerance();
+
+  // Report and plot the results of a completed tolerance analysis.
+  void ReportToleranceAnalysis();
 
   DECLARE_EVENT_TABLE()
 };
@@ -0,0 +1,121 @@
+
+// Testing for MirrorFactorizer.
+
+#include "mirror_symmetry.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "testing.h"
+
+namespace FEM {
+
+typedef std::complex<double> Complex;
+typedef Eigen::SparseMatrix<Complex> CMatrix;
+typedef Eigen::Matrix<Complex, Eigen::Dynamic, 1> CVector;
+
+// A Helmholtz-like matrix (complex symmetric) for an nx*ny grid with unit
+// spacing centered on the origin, with the rows in a random order. The
+// diagonal depends on |x| and |y| so the matrix is symmetric about both axes,
+// unless 'skew' is nonzero.
+static void MirrorMatrix(int nx, int ny, double skew, CMatrix *A,
+                         Eigen::Matrix2Xd *xy) {
+  std::vector<int> order(nx * ny);
+  for (int i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  for (int i = order.size() - 1; i > 0; i--) {
+    std::swap(order[i], order[random() % (i + 1)]);
+  }
+  std::vector<Eigen::Triplet<Complex> > t;
+  xy->resize(2, nx * ny);
+  for (int i = 0; i < ny; i++) {
+    for (int j = 0; j < nx; j++) {
+      int k = order[i * nx + j];
+      double x = j - (nx - 1) / 2.0, y = i - (ny - 1) / 2.0;
+      (*xy)(0, k) = x;
+      (*xy)(1, k) = y;
+      Complex d(3.5 + 0.01 * fabs(x) + skew * x, 0.1 * fabs(y) / ny);
+      t.push_back(Eigen::Triplet<Complex>(k, k, d));
+      if (i > 0) {
+        t.push_back(Eigen::Triplet<Complex>(k, order[(i - 1) * nx + j], -1));
+        t.push_back(Eigen::Triplet<Complex>(order[(i - 1) * nx + j], k, -1));
+      }
+      if (j > 0) {
+        t.push_back(Eigen::Triplet<Complex>(k, order[i * nx + j - 1], -1));
+        t.push_back(Eigen::Triplet<Complex>(order[i * nx + j - 1], k, -1));
+      }
+    }
+  }
+  A->resize(nx * ny, nx * ny);
+  A->setFromTriplets(t.begin(), t.end());
+}
+
+// Solve A*x=b with the given mirrors and check against SparseLU, for a
+// general b and for a b that is symmetric about x=0. Return the number
+// of blocks.
+static int MirrorSolve(const CMatrix &A, const Eigen::Matrix2Xd &xy,
+                       bool mirror_x, bool mirror_y,
+                       const std::vector<double> &boxes) {
+  MirrorFactorizer<Complex> f;
+  if (mirror_x) {
+    f.AddMirror(0, 0);
+  }
+  if (mirror_y) {
+    f.AddMirror(1, 0);
+  }
+  f.SetChangingRegion(boxes);
+  {
+    NestedDissectionCoordinates coordinates(&xy);
+    f.analyzePattern(A);
+    f.factorize(A);
+  }
+  CHECK(f.info() == Eigen::Success);
+  Eigen::SparseLU<CMatrix> lu(A);
+  for (int symmetric = 0; symmetric < 2; symmetric++) {
+    CVector b(A.rows());
+    for (int i = 0; i < b.size(); i++) {
+      double x = symmetric ? fabs(xy(0, i)) : xy(0, i);
+      b[i] = Complex(cos(x + xy(1, i)), sin(3 * x));
+    }
+    CVector x = f.solve(b);
+    CVector x_lu = lu.solve(b);
+    double error = (x - x_lu).norm() / x_lu.norm();
+    printf("Blocks %d, symmetric b %d, error = %g\n",
+           f.NumBlocks(), symmetric, error);
+    CHECK(error < 1e-10);
+  }
+  return f.NumBlocks();
+}
+
+TEST_FUNCTION(MirrorFactorizer) {
+  srandom(123);
+  std::vector<double> no_boxes, boxes(4);
+  boxes[0] = -10;               // The changing region is on the near side
+  boxes[1] = -3;
+  boxes[2] = -2;
+  boxes[3] = 3;
+  CMatrix A;
+  Eigen::Matrix2Xd xy;
+
+  // Grids with and without rows on the mirror lines.
+  MirrorMatrix(31, 20, 0, &A, &xy);
+  CHECK(MirrorSolve(A, xy, false, false, no_boxes) == 1);
+  CHECK(MirrorSolve(A, xy, true, false, no_boxes) == 2);
+  CHECK(MirrorSolve(A, xy, false, true, no_boxes) == 2);
+  CHECK(MirrorSolve(A, xy, true, true, no_boxes) == 4);
+  CHECK(MirrorSolve(A, xy, true, true, boxes) == 4);
+  MirrorMatrix(30, 21, 0, &A, &xy);
+  CHECK(MirrorSolve(A, xy, true, true, no_boxes) == 4);
+  CHECK(MirrorSolve(A, xy, true, false, boxes) == 2);
+
+  // Matrices that are not symmetric are factored as a whole.
+  MirrorMatrix(31, 20, 0.01, &A, &xy);
+  CHECK(MirrorSolve(A, xy, true, false, no_boxes) == 1);
+  CHECK(MirrorSolve(A, xy, true, true, no_boxes) == 1);
+  CHECK(MirrorSolve(A, xy, false, true, no_boxes) == 2);
+
+  // Rows that are not symmetric are factored as a whole.
+  xy(0, 0) += 0.1;
+  CHECK(MirrorSolve(A, xy, false, true, no_boxes) == 1);
+}
+
+}  // namespace FEM
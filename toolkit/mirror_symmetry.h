@@ -0,0 +1,354 @@
+// Factorization of mirror symmetric systems.
+//
+// A model that is mirror symmetric about a line, with a mesh that is exactly
+// symmetric, has a system matrix that commutes with the permutation that swaps
+// the rows of mirror image points. Let (p, m(p)) be the pairs of mirror image
+// rows, with p on the far side of the line (x > c or y > c), and let f be the
+// rows on the line, which are their own images. In the orthonormal basis of
+// even vectors (e_p + e_m(p))/sqrt(2), e_f and odd vectors
+// (e_p - e_m(p))/sqrt(2) the matrix is block diagonal with blocks
+//
+//   E(p,q) = A(p,q) + A(p,m(q))          O(p,q) = A(p,q) - A(p,m(q))
+//   E(p,f) = sqrt(2) * A(p,f)
+//   E(f,p) = sqrt(2) * A(f,p)
+//   E(f,g) = A(f,g)
+//
+// E is the problem on half of the model with a "magnetic wall" (zero normal
+// derivative) on the line, and O is the problem with an "electric wall" (zero
+// value) on the line. Each block is about half the size of A, so the two of
+// them are cheaper to factor than A (factorization time and memory grow faster
+// than linearly with size), and they are factored concurrently. Solving A*x=b
+// splits b into its even and odd parts, solves one block with each and
+// recombines. Excitations that are symmetric or antisymmetric only need one
+// block solve. A second mirror line (for quarter symmetry) splits each block
+// the same way. E and O are symmetric if A is, so LDLT can still be used.
+//
+// The coordinates of the rows are taken from NestedDissectionCoordinates, so
+// the caller must create one of those around analyzePattern() and
+// factorize(). If the rows or the values of A are not mirror symmetric then A
+// is factored as a whole.
+
+#ifndef __TOOLKIT_MIRROR_SYMMETRY_H__
+#define __TOOLKIT_MIRROR_SYMMETRY_H__
+
+#include <stdint.h>
+#include <math.h>
+#include <map>
+#include <string>
+#include <memory>
+#include "myvector"
+#include "Eigen/Dense"
+#include "Eigen/Sparse"
+#include "error.h"
+#include "thread.h"
+#include "nested_dissection.h"
+#include "substructure.h"
+
+namespace FEM {
+
+// Rows are mirror images if their coordinates match to within this fraction of
+// the size of the model, and the matrix is symmetric if the mirror image
+// entries match to within this fraction of its norm.
+const double kMirrorTolerance = 1e-9;
+
+// A drop-in replacement for an Eigen sparse factorizer. The blocks (or A, if
+// it is not split) are factored by SubstructuredFactorizers. Both triangles of
+// the matrix must be set.
+template<class Scalar>
+class MirrorFactorizer {
+ public:
+  typedef Eigen::SparseMatrix<Scalar> MatrixType;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+
+  MirrorFactorizer() : solver_name_("auto"), mixed_(false),
+                       info_(Eigen::Success), num_pairs_(0) {}
+
+  // Options for the SubstructuredFactorizers. Call these before
+  // analyzePattern().
+  void SetSolver(const std::string &name) { solver_name_ = name; }
+  void SetMixedPrecision(bool mixed) { mixed_ = mixed; }
+  void SetChangingRegion(const std::vector<double> &boxes) { boxes_ = boxes; }
+
+  // Add the mirror line x == c (axis 0) or y == c (axis 1), in the units of
+  // the row coordinates. Call this before analyzePattern().
+  void AddMirror(int axis, double c) {
+    CHECK(axis == 0 || axis == 1);
+    mirrors_.push_back(std::make_pair(axis, c));
+  }
+
+  // The number of blocks that the last factored matrix was split into, or 1
+  // if it was factored as a whole.
+  int NumBlocks() const {
+    if (whole_.get()) {
+      return 1;
+    }
+    return (even_.get() ? even_->NumBlocks() : 0) +
+           (odd_.get() ? odd_->NumBlocks() : 0);
+  }
+
+  void analyzePattern(const MatrixType &A) {
+    CHECK(A.rows() == A.cols());
+    even_.reset();
+    odd_.reset();
+    whole_.reset();
+    const Eigen::Matrix2Xd *xy = NestedDissectionCoordinates::Current();
+    if (mirrors_.empty() || !xy || xy->cols() != A.rows() ||
+        !FindImages(*xy)) {
+      whole_.reset(NewWhole());
+      whole_->analyzePattern(A);
+    }
+  }
+
+  void factorize(const MatrixType &A) {
+    if (!whole_.get() && !ValuesAreSymmetric(A)) {
+      WARNING_ONCE("The model is not mirror symmetric, so its symmetry can "
+                   "not be used");
+      whole_.reset(NewWhole());
+      whole_->analyzePattern(A);
+    }
+    if (whole_.get()) {
+      whole_->factorize(A);
+      info_ = whole_->info();
+      return;
+    }
+    const Eigen::Matrix2Xd *xy = NestedDissectionCoordinates::Current();
+    CHECK(xy && xy->cols() == A.rows());
+
+    // Form the even and odd blocks.
+    const int ne = rows_.size(), no = num_pairs_;
+    const Scalar sqrt2 = std::sqrt(2.0);
+    typedef Eigen::Triplet<Scalar> Triplet;
+    std::vector<Triplet> te, to;
+    for (int j = 0; j < A.outerSize(); j++) {
+      for (typename MatrixType::InnerIterator it(A, j); it; ++it) {
+        const int r = it.row(), c = it.col();
+        const int pr = position_[r], pc = position_[c];
+        if (side_[r] > 0) {
+          if (side_[c] > 0) {
+            te.push_back(Triplet(pr, pc, it.value()));
+            to.push_back(Triplet(pr, pc, it.value()));
+          } else if (side_[c] < 0) {
+            te.push_back(Triplet(pr, pc, it.value()));
+            to.push_back(Triplet(pr, pc, -it.value()));
+          } else {
+            te.push_back(Triplet(pr, pc, sqrt2 * it.value()));
+          }
+        } else if (side_[r] == 0) {
+          // Both A(f,p) and A(f,m(p)) contribute half of E(f,p).
+          te.push_back(Triplet(pr, pc, side_[c] ? it.value() / sqrt2
+                                                : it.value()));
+        }
+      }
+    }
+    MatrixType E(ne, ne), O(no, no);
+    E.setFromTriplets(te.begin(), te.end());
+    O.setFromTriplets(to.begin(), to.end());
+
+    // Factor the blocks concurrently. Each block gets the remaining mirrors,
+    // and the changing region on both sides of this mirror.
+    Eigen::Matrix2Xd exy(2, ne);
+    for (int i = 0; i < ne; i++) {
+      exy.col(i) = xy->col(rows_[i]);
+    }
+    Eigen::Matrix2Xd oxy = exy.leftCols(no);
+    even_.reset(NewBlock());
+    odd_.reset(NewBlock());
+    MirrorFactorizer *block[2] = {even_.get(), odd_.get()};
+    const MatrixType *matrix[2] = {&E, &O};
+    const Eigen::Matrix2Xd *block_xy[2] = {&exy, &oxy};
+    ParallelFor(2, [&](int k) {
+      NestedDissectionCoordinates coordinates(block_xy[k]);
+      block[k]->analyzePattern(*matrix[k]);
+      block[k]->factorize(*matrix[k]);
+    });
+    info_ = Eigen::Success;
+    for (int k = 0; k < 2; k++) {
+      if (block[k]->info() != Eigen::Success) {
+        info_ = block[k]->info();
+      }
+    }
+  }
+
+  Eigen::ComputationInfo info() const { return info_; }
+
+  // Solve A*x=b. Like RuntimeFactorizer this is not const.
+  template<class Derived>
+  Vector solve(const Eigen::MatrixBase<Derived> &b) {
+    return solveWithGuess(b, Vector());
+  }
+
+  // Solve A*x=b starting from an approximate solution 'guess', or from
+  // nothing if it is empty (see RuntimeFactorizer::solveWithGuess). The
+  // guess is split into even and odd parts like b.
+  Vector solveWithGuess(const Vector &b, const Vector &guess) {
+    if (whole_.get()) {
+      return whole_->solveWithGuess(b, guess);
+    }
+    CHECK(even_.get() && odd_.get());
+    const int ne = rows_.size(), no = num_pairs_;
+    Vector be, bo, ge, go;
+    Split(b, &be, &bo);
+    if (guess.size()) {
+      Split(guess, &ge, &go);
+    }
+    // A zero part (e.g. for a symmetric excitation) has a zero solution.
+    Vector xe = be.isZero(0) ? Vector(Vector::Zero(ne)) :
+                               even_->solveWithGuess(be, ge);
+    Vector xo = bo.isZero(0) ? Vector(Vector::Zero(no)) :
+                               odd_->solveWithGuess(bo, go);
+    const double sqrt2 = std::sqrt(2.0);
+    Vector x(b.size());
+    for (int i = 0; i < no; i++) {
+      x[rows_[i]] = (xe[i] + xo[i]) / sqrt2;
+      x[image_[rows_[i]]] = (xe[i] - xo[i]) / sqrt2;
+    }
+    for (int i = no; i < ne; i++) {
+      x[rows_[i]] = xe[i];
+    }
+    return x;
+  }
+
+ private:
+  std::string solver_name_;
+  bool mixed_;
+  std::vector<double> boxes_;
+  std::vector<std::pair<int, double> > mirrors_;        // axis, coordinate
+  Eigen::ComputationInfo info_;
+  std::vector<int> image_;      // The mirror image of each row
+  std::vector<int> side_;       // +1 far side, 0 on the line, -1 near side
+  std::vector<int> rows_;       // Far side rows then line rows
+  std::vector<int> position_;   // Offset in rows_ of each row or its image
+  int num_pairs_;               // The number of far side rows
+  std::unique_ptr<MirrorFactorizer> even_, odd_;        // Factor E and O
+  std::unique_ptr<SubstructuredFactorizer<Scalar> > whole_;     // Or A
+
+  SubstructuredFactorizer<Scalar> *NewWhole() const {
+    SubstructuredFactorizer<Scalar> *f = new SubstructuredFactorizer<Scalar>;
+    f->SetSolver(solver_name_);
+    f->SetMixedPrecision(mixed_);
+    f->SetChangingRegion(boxes_);
+    return f;
+  }
+
+  // Split the vector 'v' into its even part 've' and odd part 'vo'.
+  void Split(const Vector &v, Vector *ve, Vector *vo) const {
+    const int ne = rows_.size(), no = num_pairs_;
+    const double sqrt2 = std::sqrt(2.0);
+    ve->resize(ne);
+    vo->resize(no);
+    for (int i = 0; i < no; i++) {
+      (*ve)[i] = (v[rows_[i]] + v[image_[rows_[i]]]) / sqrt2;
+      (*vo)[i] = (v[rows_[i]] - v[image_[rows_[i]]]) / sqrt2;
+    }
+    for (int i = no; i < ne; i++) {
+      (*ve)[i] = v[rows_[i]];
+    }
+  }
+
+  // A factorizer for a block, which only sees the far side of the mirror.
+  MirrorFactorizer *NewBlock() const {
+    const int axis = mirrors_[0].first;
+    const double c = mirrors_[0].second;
+    MirrorFactorizer *f = new MirrorFactorizer;
+    f->SetSolver(solver_name_);
+    f->SetMixedPrecision(mixed_);
+    std::vector<double> boxes = boxes_;
+    for (int i = 0; i + 3 < boxes_.size(); i += 4) {
+      boxes.insert(boxes.end(), boxes_.begin() + i, boxes_.begin() + i + 4);
+      boxes[boxes.size() - 4 + axis] = 2 * c - boxes_[i + axis];
+      boxes[boxes.size() - 2 + axis] = 2 * c - boxes_[i + 2 + axis];
+    }
+    f->SetChangingRegion(boxes);
+    f->mirrors_.assign(mirrors_.begin() + 1, mirrors_.end());
+    return f;
+  }
+
+  // Find the mirror image of each row for the first mirror. Return false if
+  // some row has no image, or if there are no pairs.
+  bool FindImages(const Eigen::Matrix2Xd &xy) {
+    const int n = xy.cols();
+    const int axis = mirrors_[0].first;
+    const double c = mirrors_[0].second;
+    if (n == 0) {
+      return false;
+    }
+    const double size = std::max(xy.row(0).maxCoeff() - xy.row(0).minCoeff(),
+                                 xy.row(1).maxCoeff() - xy.row(1).minCoeff());
+    const double tol = kMirrorTolerance * std::max(size, fabs(c));
+    if (tol == 0) {
+      return false;
+    }
+
+    // Index the rows by their coordinates rounded to the tolerance. Images
+    // are looked up in the neighboring cells too, in case the rounding of
+    // the two points went different ways.
+    typedef std::pair<int64_t, int64_t> Cell;
+    std::map<Cell, int> index;
+    for (int i = 0; i < n; i++) {
+      index[Cell(llround(xy(0, i) / tol), llround(xy(1, i) / tol))] = i;
+    }
+    image_.assign(n, -1);
+    side_.assign(n, 0);
+    for (int i = 0; i < n; i++) {
+      double d = xy(axis, i) - c;
+      if (fabs(d) <= tol) {
+        image_[i] = i;
+        continue;
+      }
+      side_[i] = d > 0 ? 1 : -1;
+      Eigen::Vector2d p = xy.col(i);
+      p[axis] = 2 * c - p[axis];
+      int64_t x = llround(p[0] / tol), y = llround(p[1] / tol);
+      for (int dx = -1; dx <= 1 && image_[i] < 0; dx++) {
+        for (int dy = -1; dy <= 1 && image_[i] < 0; dy++) {
+          auto it = index.find(Cell(x + dx, y + dy));
+          if (it != index.end() && (xy.col(it->second) - p).norm() <= tol) {
+            image_[i] = it->second;
+          }
+        }
+      }
+      if (image_[i] < 0) {
+        return false;
+      }
+    }
+
+    // Order the block rows.
+    rows_.clear();
+    position_.assign(n, -1);
+    for (int pass = 0; pass < 2; pass++) {
+      for (int i = 0; i < n; i++) {
+        if (side_[i] == 1 - pass) {
+          if (image_[image_[i]] != i) {
+            return false;
+          }
+          position_[i] = position_[image_[i]] = rows_.size();
+          rows_.push_back(i);
+        }
+      }
+      if (pass == 0) {
+        num_pairs_ = rows_.size();
+      }
+    }
+    return num_pairs_ > 0 && rows_.size() + num_pairs_ == n;
+  }
+
+  // Check that A commutes with the mirror permutation.
+  bool ValuesAreSymmetric(const MatrixType &A) const {
+    typedef Eigen::Triplet<Scalar> Triplet;
+    std::vector<Triplet> t;
+    t.reserve(A.nonZeros());
+    for (int j = 0; j < A.outerSize(); j++) {
+      for (typename MatrixType::InnerIterator it(A, j); it; ++it) {
+        t.push_back(Triplet(image_[it.row()], image_[it.col()], it.value()));
+      }
+    }
+    MatrixType B(A.rows(), A.cols());
+    B.setFromTriplets(t.begin(), t.end());
+    B -= A;
+    return B.norm() <= kMirrorTolerance * A.norm();
+  }
+};
+
+}  // namespace FEM
+
+#endif
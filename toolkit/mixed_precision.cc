@@ -0,0 +1,106 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "mixed_precision.h"
+#include "testing.h"
+
+using namespace Eigen;
+using std::vector;
+
+typedef std::complex<double> Complex;
+typedef SparseMatrix<Complex> CMatrix;
+typedef SparseLU<CMatrix, COLAMDOrdering<int> > CLU;
+typedef SparseLU<SparseMatrix<std::complex<float> >, COLAMDOrdering<int> >
+        CLULow;
+
+// Create the system matrix for an N*N 2D grid Helmholtz problem with
+// dirichlet boundary conditions: laplacian - shift*identity.
+static void HelmholtzMatrix(int N, Complex shift, CMatrix *A) {
+  vector<Triplet<Complex> > trips;
+  for (int i = 0; i < N; i++) {
+    for (int j = 0; j < N; j++) {
+      int index = i*N + j;
+      if (i > 0) trips.push_back(Triplet<Complex>(index, index-N, -1));
+      if (i < N-1) trips.push_back(Triplet<Complex>(index, index+N, -1));
+      if (j > 0) trips.push_back(Triplet<Complex>(index, index-1, -1));
+      if (j < N-1) trips.push_back(Triplet<Complex>(index, index+1, -1));
+      trips.push_back(Triplet<Complex>(index, index, Complex(4) - shift));
+    }
+  }
+  A->resize(N*N, N*N);
+  A->setFromTriplets(trips.begin(), trips.end());
+  A->makeCompressed();
+}
+
+TEST_FUNCTION(MixedPrecisionFactorizer) {
+  srandom(123);
+  const int N = 50;
+  VectorXcd b(N*N);
+  for (int i = 0; i < b.size(); i++) {
+    b[i] = Complex(random() / double(RAND_MAX), random() / double(RAND_MAX));
+  }
+
+  // A well conditioned lossy Helmholtz problem. The refined solution should
+  // match the double precision solution.
+  {
+    CMatrix A;
+    HelmholtzMatrix(N, Complex(0.5, 0.01), &A);
+    FEM::MixedPrecisionFactorizer<CLU, CLULow> mixed, full;
+    mixed.SetMixedPrecision(true);
+    mixed.analyzePattern(A);
+    mixed.factorize(A);
+    full.analyzePattern(A);
+    full.factorize(A);
+    CHECK(mixed.info() == Success && full.info() == Success);
+    VectorXcd x1 = mixed.solve(b);
+    VectorXcd x2 = full.solve(b);
+    printf("Refinements = %d, error = %e\n", mixed.NumRefinements(),
+           (x1 - x2).norm() / x2.norm());
+    CHECK(mixed.IsMixedPrecision());
+    CHECK(mixed.NumRefinements() > 0);
+    CHECK(!full.IsMixedPrecision() && full.NumRefinements() == 0);
+    CHECK((x1 - x2).norm() < 1e-11 * x2.norm());
+    CHECK((A * x1 - b).norm() < 1e-12 * b.norm());
+  }
+
+  // Near a resonance the solution is large, so |A|*|x| is much bigger than |b|
+  // and not even double precision LU gets the residual to 1e-13*|b|. This is
+  // still well enough conditioned for refinement to reach the backward error
+  // of double precision, so it should stay in mixed precision.
+  {
+    double lambda1 = 4 - 4*cos(M_PI / (N + 1));
+    CMatrix A;
+    HelmholtzMatrix(N, lambda1 - 1e-4, &A);
+    FEM::MixedPrecisionFactorizer<CLU, CLULow> mixed, full;
+    mixed.SetMixedPrecision(true);
+    mixed.analyzePattern(A);
+    mixed.factorize(A);
+    full.analyzePattern(A);
+    full.factorize(A);
+    VectorXcd x1 = mixed.solve(b);
+    VectorXcd x2 = full.solve(b);
+    printf("Near resonance: refinements = %d, error = %e, residual = %e "
+           "(double precision %e)\n", mixed.NumRefinements(),
+           (x1 - x2).norm() / x2.norm(), (A * x1 - b).norm() / b.norm(),
+           (A * x2 - b).norm() / b.norm());
+    CHECK(mixed.IsMixedPrecision());
+    CHECK((x1 - x2).norm() < 1e-9 * x2.norm());
+  }
+
+  // A problem with a shift very close to the lowest eigenvalue is too ill
+  // conditioned for single precision, so we should fall back to double.
+  {
+    double lambda1 = 4 - 4*cos(M_PI / (N + 1));
+    CMatrix A;
+    HelmholtzMatrix(N, lambda1 - 1e-9, &A);
+    FEM::MixedPrecisionFactorizer<CLU, CLULow> mixed;
+    mixed.SetMixedPrecision(true);
+    mixed.analyzePattern(A);
+    mixed.factorize(A);
+    CHECK(mixed.info() == Success);
+    VectorXcd x = mixed.solve(b);
+    CHECK(!mixed.IsMixedPrecision());
+    CHECK((A * x - b).norm() < 1e-6 * b.norm());
+  }
+}
@@ -0,0 +1,164 @@
+// Mixed precision sparse factorization with iterative refinement.
+//
+// The cost of factoring a large sparse system is dominated by memory traffic
+// in the factor. Factoring in single precision halves the size of the factor
+// and speeds up the factorization, but gives solutions that are only accurate
+// to about 1e-7. Iterative refinement recovers double precision accuracy: with
+// the single precision factor M^-1 of A we repeat
+//
+//   r = b - A*x    (in double precision)
+//   x = x + M^-1 * r
+//
+// which converges as long as A is not too ill conditioned for single
+// precision. Refinement stops when the backward error is at the level of
+// double precision rounding, i.e. |r| <= c*eps*(|A|*|x| + |b|) in the infinity
+// norm, which is as good as a double precision factor would do on the same
+// system however it is scaled. If the refinement stagnates before that we
+// fall back to factoring A in double precision.
+
+#ifndef __TOOLKIT_MIXED_PRECISION_H__
+#define __TOOLKIT_MIXED_PRECISION_H__
+
+#include <float.h>
+#include <complex>
+#include "Eigen/Dense"
+#include "Eigen/Sparse"
+#include "error.h"
+
+namespace FEM {
+
+// The single precision version of a real or complex type.
+template<class T> struct LowPrecision {};
+template<> struct LowPrecision<double> { typedef float Type; };
+template<> struct LowPrecision<std::complex<double> > {
+  typedef std::complex<float> Type;
+};
+
+// A drop-in replacement for an Eigen sparse factorizer. 'Factorizer' is the
+// double precision factorizer and 'LowFactorizer' is the same factorizer with
+// a single precision scalar type. By default this just uses 'Factorizer', call
+// SetMixedPrecision(true) before analyzePattern() to use LowFactorizer with
+// iterative refinement.
+template<class Factorizer, class LowFactorizer>
+class MixedPrecisionFactorizer {
+ public:
+  typedef typename Factorizer::MatrixType MatrixType;
+  typedef typename MatrixType::Scalar Scalar;
+  typedef typename LowFactorizer::MatrixType::Scalar LowScalar;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+  typedef Eigen::Matrix<LowScalar, Eigen::Dynamic, 1> LowVector;
+
+  MixedPrecisionFactorizer() : mixed_(false), info_(Eigen::Success),
+                               num_refinements_(0), Anorm_(0) {}
+
+  // Choose mixed precision (true) or double precision (false).
+  void SetMixedPrecision(bool mixed) { mixed_ = mixed; }
+
+  // Return true if the single precision factor is being used. This becomes
+  // false if refinement fails.
+  bool IsMixedPrecision() const { return mixed_; }
+
+  // The total number of refinement steps done by all calls to solve().
+  int NumRefinements() const { return num_refinements_; }
+
+  void analyzePattern(const MatrixType &A) {
+    if (mixed_) {
+      low_.analyzePattern(A.template cast<LowScalar>());
+    } else {
+      high_.analyzePattern(A);
+    }
+  }
+
+  void factorize(const MatrixType &A) {
+    if (mixed_) {
+      // The double precision matrix is kept for computing residuals. It is
+      // much smaller than the factor.
+      A_ = A;
+      Anorm_ = InfinityNorm(A_);
+      low_.factorize(A_.template cast<LowScalar>());
+      if (low_.info() == Eigen::Success) {
+        info_ = Eigen::Success;
+        return;
+      }
+      FallBack();
+    } else {
+      high_.factorize(A);
+      info_ = high_.info();
+    }
+  }
+
+  Eigen::ComputationInfo info() const { return info_; }
+
+  // Solve A*x=b. This is not const (unlike Eigen's solve()) because it may
+  // need to fall back to the double precision factorization.
+  template<class Derived>
+  Vector solve(const Eigen::MatrixBase<Derived> &b) {
+    if (!mixed_) {
+      return high_.solve(b);
+    }
+    const int kMaxRefinements = 10;
+    const double kBackwardError = 16 * DBL_EPSILON;
+    const double kStagnation = 0.5;
+    Vector rhs = b;
+    const double bnorm = rhs.template lpNorm<Eigen::Infinity>();
+    Vector x = low_.solve(rhs.template cast<LowScalar>()).template
+               cast<Scalar>();
+    double last_rnorm = HUGE_VAL;
+    for (int i = 0; i < kMaxRefinements; i++) {
+      Vector r = rhs - A_ * x;
+      double rnorm = r.template lpNorm<Eigen::Infinity>();
+      double xnorm = x.template lpNorm<Eigen::Infinity>();
+      if (rnorm <= kBackwardError * (Anorm_ * xnorm + bnorm)) {
+        return x;
+      }
+      if (!(rnorm < kStagnation * last_rnorm)) {
+        break;                  // Stagnated, or NaN from a bad factor
+      }
+      last_rnorm = rnorm;
+      x += low_.solve(r.template cast<LowScalar>()).template cast<Scalar>();
+      num_refinements_++;
+    }
+
+    // Refinement did not converge, so A is too ill conditioned for the single
+    // precision factor. Use double precision from now on.
+    FallBack();
+    if (info_ != Eigen::Success) {
+      return Vector::Constant(rhs.size(), Scalar(NAN));
+    }
+    return high_.solve(rhs);
+  }
+
+ private:
+  bool mixed_;
+  Eigen::ComputationInfo info_;
+  int num_refinements_;
+  MatrixType A_;                // Copy of A, in mixed precision mode
+  double Anorm_;                // Infinity norm of A_
+  Factorizer high_;
+  LowFactorizer low_;
+
+  // The maximum absolute row sum of A.
+  static double InfinityNorm(const MatrixType &A) {
+    Eigen::VectorXd row_sum = Eigen::VectorXd::Zero(A.rows());
+    for (int k = 0; k < A.outerSize(); k++) {
+      for (typename MatrixType::InnerIterator it(A, k); it; ++it) {
+        row_sum[it.row()] += std::abs(it.value());
+      }
+    }
+    return A.rows() ? row_sum.maxCoeff() : 0;
+  }
+
+  // Switch to factoring A_ in double precision.
+  void FallBack() {
+    Warning("Mixed precision factorization failed, using double precision");
+    mixed_ = false;
+    high_.analyzePattern(A_);
+    high_.factorize(A_);
+    info_ = high_.info();
+    A_ = MatrixType();
+  }
+};
+
+}  // namespace FEM
+
+#endif
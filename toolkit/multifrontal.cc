@@ -0,0 +1,117 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "multifrontal.h"
+#include "testing.h"
+
+using namespace Eigen;
+using std::vector;
+
+typedef std::complex<double> Complex;
+
+// Create the lower triangle of the N*N 2D grid laplacian with dirichlet
+// boundary conditions, minus shift*identity.
+template<class T>
+static void LaplacianMatrix(int N, T shift, SparseMatrix<T> *A) {
+  vector<Triplet<T> > trips;
+  for (int i = 0; i < N; i++) {
+    for (int j = 0; j < N; j++) {
+      int index = i*N + j;
+      if (i < N-1) trips.push_back(Triplet<T>(index+N, index, -1));
+      if (j < N-1) trips.push_back(Triplet<T>(index+1, index, -1));
+      trips.push_back(Triplet<T>(index, index, T(4) - shift));
+    }
+  }
+  A->resize(N*N, N*N);
+  A->setFromTriplets(trips.begin(), trips.end());
+  A->makeCompressed();
+}
+
+// Factor A with MultifrontalLDLT and check the solution against SparseLU.
+template<class T>
+static void CheckMultifrontal(const SparseMatrix<T> &A) {
+  typedef Matrix<T, Dynamic, Dynamic> Dense;
+  SparseMatrix<T> full = A.template selfadjointView<Lower>();
+  for (int k = 0; k < full.outerSize(); k++) {
+    // selfadjointView() conjugates the upper triangle, we want the transpose.
+    for (typename SparseMatrix<T>::InnerIterator it(full, k); it; ++it) {
+      if (it.row() < it.col()) {
+        it.valueRef() = A.coeff(it.col(), it.row());
+      }
+    }
+  }
+  Dense b = Dense::Random(A.rows(), 3);
+  FEM::MultifrontalLDLT<SparseMatrix<T> > mf(A);
+  CHECK(mf.info() == Success);
+  SparseLU<SparseMatrix<T> > lu(full);
+  CHECK(lu.info() == Success);
+  Dense x1 = mf.solve(b);
+  Dense x2 = lu.solve(b);
+  printf("n=%d, supernodes=%d, nnz(L)=%d, error=%e\n", int(A.rows()),
+         mf.NumSupernodes(), int(mf.NonZerosInL()),
+         (x1 - x2).norm() / x2.norm());
+  CHECK((x1 - x2).norm() < 1e-10 * x2.norm());
+  CHECK((full * x1 - b).norm() < 1e-10 * b.norm());
+
+  // Factor again with the same pattern and single right hand side.
+  mf.factorize(A);
+  CHECK(mf.info() == Success);
+  Matrix<T, Dynamic, 1> x3 = mf.solve(b.col(0));
+  CHECK((x3 - x2.col(0)).norm() < 1e-10 * x2.norm());
+}
+
+TEST_FUNCTION(MultifrontalLDLT) {
+  srandom(123);
+  const int N = 40;
+
+  // Positive definite.
+  SparseMatrix<double> A;
+  LaplacianMatrix<double>(N, 0, &A);
+  CheckMultifrontal(A);
+
+  // Indefinite. The inertia should match SimplicialLDLT.
+  LaplacianMatrix<double>(N, 1.234, &A);
+  CheckMultifrontal(A);
+  {
+    FEM::MultifrontalLDLT<SparseMatrix<double> > mf(A);
+    SimplicialLDLT<SparseMatrix<double> > ldlt(A);
+    CHECK(mf.info() == Success && ldlt.info() == Success);
+    int n1 = 0, n2 = 0;
+    for (int i = 0; i < A.rows(); i++) {
+      n1 += mf.vectorD()[i] < 0;
+      n2 += ldlt.vectorD()[i] < 0;
+    }
+    printf("Negative eigenvalues = %d, %d\n", n1, n2);
+    CHECK(n1 == n2 && n1 > 0);
+  }
+
+  // Complex symmetric.
+  SparseMatrix<Complex> C;
+  LaplacianMatrix<Complex>(N, Complex(1.234, 0.5), &C);
+  CheckMultifrontal(C);
+
+  // Disconnected components give a forest.
+  SparseMatrix<double> B(2 * A.rows(), 2 * A.rows());
+  {
+    vector<Triplet<double> > trips;
+    for (int k = 0; k < A.outerSize(); k++) {
+      for (SparseMatrix<double>::InnerIterator it(A, k); it; ++it) {
+        trips.push_back(Triplet<double>(it.row(), it.col(), it.value()));
+        trips.push_back(Triplet<double>(it.row() + A.rows(),
+                                        it.col() + A.rows(), it.value()));
+      }
+    }
+    B.setFromTriplets(trips.begin(), trips.end());
+    B.makeCompressed();
+  }
+  CheckMultifrontal(B);
+
+  // A zero pivot is detected.
+  SparseMatrix<double> Z(2, 2);
+  Z.insert(1, 0) = 1;
+  Z.insert(1, 1) = 1;
+  Z.makeCompressed();
+  FEM::MultifrontalLDLT<SparseMatrix<double>, NaturalOrdering<int> > mf(Z);
+  CHECK(mf.info() == NumericalIssue);
+}
@@ -0,0 +1,522 @@
+// Multifrontal sparse LDL' factorization.
+//
+// This factors a sparse symmetric matrix A as P'*L*D*L'*P, where P is a fill
+// reducing permutation, L is unit lower triangular and D is diagonal. Note that
+// L' is the transpose and not the adjoint, so for complex matrices this
+// handles complex symmetric (not hermitian) matrices. There is no pivoting, so
+// A must be positive definite or at least not have any zero pivots.
+//
+// The columns of L are grouped into supernodes, which are runs of columns
+// with the same sparsity structure. Each supernode is factored as a small
+// dense "frontal" matrix which is assembled from the entries of A and the
+// update (Schur complement) matrices of its children in the supernodal
+// elimination tree. Factoring a front produces the dense columns of L for the
+// supernode and an update matrix for its parent. The dense work is done with
+// Eigen's blocked matrix products. Supernodes that are not ancestors of each
+// other are independent, so the tree is processed as a task graph: each
+// supernode becomes ready when all of its children are done, and ready
+// supernodes are factored by a pool of threads.
+//
+// The interface is the same as Eigen's sparse factorizers (e.g.
+// SimplicialLDLT) so this can be used as a drop-in replacement.
+
+#ifndef __TOOLKIT_MULTIFRONTAL_H__
+#define __TOOLKIT_MULTIFRONTAL_H__
+
+#include <algorithm>
+#include "myvector"
+#include "Eigen/Dense"
+#include "Eigen/Sparse"
+#include "error.h"
+#include "thread.h"
+
+namespace FEM {
+
+template<class _MatrixType, class _Ordering = Eigen::AMDOrdering<int> >
+class MultifrontalLDLT {
+ public:
+  typedef _MatrixType MatrixType;
+  typedef _Ordering OrderingType;
+  typedef typename MatrixType::Scalar Scalar;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> DenseMatrix;
+  typedef Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic, int>
+          Permutation;
+
+  MultifrontalLDLT() : info_(Eigen::Success), analyzed_(false) {}
+  explicit MultifrontalLDLT(const MatrixType &A)
+      : info_(Eigen::Success), analyzed_(false) {
+    compute(A);
+  }
+
+  // Only the lower triangle of A is used. A must be compressed. The pattern
+  // given to factorize() must be the same as the one given to
+  // analyzePattern().
+  void compute(const MatrixType &A) {
+    analyzePattern(A);
+    factorize(A);
+  }
+  void analyzePattern(const MatrixType &A);
+  void factorize(const MatrixType &A);
+
+  // Return Success, or NumericalIssue if a zero pivot was found.
+  Eigen::ComputationInfo info() const { return info_; }
+
+  // Solve A*x=b.
+  template<class Rhs>
+  Eigen::Matrix<Scalar, Eigen::Dynamic, Rhs::ColsAtCompileTime>
+  solve(const Eigen::MatrixBase<Rhs> &b) const;
+
+  // The diagonal D, in permuted order. The number of negative entries is the
+  // number of negative eigenvalues of A (for real A).
+  const Vector &vectorD() const { return D_; }
+
+  // The permutation P.
+  const Permutation &permutationP() const { return P_; }
+
+  // Sizes, for testing and statistics.
+  int rows() const { return P_.size(); }
+  int NumSupernodes() const { return supernodes_.size(); }
+  size_t NonZerosInL() const;
+
+ private:
+  struct Supernode {
+    int first, end;             // Columns first..end-1
+    int parent;                 // Parent supernode, or -1 for a root
+    std::vector<int> children;  // Child supernodes
+    std::vector<int> rows;      // Front rows, starting with first..end-1
+    std::vector<int> parent_map;        // Parent front row of rows[k...]
+    int a_begin, a_end;         // Range of a_src_ and a_dst_ for assembly
+  };
+
+  Eigen::ComputationInfo info_;
+  bool analyzed_;
+  Permutation P_;
+  int a_nonzeros_;                      // Nonzeros in A (all triangles)
+  std::vector<Supernode> supernodes_;
+  std::vector<int> a_src_, a_dst_;      // A value index -> front offset
+  std::vector<DenseMatrix> L_;          // Dense columns of each supernode
+  Vector D_;
+
+  // Factor a supernode given the update matrices of its children. Return
+  // false on a zero pivot.
+  bool FactorSupernode(int s, const MatrixType &A,
+                       std::vector<DenseMatrix> *updates);
+};
+
+template<class M, class O>
+void MultifrontalLDLT<M, O>::analyzePattern(const MatrixType &A) {
+  CHECK(A.rows() == A.cols());
+  CHECK(A.isCompressed());
+  const int n = A.rows();
+  a_nonzeros_ = A.nonZeros();
+
+  // Fill reducing ordering. Eigen's orderings return the inverse permutation,
+  // or an empty permutation for the natural ordering.
+  {
+    Permutation Pinv;
+    OrderingType ordering;
+    ordering(A, Pinv);
+    if (Pinv.size() == n) {
+      P_ = Pinv.inverse();
+    } else {
+      P_.setIdentity(n);
+    }
+  }
+
+  // Compute the elimination tree for the permuted matrix, then renumber the
+  // columns in postorder so that the columns of each subtree (and therefore
+  // each supernode) are contiguous. The second pass computes the tree of the
+  // postordered matrix.
+  std::vector<int> parent(n), up_begin, up;
+  for (int pass = 0; pass < 2; pass++) {
+    // Build 'up', the lists of off-diagonal row indexes in the upper triangle
+    // of each column of the permuted matrix.
+    up_begin.assign(n + 1, 0);
+    for (int j = 0; j < n; j++) {
+      for (typename MatrixType::InnerIterator it(A, j); it; ++it) {
+        if (it.row() > j) {
+          up_begin[std::max(P_.indices()[it.row()], P_.indices()[j]) + 1]++;
+        }
+      }
+    }
+    for (int i = 0; i < n; i++) {
+      up_begin[i + 1] += up_begin[i];
+    }
+    up.resize(up_begin[n]);
+    std::vector<int> fill(up_begin);
+    for (int j = 0; j < n; j++) {
+      for (typename MatrixType::InnerIterator it(A, j); it; ++it) {
+        if (it.row() > j) {
+          int pi = P_.indices()[it.row()], pj = P_.indices()[j];
+          up[fill[std::max(pi, pj)]++] = std::min(pi, pj);
+        }
+      }
+    }
+
+    // Elimination tree, with path compression.
+    std::vector<int> ancestor(n);
+    for (int k = 0; k < n; k++) {
+      parent[k] = -1;
+      ancestor[k] = -1;
+      for (int p = up_begin[k]; p < up_begin[k + 1]; p++) {
+        for (int i = up[p]; i != -1 && i < k; ) {
+          int next = ancestor[i];
+          ancestor[i] = k;
+          if (next == -1) {
+            parent[i] = k;
+          }
+          i = next;
+        }
+      }
+    }
+    if (pass == 1) {
+      break;
+    }
+
+    // Postorder the tree. Children are visited in increasing order.
+    std::vector<int> head(n, -1), next(n, -1), stack, post;
+    for (int j = n - 1; j >= 0; j--) {
+      if (parent[j] != -1) {
+        next[j] = head[parent[j]];
+        head[parent[j]] = j;
+      }
+    }
+    post.reserve(n);
+    for (int root = 0; root < n; root++) {
+      if (parent[root] != -1) {
+        continue;
+      }
+      stack.push_back(root);
+      while (!stack.empty()) {
+        int j = stack.back();
+        if (head[j] != -1) {
+          int child = head[j];
+          head[j] = next[child];
+          stack.push_back(child);
+        } else {
+          stack.pop_back();
+          post.push_back(j);
+        }
+      }
+    }
+    CHECK(post.size() == n);
+    std::vector<int> position(n);
+    for (int i = 0; i < n; i++) {
+      position[post[i]] = i;
+    }
+    for (int i = 0; i < n; i++) {
+      P_.indices()[i] = position[P_.indices()[i]];
+    }
+  }
+
+  // Lists of the off-diagonal rows in the lower triangle of each column.
+  std::vector<int> down_begin(n + 1, 0), down(up.size());
+  for (int i = 0; i < up.size(); i++) {
+    down_begin[up[i] + 1]++;
+  }
+  for (int i = 0; i < n; i++) {
+    down_begin[i + 1] += down_begin[i];
+  }
+  {
+    std::vector<int> fill(down_begin);
+    for (int k = 0; k < n; k++) {
+      for (int p = up_begin[k]; p < up_begin[k + 1]; p++) {
+        down[fill[up[p]]++] = k;
+      }
+    }
+  }
+
+  // Symbolic factorization. The structure of column j of L is j, the rows of
+  // A below the diagonal, and the structures of the children of j (excluding
+  // the children themselves). A new supernode starts at column j unless j is
+  // the parent of j-1 and has the same structure as j-1 without row j-1.
+  std::vector<std::vector<int> > structure(n);
+  std::vector<int> marker(n, -1), column_supernode(n);
+  std::vector<std::vector<int> > kids(n);
+  for (int j = 0; j < n; j++) {
+    if (parent[j] != -1) {
+      kids[parent[j]].push_back(j);
+    }
+  }
+  supernodes_.clear();
+  for (int j = 0; j < n; j++) {
+    std::vector<int> &s = structure[j];
+    s.push_back(j);
+    marker[j] = j;
+    for (int p = down_begin[j]; p < down_begin[j + 1]; p++) {
+      if (marker[down[p]] != j) {
+        marker[down[p]] = j;
+        s.push_back(down[p]);
+      }
+    }
+    for (int c = 0; c < kids[j].size(); c++) {
+      std::vector<int> &cs = structure[kids[j][c]];
+      for (int i = 1; i < cs.size(); i++) {
+        if (marker[cs[i]] != j) {
+          marker[cs[i]] = j;
+          s.push_back(cs[i]);
+        }
+      }
+    }
+    std::sort(s.begin(), s.end());
+    if (j > 0 && parent[j - 1] == j &&
+        structure[j - 1].size() == s.size() + 1) {
+      supernodes_.back().end = j + 1;
+    } else {
+      supernodes_.push_back(Supernode());
+      supernodes_.back().first = j;
+      supernodes_.back().end = j + 1;
+    }
+    column_supernode[j] = supernodes_.size() - 1;
+  }
+
+  // Supernode rows and tree.
+  const int ns = supernodes_.size();
+  for (int s = 0; s < ns; s++) {
+    Supernode &sn = supernodes_[s];
+    sn.rows.swap(structure[sn.first]);
+    int p = parent[sn.end - 1];
+    sn.parent = (p == -1) ? -1 : column_supernode[p];
+    if (sn.parent != -1) {
+      supernodes_[sn.parent].children.push_back(s);
+    }
+  }
+  structure.clear();
+
+  // Map the update rows of each supernode to the rows of its parent's front.
+  for (int s = 0; s < ns; s++) {
+    Supernode &sn = supernodes_[s];
+    const int k = sn.end - sn.first;
+    sn.parent_map.clear();
+    if (sn.parent == -1) {
+      CHECK(sn.rows.size() == k);
+      continue;
+    }
+    const std::vector<int> &prows = supernodes_[sn.parent].rows;
+    for (int i = k; i < sn.rows.size(); i++) {
+      sn.parent_map.push_back(std::lower_bound(prows.begin(), prows.end(),
+                                               sn.rows[i]) - prows.begin());
+      CHECK(prows[sn.parent_map.back()] == sn.rows[i]);
+    }
+  }
+
+  // Map each entry in the lower triangle of A to an offset in the front of
+  // the supernode that contains its (permuted) column.
+  std::vector<int> count(ns + 1, 0);
+  for (int j = 0; j < n; j++) {
+    for (typename MatrixType::InnerIterator it(A, j); it; ++it) {
+      if (it.row() >= j) {
+        int pj = std::min(P_.indices()[it.row()], P_.indices()[j]);
+        count[column_supernode[pj] + 1]++;
+      }
+    }
+  }
+  for (int s = 0; s < ns; s++) {
+    count[s + 1] += count[s];
+    supernodes_[s].a_begin = count[s];
+    supernodes_[s].a_end = count[s + 1];
+  }
+  a_src_.resize(count[ns]);
+  a_dst_.resize(count[ns]);
+  const typename MatrixType::StorageIndex *outer = A.outerIndexPtr();
+  const typename MatrixType::StorageIndex *inner = A.innerIndexPtr();
+  for (int j = 0; j < n; j++) {
+    for (int p = outer[j]; p < outer[j + 1]; p++) {
+      if (inner[p] >= j) {
+        int pi = P_.indices()[inner[p]], pj = P_.indices()[j];
+        if (pi < pj) {
+          std::swap(pi, pj);
+        }
+        int s = column_supernode[pj];
+        const Supernode &sn = supernodes_[s];
+        int row = std::lower_bound(sn.rows.begin(), sn.rows.end(), pi) -
+                  sn.rows.begin();
+        CHECK(sn.rows[row] == pi);
+        int q = count[s]++;
+        a_src_[q] = p;
+        a_dst_[q] = row + (pj - sn.first) * int(sn.rows.size());
+      }
+    }
+  }
+  L_.clear();
+  L_.resize(ns);
+  D_.resize(n);
+  analyzed_ = true;
+}
+
+template<class M, class O>
+bool MultifrontalLDLT<M, O>::FactorSupernode(int s, const MatrixType &A,
+                                             std::vector<DenseMatrix> *updates) {
+  const Supernode &sn = supernodes_[s];
+  const int m = sn.rows.size();
+  const int k = sn.end - sn.first;
+
+  // Assemble the front from A and the children's update matrices. Only the
+  // lower triangle is used.
+  DenseMatrix F = DenseMatrix::Zero(m, m);
+  const Scalar *values = A.valuePtr();
+  for (int p = sn.a_begin; p < sn.a_end; p++) {
+    F.data()[a_dst_[p]] += values[a_src_[p]];
+  }
+  for (int c = 0; c < sn.children.size(); c++) {
+    const Supernode &child = supernodes_[sn.children[c]];
+    DenseMatrix &U = (*updates)[sn.children[c]];
+    const std::vector<int> &map = child.parent_map;
+    for (int j = 0; j < U.cols(); j++) {
+      Scalar *Fcol = &F(0, map[j]);
+      for (int i = j; i < U.rows(); i++) {
+        Fcol[map[i]] += U(i, j);
+      }
+    }
+    U.resize(0, 0);
+  }
+
+  // Factor the first k columns.
+  for (int j = 0; j < k; j++) {
+    Scalar d = F(j, j);
+    if (d == Scalar(0)) {
+      return false;
+    }
+    D_[sn.first + j] = d;
+    for (int jj = j + 1; jj < k; jj++) {
+      F.col(jj).tail(m - jj) -= (F(jj, j) / d) * F.col(j).tail(m - jj);
+    }
+    F.col(j).tail(m - j - 1) /= d;
+  }
+
+  // Compute the update matrix F22 - L21*D*L21'.
+  if (m > k) {
+    DenseMatrix W = F.bottomLeftCorner(m - k, k) *
+                    D_.segment(sn.first, k).asDiagonal();
+    DenseMatrix &U = (*updates)[s];
+    U = F.bottomRightCorner(m - k, m - k);
+    U.template triangularView<Eigen::Lower>() -=
+        W * F.bottomLeftCorner(m - k, k).transpose();
+  }
+  L_[s] = F.leftCols(k);
+  return true;
+}
+
+template<class M, class O>
+void MultifrontalLDLT<M, O>::factorize(const MatrixType &A) {
+  CHECK(analyzed_);
+  CHECK(A.rows() == P_.size() && A.nonZeros() == a_nonzeros_);
+  CHECK(A.isCompressed());
+  const int ns = supernodes_.size();
+  std::vector<DenseMatrix> updates(ns);
+
+  // Factor supernodes as they become ready, i.e. when all their children are
+  // done. Threads wait for work if none is ready.
+  struct State {
+    Mutex mutex;
+    ConditionVariable cond;
+    std::vector<int> ready, pending;
+    int remaining;
+    bool failed;
+    State() : cond(mutex) {}
+  } state;
+  state.remaining = ns;
+  state.failed = false;
+  state.pending.resize(ns);
+  for (int s = 0; s < ns; s++) {
+    state.pending[s] = supernodes_[s].children.size();
+    if (state.pending[s] == 0) {
+      state.ready.push_back(s);
+    }
+  }
+  ParallelFor(NumberOfCores(), [&](int thread) {
+    for (;;) {
+      int s;
+      {
+        MutexLock lock(&state.mutex);
+        while (state.ready.empty() && state.remaining > 0 && !state.failed) {
+          state.cond.Wait();
+        }
+        if (state.remaining == 0 || state.failed) {
+          return;
+        }
+        s = state.ready.back();
+        state.ready.pop_back();
+      }
+      bool ok = FactorSupernode(s, A, &updates);
+      {
+        MutexLock lock(&state.mutex);
+        if (!ok) {
+          state.failed = true;
+        } else {
+          state.remaining--;
+          int p = supernodes_[s].parent;
+          if (p != -1 && --state.pending[p] == 0) {
+            state.ready.push_back(p);
+          }
+        }
+        state.cond.Broadcast();
+      }
+    }
+  });
+  info_ = state.failed ? Eigen::NumericalIssue : Eigen::Success;
+}
+
+template<class M, class O>
+template<class Rhs>
+Eigen::Matrix<typename M::Scalar, Eigen::Dynamic, Rhs::ColsAtCompileTime>
+MultifrontalLDLT<M, O>::solve(const Eigen::MatrixBase<Rhs> &b) const {
+  CHECK(info_ == Eigen::Success);
+  CHECK(b.rows() == P_.size());
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Rhs::ColsAtCompileTime> Result;
+  Result X = P_ * b;
+  const int ns = supernodes_.size();
+
+  // Solve L*y = P*b.
+  for (int s = 0; s < ns; s++) {
+    const Supernode &sn = supernodes_[s];
+    const int k = sn.end - sn.first;
+    const int m = sn.rows.size();
+    auto Xs = X.middleRows(sn.first, k);
+    L_[s].topRows(k).template triangularView<Eigen::UnitLower>().
+        solveInPlace(Xs);
+    if (m > k) {
+      DenseMatrix T = L_[s].bottomRows(m - k) * Xs;
+      for (int i = 0; i < m - k; i++) {
+        X.row(sn.rows[k + i]) -= T.row(i);
+      }
+    }
+  }
+
+  // Solve D*z = y.
+  X = D_.asDiagonal().inverse() * X;
+
+  // Solve L'*x = z.
+  for (int s = ns - 1; s >= 0; s--) {
+    const Supernode &sn = supernodes_[s];
+    const int k = sn.end - sn.first;
+    const int m = sn.rows.size();
+    auto Xs = X.middleRows(sn.first, k);
+    if (m > k) {
+      DenseMatrix G(m - k, X.cols());
+      for (int i = 0; i < m - k; i++) {
+        G.row(i) = X.row(sn.rows[k + i]);
+      }
+      Xs -= L_[s].bottomRows(m - k).transpose() * G;
+    }
+    L_[s].topRows(k).transpose().
+        template triangularView<Eigen::UnitUpper>().solveInPlace(Xs);
+  }
+  return P_.inverse() * X;
+}
+
+template<class M, class O>
+size_t MultifrontalLDLT<M, O>::NonZerosInL() const {
+  size_t count = 0;
+  for (int s = 0; s < supernodes_.size(); s++) {
+    int k = supernodes_[s].end - supernodes_[s].first;
+    int m = supernodes_[s].rows.size();
+    count += size_t(k) * m - size_t(k) * (k + 1) / 2;
+  }
+  return count;
+}
+
+}  // namespace FEM
+
+#endif
@@ -0,0 +1,124 @@
+
+// Testing for AlgebraicMultigrid.
+
+#include "multigrid.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "testing.h"
+
+namespace FEM {
+
+typedef std::complex<double> Complex;
+typedef Eigen::SparseMatrix<Complex> CMatrix;
+
+// The Helmholtz matrix K - k^2*M for the unit square, with 5 point stencils
+// on an N*N grid (the same as linear triangles with a lumped mass), where 'k'
+// is the wavenumber. The left edge is Dirichlet and the others have a first
+// order absorbing boundary.
+static void HelmholtzTestMatrix(int N, double k, CMatrix *A) {
+  const double h = 1.0 / N;
+  std::vector<Eigen::Triplet<Complex> > t;
+  for (int i = 0; i < N; i++) {
+    for (int j = 0; j < N; j++) {
+      int index = i * N + j;
+      Complex diagonal = 4.0 - k * k * h * h;
+      if (i > 0) t.push_back(Eigen::Triplet<Complex>(index, index - N, -1));
+      if (i < N - 1) t.push_back(Eigen::Triplet<Complex>(index, index + N, -1));
+      if (j > 0) t.push_back(Eigen::Triplet<Complex>(index, index - 1, -1));
+      if (j < N - 1) t.push_back(Eigen::Triplet<Complex>(index, index + 1, -1));
+      if (i == 0 || i == N - 1) diagonal += Complex(-1, -k * h);
+      if (j == N - 1) diagonal += Complex(-1, -k * h);
+      t.push_back(Eigen::Triplet<Complex>(index, index, diagonal));
+    }
+  }
+  A->resize(N * N, N * N);
+  A->setFromTriplets(t.begin(), t.end());
+  A->makeCompressed();
+}
+
+// Solve A*x=b for a random b by BiCGSTAB with the Preconditioner, and return
+// the number of iterations.
+template<class Preconditioner>
+static int Iterations(const CMatrix &A) {
+  Eigen::VectorXcd b = Eigen::VectorXcd::Random(A.rows());
+  Eigen::BiCGSTAB<CMatrix, Preconditioner> solver;
+  solver.setTolerance(1e-8);
+  solver.setMaxIterations(2000);
+  solver.compute(A);
+  Eigen::VectorXcd x = solver.solve(b);
+  CHECK(solver.info() == Eigen::Success);
+  CHECK((A * x - b).norm() < 1e-7 * b.norm());
+  return solver.iterations();
+}
+
+TEST_FUNCTION(AlgebraicMultigrid) {
+  srandom(123);
+
+  // For the Laplacian (k=0) the V-cycle alone converges quickly, and the
+  // work per cycle is a small multiple of a matrix multiply.
+  {
+    CMatrix A;
+    HelmholtzTestMatrix(64, 0, &A);
+    AlgebraicMultigrid<Complex> amg;
+    amg.compute(A);
+    CHECK(amg.info() == Eigen::Success);
+    printf("Levels = %d, operator complexity = %g\n", amg.NumLevels(),
+           amg.OperatorComplexity());
+    CHECK(amg.NumLevels() >= 3);
+    CHECK(amg.OperatorComplexity() < 2);
+    Eigen::VectorXcd b = Eigen::VectorXcd::Random(A.rows());
+    Eigen::VectorXcd x = Eigen::VectorXcd::Zero(A.rows());
+    double r0 = b.norm(), r = r0;
+    for (int i = 0; i < 10; i++) {
+      x += amg.solve(b - A * x);
+      r = (b - A * x).norm();
+    }
+    printf("Laplacian residual reduction per V-cycle = %g\n",
+           pow(r / r0, 0.1));
+    CHECK(r < 1e-3 * r0);
+  }
+
+  // For the Helmholtz problem, with about 10 points per wavelength on the
+  // coarser grid, the preconditioner is much better than a diagonal one.
+  // Refining the mesh at a fixed frequency barely changes the iterations.
+  const double k = 2 * M_PI * 6;                // 6 wavelengths across
+  int its[2];
+  for (int level = 0; level < 2; level++) {
+    CMatrix A;
+    HelmholtzTestMatrix(level == 0 ? 60 : 120, k, &A);
+    its[level] = Iterations<AlgebraicMultigrid<Complex> >(A);
+    printf("Helmholtz iterations for N = %d: %d\n", int(sqrt(A.rows())),
+           its[level]);
+    if (level == 0) {
+      int jacobi = Iterations<Eigen::DiagonalPreconditioner<Complex> >(A);
+      printf("... with diagonal preconditioner: %d\n", jacobi);
+      CHECK(3 * its[0] < jacobi);
+    }
+  }
+  CHECK(its[1] < 1.5 * its[0] + 5);
+
+  // A small matrix is factored directly, so the preconditioner is exact.
+  {
+    CMatrix A;
+    HelmholtzTestMatrix(10, k, &A);
+    AlgebraicMultigrid<Complex> amg;
+    amg.compute(A);
+    CHECK(amg.NumLevels() == 1);
+    Eigen::VectorXcd b = Eigen::VectorXcd::Random(A.rows());
+    amg.SetDamping(0);
+    amg.compute(A);
+    CHECK((A * amg.solve(b) - b).norm() < 1e-9 * b.norm());
+  }
+
+  // A zero diagonal is reported as a failure.
+  {
+    CMatrix Z(2, 2);
+    Z.insert(0, 1) = 1;
+    Z.insert(1, 0) = 1;
+    AlgebraicMultigrid<Complex> amg;
+    amg.compute(Z);
+    CHECK(amg.info() != Eigen::Success);
+  }
+}
+
+}  // namespace FEM
@@ -0,0 +1,334 @@
+// Algebraic multigrid preconditioning for Helmholtz problems.
+//
+// Multigrid solves elliptic systems in O(n) work by smoothing the error on a
+// hierarchy of ever coarser levels, but on its own it diverges for the
+// indefinite Helmholtz operator A = K - k^2*M (K the stiffness and M the mass
+// matrix, in either sign). The shifted Laplacian
+//
+//   A_beta = K - (1 - i*beta)*k^2*M
+//
+// (or 1 + i*beta, whichever matches the sign of the losses in A) adds damping
+// that makes multigrid work, and is close enough to A to be a good
+// preconditioner for a Krylov solver (Erlangga, Oosterlee and Vuik, "A novel
+// multigrid based preconditioner for heterogeneous Helmholtz problems"). The
+// V-cycle need not converge on its own for this. Only the assembled A is
+// available here, so k^2*M is replaced by its lumped (diagonal) form, which
+// is found from the row sums of A: the rows of K sum to zero except next to
+// Dirichlet boundaries, so an interior row of A sums to -k^2 times the lumped
+// mass of that row.
+//
+// The levels are built by smoothed aggregation (Vanek, Mandel and Brezina,
+// "Algebraic multigrid by smoothed aggregation for second and fourth order
+// elliptic problems"). Rows are grouped into aggregates of rows that are
+// strongly coupled in K, each of which becomes one coarse row, and the
+// piecewise constant interpolation P from the aggregates is smoothed by one
+// damped Jacobi step with K. The coarse matrices are P'*A_beta*P. Damped
+// Jacobi is also the smoother, as it works for complex matrices and is done
+// in parallel. The coarsest level is factored by LU.
+
+#ifndef __TOOLKIT_MULTIGRID_H__
+#define __TOOLKIT_MULTIGRID_H__
+
+#include <cmath>
+#include <complex>
+#include "myvector"
+#include "Eigen/Dense"
+#include "Eigen/Sparse"
+#include "error.h"
+#include "thread.h"
+
+namespace FEM {
+
+// Add the damping i*beta*mass to a diagonal entry. Real matrices can not be
+// damped, so they are unchanged.
+template<class T>
+inline T DampDiagonal(T a, T mass, double beta) {
+  return a;
+}
+template<class T>
+inline std::complex<T> DampDiagonal(std::complex<T> a, std::complex<T> mass,
+                                    double beta) {
+  return a + std::complex<T>(0, beta) * mass;
+}
+
+// A multigrid V-cycle that approximately solves A_beta*x=b, as an Eigen
+// preconditioner, e.g. for Eigen::BiCGSTAB.
+template<class Scalar>
+class AlgebraicMultigrid {
+ public:
+  typedef Eigen::SparseMatrix<Scalar> MatrixType;
+  typedef Eigen::SparseMatrix<Scalar, Eigen::RowMajor> RowMatrixType;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+  typedef typename Eigen::NumTraits<Scalar>::Real Real;
+
+  // Levels with at most this many rows are factored.
+  static const int kCoarsestSize = 400;
+
+  // The most levels in the hierarchy.
+  static const int kMaxLevels = 20;
+
+  // Jacobi steps before and after each coarse level correction.
+  static const int kSmoothingSteps = 2;
+
+  // Levels with more rows than this are smoothed in parallel blocks of this
+  // many rows. Each solve() does many short smoothing steps, so they use
+  // threads that are kept for the life of the preconditioner.
+  static const int kBlockSize = 4096;
+
+  AlgebraicMultigrid() : beta_(0.5), info_(Eigen::Success) {}
+
+  // Set the damping beta of the shifted Laplacian. 0 means no damping, and
+  // the default 0.5 is a good compromise between multigrid convergence
+  // (which wants more damping) and the quality of the preconditioner (which
+  // wants less). Call this before compute().
+  void SetDamping(double beta) { beta_ = beta; }
+
+  // The Eigen preconditioner interface.
+  template<class MatType>
+  AlgebraicMultigrid &analyzePattern(const MatType &A) { return *this; }
+  template<class MatType>
+  AlgebraicMultigrid &factorize(const MatType &A) {
+    MatrixType Ac = A;
+    Build(Ac);
+    return *this;
+  }
+  template<class MatType>
+  AlgebraicMultigrid &compute(const MatType &A) { return factorize(A); }
+  Eigen::ComputationInfo info() const { return info_; }
+
+  // Apply one V-cycle to b, starting from x=0.
+  template<class Rhs>
+  Vector solve(const Eigen::MatrixBase<Rhs> &b) const {
+    CHECK(!levels_.empty());
+    Vector bb = b;
+    return Cycle(0, bb);
+  }
+
+  // The number of levels, including the finest.
+  int NumLevels() const { return levels_.size(); }
+
+  // The total nonzeros of all level matrices divided by those of the finest.
+  // This is the cost of a V-cycle relative to a matrix multiply.
+  double OperatorComplexity() const {
+    double total = 0;
+    for (int i = 0; i < levels_.size(); i++) {
+      total += levels_[i].A.nonZeros();
+    }
+    return levels_.empty() ? 0 : total / levels_[0].A.nonZeros();
+  }
+
+ private:
+  struct Level {
+    RowMatrixType A;            // The (damped) matrix at this level
+    Vector weight;              // Jacobi weight divided by the diagonal
+    RowMatrixType P, R;         // Interpolation from the next level, and P'
+  };
+  double beta_;
+  std::vector<Level> levels_;
+  Eigen::SparseLU<MatrixType> coarsest_;        // Factors the last level
+  Eigen::ComputationInfo info_;
+  mutable ThreadPool pool_;                     // For Smooth()
+
+  // Build the hierarchy for A.
+  void Build(const MatrixType &A) {
+    CHECK(A.rows() == A.cols());
+    levels_.clear();
+    info_ = Eigen::Success;
+    MatrixType Al = A, Kl = A;
+    Split(&Al, &Kl);
+    RowMatrixType K = Kl;
+    while (true) {
+      levels_.push_back(Level());
+      Level &level = levels_.back();
+      level.A = Al;
+      if (!JacobiWeights(level.A, &level.weight)) {
+        info_ = Eigen::NumericalIssue;          // A zero diagonal
+        levels_.clear();
+        return;
+      }
+      if (Al.rows() <= kCoarsestSize || levels_.size() >= kMaxLevels) {
+        break;
+      }
+      Vector stiffness_weight;
+      if (!JacobiWeights(K, &stiffness_weight)) {
+        break;
+      }
+      std::vector<int> aggregate;
+      int num_aggregates = Aggregate(K, &aggregate);
+      if (num_aggregates > Al.rows() * 0.9) {
+        break;                  // Coarsening has stalled
+      }
+
+      // Smooth the piecewise constant interpolation.
+      std::vector<Eigen::Triplet<Scalar> > t;
+      for (int i = 0; i < aggregate.size(); i++) {
+        t.push_back(Eigen::Triplet<Scalar>(i, aggregate[i], 1));
+      }
+      RowMatrixType P0(Al.rows(), num_aggregates);
+      P0.setFromTriplets(t.begin(), t.end());
+      RowMatrixType WK = stiffness_weight.asDiagonal() * K;
+      level.P = P0 - RowMatrixType(WK * P0);
+      level.P.prune(Scalar(0));
+      level.R = level.P.transpose();
+      Al = MatrixType(level.R * level.A * level.P);
+      K = RowMatrixType(level.R * K * level.P);
+    }
+    coarsest_.compute(MatrixType(levels_.back().A));
+    if (coarsest_.info() != Eigen::Success) {
+      info_ = coarsest_.info();
+      levels_.clear();
+    }
+  }
+
+  // Replace A by the shifted Laplacian, and K (initially also A) by the
+  // stiffness matrix.
+  void Split(MatrixType *A, MatrixType *K) const {
+    // The sign of A is that of its diagonal, as K dominates it. The damping
+    // must have the same sign as any losses in A (e.g. from absorbing
+    // boundaries), otherwise A_beta can be more singular than A.
+    Vector rowsum = (*A) * Vector::Ones(A->cols());
+    Real sign = A->diagonal().real().sum() >= 0 ? 1 : -1;
+    Real loss_sign = std::imag(A->diagonal().sum()) >= 0 ? 1 : -1;
+    for (int i = 0; i < A->rows(); i++) {
+      Real mass = -std::real(rowsum[i]);
+      if (mass * sign > 0) {
+        Scalar a = A->coeff(i, i);
+        A->coeffRef(i, i) = DampDiagonal(a, Scalar(mass * sign * loss_sign),
+                                         beta_);
+        K->coeffRef(i, i) = a + mass;
+      }
+    }
+  }
+
+  // Compute the damped Jacobi weight omega/diagonal for each row. The
+  // largest eigenvalue of inv(D)*A is bounded by Gershgorin's theorem, and
+  // omega is 4/3 of the inverse of that. Return false if a diagonal is zero.
+  static bool JacobiWeights(const RowMatrixType &A, Vector *weight) {
+    const int n = A.rows();
+    weight->resize(n);
+    Real rho = 0;
+    for (int i = 0; i < n; i++) {
+      Scalar diagonal = 0;
+      Real sum = 0;
+      for (typename RowMatrixType::InnerIterator it(A, i); it; ++it) {
+        sum += std::abs(it.value());
+        if (it.col() == i) {
+          diagonal = it.value();
+        }
+      }
+      if (diagonal == Scalar(0)) {
+        return false;
+      }
+      (*weight)[i] = Real(1) / diagonal;
+      rho = std::max(rho, sum / std::abs(diagonal));
+    }
+    *weight *= Scalar(Real(4.0 / 3.0) / rho);
+    return true;
+  }
+
+  // Group the rows into aggregates. Row j is strongly coupled to row i if
+  // |a_ij| >= theta*sqrt(|a_ii*a_jj|). Each aggregate is first made from a
+  // row and all of its strong neighbors, where none are aggregated yet. The
+  // remaining rows join an aggregate they are strongly coupled to, or
+  // otherwise make new aggregates with their unaggregated strong neighbors.
+  // On return aggregate[i] is the aggregate of row i. Return the number of
+  // aggregates.
+  static int Aggregate(const RowMatrixType &A, std::vector<int> *aggregate) {
+    const Real theta = 0.08;
+    const int n = A.rows();
+    Eigen::Matrix<Real, Eigen::Dynamic, 1> diagonal =
+        A.diagonal().cwiseAbs();
+    std::vector<int> strong_begin(n + 1), strong;
+    for (int i = 0; i < n; i++) {
+      strong_begin[i] = strong.size();
+      for (typename RowMatrixType::InnerIterator it(A, i); it; ++it) {
+        int j = it.col();
+        if (j != i && std::abs(it.value()) >=
+                      theta * std::sqrt(diagonal[i] * diagonal[j])) {
+          strong.push_back(j);
+        }
+      }
+    }
+    strong_begin[n] = strong.size();
+
+    aggregate->assign(n, -1);
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+      bool free = (*aggregate)[i] == -1;
+      for (int k = strong_begin[i]; free && k < strong_begin[i + 1]; k++) {
+        free = (*aggregate)[strong[k]] == -1;
+      }
+      if (free && strong_begin[i + 1] > strong_begin[i]) {
+        (*aggregate)[i] = count;
+        for (int k = strong_begin[i]; k < strong_begin[i + 1]; k++) {
+          (*aggregate)[strong[k]] = count;
+        }
+        count++;
+      }
+    }
+    std::vector<int> first_pass(*aggregate);
+    for (int i = 0; i < n; i++) {
+      for (int k = strong_begin[i];
+           (*aggregate)[i] == -1 && k < strong_begin[i + 1]; k++) {
+        (*aggregate)[i] = first_pass[strong[k]];
+      }
+    }
+    for (int i = 0; i < n; i++) {
+      if ((*aggregate)[i] == -1) {
+        (*aggregate)[i] = count;
+        for (int k = strong_begin[i]; k < strong_begin[i + 1]; k++) {
+          if ((*aggregate)[strong[k]] == -1) {
+            (*aggregate)[strong[k]] = count;
+          }
+        }
+        count++;
+      }
+    }
+    return count;
+  }
+
+  // Do 'steps' damped Jacobi steps on A*x=b at a level. If 'zero' then x
+  // starts at zero.
+  void Smooth(const Level &level, const Vector &b, int steps, bool zero,
+              Vector *x) const {
+    const int n = level.A.rows();
+    if (zero) {
+      *x = level.weight.cwiseProduct(b);
+      steps--;
+    }
+    const int num_blocks = (n + kBlockSize - 1) / kBlockSize;
+    Vector y(n);
+    for (int step = 0; step < steps; step++) {
+      pool_.ParallelFor(num_blocks, [&](int block) {
+        const int end = std::min(n, (block + 1) * kBlockSize);
+        for (int i = block * kBlockSize; i < end; i++) {
+          Scalar Ax = 0;
+          for (typename RowMatrixType::InnerIterator it(level.A, i); it;
+               ++it) {
+            Ax += it.value() * (*x)[it.col()];
+          }
+          y[i] = (*x)[i] + level.weight[i] * (b[i] - Ax);
+        }
+      });
+      x->swap(y);
+    }
+  }
+
+  // Return the V-cycle approximation to the solution of A*x=b at level l.
+  Vector Cycle(int l, const Vector &b) const {
+    if (l == levels_.size() - 1) {
+      return coarsest_.solve(b);
+    }
+    const Level &level = levels_[l];
+    Vector x;
+    Smooth(level, b, kSmoothingSteps, true, &x);
+    Vector r = b - level.A * x;
+    x += level.P * Cycle(l + 1, level.R * r);
+    Smooth(level, b, kSmoothingSteps, false, &x);
+    return x;
+  }
+};
+
+}  // namespace FEM
+
+#endif
@@ -0,0 +1,164 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "myvector"
+#include "nested_dissection.h"
+#include "multifrontal.h"
+#include "testing.h"
+
+using namespace Eigen;
+using std::vector;
+
+typedef std::complex<double> Complex;
+
+static double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Create a Helmholtz-like matrix (laplacian - shift*identity) for a grid of
+// points in an L-shaped channel of the given width and arm length, similar to
+// a waveguide bend. The points are numbered randomly. Return the coordinates
+// of each point in 'xy'.
+static void BendMatrix(int width, int length, Complex shift,
+                       SparseMatrix<Complex> *A, Matrix2Xd *xy) {
+  vector<int> index(length * length, -1);
+  vector<int> points;
+  for (int i = 0; i < length; i++) {
+    for (int j = 0; j < length; j++) {
+      if (i < width || j < width) {
+        points.push_back(i * length + j);
+      }
+    }
+  }
+  for (int i = points.size() - 1; i > 0; i--) {
+    std::swap(points[i], points[random() % (i + 1)]);
+  }
+  xy->resize(2, points.size());
+  for (int k = 0; k < points.size(); k++) {
+    index[points[k]] = k;
+    (*xy)(0, k) = points[k] / length;
+    (*xy)(1, k) = points[k] % length;
+  }
+  vector<Triplet<Complex> > trips;
+  for (int k = 0; k < points.size(); k++) {
+    int i = points[k] / length, j = points[k] % length;
+    int neighbors[4][2] = {{i-1, j}, {i+1, j}, {i, j-1}, {i, j+1}};
+    for (int n = 0; n < 4; n++) {
+      int ni = neighbors[n][0], nj = neighbors[n][1];
+      if (ni >= 0 && ni < length && nj >= 0 && nj < length &&
+          index[ni * length + nj] >= 0) {
+        trips.push_back(Triplet<Complex>(k, index[ni * length + nj], -1));
+      }
+    }
+    trips.push_back(Triplet<Complex>(k, k, Complex(4) - shift));
+  }
+  A->resize(points.size(), points.size());
+  A->setFromTriplets(trips.begin(), trips.end());
+  A->makeCompressed();
+}
+
+// Compare the fill and factorization time of the default orderings and the
+// geometric orderings for the symmetric and LU factorizers. Check that the
+// geometric ordering chooses nested dissection if 'expect_nd'.
+static void CompareOrderings(const SparseMatrix<Complex> &A,
+                             const Matrix2Xd &xy, bool expect_nd) {
+  typedef SparseMatrix<Complex> CMatrix;
+  VectorXcd b = VectorXcd::Random(A.rows());
+  CMatrix Alower = A.triangularView<Lower>();
+  FEM::NestedDissectionCoordinates coordinates(&xy);
+  {
+    vector<int> adj_begin, adj, order, nd;
+    FEM::SymmetricAdjacency(A, &adj_begin, &adj);
+    FEM::NestedDissection(adj_begin, adj, xy, &nd);
+    FEM::GeometricOrdering(A, &order);
+    CHECK((order == nd) == expect_nd);
+  }
+  size_t fill[2];
+  double t[2];
+  {
+    t[0] = Now();
+    FEM::MultifrontalLDLT<CMatrix> ldlt(Alower);
+    t[0] = Now() - t[0];
+    CHECK(ldlt.info() == Success);
+    fill[0] = ldlt.NonZerosInL();
+  }
+  {
+    t[1] = Now();
+    FEM::MultifrontalLDLT<CMatrix, FEM::NestedDissectionOrdering<int> >
+        ldlt(Alower);
+    t[1] = Now() - t[1];
+    CHECK(ldlt.info() == Success);
+    VectorXcd x = ldlt.solve(b);
+    CHECK((A * x - b).norm() < 1e-9 * b.norm());
+    fill[1] = ldlt.NonZerosInL();
+  }
+  printf("n=%d, LDLT: AMD nnz(L)=%d (%.3fs), geometric nnz(L)=%d (%.3fs)\n",
+         int(A.rows()), int(fill[0]), t[0], int(fill[1]), t[1]);
+  {
+    t[0] = Now();
+    SparseLU<CMatrix, COLAMDOrdering<int> > lu(A);
+    t[0] = Now() - t[0];
+    CHECK(lu.info() == Success);
+    fill[0] = lu.nnzL() + lu.nnzU();
+  }
+  {
+    t[1] = Now();
+    SparseLU<CMatrix, FEM::NestedDissectionColumnOrdering<int> > lu(A);
+    t[1] = Now() - t[1];
+    CHECK(lu.info() == Success);
+    VectorXcd x = lu.solve(b);
+    CHECK((A * x - b).norm() < 1e-9 * b.norm());
+    fill[1] = lu.nnzL() + lu.nnzU();
+  }
+  printf("n=%d, LU: COLAMD nnz(L+U)=%d (%.3fs), "
+         "geometric nnz(L+U)=%d (%.3fs)\n",
+         int(A.rows()), int(fill[0]), t[0], int(fill[1]), t[1]);
+  CHECK(fill[1] < fill[0]);
+}
+
+TEST_FUNCTION(NestedDissection) {
+  srandom(123);
+  SparseMatrix<Complex> A;
+  Matrix2Xd xy;
+  BendMatrix(20, 1000, Complex(0.01, 0.001), &A, &xy);
+  const int n = A.rows();
+
+  // The orderings are permutations, and the symbolic fill matches the
+  // factorization.
+  {
+    vector<int> adj_begin, adj, order;
+    FEM::SymmetricAdjacency(A, &adj_begin, &adj);
+    FEM::NestedDissection(adj_begin, adj, xy, &order);
+    vector<int> count(n, 0);
+    for (int i = 0; i < n; i++) {
+      count[order[i]]++;
+    }
+    for (int i = 0; i < n; i++) {
+      CHECK(count[i] == 1);
+    }
+    PermutationMatrix<Dynamic, Dynamic, int> P(n);
+    for (int k = 0; k < n; k++) {
+      P.indices()[k] = order[k];
+    }
+    PermutationMatrix<Dynamic, Dynamic, int> Pinv = P.inverse();
+    SparseMatrix<Complex> PA;
+    PA = A.twistedBy(Pinv);
+    SimplicialLDLT<SparseMatrix<Complex>, Lower, NaturalOrdering<int> > ldlt;
+    ldlt.analyzePattern(PA);
+    ldlt.factorize(PA);
+    CHECK(ldlt.info() == Success);
+    size_t fill;
+    double flops;
+    FEM::SymbolicCholesky(adj_begin, adj, order, &fill, &flops);
+    CHECK(fill == ldlt.matrixL().nestedExpression().nonZeros());
+  }
+
+  // A long narrow bend, where AMD is best, and a large square, where nested
+  // dissection is best.
+  CompareOrderings(A, xy, false);
+  BendMatrix(300, 300, Complex(0.01, 0.001), &A, &xy);
+  CompareOrderings(A, xy, true);
+}
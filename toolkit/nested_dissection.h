@@ -0,0 +1,291 @@
+// Geometric nested dissection orderings for sparse factorizers.
+//
+// The fill in a sparse factorization depends on the order in which the rows
+// and columns are eliminated. Eigen's AMD and COLAMD orderings are generic
+// greedy heuristics that only look at the matrix graph. For the matrices of 2D
+// triangle meshes nested dissection can do better: split the mesh into two
+// halves with a small set of separator vertices, order each half recursively
+// and put the separator last. The fill is then O(n log n), and the elimination
+// tree is well balanced, which suits the parallel multifrontal factorizer.
+// The separators are found geometrically, from the coordinates of the mesh
+// points, by splitting at the median coordinate along the longest side of the
+// bounding box, so for long geometries they are cross-sections.
+//
+// Eigen factorizers default construct their ordering object, so the point
+// coordinates are passed to the orderings by creating a
+// NestedDissectionCoordinates object around calls to analyzePattern(). If no
+// coordinates are available, or if AMD is better (which it is for narrow
+// geometries), the orderings use AMD instead.
+
+#ifndef __TOOLKIT_NESTED_DISSECTION_H__
+#define __TOOLKIT_NESTED_DISSECTION_H__
+
+#include <algorithm>
+#include "myvector"
+#include "Eigen/Dense"
+#include "Eigen/Sparse"
+#include "error.h"
+
+namespace FEM {
+
+// The coordinates (x,y in each column) of the rows of the matrices given to
+// the orderings below (and to SubstructuredFactorizer), for the lifetime of
+// this object. This is per-thread state so factorizers in different threads
+// can use different coordinates.
+class NestedDissectionCoordinates {
+ public:
+  explicit NestedDissectionCoordinates(const Eigen::Matrix2Xd *xy)
+      : previous_(Current()) {
+    Current() = xy;
+  }
+  ~NestedDissectionCoordinates() { Current() = previous_; }
+
+  // The current coordinates, or 0 if none.
+  static const Eigen::Matrix2Xd *&Current() {
+    static thread_local const Eigen::Matrix2Xd *current = 0;
+    return current;
+  }
+
+ private:
+  const Eigen::Matrix2Xd *previous_;
+  DISALLOW_COPY_AND_ASSIGN(NestedDissectionCoordinates);
+};
+
+// Build the adjacency lists of the graph of the symmetric pattern A+A'
+// (without the diagonal). The neighbors of vertex i are
+// adj[adj_begin[i]...adj_begin[i+1]-1].
+template<class MatrixType>
+void SymmetricAdjacency(const MatrixType &A, std::vector<int> *adj_begin,
+                        std::vector<int> *adj) {
+  CHECK(A.rows() == A.cols());
+  const int n = A.rows();
+  adj_begin->assign(n + 1, 0);
+  for (int j = 0; j < A.outerSize(); j++) {
+    for (typename MatrixType::InnerIterator it(A, j); it; ++it) {
+      if (it.row() != it.col()) {
+        (*adj_begin)[it.row() + 1]++;
+        (*adj_begin)[it.col() + 1]++;
+      }
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    (*adj_begin)[i + 1] += (*adj_begin)[i];
+  }
+  adj->resize((*adj_begin)[n]);
+  std::vector<int> fill(*adj_begin);
+  for (int j = 0; j < A.outerSize(); j++) {
+    for (typename MatrixType::InnerIterator it(A, j); it; ++it) {
+      if (it.row() != it.col()) {
+        (*adj)[fill[it.row()]++] = it.col();
+        (*adj)[fill[it.col()]++] = it.row();
+      }
+    }
+  }
+}
+
+// Compute the nested dissection ordering of a graph given the coordinates of
+// each vertex. On return order[k] is the vertex that is eliminated k'th.
+inline void NestedDissection(const std::vector<int> &adj_begin,
+                             const std::vector<int> &adj,
+                             const Eigen::Matrix2Xd &xy,
+                             std::vector<int> *order) {
+  // Subgraphs with this many vertices or fewer are not dissected further.
+  const int kLeafSize = 8;
+  const int n = adj_begin.size() - 1;
+  CHECK(xy.cols() == n);
+
+  // Recursively dissect subgraphs. The stack holds subgraphs that are still
+  // to be ordered and separators that are to be appended to the order once
+  // the subgraphs above them on the stack have been ordered. 'side' is 0 or 1
+  // for vertices in the two halves of the subgraph being split, and -1
+  // otherwise.
+  struct Item {
+    std::vector<int> vertices;
+    bool separator;
+  };
+  std::vector<Item> stack(1);
+  stack[0].separator = false;
+  stack[0].vertices.resize(n);
+  for (int i = 0; i < n; i++) {
+    stack[0].vertices[i] = i;
+  }
+  std::vector<int> side(n, -1);
+  order->clear();
+  order->reserve(n);
+  while (!stack.empty()) {
+    Item item;
+    item.vertices.swap(stack.back().vertices);
+    item.separator = stack.back().separator;
+    stack.pop_back();
+    std::vector<int> &v = item.vertices;
+    if (item.separator || v.size() <= kLeafSize) {
+      order->insert(order->end(), v.begin(), v.end());
+      continue;
+    }
+
+    // Split at the median along the longest side of the bounding box. Ties
+    // are broken by the other coordinate so that points on a grid line are
+    // split cleanly.
+    Eigen::Vector2d lo = xy.col(v[0]), hi = lo;
+    for (int i = 1; i < v.size(); i++) {
+      lo = lo.cwiseMin(xy.col(v[i]));
+      hi = hi.cwiseMax(xy.col(v[i]));
+    }
+    const int axis = (hi[0] - lo[0] >= hi[1] - lo[1]) ? 0 : 1;
+    const int half = v.size() / 2;
+    std::nth_element(v.begin(), v.begin() + half, v.end(),
+                     [&](int a, int b) {
+                       return xy(axis, a) < xy(axis, b) ||
+                              (xy(axis, a) == xy(axis, b) &&
+                               xy(1 - axis, a) < xy(1 - axis, b));
+                     });
+    for (int i = 0; i < v.size(); i++) {
+      side[v[i]] = (i >= half);
+    }
+
+    // The vertices of either half that are adjacent to the other half form a
+    // separator. Use the smaller one.
+    std::vector<int> boundary[2];
+    for (int i = 0; i < v.size(); i++) {
+      int s = side[v[i]];
+      for (int p = adj_begin[v[i]]; p < adj_begin[v[i] + 1]; p++) {
+        if (side[adj[p]] == 1 - s) {
+          boundary[s].push_back(v[i]);
+          break;
+        }
+      }
+    }
+    const int sep = (boundary[0].size() <= boundary[1].size()) ? 0 : 1;
+    for (int i = 0; i < boundary[sep].size(); i++) {
+      side[boundary[sep][i]] = 2;
+    }
+    stack.resize(stack.size() + 3);
+    Item *items = &stack[stack.size() - 3];
+    items[0].separator = true;
+    items[0].vertices.swap(boundary[sep]);
+    for (int k = 1; k <= 2; k++) {
+      items[k].separator = false;
+      for (int i = 0; i < v.size(); i++) {
+        if (side[v[i]] == 2 - k) {
+          items[k].vertices.push_back(v[i]);
+        }
+      }
+    }
+    for (int i = 0; i < v.size(); i++) {
+      side[v[i]] = -1;
+    }
+  }
+  CHECK(order->size() == n);
+}
+
+// Compute the number of off-diagonal nonzeros in the Cholesky factor of a
+// graph when its vertices are eliminated in the given order, and the number
+// of multiply-adds needed to compute it. This takes O(fill) time, which is
+// much less than the numerical factorization.
+inline void SymbolicCholesky(const std::vector<int> &adj_begin,
+                             const std::vector<int> &adj,
+                             const std::vector<int> &order,
+                             size_t *fill, double *flops) {
+  const int n = order.size();
+  std::vector<int> position(n), parent(n), flag(n), count(n, 0);
+  for (int k = 0; k < n; k++) {
+    position[order[k]] = k;
+  }
+  for (int k = 0; k < n; k++) {
+    parent[k] = -1;
+    flag[k] = k;
+    int v = order[k];
+    for (int p = adj_begin[v]; p < adj_begin[v + 1]; p++) {
+      // Walk up the elimination tree from each neighbor eliminated before k.
+      // Each node visited is in the structure of row k of L.
+      for (int i = position[adj[p]]; i < k && flag[i] != k; i = parent[i]) {
+        if (parent[i] == -1) {
+          parent[i] = k;
+        }
+        count[i]++;
+        flag[i] = k;
+      }
+    }
+  }
+  *fill = 0;
+  *flops = 0;
+  for (int i = 0; i < n; i++) {
+    *fill += count[i];
+    *flops += double(count[i]) * count[i];
+  }
+}
+
+// Compute a fill reducing ordering for A, which should be structurally
+// symmetric. On return order[k] is the row that is eliminated k'th. If
+// coordinates are available this uses nested dissection, unless the AMD
+// factorization would need fewer operations. AMD wins for narrow geometries
+// (e.g. waveguides that are not many elements wide), where the factor is
+// nearly banded anyway, and nested dissection wins for large wide ones.
+template<class MatrixType>
+void GeometricOrdering(const MatrixType &A, std::vector<int> *order) {
+  const int n = A.rows();
+  Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic, int> amd;
+  Eigen::AMDOrdering<int>()(A, amd);
+  order->resize(n);
+  for (int k = 0; k < n; k++) {
+    (*order)[k] = amd.indices()[k];
+  }
+  const Eigen::Matrix2Xd *xy = NestedDissectionCoordinates::Current();
+  if (!xy || xy->cols() != n) {
+    return;
+  }
+  std::vector<int> adj_begin, adj, nd;
+  SymmetricAdjacency(A, &adj_begin, &adj);
+  NestedDissection(adj_begin, adj, *xy, &nd);
+  size_t fill[2];
+  double flops[2];
+  SymbolicCholesky(adj_begin, adj, *order, &fill[0], &flops[0]);
+  SymbolicCholesky(adj_begin, adj, nd, &fill[1], &flops[1]);
+  if (flops[1] < flops[0]) {
+    order->swap(nd);
+  }
+}
+
+// The ordering for symmetric factorizers (SimplicialLLT, SimplicialLDLT,
+// MultifrontalLDLT). Like AMDOrdering this gives the permutation from new to
+// old indexes.
+template<class StorageIndex>
+class NestedDissectionOrdering {
+ public:
+  typedef Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic,
+                                   StorageIndex> PermutationType;
+
+  template<class MatrixType>
+  void operator()(const MatrixType &A, PermutationType &perm) {
+    std::vector<int> order;
+    GeometricOrdering(A, &order);
+    perm.resize(A.rows());
+    for (int k = 0; k < order.size(); k++) {
+      perm.indices()[k] = order[k];
+    }
+  }
+};
+
+// The ordering for SparseLU. Like COLAMDOrdering this gives the permutation
+// from old to new indexes. The matrix should be structurally symmetric, and
+// then this usually gives much less fill than COLAMDOrdering.
+template<class StorageIndex>
+class NestedDissectionColumnOrdering {
+ public:
+  typedef Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic,
+                                   StorageIndex> PermutationType;
+
+  template<class MatrixType>
+  void operator()(const MatrixType &A, PermutationType &perm) {
+    std::vector<int> order;
+    GeometricOrdering(A, &order);
+    perm.resize(A.rows());
+    for (int k = 0; k < order.size(); k++) {
+      perm.indices()[order[k]] = k;
+    }
+  }
+};
+
+}  // namespace FEM
+
+#endif
@@ -176,6 +176,84 @@ void InteractiveOptimizer::Evaluate(const vector<double> &parameters,
       !(*errors_and_jacobians)->jacobians.empty()) {
     Panic("Internal error: Jacobians computed needlessly");
   }
+  if (jacobians_needed && (*errors_and_jacobians) &&
+      (*errors_and_jacobians)->errors.empty() && !impl_->aborting_) {
+    Panic("Internal error: Parameters rejected but jacobians needed");
+  }
+}
+
+//***************************************************************************
+// First order prediction of the cost.
+
+double PredictedCost(const vector<double> &base, const vector<double> &errors,
+                     const vector<double> &jacobians,
+                     const vector<double> &parameters) {
+  const int n = base.size();
+  CHECK(parameters.size() == n && jacobians.size() == errors.size() * n);
+  double cost = 0;
+  for (int j = 0; j < errors.size(); j++) {
+    double e = errors[j];
+    for (int i = 0; i < n; i++) {
+      e += jacobians[j*n + i] * (parameters[i] - base[i]);
+    }
+    cost += e * e;
+  }
+  return cost;
+}
+
+bool RejectTrialStep(const vector<double> &base, const vector<double> &errors,
+                     const vector<double> &jacobians,
+                     const vector<double> &parameters) {
+  if (parameters == base) {
+    return false;
+  }
+  return PredictedCost(base, errors, jacobians, parameters) >
+         PredictedCost(base, errors, jacobians, base);
+}
+
+TEST_FUNCTION(PredictedCost) {
+  // The errors (x-1, x*y) are linear in each parameter separately.
+  vector<double> base(2), errors(2), jacobians(4), parameters(2);
+  base[0] = 2;
+  base[1] = 3;
+  errors[0] = base[0] - 1;
+  errors[1] = base[0] * base[1];
+  jacobians[0] = 1;
+  jacobians[1] = 0;
+  jacobians[2] = base[1];
+  jacobians[3] = base[0];
+  CHECK(PredictedCost(base, errors, jacobians, base) == 37);
+  parameters[0] = 2.5;
+  parameters[1] = 3;
+  CHECK(PredictedCost(base, errors, jacobians, parameters) ==
+        1.5*1.5 + 7.5*7.5);
+  parameters[0] = 2;
+  parameters[1] = 0;
+  CHECK(PredictedCost(base, errors, jacobians, parameters) == 1);
+}
+
+TEST_FUNCTION(RejectTrialStep) {
+  // The errors (x-1, y) with a zero jacobian for y, as if y was at a bound.
+  vector<double> base(2), errors(2), jacobians(4), parameters(2);
+  base[0] = 2;
+  base[1] = 3;
+  errors[0] = base[0] - 1;
+  errors[1] = base[1];
+  jacobians[0] = 1;
+  jacobians[1] = 0;
+  jacobians[2] = 0;
+  jacobians[3] = 0;
+  // A zero step is not rejected, it predicts the same cost.
+  CHECK(!RejectTrialStep(base, errors, jacobians, base));
+  // Neither is a step that predicts the same cost.
+  parameters[0] = 2;
+  parameters[1] = 4;
+  CHECK(!RejectTrialStep(base, errors, jacobians, parameters));
+  // A step that predicts a lower cost is not rejected, a higher one is.
+  parameters[0] = 1.5;
+  CHECK(!RejectTrialStep(base, errors, jacobians, parameters));
+  parameters[0] = 2.5;
+  CHECK(RejectTrialStep(base, errors, jacobians, parameters));
 }
 
 //***************************************************************************
@@ -256,6 +334,12 @@ class CeresCostFunction : public ceres::CostFunction {
     }
     InteractiveOptimizer::ErrorsAndJacobians *ej = 0;
     opt_->Evaluate(params, jacobians != 0, &ej);
+    if (!opt_->impl_->aborting_ && ej->errors.empty()) {
+      // The parameters were rejected without being evaluated, which ceres
+      // treats as an unsuccessful step.
+      delete ej;
+      return false;
+    }
     if (!opt_->impl_->aborting_) {
       for (int i = 0; i < num_residuals(); i++) {
         residuals[i] = ej->errors[i];
@@ -378,6 +462,8 @@ bool CeresInteractiveOptimizer::Optimize(
   options.parameter_tolerance = parameter_tolerance_;
   options.gradient_tolerance = gradient_tolerance_;
   options.minimizer_progress_to_stdout = false;
+  // Otherwise steps rejected by DoOneIteration() are logged as warnings.
+  options.logging_type = ceres::SILENT;
   // For small (a few hundred parameters) or dense problems we use DENSE_QR:
   options.linear_solver_type = ceres::DENSE_QR;
   options.sparse_linear_algebra_library_type = ceres::EIGEN_SPARSE;
@@ -71,7 +71,11 @@ class InteractiveOptimizer {
   //    jacobians[j*num_parameters + i] = d error[j] / d parameter[i]
   //
   // If jacobians are requested but not supplied in the jacobians argument (as
-  // the vector size is 0) then numerical jacobians will be computed.
+  // the vector size is 0) then numerical jacobians will be computed. If no
+  // jacobian is requested then the errors vector can be empty, which rejects
+  // the Parameters() without evaluating them, as though their errors were
+  // infinite (e.g. because PredictedCost() shows that they are worse than
+  // the current parameters).
   bool DoOneIteration(const std::vector<double> &errors,
                       const std::vector<double> &jacobians) MUST_USE_RESULT;
 
@@ -103,6 +107,21 @@ class InteractiveOptimizer {
   double function_tolerance_, parameter_tolerance_, gradient_tolerance_;
 };
 
+// Return |errors|^2 predicted to first order at 'parameters', from the
+// errors and jacobians (in the format given to DoOneIteration()) at 'base'.
+double PredictedCost(const std::vector<double> &base,
+                     const std::vector<double> &errors,
+                     const std::vector<double> &jacobians,
+                     const std::vector<double> &parameters);
+
+// Return true if a trial step from 'base' to 'parameters' can be rejected
+// without being evaluated, because PredictedCost() at 'parameters' is
+// strictly higher than at 'base'. A zero step is never rejected.
+bool RejectTrialStep(const std::vector<double> &base,
+                     const std::vector<double> &errors,
+                     const std::vector<double> &jacobians,
+                     const std::vector<double> &parameters);
+
 // Interface to the Ceres optimizer. This is only included if
 // __TOOLKIT_USE_CERES__ is defined.
 
@@ -0,0 +1,119 @@
+
+// Testing for rational fitting and adaptive sampling.
+
+#include "rational_fit.h"
+#include <stdio.h>
+#include "testing.h"
+
+namespace rational_fit {
+
+// A two component response with two sharp resonances that the components
+// share, like the port outputs of a filter. The delay makes it not exactly
+// rational.
+static void Response(double x, std::vector<Complex> *f) {
+  const Complex p1(0.45, 0.003), p2(0.55, 0.004);
+  const Complex delay = exp(Complex(0, -5 * x));
+  f->resize(2);
+  (*f)[0] = (0.003 / (x - p1) + 0.004 / (x - p2)) * delay;
+  (*f)[1] = 1.0 + Complex(0, 0.003) / (x - p1) - Complex(0, 0.004) / (x - p2);
+}
+
+// The largest error of 'f' against Response() at the points 'x', relative
+// to the largest magnitude of each component.
+static double ResponseError(const std::vector<double> &x,
+                            const std::vector<std::vector<Complex> > &f) {
+  std::vector<Complex> g;
+  std::vector<double> scale(2, 0);
+  for (int i = 0; i < x.size(); i++) {
+    Response(x[i], &g);
+    for (int k = 0; k < 2; k++) {
+      scale[k] = std::max(scale[k], abs(g[k]));
+    }
+  }
+  double max_error = 0;
+  for (int i = 0; i < x.size(); i++) {
+    Response(x[i], &g);
+    for (int k = 0; k < 2; k++) {
+      max_error = std::max(max_error, abs(f[i][k] - g[k]) / scale[k]);
+    }
+  }
+  return max_error;
+}
+
+TEST_FUNCTION(AAA) {
+  // A rational response of low degree is recovered from its samples.
+  std::vector<double> x(60), fine_x(1000);
+  std::vector<std::vector<Complex> > f(x.size()), fine_f(fine_x.size());
+  for (int i = 0; i < x.size(); i++) {
+    x[i] = i / (x.size() - 1.0);
+    Response(x[i], &f[i]);
+  }
+  AAA aaa;
+  aaa.Fit(x, f, 1e-12, 100);
+  for (int i = 0; i < fine_x.size(); i++) {
+    fine_x[i] = (i + 0.5) / fine_x.size();
+    aaa.Evaluate(fine_x[i], &fine_f[i]);
+  }
+  double error = ResponseError(fine_x, fine_f);
+  printf("AAA support points = %d, error = %g\n", aaa.NumSupport(), error);
+  CHECK(aaa.NumSupport() <= 20);
+  CHECK(aaa.Error(aaa.NumSupport()) <= 1e-12);
+  CHECK(error < 1e-9);
+
+  // The fit matches the samples, and the fits with fewer support points
+  // have larger errors.
+  for (int i = 0; i < x.size(); i++) {
+    std::vector<Complex> g;
+    aaa.Evaluate(x[i], &g);
+    CHECK(abs(g[1] - f[i][1]) < 1e-9 * aaa.Scale(1));
+  }
+  for (int n = 2; n <= aaa.NumSupport(); n++) {
+    CHECK(aaa.Error(n) < aaa.Error(n - 1));
+  }
+}
+
+TEST_FUNCTION(AdaptiveSampler) {
+  // Adaptive sampling resolves the resonances with far fewer samples than
+  // there are points in the reported response, and samples most densely
+  // near the resonances.
+  const double tolerance = 1e-3;
+  AdaptiveSampler sampler(0, 1, 1001, tolerance);
+  double x;
+  int near_resonance = 0;
+  while (sampler.Next(&x)) {
+    std::vector<Complex> f;
+    Response(x, &f);
+    CHECK(sampler.Add(x, f));
+    near_resonance += (x > 0.4 && x < 0.6);
+  }
+  std::vector<double> grid;
+  std::vector<std::vector<Complex> > response;
+  sampler.GetResponse(&grid, &response);
+  CHECK(grid.size() == 1001 && response.size() == 1001);
+  CHECK(grid[0] == 0 && grid.back() == 1);
+  double error = ResponseError(grid, response);
+  printf("Adaptive samples = %d (%d near the resonances), error = %g\n",
+         sampler.NumSamples(), near_resonance, error);
+  CHECK(sampler.NumSamples() < 40);
+  CHECK(near_resonance > sampler.NumSamples() / 2);
+  CHECK(error < 10 * tolerance);
+
+  // Sampling stops if the responses change size.
+  AdaptiveSampler sampler2(0, 1, 100, tolerance);
+  std::vector<Complex> f(2);
+  CHECK(sampler2.Next(&x) && sampler2.Add(x, f));
+  f.resize(3);
+  CHECK(sampler2.Next(&x) && !sampler2.Add(x, f));
+  CHECK(!sampler2.Next(&x));
+
+  // A coarse grid is sampled at every point if necessary.
+  AdaptiveSampler sampler3(0, 1, 8, tolerance);
+  while (sampler3.Next(&x)) {
+    Response(x, &f);
+    CHECK(sampler3.Add(x, f));
+  }
+  printf("Coarse grid samples = %d\n", sampler3.NumSamples());
+  CHECK(sampler3.NumSamples() <= 8);
+}
+
+}  // namespace rational_fit
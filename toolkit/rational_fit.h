@@ -0,0 +1,343 @@
+// Rational approximation of sampled responses, and adaptive sampling.
+//
+// The AAA algorithm (Nakatsukasa, Sete and Trefethen, "The AAA algorithm for
+// rational approximation") represents a rational function in barycentric
+// form
+//
+//   r(x) = sum_j w[j]*f[j]/(x-z[j]) / sum_j w[j]/(x-z[j])
+//
+// where the support points z[j] are chosen greedily from the samples where
+// the error is largest, and the weights w minimize the linearized error at
+// the other samples (they are the smallest right singular vector of a
+// Loewner matrix). r interpolates the samples at the support points. Vector
+// valued responses (e.g. all port outputs of a sweep) share the support
+// points and weights, and so share their poles, which is right for the
+// resonances of a single model.
+
+#ifndef __TOOLKIT_RATIONAL_FIT_H__
+#define __TOOLKIT_RATIONAL_FIT_H__
+
+#include <math.h>
+#include <complex>
+#include "myvector"
+#include "Eigen/Dense"
+#include "error.h"
+
+namespace rational_fit {
+
+typedef std::complex<double> Complex;
+
+class AAA {
+ public:
+  // Fit the samples f[i] = f(x[i]), where all f[i] have the same size and
+  // the x[i] are distinct. Each component is scaled by its largest magnitude
+  // so that all are fitted with the same relative accuracy. Support points
+  // are added until the largest scaled error at the samples is at most
+  // 'tolerance', or there are max_support of them. At most half of the
+  // samples become support points, so that the weights are always a least
+  // squares fit.
+  void Fit(const std::vector<double> &x,
+           const std::vector<std::vector<Complex> > &f,
+           double tolerance, int max_support) {
+    const int M = x.size();
+    CHECK(M > 0 && f.size() == M);
+    const int K = f[0].size();
+    z_.clear();
+    w_.clear();
+    error_.clear();
+    scale_.setZero(K);
+    Eigen::MatrixXcd F(M, K);
+    for (int i = 0; i < M; i++) {
+      CHECK(f[i].size() == K);
+      for (int k = 0; k < K; k++) {
+        F(i, k) = f[i][k];
+        scale_[k] = std::max(scale_[k], abs(f[i][k]));
+      }
+    }
+    for (int k = 0; k < K; k++) {
+      if (scale_[k] == 0) {
+        scale_[k] = 1;
+      }
+      F.col(k) /= scale_[k];
+    }
+    fz_.resize(0, K);
+
+    // R is the current approximation at the samples, initially the mean.
+    Eigen::MatrixXcd R(M, K);
+    for (int k = 0; k < K; k++) {
+      R.col(k).setConstant(F.col(k).mean());
+    }
+    std::vector<bool> support(M, false);
+    std::vector<int> J;                 // Support sample indexes
+    while (true) {
+      // Add the sample with the largest error as a support point.
+      int best = -1;
+      double best_error = -1;
+      for (int i = 0; i < M; i++) {
+        if (!support[i]) {
+          double e = K > 0 ? (F.row(i) - R.row(i)).cwiseAbs().maxCoeff() : 0;
+          if (e > best_error) {
+            best_error = e;
+            best = i;
+          }
+        }
+      }
+      support[best] = true;
+      J.push_back(best);
+      z_.push_back(x[best]);
+      fz_.conservativeResize(J.size(), K);
+      for (int k = 0; k < K; k++) {
+        fz_(J.size() - 1, k) = f[best][k];
+      }
+      const int m = J.size();
+
+      // The Cauchy matrix C and Loewner matrix L over the other samples.
+      std::vector<int> I;
+      for (int i = 0; i < M; i++) {
+        if (!support[i]) {
+          I.push_back(i);
+        }
+      }
+      const int n = I.size();
+      Eigen::MatrixXcd C(n, m), L(n * K, m);
+      for (int r = 0; r < n; r++) {
+        for (int c = 0; c < m; c++) {
+          C(r, c) = 1.0 / (x[I[r]] - x[J[c]]);
+          for (int k = 0; k < K; k++) {
+            L(k * n + r, c) = (F(I[r], k) - F(J[c], k)) * C(r, c);
+          }
+        }
+      }
+
+      // The weights minimize |L*w| with |w| = 1.
+      Eigen::VectorXcd w;
+      if (L.rows() == 0) {
+        w.setOnes(m);
+      } else {
+        Eigen::JacobiSVD<Eigen::MatrixXcd> svd(L, Eigen::ComputeFullV);
+        w = svd.matrixV().col(m - 1);
+      }
+      w_.push_back(w);
+
+      // Update the approximation and its error.
+      Eigen::MatrixXcd FJ(m, K);
+      for (int c = 0; c < m; c++) {
+        FJ.row(c) = F.row(J[c]);
+      }
+      Eigen::MatrixXcd N = C * (w.asDiagonal() * FJ);
+      Eigen::VectorXcd D = C * w;
+      for (int r = 0; r < n; r++) {
+        R.row(I[r]) = N.row(r) / D[r];
+      }
+      for (int c = 0; c < m; c++) {
+        R.row(J[c]) = F.row(J[c]);
+      }
+      error_.push_back(K > 0 ? (F - R).cwiseAbs().maxCoeff() : 0);
+      if (error_.back() <= tolerance || m >= max_support || 2 * m >= M) {
+        break;
+      }
+    }
+  }
+
+  // The number of support points.
+  int NumSupport() const { return z_.size(); }
+
+  // The largest scaled error at the samples of the fit that uses the first
+  // 'n' support points (n = 1..NumSupport()).
+  double Error(int n) const {
+    CHECK(n >= 1 && n <= NumSupport());
+    return error_[n - 1];
+  }
+
+  // The magnitude scale of component k, i.e. its largest sampled magnitude.
+  double Scale(int k) const { return scale_[k]; }
+
+  // Evaluate at x the fit that uses the first 'n' support points, or all of
+  // them if n is 0.
+  void Evaluate(double x, std::vector<Complex> *f, int n = 0) const {
+    if (n == 0) {
+      n = NumSupport();
+    }
+    CHECK(n >= 1 && n <= NumSupport());
+    const Eigen::VectorXcd &w = w_[n - 1];
+    const int K = fz_.cols();
+    f->assign(K, Complex(0));
+    Complex den = 0;
+    for (int j = 0; j < n; j++) {
+      if (x == z_[j]) {
+        for (int k = 0; k < K; k++) {
+          (*f)[k] = fz_(j, k);
+        }
+        return;
+      }
+      Complex c = w[j] / (x - z_[j]);
+      den += c;
+      for (int k = 0; k < K; k++) {
+        (*f)[k] += c * fz_(j, k);
+      }
+    }
+    for (int k = 0; k < K; k++) {
+      (*f)[k] /= den;
+    }
+  }
+
+ private:
+  std::vector<double> z_;               // Support points, in order chosen
+  Eigen::MatrixXcd fz_;                 // Response at each support point
+  std::vector<Eigen::VectorXcd> w_;     // Weights for 1,2,3... supports
+  std::vector<double> error_;           // Errors for 1,2,3... supports
+  Eigen::VectorXd scale_;               // Magnitude scale of components
+};
+
+// Choose where to sample a response over an interval so that its features
+// (e.g. the sharp resonances of a filter) are resolved with few samples.
+// After each sample AAA fits of degrees that differ by one are compared on a
+// grid of candidate points: the next sample is where they disagree the most,
+// i.e. where the response is least certain. Sampling stops when they agree
+// everywhere to within 'tolerance' (relative to the largest magnitude of
+// each component) twice in a row, so that one more sample confirms the
+// convergence, or when every candidate point has been sampled.
+class AdaptiveSampler {
+ public:
+  // The number of initial uniformly spaced samples.
+  static const int kInitialSamples = 5;
+
+  // Sample over [x0,x1] with num_points uniformly spaced candidate points,
+  // which are also where the fitted response is reported.
+  AdaptiveSampler(double x0, double x1, int num_points, double tolerance)
+      : tolerance_(tolerance), consistent_(true), converged_count_(0) {
+    CHECK(num_points >= 1 && x1 >= x0);
+    grid_.resize(num_points);
+    sampled_.resize(num_points, false);
+    for (int i = 0; i < num_points; i++) {
+      grid_[i] = num_points == 1 ? x0 :
+                 x0 + (x1 - x0) * double(i) / double(num_points - 1);
+    }
+  }
+
+  // Add the response f at x, usually a value returned by Next(). Return
+  // false if f has a different size to previous responses, after which
+  // sampling stops.
+  bool Add(double x, const std::vector<Complex> &f) {
+    if (!f_.empty() && f.size() != f_[0].size()) {
+      consistent_ = false;
+    }
+    for (int i = 0; i < x_.size(); i++) {
+      if (x_[i] == x) {
+        f_[i] = f;              // Replace a repeated sample
+        return consistent_;
+      }
+    }
+    x_.push_back(x);
+    f_.push_back(f);
+    const double dx = grid_.back() - grid_[0];
+    for (int i = 0; i < grid_.size(); i++) {
+      if (fabs(grid_[i] - x) <= 1e-9 * dx) {
+        sampled_[i] = true;
+      }
+    }
+    return consistent_;
+  }
+
+  // Return true and the next value to sample in *x, or false if sampling is
+  // done.
+  bool Next(double *x) {
+    if (!consistent_) {
+      return false;
+    }
+    const int n = grid_.size();
+    const int initial = std::min(int(kInitialSamples), n);
+    if (x_.size() < initial) {
+      int i = initial == 1 ? 0 : x_.size() * (n - 1) / (initial - 1);
+      *x = grid_[i];
+      return true;
+    }
+    Fit();
+
+    // Find the candidate point where the models disagree the most.
+    const int m = aaa_.NumSupport();
+    int best = -1;
+    double best_difference = -1;
+    std::vector<Complex> f1, f2;
+    for (int i = 0; i < n; i++) {
+      if (sampled_[i]) {
+        continue;
+      }
+      double difference = aaa_.Error(m);
+      if (m > 1) {
+        aaa_.Evaluate(grid_[i], &f1, m);
+        aaa_.Evaluate(grid_[i], &f2, m - 1);
+        difference = 0;
+        for (int k = 0; k < f1.size(); k++) {
+          difference = std::max(difference,
+                                abs(f1[k] - f2[k]) / aaa_.Scale(k));
+        }
+        if (std::isnan(difference)) {
+          difference = HUGE_VAL;        // A pole at the candidate
+        }
+      }
+      if (difference > best_difference) {
+        best_difference = difference;
+        best = i;
+      }
+    }
+    if (best < 0) {
+      return false;
+    }
+    if (best_difference <= tolerance_ && aaa_.Error(m) <= tolerance_) {
+      converged_count_++;
+      if (converged_count_ >= 2) {
+        return false;
+      }
+    } else {
+      converged_count_ = 0;
+    }
+    *x = grid_[best];
+    return true;
+  }
+
+  // The number of samples added so far.
+  int NumSamples() const { return x_.size(); }
+
+  // Get the fitted response at all of the candidate points.
+  void GetResponse(std::vector<double> *x,
+                   std::vector<std::vector<Complex> > *f) {
+    *x = grid_;
+    f->clear();
+    if (x_.empty()) {
+      return;
+    }
+    Fit();
+    f->resize(grid_.size());
+    for (int i = 0; i < grid_.size(); i++) {
+      aaa_.Evaluate(grid_[i], &(*f)[i]);
+    }
+  }
+
+ private:
+  std::vector<double> grid_;            // Candidate points
+  std::vector<bool> sampled_;           // For each candidate point
+  std::vector<double> x_;               // Sample points
+  std::vector<std::vector<Complex> > f_;  // Response at each sample point
+  double tolerance_;
+  bool consistent_;                     // If all responses are the same size
+  int converged_count_;                 // Consecutive converged Next()s
+  AAA aaa_;
+
+  // Fit the samples much more accurately than 'tolerance', then add one more
+  // support point if there are enough samples. The last two fits are then
+  // both accurate at the samples, and they only agree between the samples
+  // when the response there is resolved.
+  void Fit() {
+    const double fit_tolerance = tolerance_ * 1e-2;
+    aaa_.Fit(x_, f_, fit_tolerance, x_.size());
+    const int m = aaa_.NumSupport();
+    if (aaa_.Error(m) <= fit_tolerance && 2 * (m + 1) <= x_.size()) {
+      aaa_.Fit(x_, f_, 0, m + 1);
+    }
+  }
+};
+
+}  // namespace rational_fit
+
+#endif
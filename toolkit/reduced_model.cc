@@ -0,0 +1,96 @@
+
+// Testing for ReducedBasis.
+
+#include "reduced_model.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "testing.h"
+
+namespace FEM {
+
+typedef std::complex<double> Complex;
+typedef Eigen::SparseMatrix<Complex> CMatrix;
+typedef Eigen::Matrix<Complex, Eigen::Dynamic, 1> CVector;
+
+// A Helmholtz-like system for an n*n grid of unit spacing, wavenumber k and
+// an absorbing boundary, so that the matrix is not polynomial in k. The right
+// hand side excites the left edge. If 'lower' is true then only the lower
+// triangle of the matrix is stored.
+static void SweepSystem(int n, double k, bool lower, CMatrix *A, CVector *b) {
+  std::vector<Eigen::Triplet<Complex> > t;
+  b->setZero(n * n);
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < n; j++) {
+      int k0 = i * n + j;
+      int edges = (i == 0) + (i == n - 1) + (j == 0) + (j == n - 1);
+      Complex d(4 - k * k, -k * edges);
+      t.push_back(Eigen::Triplet<Complex>(k0, k0, d));
+      if (i > 0) {
+        t.push_back(Eigen::Triplet<Complex>(k0, k0 - n, -1));
+        if (!lower) t.push_back(Eigen::Triplet<Complex>(k0 - n, k0, -1));
+      }
+      if (j > 0) {
+        t.push_back(Eigen::Triplet<Complex>(k0, k0 - 1, -1));
+        if (!lower) t.push_back(Eigen::Triplet<Complex>(k0 - 1, k0, -1));
+      }
+      if (j == 0) {
+        (*b)[k0] = Complex(0, 2 * k * sin(M_PI * (i + 0.5) / n));
+      }
+    }
+  }
+  A->resize(n * n, n * n);
+  A->setFromTriplets(t.begin(), t.end());
+}
+
+TEST_FUNCTION(ReducedBasis) {
+  // Sweep k, solving directly only where the reduced model is not accurate
+  // enough. Check that the reduced solutions are accurate and that only a
+  // few direct solves are needed (their number depends on the number of
+  // resonances in the band, not on the number of steps).
+  for (int lower = 0; lower < 2; lower++) {
+    const int n = 40, num_steps = 200;
+    ReducedBasis<Complex> basis;
+    int full_solves = 0;
+    double max_error = 0;
+    for (int step = 0; step < num_steps; step++) {
+      double k = 0.3 + 0.4 * step / (num_steps - 1.0);
+      CMatrix A, Afull;
+      CVector b, x;
+      SweepSystem(n, k, lower, &A, &b);
+      SweepSystem(n, k, false, &Afull, &b);
+      Eigen::SparseLU<CMatrix> lu(Afull);
+      CVector x_lu = lu.solve(b);
+      if (basis.Solve(A, b, lower, kReducedModelTolerance, &x)) {
+        CHECK(basis.Residual() <= kReducedModelTolerance);
+        double error = (x - x_lu).norm() / x_lu.norm();
+        max_error = std::max(max_error, error);
+      } else {
+        full_solves++;
+        CHECK(basis.Add(x_lu));
+      }
+    }
+    printf("Lower %d: %d full solves for %d steps, basis size %d, "
+           "max error = %g\n", lower, full_solves, num_steps, basis.Size(),
+           max_error);
+    CHECK(full_solves == basis.Size());
+    CHECK(full_solves < num_steps / 4);
+    CHECK(max_error < 1e-4);
+  }
+
+  // Vectors in the span of the basis are not added.
+  ReducedBasis<Complex> basis;
+  CVector v1(3), v2(3);
+  v1 << 1, 2, 3;
+  v2 << 0, Complex(0, 1), 1;
+  CHECK(basis.Add(v1));
+  CHECK(basis.Add(v2));
+  CHECK(!basis.Add(v1 * Complex(2, 1) - v2 * 3.0));
+  CHECK(!basis.Add(CVector::Zero(3)));
+  CHECK(basis.Size() == 2);
+
+  // A vector of a different size restarts the basis.
+  CHECK(basis.Add(CVector::Ones(4)));
+  CHECK(basis.Size() == 1 && basis.Rows() == 4);
+}
+
+}  // namespace FEM
@@ -0,0 +1,125 @@
+// Reduced order models for fast parameter sweeps.
+//
+// A sweep (e.g. over frequency) solves A(p)*x = b(p) for many values of a
+// parameter p. The solutions x(p) are smooth functions of p away from
+// resonances, so they lie close to the subspace spanned by the solutions (and
+// their derivatives) at a few expansion points p1, p2, ... If V is an
+// orthonormal basis for that subspace then the Galerkin projection
+//
+//   (V'*A(p)*V) * y = V'*b(p),   x = V*y
+//
+// is a tiny dense system that matches x(p) and its derivatives at the
+// expansion points (multi-point Pade / moment matching). Forming it costs a
+// few sparse matrix-vector products, which is much cheaper than factoring
+// A(p). The residual |b - A*x| / |b| is computed as a by-product and serves
+// as the error estimator: when it is too large the caller does a full solve
+// at p and adds that solution to the basis as a new expansion point.
+
+#ifndef __TOOLKIT_REDUCED_MODEL_H__
+#define __TOOLKIT_REDUCED_MODEL_H__
+
+#include "myvector"
+#include "Eigen/Dense"
+#include "Eigen/Sparse"
+#include "error.h"
+
+namespace FEM {
+
+// The default largest relative residual of an accepted reduced solution.
+const double kReducedModelTolerance = 1e-6;
+
+template<class Scalar> class ReducedBasis {
+ public:
+  typedef Eigen::SparseMatrix<Scalar> MatrixType;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> DenseMatrix;
+
+  // The basis is restarted when it would grow past this many vectors, to
+  // bound its memory and the cost of each reduced solve.
+  static const int kMaxSize = 100;
+
+  ReducedBasis() : residual_(0) {}
+
+  // The number of basis vectors, and the size of each of them.
+  int Size() const { return V_.cols(); }
+  int Rows() const { return V_.rows(); }
+
+  void Clear() {
+    V_.resize(0, 0);
+  }
+
+  // Add a vector (e.g. the solution at a new expansion point) to the basis.
+  // Return false if it was not added because it is zero or (numerically)
+  // already in the span of the basis. If the basis has a different size to
+  // 'v', or is full, it is restarted with just 'v'.
+  bool Add(const Vector &v) {
+    if (Size() > 0 && (Rows() != v.size() || Size() >= kMaxSize)) {
+      Clear();
+    }
+    double norm = v.norm();
+    if (norm == 0) {
+      return false;
+    }
+    // Classical Gram-Schmidt, done twice for numerical orthogonality.
+    Vector w = v;
+    if (Size() > 0) {
+      for (int pass = 0; pass < 2; pass++) {
+        w -= V_ * (V_.adjoint() * w);
+      }
+    }
+    double wnorm = w.norm();
+    if (!(wnorm > 1e-10 * norm)) {
+      return false;
+    }
+    V_.conservativeResize(v.size(), Size() + 1);
+    V_.col(Size() - 1) = w / wnorm;
+    return true;
+  }
+
+  // Compute the Galerkin solution 'x' of A*x = b in the span of the basis.
+  // If 'lower_triangular' is true then only the lower triangle of A is stored
+  // (the upper triangle is implied by symmetry). Return true if the relative
+  // residual is at most 'tolerance', or false if the solution is not accurate
+  // enough (or the basis is empty or the wrong size), in which case the
+  // caller should solve A*x = b directly and Add() the solution.
+  bool Solve(const MatrixType &A, const Vector &b, bool lower_triangular,
+             double tolerance, Vector *x) MUST_USE_RESULT {
+    residual_ = 0;
+    if (Size() == 0 || Rows() != A.rows() || b.size() != A.rows()) {
+      return false;
+    }
+    double bnorm = b.norm();
+    if (bnorm == 0) {
+      x->setZero(b.size());
+      return true;
+    }
+    DenseMatrix AV = A * V_;
+    if (lower_triangular) {
+      AV += A.transpose() * V_;
+      AV -= A.diagonal().asDiagonal() * V_;
+    }
+    DenseMatrix Ar = V_.adjoint() * AV;
+    Eigen::PartialPivLU<DenseMatrix> lu(Ar);
+    if (!(lu.rcond() > 1e-14)) {
+      return false;
+    }
+    Vector y = lu.solve(V_.adjoint() * b);
+    residual_ = (b - AV * y).norm() / bnorm;
+    if (!(residual_ <= tolerance)) {
+      return false;
+    }
+    *x = V_ * y;
+    return true;
+  }
+
+  // The relative residual |b-A*x|/|b| from the last Solve().
+  double Residual() const { return residual_; }
+
+ private:
+  DenseMatrix V_;               // Orthonormal basis vectors, one per column
+  double residual_;             // From the last Solve()
+};
+
+}  // namespace FEM
+
+#endif
@@ -0,0 +1,127 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "myvector"
+#include "sparse_solver.h"
+#include "testing.h"
+
+using namespace Eigen;
+using std::vector;
+
+typedef std::complex<double> Complex;
+typedef SparseMatrix<Complex> CMatrix;
+typedef FEM::SparseSolverRegistry<Complex> Registry;
+
+// Create the system matrix for an N*N 2D grid Helmholtz problem with
+// dirichlet boundary conditions: laplacian - shift*identity. If 'asymmetry'
+// is nonzero the matrix is made nonsymmetric.
+static void SolverTestMatrix(int N, Complex shift, double asymmetry,
+                             CMatrix *A) {
+  vector<Triplet<Complex> > trips;
+  for (int i = 0; i < N; i++) {
+    for (int j = 0; j < N; j++) {
+      int index = i*N + j;
+      if (i > 0) trips.push_back(Triplet<Complex>(index, index-N, -1));
+      if (i < N-1) trips.push_back(Triplet<Complex>(index, index+N, -1));
+      if (j > 0) trips.push_back(Triplet<Complex>(index, index-1, -1));
+      if (j < N-1) {
+        trips.push_back(Triplet<Complex>(index, index+1, -1 + asymmetry));
+      }
+      trips.push_back(Triplet<Complex>(index, index, Complex(4) - shift));
+    }
+  }
+  A->resize(N*N, N*N);
+  A->setFromTriplets(trips.begin(), trips.end());
+  A->makeCompressed();
+}
+
+// Solve with the given backend name and return the backend actually used.
+static std::string SolveWith(const char *name, const CMatrix &A) {
+  VectorXcd b = VectorXcd::Random(A.rows());
+  FEM::RuntimeFactorizer<Complex> f;
+  f.SetSolver(name);
+  f.analyzePattern(A);
+  f.factorize(A);
+  CHECK(f.info() == Success);
+  VectorXcd x = f.solve(b);
+  printf("Solver %s used %s, error = %e\n", name, f.BackendName().c_str(),
+         (A * x - b).norm() / b.norm());
+  CHECK((A * x - b).norm() < 1e-9 * b.norm());
+  return f.BackendName();
+}
+
+TEST_FUNCTION(SparseSolverRegistry) {
+  srandom(123);
+  Registry &registry = Registry::Get();
+  CHECK(registry.IsValid("auto") && registry.IsValid("lu") &&
+        registry.IsValid("ldlt") && registry.IsValid("iterative") &&
+        registry.IsValid("dd") && registry.IsValid("amg"));
+  CHECK(!registry.IsValid("foo"));
+
+  // All backends solve a lossy complex symmetric problem.
+  CMatrix A;
+  SolverTestMatrix(30, Complex(0.5, 0.5), 0, &A);
+  CHECK(SolveWith("lu", A) == "lu");
+  CHECK(SolveWith("ldlt", A) == "ldlt");
+  CHECK(SolveWith("iterative", A) == "iterative");
+  CHECK(SolveWith("dd", A) == "dd");
+  CHECK(SolveWith("amg", A) == "amg");
+
+  // The auto policy chooses LU for symmetric and nonsymmetric matrices when
+  // there is enough memory. LDLT is never chosen, as it does not pivot.
+  CHECK(SolveWith("auto", A) == "lu");
+  CMatrix N;
+  SolverTestMatrix(30, Complex(0.5, 0.5), 0.1, &N);
+  CHECK(SolveWith("auto", N) == "lu");
+
+  // A symmetric matrix with a zero diagonal needs pivoting.
+  {
+    CMatrix Z(2, 2);
+    Z.insert(0, 1) = 1;
+    Z.insert(1, 0) = 1;
+    Z.makeCompressed();
+    CHECK(SolveWith("auto", Z) == "lu");
+  }
+
+  // Solving from a guess gives the same solution, whether the backend uses
+  // the guess (iterative) or ignores it (lu).
+  {
+    VectorXcd b = VectorXcd::Random(A.rows());
+    FEM::RuntimeFactorizer<Complex> lu, iterative;
+    lu.SetSolver("lu");
+    iterative.SetSolver("iterative");
+    lu.analyzePattern(A);
+    lu.factorize(A);
+    iterative.analyzePattern(A);
+    iterative.factorize(A);
+    VectorXcd x = lu.solve(b);
+    VectorXcd guess = x + 1e-3 * VectorXcd::Random(A.rows());
+    VectorXcd x1 = lu.solveWithGuess(b, guess);
+    VectorXcd x2 = iterative.solveWithGuess(b, guess);
+    CHECK((x1 - x).norm() < 1e-12 * x.norm());
+    CHECK((A * x2 - b).norm() < 1e-9 * b.norm());
+  }
+
+  // The policy tests below change the memory limit and the timings, so they
+  // use their own registry to leave the global one alone.
+  Registry local;
+
+  // With little memory the backend with the smallest memory estimate is
+  // used.
+  FEM::SparseSystemStats stats(A);
+  CHECK(stats.symmetric && stats.size == A.rows() && stats.fill > 0);
+  stats.fill = 1e9;
+  local.SetMemoryLimit(1e9);
+  CHECK(local.Choose(stats) == "iterative");
+  local.SetMemoryLimit(1);
+  CHECK(local.Choose(stats) == "iterative");
+  stats.fill = 0;
+  CHECK(local.Choose(stats) == "lu");
+  local.SetMemoryLimit(1e99);
+
+  // Recorded timings change the choice.
+  FEM::SparseSystemStats stats2(A);
+  CHECK(local.Choose(stats2) == "lu");
+  local.RecordTiming("lu", stats2, 1e6);
+  CHECK(local.Choose(stats2) == "iterative");
+}
@@ -0,0 +1,454 @@
+// Runtime selection of sparse linear solvers.
+//
+// FEM problems normally choose their sparse factorizer at compile time with a
+// Factorizer typedef. RuntimeFactorizer is a Factorizer that instead chooses a
+// backend at runtime, by name, from a registry of sparse solvers. The built in
+// backends are:
+//
+//   lu        - Supernodal LU with partial pivoting (Eigen's SparseLU). This
+//               is the most robust.
+//   ldlt      - Multifrontal LDL' without pivoting (MultifrontalLDLT). This
+//               needs about half the memory and operations of LU, and uses all
+//               cores, but it only works for symmetric (or complex symmetric)
+//               matrices. Without pivoting a small pivot in an indefinite
+//               matrix (e.g. Helmholtz) gives an inaccurate solution with no
+//               failure reported, so it is never chosen by "auto".
+//   iterative - BiCGSTAB with an incomplete LU preconditioner. This needs the
+//               least memory but may converge slowly or not at all.
+//   amg       - BiCGSTAB with an algebraic multigrid preconditioner built on
+//               the shifted Laplacian (AlgebraicMultigrid). Its work and
+//               memory grow almost linearly with the matrix size, so it is for
+//               models too large for the factorizers. The number of iterations
+//               grows with the frequency (the number of wavelengths across
+//               the model), so its cost is hard to estimate and it is never
+//               chosen by "auto".
+//   dd        - Schur complement domain decomposition
+//               (DomainDecompositionFactorizer). The subdomains are factored by
+//               LU in parallel, one per core. This is for large problems on
+//               many cores, where the interface between the subdomains is
+//               relatively small. Its cost is hard to estimate so it is never
+//               chosen by "auto".
+//
+// The backend name "auto" chooses a backend for each matrix. A symbolic
+// analysis of the matrix gives the size of the factor and the number of
+// operations needed to compute it, from which each backend estimates its
+// memory use and work. The backends that fit in memory (and that can handle
+// the matrix symmetry) are ranked by work multiplied by the seconds-per-unit-
+// of-work measured in earlier solves, and the fastest is used. If the chosen
+// backend fails the LU backend is used instead. The measured speeds are only
+// kept in memory, so each run of the program starts again from the built in
+// estimates.
+//
+// Every layer also has solveWithGuess(b, guess), where 'guess' is an
+// approximate solution (e.g. a prediction from a similar system). The
+// iterative backends start from it, the others ignore it.
+
+#ifndef __TOOLKIT_SPARSE_SOLVER_H__
+#define __TOOLKIT_SPARSE_SOLVER_H__
+
+#include <cmath>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <memory>
+#include "myvector"
+#include "Eigen/Dense"
+#include "Eigen/Sparse"
+#include "error.h"
+#include "thread.h"
+#include "domain_decomposition.h"
+#include "mixed_precision.h"
+#include "multifrontal.h"
+#include "multigrid.h"
+#include "nested_dissection.h"
+
+namespace FEM {
+
+// The interface to a sparse solver backend. This is the Eigen factorizer
+// interface, made virtual.
+template<class Scalar>
+class SparseSolver {
+ public:
+  typedef Eigen::SparseMatrix<Scalar> MatrixType;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+
+  virtual ~SparseSolver() {}
+  virtual void SetMixedPrecision(bool mixed) {}
+  virtual void analyzePattern(const MatrixType &A) = 0;
+  virtual void factorize(const MatrixType &A) = 0;
+  virtual Eigen::ComputationInfo info() const = 0;
+  virtual Vector solve(const Vector &b) = 0;
+  virtual Vector solveWithGuess(const Vector &b, const Vector &guess) {
+    return solve(b);
+  }
+};
+
+// A backend for any Eigen-style factorizer that has SetMixedPrecision().
+template<class Factorizer>
+class SparseSolverAdapter
+    : public SparseSolver<typename Factorizer::MatrixType::Scalar> {
+ public:
+  typedef typename Factorizer::MatrixType MatrixType;
+  typedef typename MatrixType::Scalar Scalar;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+
+  void SetMixedPrecision(bool mixed) { f_.SetMixedPrecision(mixed); }
+  void analyzePattern(const MatrixType &A) { f_.analyzePattern(A); }
+  void factorize(const MatrixType &A) { f_.factorize(A); }
+  Eigen::ComputationInfo info() const { return f_.info(); }
+  Vector solve(const Vector &b) { return f_.solve(b); }
+
+ private:
+  Factorizer f_;
+};
+
+// The iterative backends, which differ in their preconditioner. If the
+// iteration does not converge this falls back to LU.
+template<class Scalar,
+         class Preconditioner = Eigen::IncompleteLUT<Scalar> >
+class IterativeSparseSolver : public SparseSolver<Scalar> {
+ public:
+  typedef Eigen::SparseMatrix<Scalar> MatrixType;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+
+  // The incomplete LU fill factor.
+  static const int kFillFactor = 10;
+
+  IterativeSparseSolver() {
+    Configure(&solver_.preconditioner());
+  }
+  void analyzePattern(const MatrixType &A) {}
+  void factorize(const MatrixType &A) {
+    // Eigen's iterative solvers keep a reference to A, so keep a copy.
+    A_ = A;
+    solver_.compute(A_);
+  }
+  Eigen::ComputationInfo info() const {
+    return solver_.preconditioner().info();
+  }
+  Vector solve(const Vector &b) {
+    return Converged(b, solver_.solve(b));
+  }
+  Vector solveWithGuess(const Vector &b, const Vector &guess) {
+    return Converged(b, solver_.solveWithGuess(b, guess));
+  }
+
+ private:
+  MatrixType A_;
+  Eigen::BiCGSTAB<MatrixType, Preconditioner> solver_;
+
+  // Return the iterative solution 'x' of A*x=b if it converged, otherwise
+  // solve with LU.
+  Vector Converged(const Vector &b, const Vector &x) {
+    if (solver_.info() == Eigen::Success) {
+      return x;
+    }
+    Warning("Iterative solver did not converge, using LU");
+    Eigen::SparseLU<MatrixType, NestedDissectionColumnOrdering<int> > lu(A_);
+    if (lu.info() != Eigen::Success) {
+      return Vector::Constant(b.size(), Scalar(NAN));
+    }
+    return lu.solve(b);
+  }
+
+  static void Configure(Eigen::IncompleteLUT<Scalar> *p) {
+    p->setFillfactor(kFillFactor);
+  }
+  static void Configure(AlgebraicMultigrid<Scalar> *p) {}
+};
+
+// The properties of a matrix that the backends use to estimate their cost.
+struct SparseSystemStats {
+  int size;                     // Number of rows
+  size_t nonzeros;              // Number of nonzeros
+  bool symmetric;               // True if A == A'
+  size_t fill;                  // Off-diagonal nonzeros in a Cholesky factor
+  double flops;                 // Multiply-adds to compute the factor
+
+  template<class MatrixType>
+  explicit SparseSystemStats(const MatrixType &A) {
+    size = A.rows();
+    nonzeros = A.nonZeros();
+    MatrixType At = A.transpose();
+    symmetric = (A - At).norm() <= 1e-12 * A.norm();
+    std::vector<int> adj_begin, adj, order;
+    SymmetricAdjacency(A, &adj_begin, &adj);
+    GeometricOrdering(A, &order);
+    SymbolicCholesky(adj_begin, adj, order, &fill, &flops);
+  }
+};
+
+// The registry of sparse solver backends for a given scalar type.
+template<class Scalar>
+class SparseSolverRegistry {
+ public:
+  typedef SparseSolver<Scalar> *(*Factory)();
+  typedef double (*CostFunction)(const SparseSystemStats &stats);
+
+  // A registry with just the built in backends. RuntimeFactorizer uses the
+  // one from Get(), other instances (e.g. in tests) are independent of it.
+  SparseSolverRegistry() {
+    memory_limit_ = 0.5 * double(sysconf(_SC_PHYS_PAGES)) *
+                    double(sysconf(_SC_PAGESIZE));
+    // The cost estimates are rough. LU with a symmetric ordering and diagonal
+    // pivots has twice the factor size and work of a Cholesky factor.
+    // BiCGSTAB does two matrix and two preconditioner multiplies per
+    // iteration, and for 2D elliptic problems needs O(sqrt(n)) iterations.
+    Register("lu", NewLU, false, LUMemory, LUWork, 1e-9);
+    Register("ldlt", NewLDLT, true, 0, 0, 0);
+    Register("iterative", NewIterative, false, IterativeMemory, IterativeWork,
+             1e-9);
+    Register("dd", NewDD, false, 0, 0, 0);
+    Register("amg", NewMultigrid, false, 0, 0, 0);
+  }
+
+  // Return the registry for this scalar type. The built in backends are
+  // registered when this is first called.
+  static SparseSolverRegistry &Get() {
+    static SparseSolverRegistry registry;
+    return registry;
+  }
+
+  // Add a backend. 'memory' estimates the bytes used and 'work' the work
+  // done, in any units. The seconds per unit of work starts at
+  // 'seconds_per_work' and is then updated by RecordTiming(). If 'memory'
+  // and 'work' are 0 then the backend is only used when asked for by name.
+  void Register(const std::string &name, Factory factory, bool symmetric_only,
+                CostFunction memory, CostFunction work,
+                double seconds_per_work) {
+    MutexLock lock(&mutex_);
+    CHECK(name != "auto" && FindLocked(name) == -1);
+    Backend b;
+    b.name = name;
+    b.factory = factory;
+    b.symmetric_only = symmetric_only;
+    b.memory = memory;
+    b.work = work;
+    b.seconds_per_work = seconds_per_work;
+    backends_.push_back(b);
+  }
+
+  // Return true if 'name' is a backend or "auto".
+  bool IsValid(const std::string &name) {
+    MutexLock lock(&mutex_);
+    return name == "auto" || FindLocked(name) != -1;
+  }
+
+  // Create a new backend, or return 0 if there is no such name.
+  SparseSolver<Scalar> *New(const std::string &name) {
+    MutexLock lock(&mutex_);
+    int i = FindLocked(name);
+    return (i == -1) ? 0 : backends_[i].factory();
+  }
+
+  // Return the name of the backend that is expected to be fastest for a
+  // matrix, of those that fit in memory. If none fit use the one that needs
+  // the least memory.
+  std::string Choose(const SparseSystemStats &stats) {
+    MutexLock lock(&mutex_);
+    int best = -1, smallest = -1;
+    double best_time = 0, smallest_memory = 0;
+    for (int i = 0; i < backends_.size(); i++) {
+      const Backend &b = backends_[i];
+      if ((b.symmetric_only && !stats.symmetric) || !b.work) {
+        continue;
+      }
+      double memory = b.memory(stats);
+      double time = b.work(stats) * b.seconds_per_work;
+      if (smallest == -1 || memory < smallest_memory) {
+        smallest = i;
+        smallest_memory = memory;
+      }
+      if (memory <= memory_limit_ && (best == -1 || time < best_time)) {
+        best = i;
+        best_time = time;
+      }
+    }
+    CHECK(smallest != -1);
+    return backends_[best == -1 ? smallest : best].name;
+  }
+
+  // Record that the named backend took 'seconds' to solve a system. The
+  // measured speed is averaged with earlier measurements.
+  void RecordTiming(const std::string &name, const SparseSystemStats &stats,
+                    double seconds) {
+    MutexLock lock(&mutex_);
+    int i = FindLocked(name);
+    CHECK(i != -1);
+    Backend &b = backends_[i];
+    double work = b.work ? b.work(stats) : 0;
+    if (work > 0) {
+      double rate = seconds / work;
+      b.seconds_per_work = (b.num_timings == 0) ? rate :
+                           0.5 * (b.seconds_per_work + rate);
+      b.num_timings++;
+    }
+  }
+
+  // The memory available to backends, in bytes. The default is half of the
+  // physical memory.
+  void SetMemoryLimit(double bytes) {
+    MutexLock lock(&mutex_);
+    memory_limit_ = bytes;
+  }
+
+ private:
+  struct Backend {
+    std::string name;
+    Factory factory;
+    bool symmetric_only;
+    CostFunction memory, work;
+    double seconds_per_work;
+    int num_timings;
+    Backend() : num_timings(0) {}
+  };
+  Mutex mutex_;                         // Protects members below
+  std::vector<Backend> backends_;
+  double memory_limit_;
+
+  typedef typename LowPrecision<Scalar>::Type LowScalar;
+  typedef Eigen::SparseMatrix<Scalar> MatrixType;
+  typedef Eigen::SparseMatrix<LowScalar> LowMatrixType;
+
+  int FindLocked(const std::string &name) const {
+    for (int i = 0; i < backends_.size(); i++) {
+      if (backends_[i].name == name) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  static SparseSolver<Scalar> *NewLU() {
+    return new SparseSolverAdapter<MixedPrecisionFactorizer<
+        Eigen::SparseLU<MatrixType, NestedDissectionColumnOrdering<int> >,
+        Eigen::SparseLU<LowMatrixType, NestedDissectionColumnOrdering<int> >
+        > >;
+  }
+  static SparseSolver<Scalar> *NewLDLT() {
+    return new SparseSolverAdapter<MixedPrecisionFactorizer<
+        MultifrontalLDLT<MatrixType, NestedDissectionOrdering<int> >,
+        MultifrontalLDLT<LowMatrixType, NestedDissectionOrdering<int> >
+        > >;
+  }
+  static SparseSolver<Scalar> *NewIterative() {
+    return new IterativeSparseSolver<Scalar>;
+  }
+  static SparseSolver<Scalar> *NewMultigrid() {
+    return new IterativeSparseSolver<Scalar, AlgebraicMultigrid<Scalar> >;
+  }
+  static SparseSolver<Scalar> *NewDD() {
+    return new SparseSolverAdapter<DomainDecompositionFactorizer<Scalar> >;
+  }
+  static double LUMemory(const SparseSystemStats &s) {
+    return 2.0 * (s.fill + s.size) * sizeof(Scalar);
+  }
+  static double LUWork(const SparseSystemStats &s) {
+    return 2.0 * s.flops;
+  }
+  static double IterativeMemory(const SparseSystemStats &s) {
+    const int kFill = IterativeSparseSolver<Scalar>::kFillFactor;
+    return (kFill + 2.0) * s.nonzeros * sizeof(Scalar);
+  }
+  static double IterativeWork(const SparseSystemStats &s) {
+    const int kFill = IterativeSparseSolver<Scalar>::kFillFactor;
+    return 4.0 * (kFill + 1.0) * s.nonzeros * std::sqrt(double(s.size));
+  }
+
+  DISALLOW_COPY_AND_ASSIGN(SparseSolverRegistry);
+};
+
+// A drop-in replacement for an Eigen sparse factorizer that uses a backend
+// from SparseSolverRegistry. Both triangles of the matrix must be set.
+template<class Scalar>
+class RuntimeFactorizer {
+ public:
+  typedef Eigen::SparseMatrix<Scalar> MatrixType;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+  typedef SparseSolverRegistry<Scalar> Registry;
+
+  RuntimeFactorizer() : solver_name_("auto"), mixed_(false),
+                        info_(Eigen::Success) {}
+
+  // Set the backend name, or "auto". This must be a valid name. Call this
+  // before analyzePattern().
+  void SetSolver(const std::string &name) {
+    CHECK(Registry::Get().IsValid(name));
+    solver_name_ = name;
+  }
+
+  // Use mixed precision in backends that support it.
+  void SetMixedPrecision(bool mixed) { mixed_ = mixed; }
+
+  // The backend actually being used, after analyzePattern().
+  const std::string &BackendName() const { return backend_name_; }
+
+  void analyzePattern(const MatrixType &A) {
+    backend_name_ = solver_name_;
+    if (solver_name_ == "auto") {
+      start_time_ = std::chrono::steady_clock::now();
+      stats_.reset(new SparseSystemStats(A));
+      backend_name_ = Registry::Get().Choose(*stats_);
+    }
+    backend_.reset(Registry::Get().New(backend_name_));
+    CHECK(backend_.get());
+    backend_->SetMixedPrecision(mixed_);
+    backend_->analyzePattern(A);
+  }
+
+  void factorize(const MatrixType &A) {
+    CHECK(backend_.get());
+    backend_->factorize(A);
+    info_ = backend_->info();
+    if (info_ != Eigen::Success && stats_.get() && backend_name_ != "lu") {
+      Warning("The %s solver failed, using LU", backend_name_.c_str());
+      stats_.reset();           // Don't record a timing for this
+      backend_name_ = "lu";
+      backend_.reset(Registry::Get().New(backend_name_));
+      backend_->SetMixedPrecision(mixed_);
+      backend_->analyzePattern(A);
+      backend_->factorize(A);
+      info_ = backend_->info();
+    }
+  }
+
+  Eigen::ComputationInfo info() const { return info_; }
+
+  // Solve A*x=b. Like MixedPrecisionFactorizer this is not const. The time
+  // taken by the backend to analyze, factor and do the first solve is
+  // recorded in the registry.
+  template<class Derived>
+  Vector solve(const Eigen::MatrixBase<Derived> &b) {
+    CHECK(backend_.get());
+    return Solved(backend_->solve(b));
+  }
+
+  // Solve A*x=b starting from an approximate solution, see above.
+  Vector solveWithGuess(const Vector &b, const Vector &guess) {
+    CHECK(backend_.get());
+    return Solved(backend_->solveWithGuess(b, guess));
+  }
+
+ private:
+  std::string solver_name_, backend_name_;
+  bool mixed_;
+  Eigen::ComputationInfo info_;
+  std::unique_ptr<SparseSolver<Scalar> > backend_;
+  std::unique_ptr<SparseSystemStats> stats_;    // For timing "auto" solves
+  std::chrono::steady_clock::time_point start_time_;
+
+  // Record the time taken by the first solve, return the solution 'x'.
+  Vector Solved(const Vector &x) {
+    if (stats_.get()) {
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start_time_;
+      Registry::Get().RecordTiming(backend_name_, *stats_, elapsed.count());
+      stats_.reset();
+    }
+    return x;
+  }
+};
+
+}  // namespace FEM
+
+#endif
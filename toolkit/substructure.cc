@@ -0,0 +1,106 @@
+
+// Testing for SubstructuredFactorizer.
+
+#include "substructure.h"
+#include <stdio.h>
+#include "testing.h"
+
+namespace FEM {
+
+typedef std::complex<double> Complex;
+typedef Eigen::SparseMatrix<Complex> CMatrix;
+typedef Eigen::Matrix<Complex, Eigen::Dynamic, 1> CVector;
+
+// A Helmholtz-like matrix (complex symmetric) for an n*n grid with unit
+// spacing, with rows numbered through 'order' (order[k] is the row of grid
+// point k). 'k2' is added to the diagonal of grid points with x >= 10 and
+// y >= 10.
+static void SubstructureMatrix(int n, const std::vector<int> &order,
+                               Complex k2, CMatrix *A, Eigen::Matrix2Xd *xy) {
+  std::vector<Eigen::Triplet<Complex> > t;
+  xy->resize(2, n * n);
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < n; j++) {
+      int k = order[i * n + j];
+      (*xy)(0, k) = j;
+      (*xy)(1, k) = i;
+      Complex d(4 - 0.5, 0.1 * j / n);
+      if (i >= 10 && j >= 10) {
+        d += k2;
+      }
+      t.push_back(Eigen::Triplet<Complex>(k, k, d));
+      if (i > 0) {
+        t.push_back(Eigen::Triplet<Complex>(k, order[(i - 1) * n + j], -1));
+        t.push_back(Eigen::Triplet<Complex>(order[(i - 1) * n + j], k, -1));
+      }
+      if (j > 0) {
+        t.push_back(Eigen::Triplet<Complex>(k, order[i * n + j - 1], -1));
+        t.push_back(Eigen::Triplet<Complex>(order[i * n + j - 1], k, -1));
+      }
+    }
+  }
+  A->resize(n * n, n * n);
+  A->setFromTriplets(t.begin(), t.end());
+}
+
+// Solve A*x=b with substructuring and check against SparseLU. Return true if
+// the fixed subdomain was found in the cache.
+static bool SubstructureSolve(const CMatrix &A, const Eigen::Matrix2Xd &xy,
+                              const std::vector<double> &boxes) {
+  CVector b = CVector::Random(A.rows());
+  SubstructuredFactorizer<Complex> f;
+  f.SetChangingRegion(boxes);
+  {
+    NestedDissectionCoordinates coordinates(&xy);
+    f.analyzePattern(A);
+    f.factorize(A);
+  }
+  CHECK(f.info() == Eigen::Success);
+  CVector x = f.solve(b);
+  Eigen::SparseLU<CMatrix> lu(A);
+  CVector x_lu = lu.solve(b);
+  double error = (x - x_lu).norm() / x_lu.norm();
+  printf("Interface size %d, cache hit %d, error = %g\n",
+         f.InterfaceSize(), f.CacheHit(), error);
+  CHECK(error < 1e-10);
+  return f.CacheHit();
+}
+
+TEST_FUNCTION(SubstructuredFactorizer) {
+  const int n = 30;
+  std::vector<int> order(n * n);
+  for (int i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::vector<double> boxes(4);
+  boxes[0] = 9.5;               // The changing region is x,y >= 10
+  boxes[1] = 9.5;
+  boxes[2] = n;
+  boxes[3] = n;
+  CMatrix A;
+  Eigen::Matrix2Xd xy;
+  SubstructuredFactorizer<Complex>::ClearCache();
+
+  // The first solve computes the fixed subdomain, the second (which changes
+  // only the changing region) reuses it.
+  SubstructureMatrix(n, order, Complex(0.1, 0), &A, &xy);
+  CHECK(!SubstructureSolve(A, xy, boxes));
+  SubstructureMatrix(n, order, Complex(0.3, 0.2), &A, &xy);
+  CHECK(SubstructureSolve(A, xy, boxes));
+
+  // The fixed subdomain is found even if the rows are renumbered.
+  for (int i = 0; i < order.size(); i++) {
+    order[i] = order.size() - 1 - i;
+  }
+  SubstructureMatrix(n, order, Complex(0.5, 0), &A, &xy);
+  CHECK(SubstructureSolve(A, xy, boxes));
+
+  // A different changing region gives a different fixed subdomain.
+  boxes[0] = 15.5;
+  CHECK(!SubstructureSolve(A, xy, boxes));
+
+  // Without boxes the matrix is factored as a whole.
+  CHECK(!SubstructureSolve(A, xy, std::vector<double>()));
+}
+
+}  // namespace FEM
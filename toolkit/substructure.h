@@ -0,0 +1,452 @@
+// Substructured factorization with cached Schur complements.
+//
+// Optimization models often have a large region that does not change from one
+// step to the next (feed waveguides, horns, air boxes) and a small region that
+// is parameterized. SubstructuredFactorizer splits the rows of the system
+// matrix into the fixed subdomain I, outside a given set of boxes, and the
+// rest B, inside them. The rows of B that are coupled to I are the interface
+// G. Then
+//
+//   A = [ A_II  A_IG  ]     and the Schur complement of A_II is
+//       [ A_GI  A_BB  ]     S = A_BB - A_GI * inv(A_II) * A_IG
+//
+// where the correction term only touches the G rows and columns of A_BB. The
+// factorization of A_II and the dense correction are cached, keyed by a hash
+// of the coordinates of the I and G rows and the values of A_II, A_IG and
+// A_GI. A cached subdomain keeps copies of those, which are compared in full
+// before it is reused, so a hash collision can not give a wrong factor. When a
+// later matrix has the same fixed subdomain (even if its rows are numbered
+// differently) only S, which is small, has to be factored. Solving
+// A*x=b takes two solves with A_II and one with S.
+//
+// The coordinates of the rows are taken from NestedDissectionCoordinates, so
+// the caller must create one of those around analyzePattern() and
+// factorize(). Cache hits need the fixed part of the mesh to be reproduced
+// exactly, which meshers generally do when the geometry changes only inside
+// the boxes and the boxes are not too close to the fixed features.
+
+#ifndef __TOOLKIT_SUBSTRUCTURE_H__
+#define __TOOLKIT_SUBSTRUCTURE_H__
+
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+#include <memory>
+#include "myvector"
+#include "Eigen/Dense"
+#include "Eigen/Sparse"
+#include "error.h"
+#include "thread.h"
+#include "nested_dissection.h"
+#include "sparse_solver.h"
+
+namespace FEM {
+
+// A drop-in replacement for an Eigen sparse factorizer. Without boxes (or if
+// the boxes contain everything or nothing) this is the same as a
+// RuntimeFactorizer. Both triangles of the matrix must be set.
+template<class Scalar>
+class SubstructuredFactorizer {
+ public:
+  typedef Eigen::SparseMatrix<Scalar> MatrixType;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> DenseMatrix;
+
+  // The number of fixed subdomains that are cached.
+  static const int kCacheSize = 2;
+
+  SubstructuredFactorizer() : solver_name_("auto"), mixed_(false),
+                              info_(Eigen::Success), cache_hit_(false) {}
+
+  // Options for the RuntimeFactorizers used for A_II, S (or A). Call these
+  // before analyzePattern().
+  void SetSolver(const std::string &name) { solver_name_ = name; }
+  void SetMixedPrecision(bool mixed) { mixed_ = mixed; }
+
+  // Set the boxes x1,y1,x2,y2,... that contain the changing part of the
+  // model. Rows outside all boxes are in the fixed subdomain.
+  void SetChangingRegion(const std::vector<double> &boxes) {
+    const bool whole_boxes = boxes.size() % 4 == 0;
+    CHECK(whole_boxes);
+    boxes_ = boxes;
+  }
+
+  // True if factorize() found the fixed subdomain in the cache.
+  bool CacheHit() const { return cache_hit_; }
+
+  // The number of interface rows, or 0 if the matrix is not substructured.
+  int InterfaceSize() const { return interface_.size(); }
+
+  // Empty the cache of fixed subdomains, to free memory.
+  static void ClearCache() {
+    Cache &cache = GetCache();
+    MutexLock lock(&cache.mutex);
+    cache.subdomains.clear();
+  }
+
+  void analyzePattern(const MatrixType &A) {
+    CHECK(A.rows() == A.cols());
+    const int n = A.rows();
+    const Eigen::Matrix2Xd *xy = NestedDissectionCoordinates::Current();
+    interior_.clear();
+    rest_.clear();
+    interface_.clear();
+    subdomain_.reset();
+    schur_.reset();
+    whole_.reset();
+
+    // Partition the rows.
+    fixed_.assign(n, false);
+    if (!boxes_.empty() && xy && xy->cols() == n) {
+      for (int i = 0; i < n; i++) {
+        fixed_[i] = true;
+        for (int j = 0; j + 3 < boxes_.size(); j += 4) {
+          double x = (*xy)(0, i), y = (*xy)(1, i);
+          if (x >= std::min(boxes_[j], boxes_[j + 2]) &&
+              x <= std::max(boxes_[j], boxes_[j + 2]) &&
+              y >= std::min(boxes_[j + 1], boxes_[j + 3]) &&
+              y <= std::max(boxes_[j + 1], boxes_[j + 3])) {
+            fixed_[i] = false;
+            break;
+          }
+        }
+        (fixed_[i] ? interior_ : rest_).push_back(i);
+      }
+    }
+    if (interior_.empty() || rest_.empty()) {
+      interior_.clear();
+      rest_.clear();
+      whole_.reset(NewFactorizer());
+      whole_->analyzePattern(A);
+      return;
+    }
+
+    // Find the interface rows.
+    std::vector<bool> on_interface(n, false);
+    for (int j = 0; j < A.outerSize(); j++) {
+      for (typename MatrixType::InnerIterator it(A, j); it; ++it) {
+        if (fixed_[it.row()] != fixed_[it.col()]) {
+          on_interface[fixed_[it.row()] ? it.col() : it.row()] = true;
+        }
+      }
+    }
+    for (int i = 0; i < rest_.size(); i++) {
+      if (on_interface[rest_[i]]) {
+        interface_.push_back(rest_[i]);
+      }
+    }
+
+    // Put the interior and interface rows in a canonical order, by
+    // coordinate, so that subdomains can be matched across meshes that number
+    // their points differently.
+    auto less = [xy](int a, int b) {
+      return (*xy)(0, a) < (*xy)(0, b) ||
+             ((*xy)(0, a) == (*xy)(0, b) && (*xy)(1, a) < (*xy)(1, b));
+    };
+    std::sort(interior_.begin(), interior_.end(), less);
+    std::sort(interface_.begin(), interface_.end(), less);
+    position_.assign(n, -1);
+    for (int i = 0; i < interior_.size(); i++) {
+      position_[interior_[i]] = i;
+    }
+    for (int i = 0; i < rest_.size(); i++) {
+      position_[rest_[i]] = i;
+    }
+  }
+
+  void factorize(const MatrixType &A) {
+    cache_hit_ = false;
+    if (whole_.get()) {
+      whole_->factorize(A);
+      info_ = whole_->info();
+      return;
+    }
+    const int n = A.rows();
+    const int ni = interior_.size(), nr = rest_.size(),
+              ng = interface_.size();
+    CHECK(n == ni + nr);
+    const Eigen::Matrix2Xd *xy = NestedDissectionCoordinates::Current();
+    CHECK(xy && xy->cols() == n);
+
+    // Split A into blocks. The columns of A_IG and rows of A_GI are in
+    // interface order, the rest are in interior or rest order.
+    std::vector<int> gpos(n, -1);
+    for (int i = 0; i < ng; i++) {
+      gpos[interface_[i]] = i;
+    }
+    typedef Eigen::Triplet<Scalar> Triplet;
+    std::vector<Triplet> tii, tig, tgi, tbb;
+    for (int j = 0; j < A.outerSize(); j++) {
+      for (typename MatrixType::InnerIterator it(A, j); it; ++it) {
+        int r = it.row(), c = it.col();
+        int pr = position_[r], pc = position_[c];
+        bool fr = fixed_[r], fc = fixed_[c];
+        if (fr && fc) {
+          tii.push_back(Triplet(pr, pc, it.value()));
+        } else if (fr) {
+          tig.push_back(Triplet(pr, gpos[c], it.value()));
+        } else if (fc) {
+          tgi.push_back(Triplet(gpos[r], pc, it.value()));
+        } else {
+          tbb.push_back(Triplet(pr, pc, it.value()));
+        }
+      }
+    }
+    MatrixType Aii(ni, ni), Aig(ni, ng), Agi(ng, ni);
+    Aii.setFromTriplets(tii.begin(), tii.end());
+    Aig.setFromTriplets(tig.begin(), tig.end());
+    Agi.setFromTriplets(tgi.begin(), tgi.end());
+
+    // Find or compute the fixed subdomain.
+    Eigen::Matrix2Xd fixed_xy(2, ni + ng);
+    for (int i = 0; i < ni; i++) {
+      fixed_xy.col(i) = xy->col(interior_[i]);
+    }
+    for (int i = 0; i < ng; i++) {
+      fixed_xy.col(ni + i) = xy->col(interface_[i]);
+    }
+    uint64_t key = kHashBasis;
+    Hash(&key, &ni, sizeof(ni));
+    Hash(&key, &ng, sizeof(ng));
+    Hash(&key, fixed_xy.data(), fixed_xy.size() * sizeof(double));
+    Hash(&key, Aii);
+    Hash(&key, Aig);
+    Hash(&key, Agi);
+    subdomain_ = Lookup(key, fixed_xy, Aii, Aig, Agi);
+    cache_hit_ = subdomain_.get() != 0;
+    if (!cache_hit_) {
+      subdomain_.reset(new Subdomain);
+      subdomain_->key = key;
+      subdomain_->xy = fixed_xy;
+      subdomain_->Aii = Aii;
+      if (!ComputeSubdomain(Aii, Aig, Agi, *xy, subdomain_.get())) {
+        subdomain_.reset();
+        info_ = Eigen::NumericalIssue;
+        return;
+      }
+      Insert(subdomain_);
+    }
+
+    // Form and factor S.
+    for (int i = 0; i < ng; i++) {
+      for (int j = 0; j < ng; j++) {
+        tbb.push_back(Triplet(position_[interface_[i]],
+                              position_[interface_[j]],
+                              -subdomain_->C(i, j)));
+      }
+    }
+    MatrixType S(nr, nr);
+    S.setFromTriplets(tbb.begin(), tbb.end());
+    Eigen::Matrix2Xd rest_xy(2, nr);
+    for (int i = 0; i < nr; i++) {
+      rest_xy.col(i) = xy->col(rest_[i]);
+    }
+    NestedDissectionCoordinates coordinates(&rest_xy);
+    schur_.reset(NewFactorizer());
+    schur_->analyzePattern(S);
+    schur_->factorize(S);
+    info_ = schur_->info();
+  }
+
+  Eigen::ComputationInfo info() const { return info_; }
+
+  // Solve A*x=b. Like RuntimeFactorizer this is not const.
+  template<class Derived>
+  Vector solve(const Eigen::MatrixBase<Derived> &b) {
+    return solveWithGuess(b, Vector());
+  }
+
+  // Solve A*x=b starting from an approximate solution 'guess', or from
+  // nothing if it is empty (see RuntimeFactorizer::solveWithGuess). Only the
+  // rest of the system (not the fixed interior) is solved iteratively.
+  Vector solveWithGuess(const Vector &b, const Vector &guess) {
+    if (whole_.get()) {
+      return guess.size() ? whole_->solveWithGuess(b, guess) :
+                            whole_->solve(b);
+    }
+    CHECK(subdomain_.get() && schur_.get());
+    const int ni = interior_.size(), nr = rest_.size(),
+              ng = interface_.size();
+    Vector bi(ni), br(nr);
+    for (int i = 0; i < ni; i++) {
+      bi[i] = b[interior_[i]];
+    }
+    for (int i = 0; i < nr; i++) {
+      br[i] = b[rest_[i]];
+    }
+    Vector yi = subdomain_->Solve(bi);
+    Vector t = subdomain_->Agi * yi;
+    for (int i = 0; i < ng; i++) {
+      br[position_[interface_[i]]] -= t[i];
+    }
+    Vector xr;
+    if (guess.size()) {
+      Vector gr(nr);
+      for (int i = 0; i < nr; i++) {
+        gr[i] = guess[rest_[i]];
+      }
+      xr = schur_->solveWithGuess(br, gr);
+    } else {
+      xr = schur_->solve(br);
+    }
+    Vector xg(ng);
+    for (int i = 0; i < ng; i++) {
+      xg[i] = xr[position_[interface_[i]]];
+    }
+    Vector xi = yi - subdomain_->Solve(subdomain_->Aig * xg);
+    Vector x(ni + nr);
+    for (int i = 0; i < ni; i++) {
+      x[interior_[i]] = xi[i];
+    }
+    for (int i = 0; i < nr; i++) {
+      x[rest_[i]] = xr[i];
+    }
+    return x;
+  }
+
+ private:
+  // A factored fixed subdomain, in canonical order. Solvers for different
+  // matrices may share this.
+  struct Subdomain {
+    uint64_t key;
+    Mutex mutex;                        // Protects 'interior'
+    RuntimeFactorizer<Scalar> interior; // Factors A_II
+    Eigen::Matrix2Xd xy;                // Coordinates of the I then G rows
+    MatrixType Aii, Aig, Agi;
+    DenseMatrix C;                      // A_GI * inv(A_II) * A_IG
+
+    Vector Solve(const Vector &b) {
+      MutexLock lock(&mutex);
+      return interior.solve(b);
+    }
+  };
+  struct Cache {
+    Mutex mutex;                        // Protects 'subdomains'
+    std::vector<std::shared_ptr<Subdomain> > subdomains;  // Most recent last
+  };
+
+  std::string solver_name_;
+  bool mixed_;
+  std::vector<double> boxes_;
+  Eigen::ComputationInfo info_;
+  bool cache_hit_;
+  std::vector<bool> fixed_;             // True for the rows of I
+  std::vector<int> interior_;           // Rows of I, in canonical order
+  std::vector<int> rest_;               // Rows of B, in ascending order
+  std::vector<int> interface_;          // Rows of G, in canonical order
+  std::vector<int> position_;           // Offset of each row in I or B
+  std::shared_ptr<Subdomain> subdomain_;
+  std::unique_ptr<RuntimeFactorizer<Scalar> > schur_;   // Factors S
+  std::unique_ptr<RuntimeFactorizer<Scalar> > whole_;   // Or this factors A
+
+  static const uint64_t kHashBasis = 14695981039346656037ULL;   // FNV-1a
+
+  RuntimeFactorizer<Scalar> *NewFactorizer() const {
+    RuntimeFactorizer<Scalar> *f = new RuntimeFactorizer<Scalar>;
+    f->SetSolver(solver_name_);
+    f->SetMixedPrecision(mixed_);
+    return f;
+  }
+
+  static void Hash(uint64_t *key, const void *data, size_t size) {
+    const unsigned char *p = (const unsigned char *) data;
+    for (size_t i = 0; i < size; i++) {
+      *key = (*key ^ p[i]) * 1099511628211ULL;
+    }
+  }
+  static void Hash(uint64_t *key, const MatrixType &A) {
+    CHECK(A.isCompressed());
+    Hash(key, A.outerIndexPtr(), (A.outerSize() + 1) * sizeof(int));
+    Hash(key, A.innerIndexPtr(), A.nonZeros() * sizeof(int));
+    Hash(key, A.valuePtr(), A.nonZeros() * sizeof(Scalar));
+  }
+
+  static Cache &GetCache() {
+    static Cache cache;
+    return cache;
+  }
+
+  // True if the compressed matrices A and B are exactly the same.
+  static bool Same(const MatrixType &A, const MatrixType &B) {
+    CHECK(A.isCompressed() && B.isCompressed());
+    const int nnz = A.nonZeros();
+    return A.rows() == B.rows() && A.cols() == B.cols() &&
+           nnz == B.nonZeros() &&
+           std::equal(A.outerIndexPtr(), A.outerIndexPtr() + A.outerSize() + 1,
+                      B.outerIndexPtr()) &&
+           std::equal(A.innerIndexPtr(), A.innerIndexPtr() + nnz,
+                      B.innerIndexPtr()) &&
+           std::equal(A.valuePtr(), A.valuePtr() + nnz, B.valuePtr());
+  }
+
+  // Return the cached subdomain with this key, coordinates and matrices, or
+  // 0 if there is none.
+  static std::shared_ptr<Subdomain> Lookup(uint64_t key,
+                                           const Eigen::Matrix2Xd &xy,
+                                           const MatrixType &Aii,
+                                           const MatrixType &Aig,
+                                           const MatrixType &Agi) {
+    Cache &cache = GetCache();
+    MutexLock lock(&cache.mutex);
+    std::vector<std::shared_ptr<Subdomain> > &s = cache.subdomains;
+    for (int i = 0; i < s.size(); i++) {
+      if (s[i]->key == key && s[i]->xy.cols() == xy.cols() &&
+          s[i]->xy == xy && Same(s[i]->Aii, Aii) &&
+          Same(s[i]->Aig, Aig) && Same(s[i]->Agi, Agi)) {
+        std::shared_ptr<Subdomain> result = s[i];
+        s.erase(s.begin() + i);
+        s.push_back(result);
+        return result;
+      }
+    }
+    return std::shared_ptr<Subdomain>();
+  }
+
+  static void Insert(const std::shared_ptr<Subdomain> &subdomain) {
+    Cache &cache = GetCache();
+    MutexLock lock(&cache.mutex);
+    std::vector<std::shared_ptr<Subdomain> > &s = cache.subdomains;
+    if (s.size() >= kCacheSize) {
+      s.erase(s.begin());
+    }
+    s.push_back(subdomain);
+  }
+
+  // Factor A_II and compute the correction C. Return false if A_II could not
+  // be factored.
+  bool ComputeSubdomain(const MatrixType &Aii, const MatrixType &Aig,
+                        const MatrixType &Agi, const Eigen::Matrix2Xd &xy,
+                        Subdomain *sub) const {
+    const int ni = interior_.size(), ng = interface_.size();
+    Eigen::Matrix2Xd interior_xy(2, ni);
+    for (int i = 0; i < ni; i++) {
+      interior_xy.col(i) = xy.col(interior_[i]);
+    }
+    {
+      NestedDissectionCoordinates coordinates(&interior_xy);
+      sub->interior.SetSolver(solver_name_);
+      sub->interior.SetMixedPrecision(mixed_);
+      sub->interior.analyzePattern(Aii);
+      sub->interior.factorize(Aii);
+    }
+    if (sub->interior.info() != Eigen::Success) {
+      return false;
+    }
+    sub->Aig = Aig;
+    sub->Agi = Agi;
+    // Compute C one column at a time, so that inv(A_II)*A_IG (which is dense)
+    // does not have to be stored.
+    sub->C.resize(ng, ng);
+    for (int j = 0; j < ng; j++) {
+      Vector w = sub->interior.solve(Vector(Aig.col(j).toDense()));
+      sub->C.col(j) = Agi * w;
+    }
+    return true;
+  }
+
+  DISALLOW_COPY_AND_ASSIGN(SubstructuredFactorizer);
+};
+
+}  // namespace FEM
+
+#endif
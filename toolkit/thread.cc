@@ -1,5 +1,9 @@
 
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
 #include "thread.h"
+#include "testing.h"
 
 #ifndef __TOOLKIT_WXWINDOWS__
 
@@ -43,3 +47,251 @@ void *Thread::Wait() {
 }
 
 #endif
+
+int NumberOfCores() {
+#ifdef __TOOLKIT_WXWINDOWS__
+  return std::max(1, wxThread::GetCPUCount());
+#else
+  return std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+}
+
+namespace {
+
+// True in threads that are making ParallelFor() calls.
+thread_local bool in_parallel_for = false;
+
+// State shared by all the threads of a ParallelFor().
+struct ParallelForState {
+  Mutex mutex;
+  int next, n;
+  const std::function<void(int)> *fn;
+
+  // Make calls until there are none left.
+  void Work() {
+    bool was_in_parallel_for = in_parallel_for;
+    in_parallel_for = true;
+    for (;;) {
+      int i;
+      {
+        MutexLock lock(&mutex);
+        i = next++;
+      }
+      if (i >= n) {
+        in_parallel_for = was_in_parallel_for;
+        return;
+      }
+      (*fn)(i);
+    }
+  }
+};
+
+class ParallelForThread : public Thread {
+ public:
+  explicit ParallelForThread(ParallelForState *state)
+      : Thread(JOINABLE), state_(state) {}
+  void *Entry() {
+    state_->Work();
+    return 0;
+  }
+
+ private:
+  ParallelForState *state_;
+};
+
+}  // namespace
+
+void ParallelFor(int n, const std::function<void(int)> &fn) {
+  // Nested calls are done serially, as the outer call already uses all cores.
+  int num_threads = in_parallel_for ? 1 : std::min(n, NumberOfCores());
+  if (num_threads <= 1) {
+    for (int i = 0; i < n; i++) {
+      fn(i);
+    }
+    return;
+  }
+  ParallelForState state;
+  state.next = 0;
+  state.n = n;
+  state.fn = &fn;
+  std::vector<ParallelForThread*> threads;
+  for (int i = 1; i < num_threads; i++) {
+    threads.push_back(new ParallelForThread(&state));
+    threads.back()->Run();
+  }
+  state.Work();
+  for (int i = 0; i < threads.size(); i++) {
+    threads[i]->Wait();
+    delete threads[i];
+  }
+}
+
+//***************************************************************************
+// ThreadPool.
+
+class ThreadPool::Worker : public Thread {
+ public:
+  explicit Worker(ThreadPool *pool) : Thread(JOINABLE), pool_(pool) {}
+
+  // Join every call to the pool's ParallelFor() until the pool is stopped.
+  void *Entry() {
+    int generation = 0;         // The last call joined
+    for (;;) {
+      {
+        MutexLock lock(&pool_->mutex_);
+        while (pool_->generation_ == generation && !pool_->stop_) {
+          pool_->work_ready_.Wait();
+        }
+        if (pool_->stop_) {
+          return 0;
+        }
+        generation = pool_->generation_;
+      }
+      pool_->Work();
+      MutexLock lock(&pool_->mutex_);
+      if (--pool_->busy_ == 0) {
+        pool_->work_done_.Signal();
+      }
+    }
+  }
+
+ private:
+  ThreadPool *pool_;
+};
+
+ThreadPool::ThreadPool()
+    : work_ready_(mutex_), work_done_(mutex_), num_cores_(NumberOfCores()),
+      fn_(0), next_(0), n_(0), generation_(0), busy_(0), stop_(false) {
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    MutexLock lock(&mutex_);
+    stop_ = true;
+    work_ready_.Broadcast();
+  }
+  for (int i = 0; i < workers_.size(); i++) {
+    workers_[i]->Wait();
+    delete workers_[i];
+  }
+}
+
+void ThreadPool::ParallelFor(int n, const std::function<void(int)> &fn) {
+  // Nested calls are done serially, as the outer call already uses all cores.
+  if (n <= 1 || in_parallel_for || num_cores_ <= 1) {
+    for (int i = 0; i < n; i++) {
+      fn(i);
+    }
+    return;
+  }
+  if (workers_.empty()) {
+    // The workers start before the first call, generation 1.
+    for (int i = 1; i < num_cores_; i++) {
+      workers_.push_back(new Worker(this));
+      workers_.back()->Run();
+    }
+  }
+  {
+    MutexLock lock(&mutex_);
+    fn_ = &fn;
+    next_ = 0;
+    n_ = n;
+    busy_ = workers_.size();
+    generation_++;
+    work_ready_.Broadcast();
+  }
+  Work();
+  MutexLock lock(&mutex_);
+  while (busy_ > 0) {
+    work_done_.Wait();
+  }
+  fn_ = 0;
+}
+
+void ThreadPool::Work() {
+  bool was_in_parallel_for = in_parallel_for;
+  in_parallel_for = true;
+  for (;;) {
+    int i;
+    {
+      MutexLock lock(&mutex_);
+      i = next_++;
+    }
+    if (i >= n_) {
+      in_parallel_for = was_in_parallel_for;
+      return;
+    }
+    (*fn_)(i);
+  }
+}
+
+//***************************************************************************
+// Testing.
+
+TEST_FUNCTION(ParallelFor) {
+  const int kN = 1000;
+  std::vector<int> count(kN);
+  ParallelFor(kN, [&](int i) {
+    count[i]++;
+  });
+  for (int i = 0; i < kN; i++) {
+    CHECK(count[i] == 1);
+  }
+  ParallelFor(0, [&](int i) {
+    CHECK(false);
+  });
+
+  // Nested calls.
+  std::vector<int> total(10);
+  ParallelFor(10, [&](int i) {
+    ParallelFor(10, [&](int j) {
+      total[i] += j;
+    });
+  });
+  for (int i = 0; i < 10; i++) {
+    CHECK(total[i] == 45);
+  }
+}
+
+TEST_FUNCTION(ThreadPool) {
+  // Many calls with the same workers, as for time steps.
+  const int kN = 100;
+  std::vector<int> count(kN);
+  {
+    ThreadPool pool;
+    for (int step = 0; step < 1000; step++) {
+      pool.ParallelFor(kN, [&](int i) {
+        count[i]++;
+      });
+    }
+    pool.ParallelFor(0, [&](int i) {
+      CHECK(false);
+    });
+
+    // Nested calls run serially.
+    std::vector<int> total(10);
+    pool.ParallelFor(10, [&](int i) {
+      ParallelFor(10, [&](int j) {
+        total[i] += j;
+      });
+    });
+    for (int i = 0; i < 10; i++) {
+      CHECK(total[i] == 45);
+    }
+  }
+  for (int i = 0; i < kN; i++) {
+    CHECK(count[i] == 1000);
+  }
+
+  // A pool used within a ParallelFor() runs serially.
+  std::vector<int> sums(4);
+  ParallelFor(4, [&](int i) {
+    ThreadPool pool;
+    pool.ParallelFor(10, [&](int j) {
+      sums[i] += j;
+    });
+  });
+  for (int i = 0; i < 4; i++) {
+    CHECK(sums[i] == 45);
+  }
+}
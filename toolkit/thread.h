@@ -3,6 +3,8 @@
 #ifndef __TOOLKIT_THREAD_H__
 #define __TOOLKIT_THREAD_H__
 
+#include <functional>
+#include <vector>
 #include "error.h"
 
 #ifdef __TOOLKIT_WXWINDOWS__
@@ -42,6 +44,7 @@
     ~ConditionVariable() { pthread_cond_destroy(&cond_); }
     void Wait() { pthread_cond_wait(&cond_, &mutex_->mutex_); }
     void Signal() { pthread_cond_signal(&cond_); }
+    void Broadcast() { pthread_cond_broadcast(&cond_); }
 
    private:
     pthread_cond_t cond_;
@@ -97,4 +100,49 @@ class MutexLock {
 // Catch bug where variable name is omitted, e.g. MutexLock(&mu);
 #define MutexLock(x) COMPILE_ASSERT(0, mutex_lock_decl_missing_var_name)
 
+// Return the number of CPU cores available to run threads.
+int NumberOfCores();
+
+// Call fn(i) for all 0 <= i < n using up to NumberOfCores() threads, one of
+// which is the calling thread. The calls happen in no particular order so they
+// must be independent of each other. This returns when all calls are done.
+// Calls to ParallelFor() from within fn() run serially in the calling thread.
+void ParallelFor(int n, const std::function<void(int)> &fn);
+
+// Worker threads that are started once and then used by many ParallelFor()
+// calls. This is for loops that call ParallelFor() for many small pieces of
+// work in a row (e.g. time steps or iterations), where starting threads for
+// each call would cost as much as the work.
+class ThreadPool {
+ public:
+  // The NumberOfCores()-1 worker threads (the calling thread is the other
+  // one) are started by the first ParallelFor() that has more than one call
+  // to make, so a pool that is only used for small problems costs nothing.
+  ThreadPool();
+
+  // Stop the worker threads.
+  ~ThreadPool();
+
+  // Like ::ParallelFor(), but using the workers. Only one thread at a time
+  // can call this.
+  void ParallelFor(int n, const std::function<void(int)> &fn);
+
+ private:
+  class Worker;
+  Mutex mutex_;
+  ConditionVariable work_ready_, work_done_;    // Use mutex_
+  const int num_cores_;
+  std::vector<Worker*> workers_;                // Empty until first needed
+  const std::function<void(int)> *fn_;          // The current call
+  int next_, n_;                                // Next and end of fn_ calls
+  int generation_;                              // Counts the calls
+  int busy_;                                    // Workers still in a call
+  bool stop_;                                   // Set by the destructor
+
+  // Make calls of fn_ until there are none left.
+  void Work();
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadPool);
+};
+
 #endif
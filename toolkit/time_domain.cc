@@ -0,0 +1,89 @@
+
+// Testing for the time domain solver.
+
+#include "time_domain.h"
+#include <stdio.h>
+#include "Eigen/SparseLU"
+#include "testing.h"
+
+namespace FEM {
+
+TEST_FUNCTION(TimeDomainSolver) {
+  // A uniform 1D line of unit wave speed, discretized by linear elements with
+  // a lumped mass, with absorbing boundaries at both ends. A unit wave is
+  // incident from the left end. The line is long enough that the steps are
+  // done in parallel blocks.
+  const int n = 5000;
+  const double h = 1.0 / (n - 1);
+  std::vector<Eigen::Triplet<double> > triplets;
+  for (int i = 0; i < n - 1; i++) {
+    triplets.push_back(Eigen::Triplet<double>(i, i, 1 / h));
+    triplets.push_back(Eigen::Triplet<double>(i + 1, i + 1, 1 / h));
+    triplets.push_back(Eigen::Triplet<double>(i, i + 1, -1 / h));
+    triplets.push_back(Eigen::Triplet<double>(i + 1, i, -1 / h));
+  }
+  TimeDomainSolver::MatrixType K(n, n);
+  K.setFromTriplets(triplets.begin(), triplets.end());
+  Eigen::VectorXd M = Eigen::VectorXd::Constant(n, h), C(n);
+  M[0] = M[n - 1] = h / 2;
+  C.setZero();
+  C[0] = C[n - 1] = 1;
+  Eigen::VectorXcd p = Eigen::VectorXcd::Zero(n);
+  p[0] = 2;
+  TimeDomainSolver solver(K, M, C, p);
+  CHECK(solver.IsValid());
+
+  // Solve at 20 points per wavelength and nearby frequencies.
+  const double w = 2 * M_PI / (20 * h);
+  std::vector<double> omegas(3);
+  omegas[0] = w;
+  omegas[1] = 0.8 * w;
+  omegas[2] = 1.2 * w;
+  std::vector<int> probe_rows(2);
+  probe_rows[0] = 0;
+  probe_rows[1] = n - 1;
+  Eigen::VectorXcd field;
+  Eigen::MatrixXcd probes;
+  CHECK(solver.Run(omegas, probe_rows, &field, &probes));
+  printf("Time domain steps = %d, dt/h = %g\n", solver.NumSteps(),
+         solver.TimeStep() / h);
+  CHECK(solver.TimeStep() < h);         // The CFL limit
+
+  // The results are the frequency domain solutions of the leapfrog scheme.
+  Eigen::SparseMatrix<std::complex<double> > A(n, n);
+  for (int k = 0; k < omegas.size(); k++) {
+    const double dt = solver.TimeStep(), wk = omegas[k];
+    const double s = 2 * sin(wk * dt / 2) / dt;
+    Eigen::VectorXcd d = std::complex<double>(0, sin(wk * dt) / dt) * C -
+                         s * s * M;
+    A = K.cast<std::complex<double> >();
+    for (int i = 0; i < n; i++) {
+      A.coeffRef(i, i) += d[i];
+    }
+    Eigen::SparseLU<Eigen::SparseMatrix<std::complex<double> > > lu(A);
+    Eigen::VectorXcd x = lu.solve(std::complex<double>(0, wk) * p);
+    double error = 0;
+    for (int j = 0; j < probe_rows.size(); j++) {
+      error = std::max(error, abs(probes(j, k) - x[probe_rows[j]]));
+    }
+    if (k == 0) {
+      error = std::max(error, (field - x).cwiseAbs().maxCoeff());
+    }
+    // The wave is absorbed at the right end with little reflection, so it
+    // arrives with about unit magnitude.
+    printf("Frequency %d error = %g, |u(1)| = %g\n", k, error,
+           abs(probes(1, k)));
+    CHECK(error < 1e-4);
+    CHECK(fabs(abs(probes(1, k)) - 1) < 0.05);
+  }
+
+  // The timestep can not be increased past the stability limit, and the
+  // masses must be positive.
+  solver.SetTimeStep(solver.TimeStep() * 100);
+  CHECK(solver.TimeStep() < h);
+  M[0] = 0;
+  TimeDomainSolver invalid(K, M, C, p);
+  CHECK(!invalid.IsValid());
+}
+
+}  // namespace FEM
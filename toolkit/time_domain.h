@@ -0,0 +1,214 @@
+// Broadband solution of wave problems in the time domain.
+//
+// The frequency domain system (K + i*w*C - w^2*M) * x = i*w*p, e.g. a
+// Helmholtz problem with absorbing port boundaries, is the Fourier transform
+// of the wave equation
+//
+//   M*u'' + C*u' + K*u = p*g'(t)
+//
+// for a pulse g(t). If M and C are diagonal (e.g. a lumped mass matrix) then
+// this can be integrated with explicit leapfrog (central difference) steps,
+// each of which costs one sparse matrix-vector product, and the solution at
+// every frequency in the band of the pulse is the Fourier transform of u
+// divided by that of the excitation. A single run therefore replaces many
+// factorizations of the frequency domain system. The transforms are
+// accumulated as the steps are taken, so the time history is not stored.
+//
+// The timestep must satisfy the CFL condition dt < 2/sqrt(lambda_max) where
+// lambda_max is the largest eigenvalue of inv(M)*K. A Gershgorin bound is used
+// for lambda_max, which is always safe.
+
+#ifndef __TOOLKIT_TIME_DOMAIN_H__
+#define __TOOLKIT_TIME_DOMAIN_H__
+
+#include <math.h>
+#include <complex>
+#include "myvector"
+#include "Eigen/Dense"
+#include "Eigen/Sparse"
+#include "error.h"
+#include "thread.h"
+
+namespace FEM {
+
+// A run stops when the field energy has fallen to this fraction of its peak.
+const double kTimeDomainDecayTolerance = 1e-10;
+
+class TimeDomainSolver {
+ public:
+  typedef std::complex<double> Complex;
+  typedef Eigen::SparseMatrix<double, Eigen::RowMajor> MatrixType;
+
+  // Systems with more rows than this have their steps split into blocks of
+  // this many rows that are computed in parallel.
+  static const int kBlockSize = 4096;
+
+  // The most steps a run can take.
+  static const int kMaxSteps = 1000000;
+
+  // Set up the system M*u'' + C*u' + K*u = p*g'(t), where M and C are the
+  // diagonals of diagonal matrices. Every M[i] must be positive, and K must
+  // be symmetric positive semidefinite for the steps to be stable.
+  TimeDomainSolver(const MatrixType &K, const Eigen::VectorXd &M,
+                   const Eigen::VectorXd &C, const Eigen::VectorXcd &p)
+      : K_(K), M_(M), C_(C), p_(p), dt_(0), num_steps_(0) {
+    CHECK(K.rows() == K.cols() && M.size() == K.rows() &&
+          C.size() == K.rows() && p.size() == K.rows());
+    double lambda_max = 0;
+    for (int i = 0; i < K_.rows(); i++) {
+      if (!(M_[i] > 0)) {
+        return;                 // IsValid() will return false
+      }
+      double sum = 0;
+      for (MatrixType::InnerIterator it(K_, i); it; ++it) {
+        sum += fabs(it.value());
+      }
+      lambda_max = std::max(lambda_max, sum / M_[i]);
+    }
+    // Leave a margin below the stability limit for rounding error.
+    dt_ = lambda_max > 0 ? 1.9 / sqrt(lambda_max) : HUGE_VAL;
+  }
+
+  // True if the system can be integrated, i.e. if all masses are positive.
+  bool IsValid() const { return dt_ > 0; }
+
+  // The timestep.
+  double TimeStep() const { return dt_; }
+
+  // Reduce the timestep, e.g. to resolve the highest frequency better. It
+  // can not be increased past the stability limit.
+  void SetTimeStep(double dt) { dt_ = std::min(dt_, dt); }
+
+  // The number of steps taken by the last Run().
+  int NumSteps() const { return num_steps_; }
+
+  // Excite the system with a modulated gaussian pulse whose band covers all
+  // 'omegas' (angular frequencies), and step until the field has decayed.
+  // Return in 'field' the frequency domain solution x at omegas[0], and in
+  // column k of 'probes' the solution at omegas[k] for just the rows in
+  // 'probe_rows'. Return false if the field did not decay within kMaxSteps,
+  // e.g. for a lossless model.
+  bool Run(const std::vector<double> &omegas,
+           const std::vector<int> &probe_rows, Eigen::VectorXcd *field,
+           Eigen::MatrixXcd *probes) MUST_USE_RESULT {
+    CHECK(IsValid() && !omegas.empty());
+    const int n = K_.rows();
+    const int num_omegas = omegas.size();
+    const int num_blocks = (n + kBlockSize - 1) / kBlockSize;
+
+    // The pulse is g(t) = exp(-((t-t0)/tau)^2) * cos(wc*(t-t0)). Its spectrum
+    // falls to 10% of the peak at the edges of the band.
+    double wmin = omegas[0], wmax = omegas[0];
+    for (int k = 0; k < num_omegas; k++) {
+      CHECK(omegas[k] > 0);
+      wmin = std::min(wmin, omegas[k]);
+      wmax = std::max(wmax, omegas[k]);
+    }
+    const double wc = (wmin + wmax) / 2;
+    const double half_band = std::max((wmax - wmin) / 2, wc / 4);
+    const double tau = 2.0 * sqrt(log(10.0)) / half_band;
+    const double t0 = 4 * tau;
+
+    // Leapfrog coefficients: u[n+1] = a .* (dt^2*(p*f[n] - K*u[n]) +
+    // 2*M.*u[n] - b.*u[n-1]).
+    const double dt = dt_;
+    Eigen::VectorXd a(n), b(n);
+    for (int i = 0; i < n; i++) {
+      a[i] = 1.0 / (M_[i] + C_[i] * dt / 2);
+      b[i] = M_[i] - C_[i] * dt / 2;
+    }
+
+    // The field energy is checked over windows of one period of the lowest
+    // frequency.
+    const int window = std::max(1, int(ceil(2 * M_PI / wmin / dt)));
+    double peak_energy = 0, window_energy = 0;
+    std::vector<double> block_energy(num_blocks);
+
+    // u[i] holds the field at steps n-1, n and n+1 in rotation.
+    Eigen::VectorXcd u[3];
+    for (int i = 0; i < 3; i++) {
+      u[i].setZero(n);
+    }
+    field->setZero(n);
+    probes->setZero(probe_rows.size(), num_omegas);
+    Eigen::VectorXcd excitation = Eigen::VectorXcd::Zero(num_omegas);
+    bool decayed = false;
+    ThreadPool pool;            // Each step is too short to start threads
+    for (num_steps_ = 0; num_steps_ < kMaxSteps; num_steps_++) {
+      const double t = num_steps_ * dt;
+      const double s = (t - t0) / tau;
+      const double f = -exp(-s * s) * (2 * s / tau * cos(wc * (t - t0)) +
+                                       wc * sin(wc * (t - t0)));    // g'(t)
+      const Eigen::VectorXcd &u0 = u[(num_steps_ + 2) % 3];     // u[n-1]
+      const Eigen::VectorXcd &u1 = u[num_steps_ % 3];           // u[n]
+      Eigen::VectorXcd &u2 = u[(num_steps_ + 1) % 3];           // u[n+1]
+      const Complex phasor0 = std::polar(dt, -omegas[0] * (t + dt));
+      pool.ParallelFor(num_blocks, [&](int block) {
+        const int end = std::min(n, (block + 1) * kBlockSize);
+        double energy = 0;
+        for (int i = block * kBlockSize; i < end; i++) {
+          Complex Ku = 0;
+          for (MatrixType::InnerIterator it(K_, i); it; ++it) {
+            Ku += it.value() * u1[it.col()];
+          }
+          u2[i] = a[i] * (dt * dt * (p_[i] * f - Ku) + 2 * M_[i] * u1[i] -
+                          b[i] * u0[i]);
+          (*field)[i] += u2[i] * phasor0;
+          energy += M_[i] * std::norm(u2[i]);
+        }
+        block_energy[block] = energy;
+      });
+
+      // Accumulate the transforms of the excitation and the probe rows.
+      for (int k = 0; k < num_omegas; k++) {
+        excitation[k] += f * std::polar(dt, -omegas[k] * t);
+        const Complex phasor = std::polar(dt, -omegas[k] * (t + dt));
+        for (int j = 0; j < probe_rows.size(); j++) {
+          (*probes)(j, k) += u2[probe_rows[j]] * phasor;
+        }
+      }
+
+      // Stop when the excitation is over and the field has decayed.
+      double energy = 0;
+      for (int i = 0; i < num_blocks; i++) {
+        energy += block_energy[i];
+      }
+      peak_energy = std::max(peak_energy, energy);
+      window_energy = std::max(window_energy, energy);
+      if ((num_steps_ + 1) % window == 0) {
+        if (t > 2 * t0 &&
+            window_energy <= kTimeDomainDecayTolerance * peak_energy) {
+          decayed = true;
+          num_steps_++;
+          break;
+        }
+        window_energy = 0;
+      }
+    }
+    if (!decayed) {
+      return false;
+    }
+
+    // Normalize by the excitation spectrum so that the results are solutions
+    // of the frequency domain system.
+    for (int k = 0; k < num_omegas; k++) {
+      Complex scale = Complex(0, omegas[k]) / excitation[k];
+      if (k == 0) {
+        *field *= scale;
+      }
+      probes->col(k) *= scale;
+    }
+    return true;
+  }
+
+ private:
+  MatrixType K_;
+  Eigen::VectorXd M_, C_;
+  Eigen::VectorXcd p_;
+  double dt_;                   // Timestep, or 0 if not valid
+  int num_steps_;               // Taken by the last Run()
+};
+
+}  // namespace FEM
+
+#endif
@@ -0,0 +1,103 @@
+
+// Testing for tolerance analysis sampling and statistics.
+
+#include "tolerance.h"
+#include <stdio.h>
+#include "testing.h"
+
+namespace tolerance {
+
+TEST_FUNCTION(InverseNormalCDF) {
+  CHECK(fabs(InverseNormalCDF(0.5)) < 1e-12);
+  CHECK(fabs(InverseNormalCDF(0.975) - 1.959963984540054) < 1e-8);
+  CHECK(fabs(InverseNormalCDF(0.8413447460685429) - 1) < 1e-8);
+  CHECK(fabs(InverseNormalCDF(1e-6) + 4.753424308822899) < 1e-7);
+  for (double p = 0.01; p < 1; p += 0.01) {
+    CHECK(fabs(InverseNormalCDF(p) + InverseNormalCDF(1 - p)) < 1e-8);
+  }
+}
+
+TEST_FUNCTION(LatinHypercube) {
+  const int n = 200;
+  std::vector<Distribution> d;
+  d.push_back(Distribution(Distribution::NORMAL, 2));
+  d.push_back(Distribution(Distribution::UNIFORM, 0.5));
+  d.push_back(Distribution(Distribution::NORMAL, 0.1));
+  std::vector<std::vector<double> > samples, samples2;
+  LatinHypercube(d, n, 1, &samples);
+  CHECK(samples.size() == n && samples[0].size() == 3);
+
+  // Each stratum of the uniform variation is sampled exactly once.
+  std::vector<int> count(n, 0);
+  for (int i = 0; i < n; i++) {
+    double u = (samples[i][1] / 0.5 + 1) / 2;
+    CHECK(u > 0 && u < 1);
+    count[int(u * n)]++;
+  }
+  for (int i = 0; i < n; i++) {
+    CHECK(count[i] == 1);
+  }
+
+  // The sample statistics match the distributions closely.
+  for (int j = 0; j < d.size(); j++) {
+    std::vector<double> values;
+    for (int i = 0; i < n; i++) {
+      values.push_back(samples[i][j]);
+    }
+    Statistics s(values);
+    printf("Variation %d: mean = %g, std dev = %g (expecting %g)\n", j,
+           s.mean, s.std_dev, d[j].StdDev());
+    CHECK(fabs(s.mean) < 0.01 * d[j].StdDev());
+    CHECK(fabs(s.std_dev / d[j].StdDev() - 1) < 0.05);
+  }
+
+  // The same seed gives the same samples, and a different seed doesn't.
+  LatinHypercube(d, n, 1, &samples2);
+  CHECK(samples2 == samples);
+  LatinHypercube(d, n, 2, &samples2);
+  CHECK(samples2 != samples);
+
+  // Nearest neighbor ordering permutes the samples and shortens the path
+  // through them.
+  samples2 = samples;
+  NearestNeighborOrder(d, &samples2);
+  CHECK(samples2.size() == samples.size());
+  std::vector<std::vector<double> > sorted1 = samples, sorted2 = samples2;
+  std::sort(sorted1.begin(), sorted1.end());
+  std::sort(sorted2.begin(), sorted2.end());
+  CHECK(sorted1 == sorted2);
+  double length[2] = {0, 0};
+  for (int k = 0; k < 2; k++) {
+    const std::vector<std::vector<double> > &s = k ? samples2 : samples;
+    for (int i = 1; i < n; i++) {
+      for (int j = 0; j < d.size(); j++) {
+        length[k] += fabs(s[i][j] - s[i - 1][j]) / d[j].StdDev();
+      }
+    }
+  }
+  printf("Path length = %g, ordered = %g\n", length[0], length[1]);
+  CHECK(length[1] < 0.5 * length[0]);
+}
+
+TEST_FUNCTION(Histogram) {
+  std::vector<double> values;
+  for (int i = 0; i < 100; i++) {
+    values.push_back(i % 10);
+  }
+  Statistics s(values);
+  CHECK(s.mean == 4.5 && s.min == 0 && s.max == 9);
+  std::vector<double> edges;
+  std::vector<int> counts;
+  Histogram(values, 5, &edges, &counts);
+  CHECK(edges.size() == 6 && edges[0] == 0 && fabs(edges[5] - 9) < 1e-12);
+  for (int i = 0; i < 5; i++) {
+    CHECK(counts[i] == 20);
+  }
+
+  // Constant values all go in one bin.
+  values.assign(10, 3);
+  Histogram(values, 4, &edges, &counts);
+  CHECK(counts[0] == 10 && Statistics(values).std_dev == 0);
+}
+
+}  // namespace tolerance
@@ -0,0 +1,187 @@
+// Tolerance analysis: sampling manufacturing variations of parameters, and
+// summarizing the outputs that result.
+//
+// Parameter variations are sampled by Latin hypercube sampling (McKay,
+// Beckman and Conover, "A comparison of three methods for selecting values of
+// input variables in the analysis of output from a computer code"). For N
+// samples the range of each parameter is divided into N strata of equal
+// probability, and each stratum is sampled exactly once, in a random
+// pairing with the strata of the other parameters. This covers every
+// parameter's distribution evenly with few samples, so output statistics
+// converge faster than with independent random samples.
+
+#ifndef __TOOLKIT_TOLERANCE_H__
+#define __TOOLKIT_TOLERANCE_H__
+
+#include <math.h>
+#include <algorithm>
+#include <random>
+#include "myvector"
+#include "error.h"
+
+namespace tolerance {
+
+// The inverse of the standard normal cumulative distribution function, for
+// 0 < p < 1. This is Acklam's rational approximation, with a relative error
+// below 1.2e-9.
+inline double InverseNormalCDF(double p) {
+  static const double a[6] = {-3.969683028665376e+01, 2.209460984245205e+02,
+                              -2.759285104469687e+02, 1.383577518672690e+02,
+                              -3.066479806614716e+01, 2.506628277459239e+00};
+  static const double b[5] = {-5.447609879822406e+01, 1.615858368580409e+02,
+                              -1.556989798598866e+02, 6.680131188771972e+01,
+                              -1.328068155288572e+01};
+  static const double c[6] = {-7.784894002430293e-03, -3.223964580411365e-01,
+                              -2.400758277161838e+00, -2.549732539343734e+00,
+                              4.374664141464968e+00, 2.938163982698783e+00};
+  static const double d[4] = {7.784695709041462e-03, 3.224671290700398e-01,
+                              2.445134137142996e+00, 3.754408661907416e+00};
+  const double p_low = 0.02425;
+  CHECK(p > 0 && p < 1);
+  if (p < p_low) {
+    double q = sqrt(-2 * log(p));
+    return (((((c[0]*q + c[1])*q + c[2])*q + c[3])*q + c[4])*q + c[5]) /
+           ((((d[0]*q + d[1])*q + d[2])*q + d[3])*q + 1);
+  } else if (p > 1 - p_low) {
+    return -InverseNormalCDF(1 - p);
+  }
+  double q = p - 0.5, r = q * q;
+  return (((((a[0]*r + a[1])*r + a[2])*r + a[3])*r + a[4])*r + a[5])*q /
+         (((((b[0]*r + b[1])*r + b[2])*r + b[3])*r + b[4])*r + 1);
+}
+
+// The distribution of a parameter's variation about its nominal value.
+struct Distribution {
+  enum Type {
+    NORMAL,             // 'width' is the standard deviation
+    UNIFORM,            // 'width' is the half width
+  };
+  Type type;
+  double width;
+
+  Distribution() : type(NORMAL), width(0) {}
+  Distribution(Type t, double w) : type(t), width(w) {}
+
+  // The standard deviation.
+  double StdDev() const {
+    return type == NORMAL ? width : width / sqrt(3.0);
+  }
+
+  // The variation at cumulative probability p (0 < p < 1).
+  double Quantile(double p) const {
+    return type == NORMAL ? width * InverseNormalCDF(p) : width * (2 * p - 1);
+  }
+};
+
+// Return num_samples Latin hypercube samples of the variations with the
+// given distributions, in samples[i][j] for sample i and variation j. The
+// same seed always gives the same samples.
+inline void LatinHypercube(const std::vector<Distribution> &distributions,
+                           int num_samples, unsigned int seed,
+                           std::vector<std::vector<double> > *samples) {
+  CHECK(num_samples >= 1);
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<double> uniform(0, 1);
+  samples->clear();
+  samples->resize(num_samples,
+                  std::vector<double>(distributions.size()));
+  std::vector<int> strata(num_samples);
+  for (int j = 0; j < distributions.size(); j++) {
+    for (int i = 0; i < num_samples; i++) {
+      strata[i] = i;
+    }
+    std::shuffle(strata.begin(), strata.end(), rng);
+    for (int i = 0; i < num_samples; i++) {
+      // A point inside the stratum, never at its edges (so p is never 0 or
+      // 1).
+      double u = std::max(1e-6, std::min(1 - 1e-6, uniform(rng)));
+      (*samples)[i][j] = distributions[j].Quantile((strata[i] + u) /
+                                                   num_samples);
+    }
+  }
+}
+
+// Reorder samples (as from LatinHypercube()) so that each one is near the
+// one before, starting with the sample nearest the nominal values. The
+// distance is measured in units of the standard deviations, which must be
+// positive. Consecutive models are then similar, which helps solvers that
+// reuse the previous model's solution or factorization.
+inline void NearestNeighborOrder(const std::vector<Distribution> &d,
+                                 std::vector<std::vector<double> > *samples) {
+  for (int j = 0; j < d.size(); j++) {
+    CHECK(d[j].width > 0);
+  }
+  std::vector<std::vector<double> > ordered;
+  ordered.reserve(samples->size());
+  std::vector<bool> used(samples->size(), false);
+  std::vector<double> last(d.size(), 0);
+  for (int k = 0; k < samples->size(); k++) {
+    int best = -1;
+    double best_distance = 0;
+    for (int i = 0; i < samples->size(); i++) {
+      if (used[i]) {
+        continue;
+      }
+      double distance = 0;
+      for (int j = 0; j < d.size(); j++) {
+        double delta = ((*samples)[i][j] - last[j]) / d[j].StdDev();
+        distance += delta * delta;
+      }
+      if (best == -1 || distance < best_distance) {
+        best = i;
+        best_distance = distance;
+      }
+    }
+    used[best] = true;
+    ordered.push_back((*samples)[best]);
+    last = ordered.back();
+  }
+  samples->swap(ordered);
+}
+
+// Summary statistics of a set of values.
+struct Statistics {
+  double mean, std_dev, min, max;
+
+  explicit Statistics(const std::vector<double> &values) {
+    CHECK(!values.empty());
+    mean = 0;
+    min = max = values[0];
+    for (int i = 0; i < values.size(); i++) {
+      mean += values[i];
+      min = std::min(min, values[i]);
+      max = std::max(max, values[i]);
+    }
+    mean /= values.size();
+    double sum2 = 0;
+    for (int i = 0; i < values.size(); i++) {
+      sum2 += (values[i] - mean) * (values[i] - mean);
+    }
+    std_dev = values.size() > 1 ? sqrt(sum2 / (values.size() - 1)) : 0;
+  }
+};
+
+// Count the values in num_bins equal width bins over [min,max] of the
+// values. Bin i covers [edges[i],edges[i+1]).
+inline void Histogram(const std::vector<double> &values, int num_bins,
+                      std::vector<double> *edges, std::vector<int> *counts) {
+  CHECK(num_bins >= 1);
+  Statistics s(values);
+  double width = (s.max - s.min) / num_bins;
+  if (width == 0) {
+    width = std::max(1e-9 * fabs(s.min), 1e-300);
+  }
+  edges->resize(num_bins + 1);
+  for (int i = 0; i <= num_bins; i++) {
+    (*edges)[i] = s.min + i * width;
+  }
+  counts->assign(num_bins, 0);
+  for (int i = 0; i < values.size(); i++) {
+    int bin = int((values[i] - s.min) / width);
+    (*counts)[std::max(0, std::min(num_bins - 1, bin))]++;
+  }
+}
+
+}  // namespace tolerance
+
+#endif